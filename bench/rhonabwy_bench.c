@@ -0,0 +1,1050 @@
+/**
+ *
+ * rhonabwy_bench: Rhonabwy benchmark suite
+ *
+ * Measures throughput (ops/sec) and latency percentiles of the
+ * library main code paths:
+ * - JWS sign, verify and parse for every signature algorithm
+ * - JWE encrypt, decrypt and parse for every key management algorithm
+ *   and content encryption pair
+ * - JWKS import and JWS verification against a JWKS of increasing size
+ * - JWT parse only
+ *
+ * The result is written as a JSON document so it can be stored and
+ * compared between releases
+ *
+ * Public domain, no copyright. Use at your own risk.
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/utsname.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <jansson.h>
+#include <orcania.h>
+#include <yder.h>
+#include <rhonabwy.h>
+
+#define BENCH_GROUP_JWS  0x01
+#define BENCH_GROUP_JWE  0x02
+#define BENCH_GROUP_JWT  0x04
+#define BENCH_GROUP_JWKS 0x08
+#define BENCH_GROUP_ALL  (BENCH_GROUP_JWS|BENCH_GROUP_JWE|BENCH_GROUP_JWT|BENCH_GROUP_JWKS)
+
+#define BENCH_DEFAULT_MIN_TIME       0.2
+#define BENCH_DEFAULT_MIN_ITERATIONS 3
+#define BENCH_DEFAULT_MAX_ITERATIONS 100000
+#define BENCH_MAX_SIZES              32
+#define BENCH_PASSWORD               "rhonabwy-bench-password"
+#define BENCH_RSA_BITS               2048
+
+static const size_t default_payload_sizes[] = {100, 1000, 10000, 100000, 1000000, 10000000};
+static const size_t default_jwks_sizes[] = {1, 10, 100, 1000, 10000};
+
+struct _bench_config {
+  int      groups;
+  double   min_time;
+  size_t   min_iterations;
+  size_t   max_iterations;
+  size_t   payload_sizes[BENCH_MAX_SIZES];
+  size_t   nb_payload_sizes;
+  size_t   jwks_sizes[BENCH_MAX_SIZES];
+  size_t   nb_jwks_sizes;
+  jwa_alg  alg_filter;
+  jwa_enc  enc_filter;
+  int      quiet;
+  int      arena;
+};
+
+/**
+ * A benchmarked operation, called once per iteration,
+ * returns RHN_OK on success
+ */
+typedef int (* bench_op)(void * ctx);
+
+struct _bench_stats {
+  size_t iterations;
+  double total_ns;
+  double min_ns;
+  double p50_ns;
+  double p99_ns;
+  double max_ns;
+};
+
+/**
+ * Key material for an algorithm, the same key is used for every
+ * payload size of the algorithm
+ */
+struct _bench_keys {
+  jwk_t * privkey;
+  jwk_t * pubkey;
+};
+
+struct _bench_jws_ctx {
+  jwa_alg               alg;
+  const unsigned char * payload;
+  size_t                payload_len;
+  jwk_t               * privkey;
+  jwk_t               * pubkey;
+  jwks_t              * jwks;
+  jwks_shared_t       * jwks_shared;
+  jwt_claims_schema_t * schema;
+  rhn_arena_t         * arena;
+  const char          * token;
+};
+
+struct _bench_claims {
+  char      iss[64];
+  rhn_int_t iat;
+};
+
+struct _bench_jwe_ctx {
+  jwa_alg               alg;
+  jwa_enc               enc;
+  const unsigned char * payload;
+  size_t                payload_len;
+  jwk_t               * privkey;
+  jwk_t               * pubkey;
+  const char          * token;
+};
+
+struct _bench_jwks_ctx {
+  const char * jwks_str;
+};
+
+static double bench_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int bench_compare_double(const void * a, const void * b) {
+  double da = *(const double *)a, db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+static double bench_percentile(const double * sorted, size_t n, double percentile) {
+  size_t index = (size_t)(percentile * (double)(n - 1) + 0.5);
+
+  if (index >= n) {
+    index = n - 1;
+  }
+  return sorted[index];
+}
+
+/**
+ * Runs op until min_time is elapsed and at least min_iterations are done,
+ * or max_iterations is reached
+ */
+static int bench_run(struct _bench_config * config, bench_op op, void * ctx, struct _bench_stats * stats) {
+  double * samples = NULL, start, end, begin;
+  size_t samples_size = 1024, n = 0;
+  int ret = RHN_OK;
+
+  memset(stats, 0, sizeof(struct _bench_stats));
+  if ((samples = o_malloc(samples_size*sizeof(double))) != NULL) {
+    // Warmup
+    if (op(ctx) == RHN_OK) {
+      begin = bench_now_ns();
+      while (n < config->max_iterations && (n < config->min_iterations || (bench_now_ns() - begin) < config->min_time*1e9)) {
+        if (n == samples_size) {
+          samples_size *= 2;
+          if ((samples = o_realloc(samples, samples_size*sizeof(double))) == NULL) {
+            fprintf(stderr, "bench_run - Error reallocating resources for samples\n");
+            ret = RHN_ERROR_MEMORY;
+            break;
+          }
+        }
+        start = bench_now_ns();
+        if (op(ctx) != RHN_OK) {
+          ret = RHN_ERROR;
+          break;
+        }
+        end = bench_now_ns();
+        samples[n] = end - start;
+        stats->total_ns += samples[n];
+        n++;
+      }
+      if (ret == RHN_OK && n) {
+        qsort(samples, n, sizeof(double), bench_compare_double);
+        stats->iterations = n;
+        stats->min_ns = samples[0];
+        stats->p50_ns = bench_percentile(samples, n, 0.50);
+        stats->p99_ns = bench_percentile(samples, n, 0.99);
+        stats->max_ns = samples[n-1];
+      }
+    } else {
+      ret = RHN_ERROR;
+    }
+    o_free(samples);
+  } else {
+    fprintf(stderr, "bench_run - Error allocating resources for samples\n");
+    ret = RHN_ERROR_MEMORY;
+  }
+  return ret;
+}
+
+static json_t * bench_result(const char * group, const char * operation, jwa_alg alg, jwa_enc enc, size_t payload_size, size_t jwks_size) {
+  json_t * j_result = json_pack("{ssss}", "group", group, "operation", operation);
+
+  if (alg != R_JWA_ALG_UNKNOWN) {
+    json_object_set_new(j_result, "alg", json_string(r_jwa_alg_to_str(alg)));
+  }
+  if (enc != R_JWA_ENC_UNKNOWN) {
+    json_object_set_new(j_result, "enc", json_string(r_jwa_enc_to_str(enc)));
+  }
+  if (payload_size) {
+    json_object_set_new(j_result, "payload_size", json_integer((json_int_t)payload_size));
+  }
+  if (jwks_size) {
+    json_object_set_new(j_result, "jwks_size", json_integer((json_int_t)jwks_size));
+  }
+  return j_result;
+}
+
+static void bench_measure(struct _bench_config * config, json_t * j_results, json_t * j_result, bench_op op, void * ctx) {
+  struct _bench_stats stats;
+
+  if (bench_run(config, op, ctx, &stats) == RHN_OK) {
+    json_object_set_new(j_result, "iterations", json_integer((json_int_t)stats.iterations));
+    json_object_set_new(j_result, "ops_per_sec", json_real(stats.total_ns>0?(double)stats.iterations*1e9/stats.total_ns:0));
+    json_object_set_new(j_result, "min_us", json_real(stats.min_ns/1e3));
+    json_object_set_new(j_result, "p50_us", json_real(stats.p50_ns/1e3));
+    json_object_set_new(j_result, "p99_us", json_real(stats.p99_ns/1e3));
+    json_object_set_new(j_result, "max_us", json_real(stats.max_ns/1e3));
+  } else {
+    json_object_set_new(j_result, "error", json_string("operation failed"));
+  }
+  if (!config->quiet) {
+    char * str = json_dumps(j_result, JSON_COMPACT);
+    fprintf(stderr, "%s\n", str);
+    o_free(str);
+  }
+  json_array_append_new(j_results, j_result);
+}
+
+static void bench_skip(struct _bench_config * config, json_t * j_results, json_t * j_result, const char * reason) {
+  json_object_set_new(j_result, "error", json_string(reason));
+  if (!config->quiet) {
+    char * str = json_dumps(j_result, JSON_COMPACT);
+    fprintf(stderr, "%s\n", str);
+    o_free(str);
+  }
+  json_array_append_new(j_results, j_result);
+}
+
+static unsigned char * bench_payload(size_t len) {
+  unsigned char * payload = o_malloc(len+1);
+  size_t i;
+
+  if (payload != NULL) {
+    for (i=0; i<len; i++) {
+      payload[i] = (unsigned char)('a' + (i%26));
+    }
+    payload[len] = '\0';
+  }
+  return payload;
+}
+
+static int bench_symmetric_key(jwk_t * jwk, size_t key_len) {
+  unsigned char key[64];
+  int ret;
+
+  if (key_len <= sizeof(key) && !gnutls_rnd(GNUTLS_RND_KEY, key, key_len)) {
+    ret = r_jwk_import_from_symmetric_key(jwk, key, key_len);
+  } else {
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
+static size_t bench_enc_key_size(jwa_enc enc) {
+  switch (enc) {
+    case R_JWA_ENC_A128CBC:
+      return 32;
+    case R_JWA_ENC_A192CBC:
+      return 48;
+    case R_JWA_ENC_A256CBC:
+      return 64;
+    case R_JWA_ENC_A128GCM:
+      return 16;
+    case R_JWA_ENC_A192GCM:
+      return 24;
+    case R_JWA_ENC_A256GCM:
+      return 32;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Generates the key pair used by alg, enc is only used for R_JWA_ALG_DIR
+ * If the algorithm can't be used to generate keys, returns RHN_ERROR_UNSUPPORTED
+ */
+static int bench_generate_keys(jwa_alg alg, jwa_enc enc, struct _bench_keys * keys) {
+  int ret = RHN_OK;
+
+  keys->privkey = NULL;
+  keys->pubkey = NULL;
+  if (r_jwk_init(&keys->privkey) != RHN_OK || r_jwk_init(&keys->pubkey) != RHN_OK) {
+    return RHN_ERROR_MEMORY;
+  }
+  switch (alg) {
+    case R_JWA_ALG_HS256:
+      ret = bench_symmetric_key(keys->privkey, 32);
+      break;
+    case R_JWA_ALG_HS384:
+      ret = bench_symmetric_key(keys->privkey, 48);
+      break;
+    case R_JWA_ALG_HS512:
+      ret = bench_symmetric_key(keys->privkey, 64);
+      break;
+    case R_JWA_ALG_A128KW:
+    case R_JWA_ALG_A128GCMKW:
+      ret = bench_symmetric_key(keys->privkey, 16);
+      break;
+    case R_JWA_ALG_A192KW:
+    case R_JWA_ALG_A192GCMKW:
+      ret = bench_symmetric_key(keys->privkey, 24);
+      break;
+    case R_JWA_ALG_A256KW:
+    case R_JWA_ALG_A256GCMKW:
+      ret = bench_symmetric_key(keys->privkey, 32);
+      break;
+    case R_JWA_ALG_DIR:
+      ret = bench_symmetric_key(keys->privkey, bench_enc_key_size(enc));
+      break;
+    case R_JWA_ALG_PBES2_H256:
+    case R_JWA_ALG_PBES2_H384:
+    case R_JWA_ALG_PBES2_H512:
+      ret = r_jwk_import_from_password(keys->privkey, BENCH_PASSWORD);
+      break;
+    case R_JWA_ALG_RS256:
+    case R_JWA_ALG_RS384:
+    case R_JWA_ALG_RS512:
+    case R_JWA_ALG_PS256:
+    case R_JWA_ALG_PS384:
+    case R_JWA_ALG_PS512:
+    case R_JWA_ALG_RSA1_5:
+    case R_JWA_ALG_RSA_OAEP:
+    case R_JWA_ALG_RSA_OAEP_256:
+      ret = r_jwk_generate_key_pair(keys->privkey, keys->pubkey, R_KEY_TYPE_RSA, BENCH_RSA_BITS, NULL);
+      break;
+    case R_JWA_ALG_ES256:
+    case R_JWA_ALG_ECDH_ES:
+    case R_JWA_ALG_ECDH_ES_A128KW:
+    case R_JWA_ALG_ECDH_ES_A192KW:
+    case R_JWA_ALG_ECDH_ES_A256KW:
+      ret = r_jwk_generate_key_pair(keys->privkey, keys->pubkey, R_KEY_TYPE_EC, 256, NULL);
+      break;
+    case R_JWA_ALG_ES384:
+      ret = r_jwk_generate_key_pair(keys->privkey, keys->pubkey, R_KEY_TYPE_EC, 384, NULL);
+      break;
+    case R_JWA_ALG_ES512:
+      ret = r_jwk_generate_key_pair(keys->privkey, keys->pubkey, R_KEY_TYPE_EC, 521, NULL);
+      break;
+    case R_JWA_ALG_EDDSA:
+      ret = r_jwk_generate_key_pair(keys->privkey, keys->pubkey, R_KEY_TYPE_EDDSA, 256, NULL);
+      break;
+    default:
+      ret = RHN_ERROR_UNSUPPORTED;
+      break;
+  }
+  if (ret == RHN_OK && r_jwk_key_type(keys->privkey, NULL, 0) & R_KEY_TYPE_SYMMETRIC) {
+    // Symmetric keys are used on both sides
+    r_jwk_free(keys->pubkey);
+    keys->pubkey = r_jwk_copy(keys->privkey);
+  }
+  if (ret != RHN_OK) {
+    r_jwk_free(keys->privkey);
+    r_jwk_free(keys->pubkey);
+    keys->privkey = NULL;
+    keys->pubkey = NULL;
+  }
+  return ret;
+}
+
+static void bench_free_keys(struct _bench_keys * keys) {
+  r_jwk_free(keys->privkey);
+  r_jwk_free(keys->pubkey);
+  keys->privkey = NULL;
+  keys->pubkey = NULL;
+}
+
+static char * bench_jws_serialize(struct _bench_jws_ctx * ctx) {
+  jws_t * jws = NULL;
+  char * token = NULL;
+
+  if (r_jws_init(&jws) == RHN_OK) {
+    if (r_jws_set_alg(jws, ctx->alg) == RHN_OK && r_jws_set_payload(jws, ctx->payload, ctx->payload_len) == RHN_OK) {
+      token = r_jws_serialize(jws, ctx->privkey, 0);
+    }
+    r_jws_free(jws);
+  }
+  return token;
+}
+
+static int bench_jws_sign(void * data) {
+  char * token = bench_jws_serialize((struct _bench_jws_ctx *)data);
+  int ret = token!=NULL?RHN_OK:RHN_ERROR;
+
+  o_free(token);
+  return ret;
+}
+
+static int bench_jws_verify(void * data) {
+  struct _bench_jws_ctx * ctx = (struct _bench_jws_ctx *)data;
+  jws_t * jws = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jws_init(&jws) == RHN_OK) {
+    if (r_jws_parse(jws, ctx->token, 0) == RHN_OK) {
+      if (ctx->jwks != NULL) {
+        if (r_jws_add_jwks(jws, NULL, ctx->jwks) == RHN_OK) {
+          ret = r_jws_verify_signature(jws, NULL, 0);
+        }
+      } else {
+        ret = r_jws_verify_signature(jws, ctx->pubkey, 0);
+      }
+    }
+    r_jws_free(jws);
+  }
+  return ret;
+}
+
+static int bench_jws_parse(void * data) {
+  struct _bench_jws_ctx * ctx = (struct _bench_jws_ctx *)data;
+  jws_t * jws = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jws_init(&jws) == RHN_OK) {
+    ret = r_jws_parse(jws, ctx->token, 0);
+    r_jws_free(jws);
+  }
+  return ret;
+}
+
+static char * bench_jwe_serialize(struct _bench_jwe_ctx * ctx) {
+  jwe_t * jwe = NULL;
+  char * token = NULL;
+
+  if (r_jwe_init(&jwe) == RHN_OK) {
+    if (r_jwe_set_alg(jwe, ctx->alg) == RHN_OK && r_jwe_set_enc(jwe, ctx->enc) == RHN_OK && r_jwe_set_payload(jwe, ctx->payload, ctx->payload_len) == RHN_OK) {
+      token = r_jwe_serialize(jwe, ctx->pubkey, 0);
+    }
+    r_jwe_free(jwe);
+  }
+  return token;
+}
+
+static int bench_jwe_encrypt(void * data) {
+  char * token = bench_jwe_serialize((struct _bench_jwe_ctx *)data);
+  int ret = token!=NULL?RHN_OK:RHN_ERROR;
+
+  o_free(token);
+  return ret;
+}
+
+static int bench_jwe_decrypt(void * data) {
+  struct _bench_jwe_ctx * ctx = (struct _bench_jwe_ctx *)data;
+  jwe_t * jwe = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jwe_init(&jwe) == RHN_OK) {
+    if (r_jwe_parse(jwe, ctx->token, 0) == RHN_OK) {
+      ret = r_jwe_decrypt(jwe, ctx->privkey, 0);
+    }
+    r_jwe_free(jwe);
+  }
+  return ret;
+}
+
+static int bench_jwe_parse(void * data) {
+  struct _bench_jwe_ctx * ctx = (struct _bench_jwe_ctx *)data;
+  jwe_t * jwe = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jwe_init(&jwe) == RHN_OK) {
+    ret = r_jwe_parse(jwe, ctx->token, 0);
+    r_jwe_free(jwe);
+  }
+  return ret;
+}
+
+static int bench_jwt_parse(void * data) {
+  struct _bench_jws_ctx * ctx = (struct _bench_jws_ctx *)data;
+  jwt_t * jwt = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jwt_init(&jwt) == RHN_OK) {
+    ret = r_jwt_parse(jwt, ctx->token, 0);
+    r_jwt_free(jwt);
+  }
+  return ret;
+}
+
+static int bench_jwt_parse_lazy(void * data) {
+  struct _bench_jws_ctx * ctx = (struct _bench_jws_ctx *)data;
+  jwt_t * jwt = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jwt_init(&jwt) == RHN_OK) {
+    if (r_jwt_advanced_parse(jwt, ctx->token, R_PARSE_HEADER_ALL|R_PARSE_LAZY_CLAIMS, 0) == RHN_OK && r_jwt_get_claim_str_value(jwt, "iss") != NULL) {
+      ret = RHN_OK;
+    }
+    r_jwt_free(jwt);
+  }
+  return ret;
+}
+
+static int bench_jwt_claims_get(void * data) {
+  struct _bench_jws_ctx * ctx = (struct _bench_jws_ctx *)data;
+  jwt_t * jwt = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jwt_init(&jwt) == RHN_OK) {
+    if (r_jwt_parse(jwt, ctx->token, 0) == RHN_OK && r_jwt_get_claim_str_value(jwt, "iss") != NULL && r_jwt_get_claim_int_value(jwt, "iat")) {
+      ret = RHN_OK;
+    }
+    r_jwt_free(jwt);
+  }
+  return ret;
+}
+
+static int bench_jwt_claims_struct(void * data) {
+  struct _bench_jws_ctx * ctx = (struct _bench_jws_ctx *)data;
+  struct _bench_claims claims;
+  jwt_t * jwt = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jwt_init(&jwt) == RHN_OK) {
+    if (r_jwt_advanced_parse(jwt, ctx->token, R_PARSE_HEADER_ALL|R_PARSE_LAZY_CLAIMS, 0) == RHN_OK) {
+      ret = r_jwt_get_claims_struct(jwt, ctx->schema, &claims, NULL);
+    }
+    r_jwt_free(jwt);
+  }
+  return ret;
+}
+
+static int bench_jwt_peek(void * data) {
+  struct _bench_jws_ctx * ctx = (struct _bench_jws_ctx *)data;
+  char buffer[256];
+  const char * alg, * kid, * typ, * iss;
+  int ret = RHN_ERROR;
+
+  if (r_jwt_token_typen(ctx->token, o_strlen(ctx->token)) == R_JWT_TYPE_SIGN &&
+      r_jwt_peek_header(ctx->token, o_strlen(ctx->token), buffer, sizeof(buffer), "alg", &alg, "kid", &kid, "typ", &typ, NULL) == RHN_OK) {
+    ret = r_jwt_peek_claims(ctx->token, o_strlen(ctx->token), buffer, sizeof(buffer), "iss", &iss, NULL);
+  }
+  return ret;
+}
+
+static int bench_jwt_verify(void * data) {
+  struct _bench_jws_ctx * ctx = (struct _bench_jws_ctx *)data;
+  jwt_t * jwt = NULL;
+  json_t * j_claims;
+  int ret = RHN_ERROR;
+
+  if (r_jwt_init(&jwt) == RHN_OK) {
+    if (r_jwt_add_sign_keys(jwt, NULL, ctx->pubkey) == RHN_OK &&
+        r_jwt_parse(jwt, ctx->token, 0) == RHN_OK &&
+        r_jwt_verify_signature(jwt, NULL, 0) == RHN_OK &&
+        r_jwt_validate_claims(jwt, R_JWT_CLAIM_ISS, "https://rhonabwy.bench/", R_JWT_CLAIM_NOP) == RHN_OK &&
+        (j_claims = r_jwt_get_full_claims_json_t(jwt)) != NULL) {
+      json_decref(j_claims);
+      ret = RHN_OK;
+    }
+    r_jwt_free(jwt);
+  }
+  return ret;
+}
+
+static int bench_jwt_verify_arena(void * data) {
+  struct _bench_jws_ctx * ctx = (struct _bench_jws_ctx *)data;
+  int ret = RHN_ERROR;
+
+  if (r_arena_begin(ctx->arena) == RHN_OK) {
+    ret = bench_jwt_verify(data);
+    r_arena_end();
+    r_arena_reset(ctx->arena);
+  }
+  return ret;
+}
+
+static int bench_jwt_verify_compact(void * data) {
+  struct _bench_jws_ctx * ctx = (struct _bench_jws_ctx *)data;
+  json_t * j_claims = NULL;
+  int ret;
+
+  ret = r_jwt_verify_compact(ctx->token, o_strlen(ctx->token), ctx->jwks_shared, &j_claims, R_JWT_CLAIM_ISS, "https://rhonabwy.bench/", R_JWT_CLAIM_NOP);
+  json_decref(j_claims);
+  return ret;
+}
+
+static int bench_jwks_import(void * data) {
+  struct _bench_jwks_ctx * ctx = (struct _bench_jwks_ctx *)data;
+  jwks_t * jwks = NULL;
+  int ret = RHN_ERROR;
+
+  if (r_jwks_init(&jwks) == RHN_OK) {
+    ret = r_jwks_import_from_json_str(jwks, ctx->jwks_str);
+    r_jwks_free(jwks);
+  }
+  return ret;
+}
+
+static int bench_alg_selected(struct _bench_config * config, jwa_alg alg) {
+  return config->alg_filter == R_JWA_ALG_UNKNOWN || config->alg_filter == alg;
+}
+
+static int bench_enc_selected(struct _bench_config * config, jwa_enc enc) {
+  return config->enc_filter == R_JWA_ENC_UNKNOWN || config->enc_filter == enc;
+}
+
+static void bench_jws(struct _bench_config * config, json_t * j_results) {
+  static const jwa_alg algs[] = {R_JWA_ALG_HS256, R_JWA_ALG_HS384, R_JWA_ALG_HS512,
+                                 R_JWA_ALG_RS256, R_JWA_ALG_RS384, R_JWA_ALG_RS512,
+                                 R_JWA_ALG_PS256, R_JWA_ALG_PS384, R_JWA_ALG_PS512,
+                                 R_JWA_ALG_ES256, R_JWA_ALG_ES384, R_JWA_ALG_ES512,
+                                 R_JWA_ALG_ES256K, R_JWA_ALG_EDDSA};
+  struct _bench_keys keys;
+  struct _bench_jws_ctx ctx;
+  unsigned char * payload;
+  size_t i, j;
+  char * token;
+
+  for (i=0; i<sizeof(algs)/sizeof(jwa_alg); i++) {
+    if (!bench_alg_selected(config, algs[i])) {
+      continue;
+    }
+    if (bench_generate_keys(algs[i], R_JWA_ENC_UNKNOWN, &keys) != RHN_OK) {
+      bench_skip(config, j_results, bench_result("jws", "sign", algs[i], R_JWA_ENC_UNKNOWN, 0, 0), "unsupported key type");
+      continue;
+    }
+    for (j=0; j<config->nb_payload_sizes; j++) {
+      if ((payload = bench_payload(config->payload_sizes[j])) == NULL) {
+        continue;
+      }
+      memset(&ctx, 0, sizeof(ctx));
+      ctx.alg = algs[i];
+      ctx.payload = payload;
+      ctx.payload_len = config->payload_sizes[j];
+      ctx.privkey = keys.privkey;
+      ctx.pubkey = keys.pubkey;
+      bench_measure(config, j_results, bench_result("jws", "sign", algs[i], R_JWA_ENC_UNKNOWN, ctx.payload_len, 0), bench_jws_sign, &ctx);
+      if ((token = bench_jws_serialize(&ctx)) != NULL) {
+        ctx.token = token;
+        bench_measure(config, j_results, bench_result("jws", "verify", algs[i], R_JWA_ENC_UNKNOWN, ctx.payload_len, 0), bench_jws_verify, &ctx);
+        bench_measure(config, j_results, bench_result("jws", "parse", algs[i], R_JWA_ENC_UNKNOWN, ctx.payload_len, 0), bench_jws_parse, &ctx);
+        o_free(token);
+      }
+      o_free(payload);
+    }
+    bench_free_keys(&keys);
+  }
+}
+
+static void bench_jwe(struct _bench_config * config, json_t * j_results) {
+  static const jwa_alg algs[] = {R_JWA_ALG_RSA1_5, R_JWA_ALG_RSA_OAEP, R_JWA_ALG_RSA_OAEP_256,
+                                 R_JWA_ALG_A128KW, R_JWA_ALG_A192KW, R_JWA_ALG_A256KW,
+                                 R_JWA_ALG_DIR,
+                                 R_JWA_ALG_ECDH_ES, R_JWA_ALG_ECDH_ES_A128KW, R_JWA_ALG_ECDH_ES_A192KW, R_JWA_ALG_ECDH_ES_A256KW,
+                                 R_JWA_ALG_A128GCMKW, R_JWA_ALG_A192GCMKW, R_JWA_ALG_A256GCMKW,
+                                 R_JWA_ALG_PBES2_H256, R_JWA_ALG_PBES2_H384, R_JWA_ALG_PBES2_H512};
+  static const jwa_enc encs[] = {R_JWA_ENC_A128CBC, R_JWA_ENC_A192CBC, R_JWA_ENC_A256CBC,
+                                 R_JWA_ENC_A128GCM, R_JWA_ENC_A192GCM, R_JWA_ENC_A256GCM};
+  struct _bench_keys keys;
+  struct _bench_jwe_ctx ctx;
+  unsigned char * payload;
+  size_t i, j, k;
+  char * token;
+
+  for (i=0; i<sizeof(algs)/sizeof(jwa_alg); i++) {
+    if (!bench_alg_selected(config, algs[i])) {
+      continue;
+    }
+    keys.privkey = keys.pubkey = NULL;
+    for (j=0; j<sizeof(encs)/sizeof(jwa_enc); j++) {
+      if (!bench_enc_selected(config, encs[j])) {
+        continue;
+      }
+      // The key size depends on enc with dir, otherwise keys are generated once per alg
+      if (algs[i] == R_JWA_ALG_DIR) {
+        bench_free_keys(&keys);
+      }
+      if (keys.privkey == NULL && bench_generate_keys(algs[i], encs[j], &keys) != RHN_OK) {
+        bench_skip(config, j_results, bench_result("jwe", "encrypt", algs[i], encs[j], 0, 0), "unsupported key type");
+        continue;
+      }
+      for (k=0; k<config->nb_payload_sizes; k++) {
+        if ((payload = bench_payload(config->payload_sizes[k])) == NULL) {
+          continue;
+        }
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.alg = algs[i];
+        ctx.enc = encs[j];
+        ctx.payload = payload;
+        ctx.payload_len = config->payload_sizes[k];
+        ctx.privkey = keys.privkey;
+        ctx.pubkey = keys.pubkey;
+        bench_measure(config, j_results, bench_result("jwe", "encrypt", algs[i], encs[j], ctx.payload_len, 0), bench_jwe_encrypt, &ctx);
+        if ((token = bench_jwe_serialize(&ctx)) != NULL) {
+          ctx.token = token;
+          bench_measure(config, j_results, bench_result("jwe", "decrypt", algs[i], encs[j], ctx.payload_len, 0), bench_jwe_decrypt, &ctx);
+          bench_measure(config, j_results, bench_result("jwe", "parse", algs[i], encs[j], ctx.payload_len, 0), bench_jwe_parse, &ctx);
+          o_free(token);
+        }
+        o_free(payload);
+      }
+    }
+    bench_free_keys(&keys);
+  }
+}
+
+static void bench_jwt(struct _bench_config * config, json_t * j_results) {
+  struct _bench_keys keys;
+  struct _bench_jws_ctx ctx;
+  rhn_claim_desc claims_desc[] = {
+    {"iss", R_CLAIM_TYPE_STR, offsetof(struct _bench_claims, iss), sizeof(((struct _bench_claims *)0)->iss)},
+    {"iat", R_CLAIM_TYPE_INT, offsetof(struct _bench_claims, iat), 0}
+  };
+  jwt_claims_schema_t * schema;
+  json_t * j_claims;
+  jwt_t * jwt = NULL;
+  unsigned char * payload;
+  char * token;
+  size_t i;
+
+  if (!bench_alg_selected(config, R_JWA_ALG_HS256)) {
+    return;
+  }
+  if (bench_generate_keys(R_JWA_ALG_HS256, R_JWA_ENC_UNKNOWN, &keys) != RHN_OK) {
+    return;
+  }
+  schema = r_jwt_claims_schema_new(claims_desc, sizeof(claims_desc)/sizeof(rhn_claim_desc));
+  for (i=0; i<config->nb_payload_sizes; i++) {
+    if ((payload = bench_payload(config->payload_sizes[i])) == NULL) {
+      continue;
+    }
+    token = NULL;
+    j_claims = json_pack("{sssIss}", "iss", "https://rhonabwy.bench/", "iat", (json_int_t)time(NULL), "data", (const char *)payload);
+    if (r_jwt_init(&jwt) == RHN_OK) {
+      if (r_jwt_set_sign_alg(jwt, R_JWA_ALG_HS256) == RHN_OK && r_jwt_set_full_claims_json_t(jwt, j_claims) == RHN_OK) {
+        token = r_jwt_serialize_signed(jwt, keys.privkey, 0);
+      }
+      r_jwt_free(jwt);
+    }
+    if (token != NULL) {
+      memset(&ctx, 0, sizeof(ctx));
+      ctx.token = token;
+      ctx.pubkey = keys.pubkey;
+      ctx.schema = schema;
+      bench_measure(config, j_results, bench_result("jwt", "parse", R_JWA_ALG_HS256, R_JWA_ENC_UNKNOWN, config->payload_sizes[i], 0), bench_jwt_parse, &ctx);
+      bench_measure(config, j_results, bench_result("jwt", "parse_lazy", R_JWA_ALG_HS256, R_JWA_ENC_UNKNOWN, config->payload_sizes[i], 0), bench_jwt_parse_lazy, &ctx);
+      bench_measure(config, j_results, bench_result("jwt", "claims_get", R_JWA_ALG_HS256, R_JWA_ENC_UNKNOWN, config->payload_sizes[i], 0), bench_jwt_claims_get, &ctx);
+      if (schema != NULL) {
+        bench_measure(config, j_results, bench_result("jwt", "claims_struct", R_JWA_ALG_HS256, R_JWA_ENC_UNKNOWN, config->payload_sizes[i], 0), bench_jwt_claims_struct, &ctx);
+      }
+      bench_measure(config, j_results, bench_result("jwt", "peek", R_JWA_ALG_HS256, R_JWA_ENC_UNKNOWN, config->payload_sizes[i], 0), bench_jwt_peek, &ctx);
+      bench_measure(config, j_results, bench_result("jwt", "verify", R_JWA_ALG_HS256, R_JWA_ENC_UNKNOWN, config->payload_sizes[i], 0), bench_jwt_verify, &ctx);
+      if (config->arena && (ctx.arena = r_arena_new(0)) != NULL) {
+        bench_measure(config, j_results, bench_result("jwt", "verify_arena", R_JWA_ALG_HS256, R_JWA_ENC_UNKNOWN, config->payload_sizes[i], 0), bench_jwt_verify_arena, &ctx);
+      }
+      r_arena_free(ctx.arena);
+      if (r_jwks_init(&ctx.jwks) == RHN_OK && r_jwks_append_jwk(ctx.jwks, keys.pubkey) == RHN_OK && (ctx.jwks_shared = r_jwks_shared_new(ctx.jwks)) != NULL) {
+        bench_measure(config, j_results, bench_result("jwt", "verify_compact", R_JWA_ALG_HS256, R_JWA_ENC_UNKNOWN, config->payload_sizes[i], 0), bench_jwt_verify_compact, &ctx);
+      }
+      r_jwks_shared_free(ctx.jwks_shared);
+      r_jwks_free(ctx.jwks);
+      o_free(token);
+    }
+    json_decref(j_claims);
+    o_free(payload);
+  }
+  r_jwt_claims_schema_free(schema);
+  bench_free_keys(&keys);
+}
+
+static void bench_jwks(struct _bench_config * config, json_t * j_results) {
+  struct _bench_jwks_ctx jwks_ctx;
+  struct _bench_jws_ctx ctx;
+  jwks_t * jwks = NULL;
+  jwk_t * jwk = NULL;
+  unsigned char * payload = bench_payload(100);
+  char * kid, * token;
+  size_t i, j;
+
+  if (!bench_alg_selected(config, R_JWA_ALG_HS256) || payload == NULL) {
+    o_free(payload);
+    return;
+  }
+  for (i=0; i<config->nb_jwks_sizes; i++) {
+    if (r_jwks_init(&jwks) != RHN_OK) {
+      continue;
+    }
+    jwk = NULL;
+    for (j=0; j<config->jwks_sizes[i]; j++) {
+      r_jwk_free(jwk);
+      jwk = NULL;
+      if (r_jwk_init(&jwk) == RHN_OK && bench_symmetric_key(jwk, 32) == RHN_OK) {
+        kid = msprintf("bench-%zu", j);
+        r_jwk_set_property_str(jwk, "kid", kid);
+        r_jwk_set_property_str(jwk, "alg", "HS256");
+        r_jwks_append_jwk(jwks, jwk);
+        o_free(kid);
+      }
+    }
+    // The token is signed with the last key of the JWKS so the lookup by kid goes through the whole set
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.alg = R_JWA_ALG_HS256;
+    ctx.payload = payload;
+    ctx.payload_len = 100;
+    ctx.privkey = jwk;
+    ctx.jwks = jwks;
+    jwks_ctx.jwks_str = r_jwks_export_to_json_str(jwks, 0);
+    bench_measure(config, j_results, bench_result("jwks", "import", R_JWA_ALG_UNKNOWN, R_JWA_ENC_UNKNOWN, 0, config->jwks_sizes[i]), bench_jwks_import, &jwks_ctx);
+    if ((token = bench_jws_serialize(&ctx)) != NULL) {
+      ctx.token = token;
+      bench_measure(config, j_results, bench_result("jwks", "verify", R_JWA_ALG_HS256, R_JWA_ENC_UNKNOWN, 100, config->jwks_sizes[i]), bench_jws_verify, &ctx);
+      o_free(token);
+    }
+    o_free((char *)jwks_ctx.jwks_str);
+    r_jwk_free(jwk);
+    r_jwks_free(jwks);
+  }
+  o_free(payload);
+}
+
+static size_t bench_parse_sizes(const char * value, size_t * sizes) {
+  char ** values = NULL;
+  size_t nb, i, n = 0;
+  char * endptr = NULL;
+  unsigned long long size;
+
+  nb = split_string(value, ",", &values);
+  for (i=0; i<nb && n<BENCH_MAX_SIZES; i++) {
+    size = strtoull(values[i], &endptr, 10);
+    if (endptr != values[i] && size) {
+      sizes[n++] = (size_t)size;
+    } else {
+      fprintf(stderr, "Invalid size: %s\n", values[i]);
+    }
+  }
+  free_string_array(values);
+  return n;
+}
+
+static int bench_parse_groups(const char * value) {
+  char ** values = NULL;
+  size_t nb, i;
+  int groups = 0;
+
+  nb = split_string(value, ",", &values);
+  for (i=0; i<nb; i++) {
+    if (0 == o_strcasecmp("jws", values[i])) {
+      groups |= BENCH_GROUP_JWS;
+    } else if (0 == o_strcasecmp("jwe", values[i])) {
+      groups |= BENCH_GROUP_JWE;
+    } else if (0 == o_strcasecmp("jwt", values[i])) {
+      groups |= BENCH_GROUP_JWT;
+    } else if (0 == o_strcasecmp("jwks", values[i])) {
+      groups |= BENCH_GROUP_JWKS;
+    } else if (0 == o_strcasecmp("all", values[i])) {
+      groups |= BENCH_GROUP_ALL;
+    } else {
+      fprintf(stderr, "Invalid group: %s\n", values[i]);
+    }
+  }
+  free_string_array(values);
+  return groups;
+}
+
+static void print_help(FILE * output) {
+  fprintf(output, "\nrhonabwy_bench - Rhonabwy benchmark suite\n");
+  fprintf(output, "\n");
+  fprintf(output, "Measures throughput and latency of JWS, JWE, JWT and JWKS operations, outputs the results in JSON format\n");
+  fprintf(output, "\n");
+  fprintf(output, "Command-line options:\n");
+  fprintf(output, "\n");
+  fprintf(output, "-g --group <groups>\n");
+  fprintf(output, "\tComma separated list of benchmark groups to run, values available are jws, jwe, jwt, jwks or all, default all\n");
+  fprintf(output, "-a --alg <alg>\n");
+  fprintf(output, "\tRun the benchmarks for this alg only\n");
+  fprintf(output, "-e --enc <enc>\n");
+  fprintf(output, "\tRun the JWE benchmarks for this enc only\n");
+  fprintf(output, "-s --payload-sizes <sizes>\n");
+  fprintf(output, "\tComma separated list of payload sizes in bytes, default 100,1000,10000,100000,1000000,10000000\n");
+  fprintf(output, "-k --jwks-sizes <sizes>\n");
+  fprintf(output, "\tComma separated list of JWKS sizes, default 1,10,100,1000,10000\n");
+  fprintf(output, "-t --min-time <seconds>\n");
+  fprintf(output, "\tMinimum time spent on each benchmark, default %.1f\n", BENCH_DEFAULT_MIN_TIME);
+  fprintf(output, "-n --min-iterations <n>\n");
+  fprintf(output, "\tMinimum number of iterations for each benchmark, default %d\n", BENCH_DEFAULT_MIN_ITERATIONS);
+  fprintf(output, "-m --max-iterations <n>\n");
+  fprintf(output, "\tMaximum number of iterations for each benchmark, default %d\n", BENCH_DEFAULT_MAX_ITERATIONS);
+  fprintf(output, "-o --output <file>\n");
+  fprintf(output, "\tWrite the JSON result in the file instead of the standard output\n");
+  fprintf(output, "-q --quiet\n");
+  fprintf(output, "\tDo not print the progress on the error output\n");
+  fprintf(output, "-h --help\n");
+  fprintf(output, "\tPrint this help message and exit\n");
+}
+
+int main(int argc, char ** argv) {
+  const char * short_options = "g:a:e:s:k:t:n:m:o:qh";
+  static const struct option long_options[]= {
+    {"group", required_argument, NULL, 'g'},
+    {"alg", required_argument, NULL, 'a'},
+    {"enc", required_argument, NULL, 'e'},
+    {"payload-sizes", required_argument, NULL, 's'},
+    {"jwks-sizes", required_argument, NULL, 'k'},
+    {"min-time", required_argument, NULL, 't'},
+    {"min-iterations", required_argument, NULL, 'n'},
+    {"max-iterations", required_argument, NULL, 'm'},
+    {"output", required_argument, NULL, 'o'},
+    {"quiet", no_argument, NULL, 'q'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  struct _bench_config config;
+  const char * output = NULL;
+  json_t * j_bench, * j_results, * j_info;
+  struct utsname host;
+  int next_option, ret = 0;
+  size_t i;
+  char * str, nettle_version[16];
+  FILE * f;
+
+  memset(&config, 0, sizeof(config));
+  config.groups = BENCH_GROUP_ALL;
+  config.min_time = BENCH_DEFAULT_MIN_TIME;
+  config.min_iterations = BENCH_DEFAULT_MIN_ITERATIONS;
+  config.max_iterations = BENCH_DEFAULT_MAX_ITERATIONS;
+  for (i=0; i<sizeof(default_payload_sizes)/sizeof(size_t); i++) {
+    config.payload_sizes[config.nb_payload_sizes++] = default_payload_sizes[i];
+  }
+  for (i=0; i<sizeof(default_jwks_sizes)/sizeof(size_t); i++) {
+    config.jwks_sizes[config.nb_jwks_sizes++] = default_jwks_sizes[i];
+  }
+
+  do {
+    next_option = getopt_long(argc, argv, short_options, long_options, NULL);
+    switch (next_option) {
+      case 'g':
+        config.groups = bench_parse_groups(optarg);
+        break;
+      case 'a':
+        if ((config.alg_filter = r_str_to_jwa_alg(optarg)) == R_JWA_ALG_UNKNOWN) {
+          fprintf(stderr, "Invalid alg: %s\n", optarg);
+          ret = 1;
+        }
+        break;
+      case 'e':
+        if ((config.enc_filter = r_str_to_jwa_enc(optarg)) == R_JWA_ENC_UNKNOWN) {
+          fprintf(stderr, "Invalid enc: %s\n", optarg);
+          ret = 1;
+        }
+        break;
+      case 's':
+        config.nb_payload_sizes = bench_parse_sizes(optarg, config.payload_sizes);
+        break;
+      case 'k':
+        config.nb_jwks_sizes = bench_parse_sizes(optarg, config.jwks_sizes);
+        break;
+      case 't':
+        config.min_time = strtod(optarg, NULL);
+        break;
+      case 'n':
+        config.min_iterations = (size_t)strtoull(optarg, NULL, 10);
+        break;
+      case 'm':
+        config.max_iterations = (size_t)strtoull(optarg, NULL, 10);
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'q':
+        config.quiet = 1;
+        break;
+      case 'h':
+        print_help(stdout);
+        return 0;
+        break;
+      case -1:
+        break;
+      default:
+        print_help(stderr);
+        return 1;
+        break;
+    }
+  } while (next_option != -1);
+
+  if (ret || !config.max_iterations) {
+    print_help(stderr);
+    return 1;
+  }
+
+  // The arena allocators must be set before any allocation of the library
+  config.arena = (r_global_enable_arena() == RHN_OK);
+  if (r_global_init() != RHN_OK) {
+    fprintf(stderr, "Error r_global_init\n");
+    return 1;
+  }
+
+  j_info = r_library_info_json_t();
+  j_results = json_array();
+  snprintf(nettle_version, sizeof(nettle_version), "%d.%d", NETTLE_VERSION_MAJOR, NETTLE_VERSION_MINOR);
+  j_bench = json_pack("{s{ssssssss}s{sfsIsI}sOso}",
+                      "versions",
+                        "rhonabwy", RHONABWY_VERSION_STR,
+                        "gnutls", gnutls_check_version(NULL),
+                        "nettle", nettle_version,
+                        "jansson", JANSSON_VERSION,
+                      "settings",
+                        "min_time", config.min_time,
+                        "min_iterations", (json_int_t)config.min_iterations,
+                        "max_iterations", (json_int_t)config.max_iterations,
+                      "library", j_info,
+                      "results", j_results);
+  if (!uname(&host)) {
+    json_object_set_new(j_bench, "host", json_pack("{ssssss}", "sysname", host.sysname, "release", host.release, "machine", host.machine));
+  }
+
+  if (config.groups & BENCH_GROUP_JWS) {
+    bench_jws(&config, j_results);
+  }
+  if (config.groups & BENCH_GROUP_JWE) {
+    bench_jwe(&config, j_results);
+  }
+  if (config.groups & BENCH_GROUP_JWT) {
+    bench_jwt(&config, j_results);
+  }
+  if (config.groups & BENCH_GROUP_JWKS) {
+    bench_jwks(&config, j_results);
+  }
+
+  str = json_dumps(j_bench, JSON_INDENT(2));
+  if (output != NULL) {
+    if ((f = fopen(output, "w")) != NULL) {
+      fprintf(f, "%s\n", str);
+      fclose(f);
+    } else {
+      fprintf(stderr, "Error opening output file %s\n", output);
+      ret = 1;
+    }
+  } else {
+    printf("%s\n", str);
+  }
+  o_free(str);
+  json_decref(j_info);
+  json_decref(j_bench);
+  r_global_close();
+  return ret;
+}
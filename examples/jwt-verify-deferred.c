@@ -0,0 +1,221 @@
+/**
+ *
+ * Rhonabwy Javascript Object Signing and Encryption (JOSE) library
+ *
+ * Example program verifying a signed token whose keys are referenced by a jku or x5u header
+ * The remote keys are downloaded by the application in its own poll() loop,
+ * so the verification never blocks on the network inside the library
+ *
+ * Copyright 2022 Nicolas Mora <mail@babelouest.org>
+ *
+ * License MIT
+ *
+ * To compile with gcc, use the following command:
+ * gcc -o jwt-verify-deferred jwt-verify-deferred.c -lrhonabwy -lcurl
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <curl/curl.h>
+#include <rhonabwy.h>
+
+#define MAX_DOWNLOADS 8
+#define MAX_SOCKETS 16
+
+struct download {
+  CURL * handle;
+  const char * url;
+  char * content;
+  size_t content_len;
+};
+
+/**
+ * The sockets curl asks the loop to watch, and the timeout before
+ * the next call to curl_multi_socket_action without any socket event
+ */
+struct event_loop {
+  struct pollfd fds[MAX_SOCKETS];
+  nfds_t nb_fds;
+  long timeout_ms;
+};
+
+static size_t write_content(char * ptr, size_t size, size_t nmemb, void * userdata) {
+  struct download * dl = (struct download *)userdata;
+  char * content = realloc(dl->content, dl->content_len + size*nmemb + 1);
+
+  if (content == NULL) {
+    return 0;
+  }
+  memcpy(content + dl->content_len, ptr, size*nmemb);
+  dl->content = content;
+  dl->content_len += size*nmemb;
+  dl->content[dl->content_len] = '\0';
+  return size*nmemb;
+}
+
+/**
+ * Called by curl to add, update or remove a socket to watch
+ */
+static int socket_cb(CURL * easy, curl_socket_t s, int what, void * userp, void * socketp) {
+  struct event_loop * loop = (struct event_loop *)userp;
+  nfds_t i;
+  (void)easy;
+  (void)socketp;
+
+  for (i=0; i<loop->nb_fds && loop->fds[i].fd != s; i++);
+  if (what == CURL_POLL_REMOVE) {
+    if (i < loop->nb_fds) {
+      loop->fds[i] = loop->fds[loop->nb_fds-1];
+      loop->nb_fds--;
+    }
+  } else if (i < MAX_SOCKETS) {
+    if (i == loop->nb_fds) {
+      loop->fds[i].fd = s;
+      loop->nb_fds++;
+    }
+    loop->fds[i].events = 0;
+    if (what & CURL_POLL_IN) {
+      loop->fds[i].events |= POLLIN;
+    }
+    if (what & CURL_POLL_OUT) {
+      loop->fds[i].events |= POLLOUT;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Called by curl to set the timeout of the next poll
+ */
+static int timer_cb(CURLM * multi, long timeout_ms, void * userp) {
+  struct event_loop * loop = (struct event_loop *)userp;
+  (void)multi;
+
+  loop->timeout_ms = timeout_ms;
+  return 0;
+}
+
+/**
+ * Hands the completed downloads back to the token, must be called after each
+ * curl_multi_socket_action, a download may complete in any of them
+ */
+static void drain_messages(CURLM * multi, jwt_t * jwt) {
+  CURLMsg * msg;
+  struct download * cur;
+  char * private_data;
+  long status;
+  int msgs_left;
+
+  while ((msg = curl_multi_info_read(multi, &msgs_left)) != NULL) {
+    if (msg->msg == CURLMSG_DONE) {
+      private_data = NULL;
+      status = 0;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &private_data);
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+      cur = (struct download *)private_data;
+      // Hand the downloaded content back to the token, NULL if the download failed
+      if (msg->data.result == CURLE_OK && status >= 200 && status < 300) {
+        r_jwt_remote_resume(jwt, cur->url, cur->content, cur->content_len);
+      } else {
+        r_jwt_remote_resume(jwt, cur->url, NULL, 0);
+      }
+    }
+  }
+}
+
+int main(int argc, char ** argv) {
+  jwt_t * jwt = NULL;
+  CURLM * multi = NULL;
+  struct download dl[MAX_DOWNLOADS];
+  struct event_loop loop;
+  struct pollfd fds[MAX_SOCKETS];
+  size_t i, nb_dl = 0;
+  nfds_t j, nb_fds;
+  int running = 0, ret, nb_events, ev_bitmask;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <token>\n", argv[0]);
+    return 1;
+  }
+
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  memset(dl, 0, sizeof(dl));
+  memset(&loop, 0, sizeof(loop));
+  loop.timeout_ms = -1;
+
+  // Parse the token, the jku and x5u urls are only recorded, not downloaded
+  if (NULL != (jwt = r_jwt_quick_parse(argv[1], R_PARSE_HEADER_JKU|R_PARSE_HEADER_X5U, R_FLAG_DEFER_REMOTE))) {
+    if ((ret = r_jwt_verify_signature(jwt, NULL, 0)) == RHN_NEED_KEY) {
+      multi = curl_multi_init();
+      curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_cb);
+      curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, &loop);
+      curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_cb);
+      curl_multi_setopt(multi, CURLMOPT_TIMERDATA, &loop);
+      // Start one download per pending url
+      for (i=0; i<r_jwt_remote_pending_size(jwt) && nb_dl<MAX_DOWNLOADS; i++) {
+        dl[nb_dl].url = r_jwt_remote_pending_get_at(jwt, i, NULL);
+        dl[nb_dl].handle = curl_easy_init();
+        curl_easy_setopt(dl[nb_dl].handle, CURLOPT_URL, dl[nb_dl].url);
+        curl_easy_setopt(dl[nb_dl].handle, CURLOPT_WRITEFUNCTION, write_content);
+        curl_easy_setopt(dl[nb_dl].handle, CURLOPT_WRITEDATA, &dl[nb_dl]);
+        curl_easy_setopt(dl[nb_dl].handle, CURLOPT_PRIVATE, &dl[nb_dl]);
+        curl_easy_setopt(dl[nb_dl].handle, CURLOPT_TIMEOUT_MS, 10000L);
+        curl_multi_add_handle(multi, dl[nb_dl].handle);
+        nb_dl++;
+      }
+      curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+      // A download may already be complete, e.g. on an immediate connection error
+      drain_messages(multi, jwt);
+
+      // Event loop, the application can add its own file descriptors to the poll() call
+      while (running) {
+        // The callbacks may change loop.fds during curl_multi_socket_action
+        nb_fds = loop.nb_fds;
+        memcpy(fds, loop.fds, nb_fds*sizeof(struct pollfd));
+        if ((nb_events = poll(fds, nb_fds, (int)loop.timeout_ms)) < 0) {
+          break;
+        } else if (!nb_events) {
+          curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+          drain_messages(multi, jwt);
+        } else {
+          for (j=0; j<nb_fds; j++) {
+            if (fds[j].revents) {
+              ev_bitmask = 0;
+              if (fds[j].revents & POLLIN) {
+                ev_bitmask |= CURL_CSELECT_IN;
+              }
+              if (fds[j].revents & POLLOUT) {
+                ev_bitmask |= CURL_CSELECT_OUT;
+              }
+              if (fds[j].revents & (POLLERR|POLLHUP)) {
+                ev_bitmask |= CURL_CSELECT_ERR;
+              }
+              curl_multi_socket_action(multi, fds[j].fd, ev_bitmask, &running);
+              drain_messages(multi, jwt);
+            }
+          }
+        }
+      }
+
+      ret = r_jwt_verify_signature(jwt, NULL, 0);
+    }
+    if (ret == RHN_OK) {
+      printf("Token signature verified.\n");
+    } else {
+      printf("Token signature invalid!\n");
+    }
+  } // else handle r_jwt_quick_parse error
+
+  for (i=0; i<nb_dl; i++) {
+    curl_multi_remove_handle(multi, dl[i].handle);
+    curl_easy_cleanup(dl[i].handle);
+    free(dl[i].content);
+  }
+  curl_multi_cleanup(multi);
+  r_jwt_free(jwt);
+  curl_global_cleanup();
+
+  return 0;
+}
@@ -49,6 +49,7 @@ extern "C"
 #define RHN_ERROR_PARAM        3
 #define RHN_ERROR_UNSUPPORTED  4
 #define RHN_ERROR_INVALID      5
+#define RHN_NEED_KEY           6
 
 #define R_X509_TYPE_UNSPECIFIED 0
 #define R_X509_TYPE_PUBKEY      1
@@ -71,6 +72,14 @@ extern "C"
 #define R_FLAG_IGNORE_SERVER_CERTIFICATE 0x00000001
 #define R_FLAG_FOLLOW_REDIRECT           0x00000010
 #define R_FLAG_IGNORE_REMOTE             0x00000100
+#define R_FLAG_DEFER_REMOTE              0x00001000
+
+#define R_REMOTE_JKU 1
+#define R_REMOTE_X5U 2
+
+#define R_JWKS_STORE_VALIDATE_IMPORT   0
+#define R_JWKS_STORE_VALIDATE_PARALLEL 1
+#define R_JWKS_STORE_VALIDATE_DEFERRED 2
 
 #define R_JWT_TYPE_NONE                     0
 #define R_JWT_TYPE_SIGN                     1
@@ -96,6 +105,7 @@ extern "C"
 #define R_PARSE_HEADER_X5U     8
 #define R_PARSE_HEADER_ALL    (R_PARSE_HEADER_JWK|R_PARSE_HEADER_JKU|R_PARSE_HEADER_X5C|R_PARSE_HEADER_X5U)
 #define R_PARSE_UNSIGNED       16
+#define R_PARSE_LAZY_CLAIMS    32
 #define R_PARSE_ALL           (R_PARSE_HEADER_ALL|R_PARSE_UNSIGNED)
 
 /**
@@ -110,6 +120,10 @@ extern "C"
 
 typedef json_t jwk_t;
 typedef json_t jwks_t;
+typedef struct _jwks_store jwks_store_t;
+typedef struct _jwks_shared jwks_shared_t;
+typedef struct _jwt_claims_schema jwt_claims_schema_t;
+typedef struct _rhn_arena rhn_arena_t;
 typedef json_int_t rhn_int_t;
 
 #define RHONABWY_INTEGER_FORMAT JSON_INTEGER_FORMAT
@@ -166,6 +180,40 @@ typedef enum {
   R_JWT_CLAIM_CTY = 12,
 } rhn_claim_opt;
 
+typedef enum {
+  R_CLAIM_TYPE_STR  = 0, ///< String value copied in a char array of max_len bytes, including the NULL terminator
+  R_CLAIM_TYPE_INT  = 1, ///< Integer value stored in a rhn_int_t
+  R_CLAIM_TYPE_BOOL = 2  ///< Boolean value stored in an int, 1 for true, 0 for false
+} rhn_claim_type;
+
+/**
+ * Describes a claim extracted by r_jwt_get_claims_struct
+ * in a member of a struct defined by the application
+ */
+typedef struct {
+  const char     * name;    ///< Claim name
+  rhn_claim_type   type;    ///< Claim type
+  size_t           offset;  ///< Offset of the member in the struct, use offsetof
+  size_t           max_len; ///< Size of the char array for R_CLAIM_TYPE_STR, ignored otherwise
+} rhn_claim_desc;
+
+#define R_CLAIMS_SCHEMA_MAX 64
+
+#define R_THREAD_CTX_SCRATCH_MAX (64*1024)
+
+/**
+ * Allocation statistics of an accounting scope,
+ * set by r_alloc_stats_end
+ */
+typedef struct {
+  size_t allocs;   ///< Number of allocations
+  size_t reallocs; ///< Number of reallocations
+  size_t frees;    ///< Number of frees
+  size_t bytes;    ///< Total number of bytes allocated or reallocated
+  size_t peak;     ///< Peak number of bytes allocated in the scope and not freed yet
+  size_t in_use;   ///< Number of bytes allocated in the scope and not freed at the end
+} rhn_alloc_stats;
+
 typedef enum {
   R_JWA_ENC_UNKNOWN = 0,
   R_JWA_ENC_A128CBC = 1,
@@ -252,6 +300,11 @@ typedef struct {
   size_t          payload_len;
   json_t        * j_json_serialization;
   int             token_mode;
+  json_t        * j_jwks_pubkey_header;
+  json_t        * j_remote_pending;
+  jwks_store_t  * jwks_store;
+  jwks_shared_t * jwks_shared_privkey;
+  jwks_shared_t * jwks_shared_pubkey;
 } jws_t;
 
 typedef struct {
@@ -277,6 +330,9 @@ typedef struct {
   size_t          payload_len;
   json_t        * j_json_serialization;
   int             token_mode;
+  json_t        * j_jwks_pubkey_header;
+  jwks_shared_t * jwks_shared_privkey;
+  jwks_shared_t * jwks_shared_pubkey;
 } jwe_t;
 
 typedef struct {
@@ -297,6 +353,14 @@ typedef struct {
   jwks_t        * jwks_pubkey_sign;
   jwks_t        * jwks_privkey_enc;
   jwks_t        * jwks_pubkey_enc;
+  json_t        * j_jwks_pubkey_sign_header;
+  json_t        * j_jwks_pubkey_enc_header;
+  jwks_store_t  * jwks_store_sign;
+  jwks_shared_t * jwks_shared_privkey_sign;
+  jwks_shared_t * jwks_shared_pubkey_sign;
+  jwks_shared_t * jwks_shared_privkey_enc;
+  jwks_shared_t * jwks_shared_pubkey_enc;
+  struct _r_jwt_lazy_claims * lazy_claims;
 } jwt_t;
 
 /**
@@ -320,9 +384,154 @@ int r_global_init(void);
 
 /**
  * Close rhonabwy global parameters
+ * The per-thread context of the calling thread is freed
  */
 void r_global_close(void);
 
+/**
+ * Sets the options of the HTTP client used to download remote content,
+ * e.g. x5u certificates or jku key sets
+ * By default, the requests have no timeout and no response size limit
+ * @param connect_timeout: the maximum time in milliseconds to connect to the server, 0 for no limit
+ * @param timeout: the maximum time in milliseconds for the whole request, 0 for no limit
+ * @param max_response_size: the maximum size in bytes of the response body, 0 for no limit
+ * @return RHN_OK on success, an error value on error
+ */
+int r_global_set_http_options(unsigned int connect_timeout, unsigned int timeout, size_t max_response_size);
+
+/**
+ * Sets how concurrent and repeated downloads of the same remote content are handled
+ * Concurrent requests of the same url are coalesced: one thread downloads
+ * the content and the other threads wait for its result
+ * @param wait_timeout: the maximum time in milliseconds a thread waits for
+ * the download made by another thread, 0 for no limit, default is 30 seconds
+ * @param min_refresh: the time in milliseconds a successful response is reused
+ * for the next requests of the same url, 0 to disable (default)
+ * @param backoff_min: the time in milliseconds during which a failed url isn't requested again,
+ * doubled on each consecutive failure, 0 to disable (default)
+ * @param backoff_max: the maximum backoff time in milliseconds, 0 for no limit
+ * @return RHN_OK on success, an error value on error
+ */
+int r_global_set_http_fetch_options(unsigned int wait_timeout, unsigned int min_refresh, unsigned int backoff_min, unsigned int backoff_max);
+
+/**
+ * Enables the arena allocators
+ * The orcania and jansson allocation functions are replaced with functions
+ * allocating in the arena of the current thread, set with r_arena_begin,
+ * or with the previous allocation functions outside of an arena scope
+ * The replacement is process-wide, the jansson objects and orcania strings
+ * created by the application in an arena scope are allocated in the arena too
+ * Each block is preceded by a header telling if it's in an arena,
+ * so the memory must be freed with the orcania and jansson functions
+ * This function isn't thread-safe, it must be called once at startup,
+ * before any allocation and before r_global_init
+ * @return RHN_OK on success, an error value on error
+ */
+int r_global_enable_arena(void);
+
+/**
+ * Creates an arena, a bump allocator used for all the allocations
+ * of the library made by a thread between r_arena_begin and r_arena_end
+ * @param chunk_size: the size of each memory chunk, 0 for the default size of 16KB
+ * @return a new rhn_arena_t * or NULL on error, must be freed with r_arena_free
+ */
+rhn_arena_t * r_arena_new(size_t chunk_size);
+
+/**
+ * Frees an arena and all the memory allocated in it
+ * @param arena: the arena to free
+ */
+void r_arena_free(rhn_arena_t * arena);
+
+/**
+ * Starts an arena scope in the current thread
+ * Until r_arena_end, the memory allocated by the library in this thread
+ * comes from the arena, and freeing it does nothing
+ * The memory allocated in the scope stays valid until r_arena_reset or r_arena_free,
+ * it can be freed or reallocated before by any thread, in or out of an arena scope
+ * Shared key sets, key stores, the PBES2 cache and the ECDH-ES pool
+ * are never allocated in the arena
+ * GnuTLS and Nettle allocations aren't made in the arena
+ * @param arena: the arena to use
+ * @return RHN_OK on success, RHN_ERROR_UNSUPPORTED if r_global_enable_arena wasn't called,
+ * RHN_ERROR_PARAM if arena is NULL or if an arena scope is already started in this thread
+ */
+int r_arena_begin(rhn_arena_t * arena);
+
+/**
+ * Ends the arena scope of the current thread
+ */
+void r_arena_end(void);
+
+/**
+ * Releases all the memory allocated in the arena, the memory chunks are kept for reuse
+ * The arena must not be in use by another thread
+ * @param arena: the arena to reset
+ */
+void r_arena_reset(rhn_arena_t * arena);
+
+/**
+ * Returns the number of bytes allocated in the arena since its last reset
+ * @param arena: the arena
+ * @return the number of bytes allocated
+ */
+size_t r_arena_used(rhn_arena_t * arena);
+
+/**
+ * Frees the per-thread context of the current thread
+ * Each thread keeps the scratch buffers and the compression streams
+ * used by the token operations, so the next operations reuse them
+ * A scratch buffer larger than R_THREAD_CTX_SCRATCH_MAX isn't kept
+ * The context is freed when the thread exits, this function can be used
+ * to release the memory of a thread that won't process tokens for a while
+ */
+void r_thread_ctx_release(void);
+
+/**
+ * Returns the size of the scratch buffers kept by the current thread
+ * @return the number of bytes
+ */
+size_t r_thread_ctx_size(void);
+
+/**
+ * Enables the allocation accounting
+ * The orcania and jansson allocation functions are replaced with functions
+ * counting the allocations made in an accounting scope of the current thread
+ * and calling the previous allocation functions
+ * This function isn't thread-safe, it must be called once
+ * before any accounting scope is used, preferably before r_global_init
+ * @return RHN_OK on success, an error value on error
+ */
+int r_global_enable_alloc_stats(void);
+
+/**
+ * Starts an allocation accounting scope in the current thread
+ * Until r_alloc_stats_end, the allocations made by the library
+ * in this thread are counted
+ * GnuTLS and Nettle allocations aren't counted
+ * @return RHN_OK on success, RHN_ERROR_UNSUPPORTED if r_global_enable_alloc_stats wasn't called,
+ * RHN_ERROR_PARAM if an accounting scope is already started in this thread
+ */
+int r_alloc_stats_begin(void);
+
+/**
+ * Ends the allocation accounting scope of the current thread
+ * @param stats: set to the statistics of the scope, may be NULL
+ * @return RHN_OK on success, RHN_ERROR_PARAM if no accounting scope is started in this thread
+ */
+int r_alloc_stats_end(rhn_alloc_stats * stats);
+
+/**
+ * Returns the state of the memory used for the secrets
+ * The content encryption keys and the symmetric keys exported during the
+ * key management are allocated in slabs locked in memory, excluded from
+ * core dumps if the system allows it, and zeroized when freed
+ * @param mapped: set to the size of the slabs, may be NULL
+ * @param locked: set to the size of the slabs locked in memory, may be NULL
+ * @param in_use: set to the size of the blocks allocated in the slabs, may be NULL
+ */
+void r_secure_memory_info(size_t * mapped, size_t * locked, size_t * in_use);
+
 /**
  * Get the library information as a json_t * object
  * - library version
@@ -387,6 +596,15 @@ int r_jws_init(jws_t ** jws);
  */
 void r_jws_free(jws_t * jws);
 
+/**
+ * Reset a jws_t to its initial state so it can be reused for another token
+ * The allocated containers and the keys added by the application are kept,
+ * the keys extracted from a parsed token header are removed
+ * @param jws: the jws_t * to reset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jws_reset(jws_t * jws);
+
 /**
  * Initialize a jwe_t
  * @param jwe: a reference to a jwe_t * to initialize
@@ -400,6 +618,15 @@ int r_jwe_init(jwe_t ** jwe);
  */
 void r_jwe_free(jwe_t * jwe);
 
+/**
+ * Reset a jwe_t to its initial state so it can be reused for another token
+ * The allocated containers and the keys added by the application are kept,
+ * the keys extracted from a parsed token header are removed
+ * @param jwe: the jwe_t * to reset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_reset(jwe_t * jwe);
+
 /**
  * Initialize a jwt_t
  * @param jwt: a reference to a jwt_t * to initialize
@@ -413,6 +640,15 @@ int r_jwt_init(jwt_t ** jwt);
  */
 void r_jwt_free(jwt_t * jwt);
 
+/**
+ * Reset a jwt_t to its initial state so it can be reused for another token
+ * The allocated containers and the keys added by the application are kept,
+ * the keys extracted from a parsed token header are removed
+ * @param jwt: the jwt_t * to reset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_reset(jwt_t * jwt);
+
 /**
  * Get the jwa_alg corresponding to the string algorithm specified
  * @param alg: the algorithm to convert
@@ -950,6 +1186,21 @@ int r_jwks_import_from_json_str(jwks_t * jwks, const char * input);
  */
 int r_jwks_import_from_json_t(jwks_t * jwks, json_t * j_input);
 
+/**
+ * Import a JWKS in json_t format into a jwk_t,
+ * the JWKs are validated in parallel by a pool of threads,
+ * then appended in their original order
+ * @param jwks: the jwk_t * to import to
+ * @param j_input: a JWK in json_t * format
+ * @param nb_threads: the number of threads used to validate the JWKs,
+ * 0 to use the number of CPUs available
+ * If jwks is set, JWK will be appended
+ * @return RHN_OK on success, an error value on error
+ * may return RHN_ERROR_PARAM if at least one JWK
+ * is invalid, but the will import the others
+ */
+int r_jwks_import_from_json_t_parallel(jwks_t * jwks, json_t * j_input, unsigned int nb_threads);
+
 /**
  * Import a JWKS from an uri
  * @param jwks: the jwk_t * to import to
@@ -965,6 +1216,43 @@ int r_jwks_import_from_json_t(jwks_t * jwks, json_t * j_input);
  */
 int r_jwks_import_from_uri(jwks_t * jwks, const char * uri, int x5u_flags);
 
+/**
+ * Import keys from a binary content generated by r_jwks_export_to_binary
+ * The content checksum is verified but the keys are not validated again,
+ * so the binary content must come from a trusted source
+ * If a record is invalid, no key is added to jwks
+ * @param jwks: the jwks_t * to update
+ * @param input: the binary content
+ * @param input_len: the length of the binary content
+ * @return RHN_OK on success, RHN_ERROR_UNSUPPORTED if the format version
+ * is unknown, an error value on error
+ */
+int r_jwks_import_from_binary(jwks_t * jwks, const unsigned char * input, size_t input_len);
+
+/**
+ * Verifies the header, the checksum and the records bounds
+ * of a binary content generated by r_jwks_export_to_binary
+ * The content should be verified once after it's read or mapped,
+ * before using r_jwks_binary_get_by_kid
+ * @param input: the binary content
+ * @param input_len: the length of the binary content
+ * @return RHN_OK if the content is valid, RHN_ERROR_UNSUPPORTED if the format version
+ * is unknown, RHN_ERROR_PARAM otherwise
+ */
+int r_jwks_binary_verify(const unsigned char * input, size_t input_len);
+
+/**
+ * Get a key by its kid from a binary content generated by r_jwks_export_to_binary,
+ * only the entry table and the keys with the same kid hash are read,
+ * the content checksum isn't verified, see r_jwks_binary_verify
+ * @param input: the binary content
+ * @param input_len: the length of the binary content
+ * @param kid: the key id of the key to return
+ * @return a jwk_t * corresponding to the kid, NULL if not found
+ * the returned value must be r_jwk_free after use
+ */
+jwk_t * r_jwks_binary_get_by_kid(const unsigned char * input, size_t input_len, const char * kid);
+
 /**
  * Import data into a jwks
  * parameters must be set of values
@@ -1104,6 +1392,20 @@ gnutls_pubkey_t * r_jwks_export_to_gnutls_pubkey(jwks_t * jwks, size_t * len, in
  */
 int r_jwks_export_to_pem_der(jwks_t * jwks, int format, unsigned char * output, size_t * output_len, int x5u_flags);
 
+/**
+ * Export a JWKS in a compact binary format
+ * The binary format contains the key properties without base64 decoding
+ * and a table of kid hashes, so it can be imported
+ * without JSON parsing nor key validation
+ * The key types and bits aren't stored, r_jwk_key_type computes them
+ * from the imported properties when needed
+ * All the keys must be valid
+ * @param jwks: the jwks_t * to export
+ * @param output_len: set to the length of the output
+ * @return the binary content on success, NULL on error, must be r_free'd after use
+ */
+unsigned char * r_jwks_export_to_binary(jwks_t * jwks, size_t * output_len);
+
 /**
  * Search in a jwks_t for a subset matching the given query
  * @param jwks: the jwks_t to look into
@@ -1132,6 +1434,184 @@ jwks_t * r_jwks_search_json_t(jwks_t * jwks, json_t * j_match);
  */
 jwks_t * r_jwks_search_json_str(jwks_t * jwks, const char * str_match);
 
+/**
+ * Initialize a jwks_store_t
+ * A jwks_store_t holds the public keys downloaded from a list of urls
+ * or read from a list of files, and refreshes them periodically
+ * in a background thread if needed
+ * The keys are published as an immutable snapshot, so readers
+ * never take a lock, even when a refresh is in progress
+ * @param store: a reference to a jwks_store_t * to initialize
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwks_store_init(jwks_store_t ** store);
+
+/**
+ * Free a jwks_store_t, stops the background refresh if running
+ * The store must not be used by a jws_t or a jwt_t anymore
+ * @param store: the jwks_store_t * to free
+ */
+void r_jwks_store_free(jwks_store_t * store);
+
+/**
+ * Adds an url to a JWKS to the store
+ * The keys are available after the next call to r_jwks_store_refresh
+ * or the next background refresh
+ * @param store: the jwks_store_t * to update
+ * @param uri: the url of the JWKS
+ * @param x5u_flags: Flags to retrieve the JWKS
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwks_store_add_uri(jwks_store_t * store, const char * uri, int x5u_flags);
+
+/**
+ * Adds a file containing a JWKS in JSON format to the store
+ * The keys are available after the next call to r_jwks_store_refresh
+ * or the next background refresh
+ * @param store: the jwks_store_t * to update
+ * @param path: the path to the JWKS file
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwks_store_add_file(jwks_store_t * store, const char * path);
+
+/**
+ * Adds a file containing a JWKS in JSON format to the store,
+ * the file is memory-mapped and each key is parsed
+ * on its first lookup by kid, the keys without kid are parsed
+ * when the file is loaded
+ * When the background refresh is running, the file is watched
+ * with inotify and reloaded when it changes,
+ * the keys already parsed and unchanged are kept
+ * The file must be replaced atomically, e.g. written in a temporary
+ * file then renamed, never modified in place while it's mapped
+ * A file that json_loads would reject is rejected
+ * @param store: the jwks_store_t * to update
+ * @param path: the path to the JWKS file
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwks_store_add_file_mapped(jwks_store_t * store, const char * path);
+
+/**
+ * Sets how the keys of the urls and the JSON files are validated
+ * on the next refreshes, the memory-mapped files aren't affected
+ * @param store: the jwks_store_t * to update
+ * @param validation: the validation mode, values available are
+ * - R_JWKS_STORE_VALIDATE_IMPORT: the keys are validated one by one when imported (default)
+ * - R_JWKS_STORE_VALIDATE_PARALLEL: the keys are validated in parallel when imported
+ * - R_JWKS_STORE_VALIDATE_DEFERRED: the keys are validated on their first lookup,
+ * an invalid key is never returned by the store
+ * @param nb_threads: the number of threads used with R_JWKS_STORE_VALIDATE_PARALLEL,
+ * 0 to use the number of CPUs available
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwks_store_set_validation(jwks_store_t * store, int validation, unsigned int nb_threads);
+
+/**
+ * Reloads all the urls and files of the store and publishes the new keys
+ * The urls are downloaded without holding the store lock,
+ * if two refreshes run at the same time, the most recent keys are kept
+ * If a url or a file can't be loaded, its previous keys are kept
+ * @param store: the jwks_store_t * to refresh
+ * @return RHN_OK on success, RHN_ERROR if at least one url or file
+ * couldn't be loaded, an error value on error
+ */
+int r_jwks_store_refresh(jwks_store_t * store);
+
+/**
+ * Starts a background thread that refreshes the store periodically
+ * The first refresh is made before the function returns
+ * @param store: the jwks_store_t * to refresh
+ * @param interval: the delay between two refreshes in seconds
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwks_store_start(jwks_store_t * store, unsigned int interval);
+
+/**
+ * Stops the background refresh thread, the current keys are kept
+ * @param store: the jwks_store_t * to update
+ */
+void r_jwks_store_stop(jwks_store_t * store);
+
+/**
+ * Get the number of keys in the current snapshot of the store,
+ * including the keys not validated yet
+ * @param store: the jwks_store_t * to check
+ * @return the number of keys
+ */
+size_t r_jwks_store_size(jwks_store_t * store);
+
+/**
+ * Get a copy of the current keys of the store,
+ * the keys not validated yet are validated, the invalid keys are skipped
+ * @param store: the jwks_store_t * to read
+ * @return a jwks_t * containing the keys, must be r_jwks_free after use
+ */
+jwks_t * r_jwks_store_get_jwks(jwks_store_t * store);
+
+/**
+ * Get a key of the store by its kid
+ * The sources are looked up in the order they were added,
+ * memory-mapped or not
+ * @param store: the jwks_store_t * to read
+ * @param kid: the key id of the key to return
+ * @return a jwk_t * corresponding to the kid, NULL if not found
+ * the returned value must be r_jwk_free after use
+ */
+jwk_t * r_jwks_store_get_by_kid(jwks_store_t * store, const char * kid);
+
+/**
+ * Creates a shared key set from a jwks_t
+ * A jwks_shared_t is an immutable copy of the keys indexed by kid,
+ * it can be attached to any number of jws_t, jwe_t or jwt_t
+ * without copying the keys, and used by multiple threads
+ * The jwks_shared_t is reference counted, each object it's attached to
+ * holds a reference
+ * @param jwks: the keys to copy in the shared key set
+ * @return a new jwks_shared_t * with a reference count of 1,
+ * must be r_jwks_shared_free after use, NULL on error
+ */
+jwks_shared_t * r_jwks_shared_new(jwks_t * jwks);
+
+/**
+ * Adds a reference to a shared key set
+ * @param shared: the jwks_shared_t * to reference
+ * @return shared
+ */
+jwks_shared_t * r_jwks_shared_ref(jwks_shared_t * shared);
+
+/**
+ * Releases a reference to a shared key set,
+ * the keys are freed when the last reference is released
+ * @param shared: the jwks_shared_t * to release
+ */
+void r_jwks_shared_free(jwks_shared_t * shared);
+
+/**
+ * Get the number of keys in a shared key set
+ * @param shared: the jwks_shared_t * to check
+ * @return the number of keys
+ */
+size_t r_jwks_shared_size(jwks_shared_t * shared);
+
+/**
+ * Get a copy of the key at the specified index in a shared key set
+ * @param shared: the jwks_shared_t * to read
+ * @param index: the index of the key
+ * @return a jwk_t * on success, must be r_jwk_free after use, NULL on error
+ */
+jwk_t * r_jwks_shared_get_at(jwks_shared_t * shared, size_t index);
+
+/**
+ * Get a copy of the first key with the specified kid in a shared key set
+ * @param shared: the jwks_shared_t * to read
+ * @param kid: the key id
+ * @return a jwk_t * on success, must be r_jwk_free after use, NULL if not found
+ */
+jwk_t * r_jwks_shared_get_by_kid(jwks_shared_t * shared, const char * kid);
+
 /**
  * @}
  */
@@ -1295,6 +1775,29 @@ int r_jws_add_keys(jws_t * jws, jwk_t * jwk_privkey, jwk_t * jwk_pubkey);
  */
 int r_jws_add_jwks(jws_t * jws, jwks_t * jwks_privkey, jwks_t * jwks_pubkey);
 
+/**
+ * Sets a jwks_store_t to look up the verification key
+ * when the key isn't available in the jws public keys
+ * The store isn't copied, it must remain valid while the jws uses it
+ * @param jws: the jws_t to update
+ * @param store: the jwks_store_t to use, NULL to unset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jws_set_jwks_store(jws_t * jws, jwks_store_t * store);
+
+/**
+ * Attaches shared key sets for the signature and verification
+ * The keys are looked up in the shared key sets when they aren't
+ * available in the jws keys, they're never copied in the jws
+ * The jws holds a reference to each shared key set,
+ * the previous shared key sets are released
+ * @param jws: the jws_t to update
+ * @param jwks_shared_privkey: the shared private key set, NULL to unset
+ * @param jwks_shared_pubkey: the shared public key set, NULL to unset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jws_set_shared_jwks(jws_t * jws, jwks_shared_t * jwks_shared_privkey, jwks_shared_t * jwks_shared_pubkey);
+
 /**
  * Add keys to perform signature or signature verification
  * keys must be a JWK stringified
@@ -1757,10 +2260,43 @@ jws_t * r_jws_quick_parsen(const char * jws_str, size_t jws_str_len, uint32_t pa
  * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
  * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
  * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
- * @return RHN_OK on success, an error value on error
+ * @return RHN_OK on success, RHN_NEED_KEY if jwk_pubkey is NULL, none of the
+ * available keys verifies the signature and remote keys must be downloaded first,
+ * see r_jws_remote_resume, an error value on error
  */
 int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags);
 
+/**
+ * Returns the number of remote keys to download before verifying the signature
+ * Remote keys are pending if the jws was parsed with the flag R_FLAG_DEFER_REMOTE
+ * and the header contains a jku or a x5u url
+ * @param jws: the jws_t to check
+ * @return the number of pending remote keys
+ */
+size_t r_jws_remote_pending_size(jws_t * jws);
+
+/**
+ * Returns the url of a pending remote key
+ * @param jws: the jws_t to check
+ * @param index: the index of the pending remote key
+ * @param type: set to the type of the remote key, R_REMOTE_JKU or R_REMOTE_X5U, may be NULL
+ * @return the url to download, NULL on error
+ * the returned value is valid until the url is resumed or the jws is reset
+ */
+const char * r_jws_remote_pending_get_at(jws_t * jws, size_t index, int * type);
+
+/**
+ * Resumes the parsing of a jws with the content downloaded by the application
+ * The content is imported as a JWKS for a jku url or as a PEM certificate for a x5u url,
+ * the url is removed from the pending remote keys
+ * @param jws: the jws_t to update
+ * @param url: the pending url downloaded
+ * @param content: the content downloaded, NULL if the download failed
+ * @param content_len: the length of content
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jws_remote_resume(jws_t * jws, const char * url, const char * content, size_t content_len);
+
 /**
  * Serialize a JWS in compact mode (xxx.yyy.zzz)
  * @param jws: the JWS to serialize
@@ -1792,6 +2328,49 @@ char * r_jws_serialize(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags);
  */
 char * r_jws_serialize_unsecure(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags);
 
+/**
+ * Return the exact length of the JWS serialized in compact mode
+ * using r_jws_serialize_to with the same parameters
+ * The jws isn't changed, the length includes the alg and kid header values
+ * r_jws_serialize_to sets from the key if missing
+ * The alg none isn't supported, as with r_jws_serialize_to
+ * If the zip header is set, the payload is compressed to compute the length
+ * @param jws: the JWS to serialize
+ * @param jwk_privkey: the private key to use to sign the JWS
+ * can be NULL if jws already contains a private key
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @return the length of the serialized JWS, 0 on error
+ */
+size_t r_jws_serialized_length(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags);
+
+/**
+ * Serialize a JWS in compact mode (xxx.yyy.zzz) into a buffer provided by the caller
+ * The header, the payload and the signature are encoded directly in output,
+ * without intermediate serialized strings, the key isn't copied
+ * and the signature is computed over output
+ * The encoded values aren't kept in the JWS
+ * output isn't NULL terminated
+ * @param jws: the JWS to serialize
+ * @param jwk_privkey: the private key to use to sign the JWS
+ * can be NULL if jws already contains a private key
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @param output: a char * that will contain the serialized JWS
+ * @param output_len: the size of output and will be set to the data size that has been written to output
+ * @return RHN_OK on success, an error value on error
+ * @return RHN_ERROR_PARAM if output_len isn't large enough to hold the output, then output_len will be set to the required size
+ */
+int r_jws_serialize_to(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags, char * output, size_t * output_len);
+
 /**
  * Serialize a JWS into its JSON format (general or flattened)
  * Mode general: Multiple signatures are generated.
@@ -2050,6 +2629,19 @@ int r_jwe_add_keys(jwe_t * jwe, jwk_t * jwk_privkey, jwk_t * jwk_pubkey);
  */
 int r_jwe_add_jwks(jwe_t * jwe, jwks_t * jwks_privkey, jwks_t * jwks_pubkey);
 
+/**
+ * Attaches shared key sets for the encryption and decryption
+ * The keys are looked up in the shared key sets when they aren't
+ * available in the jwe keys, they're never copied in the jwe
+ * The jwe holds a reference to each shared key set,
+ * the previous shared key sets are released
+ * @param jwe: the jwe_t to update
+ * @param jwks_shared_privkey: the shared private key set, NULL to unset
+ * @param jwks_shared_pubkey: the shared public key set, NULL to unset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_set_shared_jwks(jwe_t * jwe, jwks_shared_t * jwks_shared_privkey, jwks_shared_t * jwks_shared_pubkey);
+
 /**
  * Add keys to perform encryption ot decryption
  * keys must be a JWK stringified
@@ -2223,6 +2815,66 @@ int r_jwe_encrypt_key(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags);
  */
 int r_jwe_decrypt_key(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags);
 
+/**
+ * Starts the pool of pre-generated ephemeral keys used for ECDH-ES encryption
+ * A background thread generates single-use key pairs for the curves
+ * P-256, P-384, P-521, X25519 and X448, so the key generation is moved
+ * out of r_jwe_encrypt_key
+ * A key taken from the pool is used once and zeroized,
+ * when the pool is empty, the ephemeral key is generated as usual
+ * r_jwe_ecdh_pool_start and r_jwe_ecdh_pool_stop must not be called concurrently
+ * @param pool_size: the number of keys to keep available for each curve
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_ecdh_pool_start(size_t pool_size);
+
+/**
+ * Stops the pool of pre-generated ephemeral keys,
+ * the remaining keys are zeroized
+ */
+void r_jwe_ecdh_pool_stop(void);
+
+/**
+ * Returns the number of ephemeral keys available in the pool for a curve
+ * @param type: the key type, R_KEY_TYPE_EC or R_KEY_TYPE_ECDH
+ * @param bits: the key length, 256, 384 or 521 for R_KEY_TYPE_EC,
+ * 256 or 448 for R_KEY_TYPE_ECDH
+ * @return the number of keys available
+ */
+size_t r_jwe_ecdh_pool_available(int type, unsigned int bits);
+
+/**
+ * Starts the cache of PBES2-derived KEKs
+ * When the same password, alg, p2s and p2c are used to decrypt
+ * several tokens, the PBKDF2 derivation is done once,
+ * the next tokens use the cached KEK
+ * The cache holds up to cache_size KEKs in locked memory,
+ * the least recently used KEK is zeroized when evicted
+ * Encryption with a random p2s doesn't use the cache
+ * @param cache_size: the maximum number of KEKs in the cache
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_pbes2_cache_start(size_t cache_size);
+
+/**
+ * Stops the cache of PBES2-derived KEKs,
+ * the cached KEKs are zeroized
+ */
+void r_jwe_pbes2_cache_stop(void);
+
+/**
+ * Returns the number of KEKs in the PBES2 cache
+ * @return the number of cached KEKs
+ */
+size_t r_jwe_pbes2_cache_count(void);
+
+/**
+ * Sets the maximum iteration count (p2c) accepted to decrypt or encrypt a PBES2 token,
+ * a token with a higher p2c is rejected before the key derivation
+ * @param max_iterations: the maximum p2c value, 0 for no limit (default)
+ */
+void r_jwe_pbes2_set_max_iterations(unsigned int max_iterations);
+
 /**
  * Parses the JWE in all modes (compact, flattened or general)
  * @param jwe: the jwe_t to update
@@ -2572,6 +3224,45 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags);
  */
 char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags);
 
+/**
+ * Return the length of the JWE serialized using r_jwe_serialize_to
+ * with the same parameters
+ * @param jwe: the JWE to serialize
+ * @param jwk_pubkey: the public key to encrypt the cypher key,
+ * can be NULL if jwe already contains a public key
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @return the length of the serialized JWE, 0 on error
+ */
+size_t r_jwe_serialized_length(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags);
+
+/**
+ * Serialize a JWE into its string format (aaa.bbb.ccc.xxx.yyy.zzz)
+ * in a buffer provided by the caller
+ * output isn't NULL terminated
+ * The ciphertext and the tag are encoded directly in output
+ * and aren't kept in the JWE
+ * The key is encrypted first, but the payload isn't encrypted if output is too small
+ * @param jwe: the JWE to serialize
+ * @param jwk_pubkey: the public key to encrypt the cypher key,
+ * can be NULL if jwe already contains a public key
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @param output: a char * that will contain the serialized JWE
+ * @param output_len: the size of output and will be set to the data size that has been written to output
+ * @return RHN_OK on success, an error value on error
+ * @return RHN_ERROR_PARAM if output_len isn't large enough to hold the output, then output_len will be set to the required size
+ */
+int r_jwe_serialize_to(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags, char * output, size_t * output_len);
+
 /**
  * Serialize a JWE into its JSON format (general or flattened)
  * Mode general: Multiple encryptions are generated.
@@ -2835,6 +3526,29 @@ int r_jwt_add_sign_keys(jwt_t * jwt, jwk_t * privkey, jwk_t * pubkey);
  */
 int r_jwt_add_sign_jwks(jwt_t * jwt, jwks_t * jwks_privkey, jwks_t * jwks_pubkey);
 
+/**
+ * Sets a jwks_store_t to look up the signature verification key
+ * when the key isn't available in the jwt public keys
+ * The store isn't copied, it must remain valid while the jwt uses it
+ * @param jwt: the jwt_t to update
+ * @param store: the jwks_store_t to use, NULL to unset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_set_sign_jwks_store(jwt_t * jwt, jwks_store_t * store);
+
+/**
+ * Attaches shared key sets for the signature and verification
+ * The shared key sets are referenced by the jws used to sign or verify
+ * the token, the keys are never copied
+ * The jwt holds a reference to each shared key set,
+ * the previous shared key sets are released
+ * @param jwt: the jwt_t to update
+ * @param jwks_shared_privkey: the shared private key set, NULL to unset
+ * @param jwks_shared_pubkey: the shared public key set, NULL to unset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_set_sign_shared_jwks(jwt_t * jwt, jwks_shared_t * jwks_shared_privkey, jwks_shared_t * jwks_shared_pubkey);
+
 /**
  * Add keys to perform signature or signature verification to the JWT
  * keys must be a JWK stringified
@@ -2919,6 +3633,19 @@ int r_jwt_add_enc_keys(jwt_t * jwt, jwk_t * privkey, jwk_t * pubkey);
  */
 int r_jwt_add_enc_jwks(jwt_t * jwt, jwks_t * jwks_privkey, jwks_t * jwks_pubkey);
 
+/**
+ * Attaches shared key sets for the encryption and decryption
+ * The shared key sets are referenced by the jwe used to encrypt or decrypt
+ * the token, the keys are never copied
+ * The jwt holds a reference to each shared key set,
+ * the previous shared key sets are released
+ * @param jwt: the jwt_t to update
+ * @param jwks_shared_privkey: the shared private key set, NULL to unset
+ * @param jwks_shared_pubkey: the shared public key set, NULL to unset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_set_enc_shared_jwks(jwt_t * jwt, jwks_shared_t * jwks_shared_privkey, jwks_shared_t * jwks_shared_pubkey);
+
 /**
  * Add keys to perform encryption ot decryption to the JWT
  * keys must be a JWK stringified
@@ -3123,6 +3850,41 @@ char * r_jwt_serialize_signed(jwt_t * jwt, jwk_t * privkey, int x5u_flags);
  */
 char * r_jwt_serialize_signed_unsecure(jwt_t * jwt, jwk_t * privkey, int x5u_flags);
 
+/**
+ * Return the exact length of the signed JWT serialized
+ * using r_jwt_serialize_signed_to with the same parameters
+ * The jwt isn't changed
+ * @param jwt: the jwt_t to sign
+ * @param privkey: the private key to sign the JWT, may be NULL
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @return the length of the signed JWT, 0 on error
+ */
+size_t r_jwt_serialized_signed_length(jwt_t * jwt, jwk_t * privkey, int x5u_flags);
+
+/**
+ * Return a signed JWT in a buffer provided by the caller
+ * The JWT claims will be serialized
+ * output isn't NULL terminated
+ * @param jwt: the jwt_t to sign
+ * @param privkey: the private key to sign the JWT, may be NULL
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @param output: a char * that will contain the signed JWT
+ * @param output_len: the size of output and will be set to the data size that has been written to output
+ * @return RHN_OK on success, an error value on error
+ * @return RHN_ERROR_PARAM if output_len isn't large enough to hold the output, then output_len will be set to the required size
+ */
+int r_jwt_serialize_signed_to(jwt_t * jwt, jwk_t * privkey, int x5u_flags, char * output, size_t * output_len);
+
 /**
  * Return an encrypted JWT in serialized format (xxx.yyy.zzz.aaa.bbb)
  * @param jwt: the jwt_t to encrypt
@@ -3252,6 +4014,8 @@ int r_jwt_parsen_unsecure(jwt_t * jwt, const char * token, size_t token_len, int
  * - R_PARSE_HEADER_ALL
  * - R_PARSE_UNSIGNED
  * - R_PARSE_ALL
+ * - R_PARSE_LAZY_CLAIMS: the claims of a signed JWT are decoded only when they're needed,
+ * registered claims are read without decoding the whole claims
  * @param x5u_flags: Flags to retrieve x5u certificates
  * pointed by x5u if necessary, could be 0 if not needed
  * Flags available are 
@@ -3280,6 +4044,8 @@ int r_jwt_advanced_parse(jwt_t * jwt, const char * token, uint32_t parse_flags,
  * - R_PARSE_HEADER_ALL
  * - R_PARSE_UNSIGNED
  * - R_PARSE_ALL
+ * - R_PARSE_LAZY_CLAIMS: the claims of a signed JWT are decoded only when they're needed,
+ * registered claims are read without decoding the whole claims
  * @param x5u_flags: Flags to retrieve x5u certificates
  * pointed by x5u if necessary, could be 0 if not needed
  * Flags available are 
@@ -3306,6 +4072,8 @@ int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uin
  * - R_PARSE_HEADER_ALL
  * - R_PARSE_UNSIGNED
  * - R_PARSE_ALL
+ * - R_PARSE_LAZY_CLAIMS: the claims of a signed JWT are decoded only when they're needed,
+ * registered claims are read without decoding the whole claims
  * @param x5u_flags: Flags to retrieve x5u certificates
  * pointed by x5u if necessary, could be 0 if not needed
  * Flags available are 
@@ -3333,6 +4101,8 @@ jwt_t * r_jwt_quick_parse(const char * token, uint32_t parse_flags, int x5u_flag
  * - R_PARSE_HEADER_ALL
  * - R_PARSE_UNSIGNED
  * - R_PARSE_ALL
+ * - R_PARSE_LAZY_CLAIMS: the claims of a signed JWT are decoded only when they're needed,
+ * registered claims are read without decoding the whole claims
  * @param x5u_flags: Flags to retrieve x5u certificates
  * pointed by x5u if necessary, could be 0 if not needed
  * Flags available are 
@@ -3378,6 +4148,79 @@ int r_jwt_token_type(const char * token);
  */
 int r_jwt_token_typen(const char * token, size_t token_len);
 
+/**
+ * Reads values of the protected header of a compact JWT,
+ * without parsing the token nor verifying its signature
+ * The header segment is decoded progressively and only the values
+ * requested are copied in buffer, no memory is allocated
+ * The whole segment is read, if a member is duplicated its last value
+ * is returned, as when the token is parsed
+ * The values are returned as strings, a string value is unescaped,
+ * a number or a boolean value is returned as its JSON text,
+ * a null, object or array value is returned as NULL
+ * Example:
+ * char buffer[256];
+ * const char * alg, * kid;
+ * r_jwt_peek_header(token, token_len, buffer, sizeof(buffer), "alg", &alg, "kid", &kid, NULL);
+ * @param token: the token to read
+ * @param token_len: token length
+ * @param buffer: the buffer where the values are copied
+ * @param buffer_len: the size of buffer
+ * @param ...: the list of values to read, each value is a const char * name
+ * followed by a const char ** that will point to the value in buffer, or NULL if the value is absent,
+ * the list must end with NULL
+ * @return RHN_OK on success, RHN_ERROR_PARAM if the header is invalid
+ * or if buffer is too small for the values requested
+ */
+int r_jwt_peek_header(const char * token, size_t token_len, char * buffer, size_t buffer_len, ...);
+
+/**
+ * Reads claims of a signed compact JWT, without parsing the token
+ * nor verifying its signature, so the values must not be trusted
+ * The payload segment is decoded progressively and only the claims
+ * requested are copied in buffer, no memory is allocated
+ * The values are returned the same way as r_jwt_peek_header
+ * @param token: the token to read
+ * @param token_len: token length
+ * @param buffer: the buffer where the values are copied
+ * @param buffer_len: the size of buffer
+ * @param ...: the list of claims to read, each claim is a const char * name
+ * followed by a const char ** that will point to the value in buffer, or NULL if the claim is absent,
+ * the list must end with NULL
+ * @return RHN_OK on success, RHN_ERROR_UNSUPPORTED if the token is encrypted or its payload is compressed,
+ * RHN_ERROR_PARAM if the payload is invalid or if buffer is too small for the values requested
+ */
+int r_jwt_peek_claims(const char * token, size_t token_len, char * buffer, size_t buffer_len, ...);
+
+/**
+ * Creates a claims schema to extract claims in a struct with r_jwt_get_claims_struct
+ * The schema is immutable and can be shared between threads
+ * @param claims: the list of claims to extract, the names are copied
+ * @param nb_claims: the number of claims, up to R_CLAIMS_SCHEMA_MAX
+ * @return a new jwt_claims_schema_t * or NULL on error, must be freed with r_jwt_claims_schema_free
+ */
+jwt_claims_schema_t * r_jwt_claims_schema_new(const rhn_claim_desc * claims, size_t nb_claims);
+
+/**
+ * Frees a claims schema
+ * @param schema: the schema to free
+ */
+void r_jwt_claims_schema_free(jwt_claims_schema_t * schema);
+
+/**
+ * Extracts the claims of a JWT in a struct defined by the application
+ * If the JWT was parsed with R_PARSE_LAZY_CLAIMS, the claims are read
+ * in a single pass over the payload without being loaded
+ * A claim absent or of another type is set to an empty string, 0 or false
+ * @param jwt: the jwt to read
+ * @param schema: the claims schema
+ * @param claims: the struct to fill
+ * @param present: set to the mask of the claims found, bit i for the claim i of the schema, optional
+ * @return RHN_OK on success, RHN_ERROR_PARAM if a string value doesn't fit in its member
+ * or if the claims are invalid
+ */
+int r_jwt_get_claims_struct(jwt_t * jwt, const jwt_claims_schema_t * schema, void * claims, uint64_t * present);
+
 /**
  * Verifies the signature of the JWT
  * The JWT must contain a signature
@@ -3391,10 +4234,43 @@ int r_jwt_token_typen(const char * token, size_t token_len);
  * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
  * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
  * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
- * @return RHN_OK on success, an error value on error
+ * @return RHN_OK on success, RHN_NEED_KEY if pubkey is NULL, none of the
+ * available keys verifies the signature and remote keys must be downloaded first,
+ * see r_jwt_remote_resume, an error value on error
  */
 int r_jwt_verify_signature(jwt_t * jwt, jwk_t * pubkey, int x5u_flags);
 
+/**
+ * Returns the number of remote keys to download before verifying the signature
+ * Remote keys are pending if the jwt was parsed with the flag R_FLAG_DEFER_REMOTE
+ * and the header contains a jku or a x5u url
+ * @param jwt: the jwt_t to check
+ * @return the number of pending remote keys
+ */
+size_t r_jwt_remote_pending_size(jwt_t * jwt);
+
+/**
+ * Returns the url of a pending remote key
+ * @param jwt: the jwt_t to check
+ * @param index: the index of the pending remote key
+ * @param type: set to the type of the remote key, R_REMOTE_JKU or R_REMOTE_X5U, may be NULL
+ * @return the url to download, NULL on error
+ * the returned value is valid until the url is resumed or the jwt is reset
+ */
+const char * r_jwt_remote_pending_get_at(jwt_t * jwt, size_t index, int * type);
+
+/**
+ * Resumes the parsing of a jwt with the content downloaded by the application
+ * The content is imported as a JWKS for a jku url or as a PEM certificate for a x5u url,
+ * the url is removed from the pending remote keys
+ * @param jwt: the jwt_t to update
+ * @param url: the pending url downloaded
+ * @param content: the content downloaded, NULL if the download failed
+ * @param content_len: the length of content
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_remote_resume(jwt_t * jwt, const char * url, const char * content, size_t content_len);
+
 /**
  * Decrypts the payload of the JWT
  * @param jwt: the jwt_t to decrypt
@@ -3478,7 +4354,8 @@ int r_jwt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int verify_ke
  * - R_JWT_CLAIM_JTI: claim "jti", values expected a string or NULL to validate the presence of the claim
  * - R_JWT_CLAIM_STR: the claim name specified must have the string value expected or NULL to validate the presence of the claim
  * - R_JWT_CLAIM_INT: the claim name specified must have the integer value expected
- * - R_JWT_CLAIM_JSN: the claim name specified must have the json_t * value expected or NULL to validate the presence of the claim
+ * - R_JWT_CLAIM_JSN: the claim name specified must have the json_t * value expected or NULL to validate the presence of the claim,
+ * the json_t * value is released by the function, whatever the result
  * Example
  * The following code will check the jwt agains the iss value "https://example.com", the sub value "client_1", the presence of the claim aud and that the claim exp is after now and the claim `nbf` is before now:
  * if (r_jwt_validate_claims(jwt, R_JWT_CLAIM_ISS, "https://example.com", 
@@ -3493,6 +4370,29 @@ int r_jwt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int verify_ke
  */
 int r_jwt_validate_claims(jwt_t * jwt, ...);
 
+/**
+ * Verifies the signature of a signed JWT in compact format and validates its claims,
+ * without building a jwt_t
+ * The token segments are decoded in a buffer on the stack,
+ * only the header and the claims are parsed as json objects
+ * The header parameters jku, jwk, x5u and x5c are ignored,
+ * the key is looked up in jwks_pubkey by the kid header,
+ * or is the only key of jwks_pubkey if the header has no kid
+ * Nested and unsigned JWTs are rejected
+ * @param token: the token to verify
+ * @param token_len: the length of token
+ * @param jwks_pubkey: the public keys to verify the signature
+ * @param j_claims: if not NULL, will be set to the claims of the token if it's valid,
+ * must be json_decref after use
+ * @param ...: the list of expected claims, ending with R_JWT_CLAIM_NOP,
+ * see r_jwt_validate_claims for the claim types available,
+ * the R_JWT_CLAIM_JSN values are released on every return path
+ * @return RHN_OK on success, RHN_ERROR_INVALID if the signature is invalid,
+ * RHN_ERROR_PARAM if the token format is invalid or a claim doesn't match,
+ * another error value on error
+ */
+int r_jwt_verify_compact(const char * token, size_t token_len, jwks_shared_t * jwks_pubkey, json_t ** j_claims, ...);
+
 /**
  * Set the jwt claims with the list of claims given in parameters
  * The list must end with the claim type R_JWT_CLAIM_NOP
@@ -3537,10 +4437,86 @@ size_t _r_get_key_size(jwa_enc enc);
 
 gnutls_cipher_algorithm_t _r_get_alg_from_enc(jwa_enc enc);
 
+size_t _r_get_base64url_len(size_t len);
+
+/**
+ * Base64url encoder without padding writing in a buffer as the data comes,
+ * the characters beyond the size of the buffer are only counted,
+ * _r_b64url_writer_write can be used as a json_dump_callback_t
+ */
+struct _r_b64url_writer {
+  unsigned char * output;
+  size_t          size;
+  size_t          len;
+  unsigned char   rest[3];
+  size_t          rest_len;
+};
+
+void _r_b64url_writer_init(struct _r_b64url_writer * writer, unsigned char * output, size_t size);
+
+int _r_b64url_writer_write(const char * buffer, size_t size, void * data);
+
+size_t _r_b64url_writer_end(struct _r_b64url_writer * writer);
+
+size_t _r_get_rsa_modulus_len(jwk_t * jwk, unsigned int bits);
+
+int _r_json_object_reset(json_t ** j_object);
+
+int _r_json_object_replace(json_t ** j_object, json_t * j_source);
+
+int _r_jwks_add_header_keys(jwks_t * jwks, size_t jwks_size, json_t ** j_header_keys);
+
+void _r_jwks_remove_header_keys(jwks_t * jwks, json_t * j_header_keys);
+
+jwk_t * _r_jwks_store_get_verify_key(jwks_store_t * store, const char * kid, unsigned int * slot);
+
+void _r_jwks_store_put_verify_key(jwks_store_t * store, unsigned int slot);
+
+jwk_t * _r_jwks_key_at(jwks_t * jwks, size_t index);
+
+jwk_t * _r_jwks_shared_key(jwks_shared_t * shared, const char * kid);
+
+jwk_t * _r_jwks_shared_get_key(jwks_shared_t * shared, const char * kid);
+
+int _r_jwks_shared_set(jwks_shared_t ** dest, jwks_shared_t * shared);
+
+jwks_t * _r_jwks_shared_jwks(jwks_shared_t * shared);
+
+int _r_jws_verify_compact(const char * token, size_t token_len, jwks_shared_t * jwks_pubkey, json_t ** j_header, json_t ** j_payload);
+
+rhn_arena_t * _r_arena_suspend(void);
+
+void _r_arena_resume(rhn_arena_t * arena);
+
+/**
+ * Scratch buffers of the per-thread context, a slot is used by
+ * one function at a time and released before the function returns
+ */
+#define _R_SCRATCH_SIGNING_INPUT 0
+#define _R_SCRATCH_SIGNATURE     1
+#define _R_SCRATCH_HMAC_INPUT    2
+#define _R_SCRATCH_PAYLOAD       3
+#define _R_SCRATCH_CIPHERTEXT    4
+#define _R_SCRATCH_TOKEN         5
+#define _R_SCRATCH_CLAIMS        6
+#define _R_SCRATCH_MAX           7
+
+unsigned char * _r_scratch_get(int slot, size_t size);
+
+void _r_scratch_release(int slot, size_t wipe_len);
+
+void * _r_secure_malloc(size_t size);
+
+void _r_secure_free(void * ptr);
+
 int _r_deflate_payload(const unsigned char * uncompressed, size_t uncompressed_len, unsigned char ** compressed, size_t * compressed_len);
 
 int _r_inflate_payload(const unsigned char * compressed, size_t compressed_len, unsigned char ** uncompressed, size_t * uncompressed_len);
 
+jwa_alg _r_str_to_jwa_alg_len(const char * alg, size_t alg_len);
+
+jwa_enc _r_str_to_jwa_enc_len(const char * enc, size_t enc_len);
+
 #endif
 
 #ifdef __cplusplus
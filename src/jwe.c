@@ -23,6 +23,7 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 #include <gnutls/abstract.h>
@@ -37,7 +38,10 @@
 
 #define _R_PBES_DEFAULT_ITERATION 4096
 #define _R_PBES_DEFAULT_SALT_LENGTH 8
+#define _R_PBES2_KEK_MAX_SIZE 32
+#define _R_PBES2_ID_KEY_SIZE 32
 #define _R_CURVE_MAX_SIZE 66
+#define _R_ECDH_POOL_CURVES 5
 
 // AES KeyWrap (includes)
 #if NETTLE_VERSION_NUMBER >= 0x030400
@@ -808,13 +812,27 @@ static int _r_concat_kdf(jwe_t * jwe, jwa_alg alg, const gnutls_datum_t * Z, gnu
   return ret;
 }
 
-static int _r_ecdh_compute(uint8_t * priv_d, size_t priv_d_size, uint8_t * pub_x, size_t pub_x_size, uint8_t * pub_y, size_t pub_y_size, const struct ecc_curve * curve, gnutls_datum_t * Z) {
+/**
+ * Clears a mpz_t holding a private scalar or a shared secret, its limbs are wiped first
+ */
+static void _r_mpz_wipe_clear(mpz_t z) {
+  size_t size = mpz_size(z);
+
+  if (size) {
+    gnutls_memset(mpz_limbs_modify(z, size), 0, size*sizeof(mp_limb_t));
+  }
+  mpz_clear(z);
+}
+
+/**
+ * Computes the shared secret Z, the x coordinate of the product on crv_size bytes
+ */
+static int _r_ecdh_compute(uint8_t * priv_d, size_t priv_d_size, uint8_t * pub_x, size_t pub_x_size, uint8_t * pub_y, size_t pub_y_size, const struct ecc_curve * curve, size_t crv_size, gnutls_datum_t * Z) {
   int ret = RHN_OK;
   struct ecc_scalar priv;
   struct ecc_point pub, r;
   mpz_t z_priv_d, z_pub_x, z_pub_y, r_x, r_y;
-  uint8_t r_x_u[64] = {0};
-  size_t r_x_u_len = 64;
+  uint8_t r_x_u[_R_CURVE_MAX_SIZE] = {0};
 
   mpz_init(z_priv_d);
   mpz_init(z_pub_x);
@@ -843,22 +861,23 @@ static int _r_ecdh_compute(uint8_t * priv_d, size_t priv_d_size, uint8_t * pub_x
     ecc_point_mul(&r, &priv, &pub);
     ecc_point_get(&r, r_x, r_y);
 
-    mpz_export(r_x_u, &r_x_u_len, 1, 1, 0, 0, r_x);
+    nettle_mpz_get_str_256(crv_size, r_x_u, r_x);
 
-    if ((Z->data = gnutls_malloc(r_x_u_len)) == NULL) {
+    if ((Z->data = gnutls_malloc(crv_size)) == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_compute - Error gnutls_malloc");
       ret = RHN_ERROR_MEMORY;
       break;
     }
-    memcpy(Z->data, r_x_u, r_x_u_len);
-    Z->size = r_x_u_len;
+    memcpy(Z->data, r_x_u, crv_size);
+    Z->size = crv_size;
     ret = RHN_OK;
   } while (0);
-  mpz_clear(z_priv_d);
+  _r_mpz_wipe_clear(z_priv_d);
   mpz_clear(z_pub_x);
   mpz_clear(z_pub_y);
-  mpz_clear(r_x);
-  mpz_clear(r_y);
+  _r_mpz_wipe_clear(r_x);
+  _r_mpz_wipe_clear(r_y);
+  gnutls_memset(r_x_u, 0, sizeof(r_x_u));
   ecc_scalar_clear(&priv);
   ecc_point_clear(&pub);
   ecc_point_clear(&r);
@@ -884,10 +903,223 @@ static int _r_dh_compute(uint8_t * priv_k, uint8_t * pub_x, size_t crv_size, gnu
     y_log_message(Y_LOG_LEVEL_ERROR, "_r_dh_compute - Error gnutls_malloc");
     ret = RHN_ERROR_MEMORY;
   }
+  gnutls_memset(q, 0, sizeof(q));
+
+  return ret;
+}
+
+static void _r_rnd_key_func(void * ctx, size_t length, uint8_t * data) {
+  (void)ctx;
+  gnutls_rnd(GNUTLS_RND_KEY, data, length);
+}
+
+/**
+ * Generates an ephemeral EC key pair directly in binary form
+ * priv_d, pub_x and pub_y must be at least crv_size long
+ */
+static void _r_ecdh_generate(const struct ecc_curve * curve, size_t crv_size, uint8_t * priv_d, uint8_t * pub_x, uint8_t * pub_y) {
+  struct ecc_scalar priv;
+  struct ecc_point pub;
+  mpz_t z_priv_d, z_pub_x, z_pub_y;
+
+  mpz_init(z_priv_d);
+  mpz_init(z_pub_x);
+  mpz_init(z_pub_y);
+  ecc_scalar_init(&priv, curve);
+  ecc_point_init(&pub, curve);
+
+  ecc_scalar_random(&priv, NULL, _r_rnd_key_func);
+  ecc_point_mul_g(&pub, &priv);
+  ecc_scalar_get(&priv, z_priv_d);
+  ecc_point_get(&pub, z_pub_x, z_pub_y);
+  nettle_mpz_get_str_256(crv_size, priv_d, z_priv_d);
+  nettle_mpz_get_str_256(crv_size, pub_x, z_pub_x);
+  nettle_mpz_get_str_256(crv_size, pub_y, z_pub_y);
+
+  _r_mpz_wipe_clear(z_priv_d);
+  mpz_clear(z_pub_x);
+  mpz_clear(z_pub_y);
+  ecc_scalar_clear(&priv);
+  ecc_point_clear(&pub);
+}
+
+/**
+ * Generates an ephemeral X25519 or X448 key pair directly in binary form
+ */
+static int _r_dh_generate(size_t crv_size, uint8_t * priv_k, uint8_t * pub_x) {
+  int ret;
+
+  if (!gnutls_rnd(GNUTLS_RND_KEY, priv_k, crv_size)) {
+    if (crv_size == CURVE25519_SIZE) {
+      curve25519_mul_g(pub_x, priv_k);
+    } else {
+      curve448_mul_g(pub_x, priv_k);
+    }
+    ret = RHN_OK;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_dh_generate - Error gnutls_rnd");
+    ret = RHN_ERROR;
+  }
+
+  return ret;
+}
+
+/**
+ * Pool of pre-generated single-use ephemeral keys, one per curve
+ * P-256, P-384, X25519, X448 and P-521, refilled by a background thread
+ * The keys are held in secure memory
+ */
+struct _r_ecdh_pool_key {
+  uint8_t priv_k[_R_CURVE_MAX_SIZE];
+  uint8_t epk_x[_R_CURVE_MAX_SIZE];
+  uint8_t epk_y[_R_CURVE_MAX_SIZE];
+};
+
+struct _r_ecdh_pool {
+  pthread_t                 thread;
+  int                       running;
+  size_t                    pool_size;
+  size_t                    count[_R_ECDH_POOL_CURVES];
+  struct _r_ecdh_pool_key * keys[_R_ECDH_POOL_CURVES];
+};
+
+static struct _r_ecdh_pool _r_ecdh_pool_global;
+static pthread_mutex_t _r_ecdh_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _r_ecdh_pool_refill_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t _r_ecdh_pool_once = PTHREAD_ONCE_INIT;
+
+static int _r_ecdh_pool_index(int type, unsigned int bits) {
+  if (type & R_KEY_TYPE_EC) {
+    if (bits == 256) {
+      return 0;
+    } else if (bits == 384) {
+      return 1;
+    } else if (bits == 521) {
+      return 4;
+    }
+  } else if (type & R_KEY_TYPE_ECDH) {
+    if (bits == 256) {
+      return 2;
+    } else if (bits == 448) {
+      return 3;
+    }
+  }
+  return -1;
+}
+
+static void _r_ecdh_pool_clear(void) {
+  size_t i;
+
+  for (i=0; i<_R_ECDH_POOL_CURVES; i++) {
+    // The keys are zeroized by _r_secure_free
+    _r_secure_free(_r_ecdh_pool_global.keys[i]);
+    _r_ecdh_pool_global.keys[i] = NULL;
+    _r_ecdh_pool_global.count[i] = 0;
+  }
+  _r_ecdh_pool_global.pool_size = 0;
+}
+
+/**
+ * A forked child must never use the keys of its parent,
+ * and the refill thread doesn't exist in the child
+ */
+static void _r_ecdh_pool_atfork_child(void) {
+  pthread_mutex_init(&_r_ecdh_pool_lock, NULL);
+  pthread_cond_init(&_r_ecdh_pool_refill_cond, NULL);
+  _r_ecdh_pool_global.running = 0;
+  _r_ecdh_pool_clear();
+}
+
+static void _r_ecdh_pool_register_atfork(void) {
+  pthread_atfork(NULL, NULL, _r_ecdh_pool_atfork_child);
+}
+
+static void * _r_ecdh_pool_refill(void * args) {
+  struct _r_ecdh_pool_key key;
+  size_t i;
+  int full, res;
+  (void)args;
+
+  pthread_mutex_lock(&_r_ecdh_pool_lock);
+  while (_r_ecdh_pool_global.running) {
+    full = 1;
+    for (i=0; i<_R_ECDH_POOL_CURVES && _r_ecdh_pool_global.running; i++) {
+      if (_r_ecdh_pool_global.count[i] < _r_ecdh_pool_global.pool_size) {
+        full = 0;
+        pthread_mutex_unlock(&_r_ecdh_pool_lock);
+        res = RHN_OK;
+        if (i == 0) {
+          _r_ecdh_generate(nettle_get_secp_256r1(), 32, key.priv_k, key.epk_x, key.epk_y);
+        } else if (i == 1) {
+          _r_ecdh_generate(nettle_get_secp_384r1(), 48, key.priv_k, key.epk_x, key.epk_y);
+        } else if (i == 4) {
+          _r_ecdh_generate(nettle_get_secp_521r1(), 66, key.priv_k, key.epk_x, key.epk_y);
+        } else {
+          res = _r_dh_generate(i==2?CURVE25519_SIZE:CURVE448_SIZE, key.priv_k, key.epk_x);
+        }
+        pthread_mutex_lock(&_r_ecdh_pool_lock);
+        if (res == RHN_OK && _r_ecdh_pool_global.running && _r_ecdh_pool_global.count[i] < _r_ecdh_pool_global.pool_size) {
+          memcpy(&_r_ecdh_pool_global.keys[i][_r_ecdh_pool_global.count[i]], &key, sizeof(struct _r_ecdh_pool_key));
+          _r_ecdh_pool_global.count[i]++;
+        }
+        gnutls_memset(&key, 0, sizeof(struct _r_ecdh_pool_key));
+      }
+    }
+    if (full && _r_ecdh_pool_global.running) {
+      pthread_cond_wait(&_r_ecdh_pool_refill_cond, &_r_ecdh_pool_lock);
+    }
+  }
+  pthread_mutex_unlock(&_r_ecdh_pool_lock);
+  return NULL;
+}
 
+/**
+ * Takes an ephemeral key from the pool, the pool slot is zeroized
+ * Returns RHN_OK if a key was available
+ */
+static int _r_ecdh_pool_get(int type, unsigned int bits, uint8_t * priv_k, uint8_t * epk_x, uint8_t * epk_y) {
+  int ret = RHN_ERROR, index = _r_ecdh_pool_index(type, bits);
+  struct _r_ecdh_pool_key * key;
+
+  if (index >= 0) {
+    pthread_mutex_lock(&_r_ecdh_pool_lock);
+    if (_r_ecdh_pool_global.running && _r_ecdh_pool_global.count[index]) {
+      _r_ecdh_pool_global.count[index]--;
+      key = &_r_ecdh_pool_global.keys[index][_r_ecdh_pool_global.count[index]];
+      memcpy(priv_k, key->priv_k, _R_CURVE_MAX_SIZE);
+      memcpy(epk_x, key->epk_x, _R_CURVE_MAX_SIZE);
+      memcpy(epk_y, key->epk_y, _R_CURVE_MAX_SIZE);
+      gnutls_memset(key, 0, sizeof(struct _r_ecdh_pool_key));
+      pthread_cond_signal(&_r_ecdh_pool_refill_cond);
+      ret = RHN_OK;
+    }
+    pthread_mutex_unlock(&_r_ecdh_pool_lock);
+  }
   return ret;
 }
 
+/**
+ * Builds the epk header value from the binary ephemeral public key
+ */
+static json_t * _r_ecdh_epk_json(const char * kty, const char * crv, const uint8_t * epk_x, const uint8_t * epk_y, size_t crv_size) {
+  unsigned char x_b64[_R_CURVE_MAX_SIZE*2] = {0}, y_b64[_R_CURVE_MAX_SIZE*2] = {0};
+  size_t x_b64_len = 0, y_b64_len = 0;
+  json_t * j_epk = NULL;
+
+  if (o_base64url_encode(epk_x, crv_size, x_b64, &x_b64_len)) {
+    if (epk_y == NULL) {
+      j_epk = json_pack("{ssssss%}", "kty", kty, "crv", crv, "x", x_b64, x_b64_len);
+    } else if (o_base64url_encode(epk_y, crv_size, y_b64, &y_b64_len)) {
+      j_epk = json_pack("{ssssss%ss%}", "kty", kty, "crv", crv, "x", x_b64, x_b64_len, "y", y_b64, y_b64_len);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_epk_json - Error o_base64url_encode y");
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_epk_json - Error o_base64url_encode x");
+  }
+  return j_epk;
+}
+
 static int _r_compare_likely(size_t src, size_t around) {
   return ((around && src == around-1) || src == around || src == around+1);
 }
@@ -895,24 +1127,24 @@ static int _r_compare_likely(size_t src, size_t around) {
 static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, jwk_t * jwk_priv, int type, unsigned int bits, int x5u_flags, int * ret) {
   int type_priv = 0;
   unsigned int bits_priv = 0;
-  jwk_t * jwk_ephemeral = NULL, * jwk_ephemeral_pub = NULL;
+  jwk_t * jwk_ephemeral_pub = NULL;
   gnutls_datum_t Z = {NULL, 0}, kdf = {NULL, 0};
   unsigned char cipherkey_b64url[256] = {0};
-  uint8_t derived_key[64] = {0}, wrapped_key[72] = {0}, priv_k[_R_CURVE_MAX_SIZE] = {0}, pub_x[_R_CURVE_MAX_SIZE] = {0}, pub_y[_R_CURVE_MAX_SIZE] = {0};
+  uint8_t derived_key[64] = {0}, wrapped_key[72] = {0}, priv_k[_R_CURVE_MAX_SIZE] = {0}, pub_x[_R_CURVE_MAX_SIZE] = {0}, pub_y[_R_CURVE_MAX_SIZE] = {0}, epk_x[_R_CURVE_MAX_SIZE] = {0}, epk_y[_R_CURVE_MAX_SIZE] = {0};
   size_t derived_key_len = 0, cipherkey_b64url_len = 0, priv_k_size = 0, pub_x_size = 0, pub_y_size = 0, crv_size = 0;
   const char * key = NULL;
-  json_t * j_return = NULL;
+  json_t * j_return = NULL, * j_epk = NULL;
   const struct ecc_curve * nettle_curve;
   gnutls_ecc_curve_t curve = GNUTLS_ECC_CURVE_INVALID;
 
   do {
-    if (r_jwk_init(&jwk_ephemeral_pub) != RHN_OK) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_init jwk_ephemeral_pub");
-      *ret = RHN_ERROR;
-      break;
-    }
-
     if (jwk_priv != NULL) {
+      if (r_jwk_init(&jwk_ephemeral_pub) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_init jwk_ephemeral_pub");
+        *ret = RHN_ERROR;
+        break;
+      }
+
       type_priv = r_jwk_key_type(jwk_priv, &bits_priv, x5u_flags);
 
       if ((type_priv & 0xffffff00) != (type & 0xffffff00)) {
@@ -932,20 +1164,12 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         *ret = RHN_ERROR;
         break;
       }
-    } else {
-      if (r_jwk_init(&jwk_ephemeral) != RHN_OK) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_init jwk_ephemeral");
-        *ret = RHN_ERROR;
-        break;
-      }
 
-      if (r_jwk_generate_key_pair(jwk_ephemeral, jwk_ephemeral_pub, type&R_KEY_TYPE_EC?R_KEY_TYPE_EC:R_KEY_TYPE_ECDH, bits, NULL) != RHN_OK) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_generate_key_pair");
+      if ((j_epk = r_jwk_export_to_json_t(jwk_ephemeral_pub)) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_export_to_json_t jwk_ephemeral_pub");
         *ret = RHN_ERROR;
         break;
       }
-
-      r_jwk_delete_property_str(jwk_ephemeral_pub, "kid");
     }
 
     if (type & R_KEY_TYPE_EC) {
@@ -957,30 +1181,39 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         crv_size = 48;
       } else {
         nettle_curve = nettle_get_secp_521r1();
-        crv_size = 64;
+        crv_size = 66;
       }
 
       if (jwk_priv != NULL) {
         key = r_jwk_get_property_str(jwk_priv, "d");
-      } else {
-        key = r_jwk_get_property_str(jwk_ephemeral, "d");
-      }
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (ecdsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
-      }
+        if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (ecdsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
 
-      if (!priv_k_size || priv_k_size > _R_CURVE_MAX_SIZE) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Invalid priv_k_size (ecdsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
-      }
+        if (!priv_k_size || priv_k_size > _R_CURVE_MAX_SIZE) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Invalid priv_k_size (ecdsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (ecdsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
+        if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (ecdsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
+      } else {
+        // Use a pre-generated ephemeral key if available, or generate it in binary form, only the epk header is converted to JSON
+        if (_r_ecdh_pool_get(type, bits, priv_k, epk_x, epk_y) != RHN_OK) {
+          _r_ecdh_generate(nettle_curve, crv_size, priv_k, epk_x, epk_y);
+        }
+        priv_k_size = crv_size;
+        if ((j_epk = _r_ecdh_epk_json("EC", bits==256?"P-256":(bits==384?"P-384":"P-521"), epk_x, epk_y, crv_size)) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_ecdh_epk_json (ecdsa)");
+          *ret = RHN_ERROR;
+          break;
+        }
       }
 
       key = r_jwk_get_property_str(jwk_pub, "x");
@@ -1021,7 +1254,7 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         break;
       }
 
-      if (_r_ecdh_compute(priv_k, priv_k_size, pub_x, pub_x_size, pub_y, pub_y_size, nettle_curve, &Z) != RHN_OK) {
+      if (_r_ecdh_compute(priv_k, priv_k_size, pub_x, pub_x_size, pub_y, pub_y_size, nettle_curve, crv_size, &Z) != RHN_OK) {
         y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_ecdh_compute (ecdsa)");
         *ret = RHN_ERROR;
         break;
@@ -1037,31 +1270,42 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
 
       if (jwk_priv != NULL) {
         key = r_jwk_get_property_str(jwk_priv, "d");
-      } else {
-        key = r_jwk_get_property_str(jwk_ephemeral, "d");
-      }
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (eddsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
-      }
+        if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (eddsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
 
-      if (!priv_k_size || priv_k_size > _R_CURVE_MAX_SIZE) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Invalid priv_k_size (eddsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
-      }
+        if (!priv_k_size || priv_k_size > _R_CURVE_MAX_SIZE) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Invalid priv_k_size (eddsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (eddsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
-      }
+        if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (eddsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
 
-      if (!_r_compare_likely(priv_k_size, (size_t)gnutls_ecc_curve_get_size(curve))) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error invalid priv_k_size (eddsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
+        if (!_r_compare_likely(priv_k_size, (size_t)gnutls_ecc_curve_get_size(curve))) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error invalid priv_k_size (eddsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
+      } else {
+        // Use a pre-generated ephemeral key if available, or generate it in binary form, only the epk header is converted to JSON
+        if (_r_ecdh_pool_get(type, bits, priv_k, epk_x, epk_y) != RHN_OK && _r_dh_generate(crv_size, priv_k, epk_x) != RHN_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_dh_generate (eddsa)");
+          *ret = RHN_ERROR;
+          break;
+        }
+        priv_k_size = crv_size;
+        if ((j_epk = _r_ecdh_epk_json("OKP", crv_size==CURVE25519_SIZE?"X25519":"X448", epk_x, NULL, crv_size)) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_ecdh_epk_json (eddsa)");
+          *ret = RHN_ERROR;
+          break;
+        }
       }
 
       pub_x_size = CURVE448_SIZE;
@@ -1124,9 +1368,9 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
       r_jwe_set_cypher_key(jwe, derived_key, derived_key_len);
       o_free(jwe->encrypted_key_b64url);
       jwe->encrypted_key_b64url = NULL;
-      j_return = json_pack("{s{ss so}}", "header",
+      j_return = json_pack("{s{ss sO}}", "header",
                                            "alg", r_jwa_alg_to_str(alg),
-                                           "epk", r_jwk_export_to_json_t(jwk_ephemeral_pub));
+                                           "epk", j_epk);
     } else {
       _r_aes_key_wrap(derived_key, derived_key_len, jwe->key, jwe->key_len, wrapped_key);
       if (!o_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
@@ -1135,17 +1379,22 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
       }
       o_free(jwe->encrypted_key_b64url);
       jwe->encrypted_key_b64url = (unsigned char *)o_strndup((const char *)cipherkey_b64url, cipherkey_b64url_len);
-      j_return = json_pack("{ss%s{ss so}}", "encrypted_key", cipherkey_b64url, cipherkey_b64url_len,
+      j_return = json_pack("{ss%s{ss sO}}", "encrypted_key", cipherkey_b64url, cipherkey_b64url_len,
                                              "header",
                                                "alg", r_jwa_alg_to_str(alg),
-                                               "epk", r_jwk_export_to_json_t(jwk_ephemeral_pub));
+                                               "epk", j_epk);
     }
   } while (0);
 
   o_free(kdf.data);
+  if (Z.data != NULL) {
+    gnutls_memset(Z.data, 0, Z.size);
+  }
   gnutls_free(Z.data);
-  r_jwk_free(jwk_ephemeral);
   r_jwk_free(jwk_ephemeral_pub);
+  json_decref(j_epk);
+  gnutls_memset(priv_k, 0, sizeof(priv_k));
+  gnutls_memset(derived_key, 0, sizeof(derived_key));
 
   return j_return;
 }
@@ -1181,7 +1430,7 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
     }
 
     if (type & R_KEY_TYPE_EC) {
-      if (!(r_jwk_key_type(jwk_ephemeral_pub, &epk_bits, x5u_flags) & (R_KEY_TYPE_EC|R_KEY_TYPE_PUBLIC)) || epk_bits != bits || epk_bits > 384) {
+      if (!(r_jwk_key_type(jwk_ephemeral_pub, &epk_bits, x5u_flags) & (R_KEY_TYPE_EC|R_KEY_TYPE_PUBLIC)) || epk_bits != bits) {
         y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error invalid private key type (ecc)");
         ret = RHN_ERROR_PARAM;
         break;
@@ -1195,7 +1444,7 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
         crv_size = 48;
       } else {
         nettle_curve = nettle_get_secp_521r1();
-        crv_size = 64;
+        crv_size = 66;
       }
 
       key = r_jwk_get_property_str(jwk, "d");
@@ -1255,7 +1504,7 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
         break;
       }
 
-      if (_r_ecdh_compute(priv_k, priv_k_size, pub_x, pub_x_size, pub_y, pub_y_size, nettle_curve, &Z) != RHN_OK) {
+      if (_r_ecdh_compute(priv_k, priv_k_size, pub_x, pub_x_size, pub_y, pub_y_size, nettle_curve, crv_size, &Z) != RHN_OK) {
         y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_ecdh_compute (ecdsa)");
         ret = RHN_ERROR_INVALID;
         break;
@@ -1359,9 +1608,15 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
   } while (0);
 
   o_free(kdf.data);
+  if (Z.data != NULL) {
+    gnutls_memset(Z.data, 0, Z.size);
+  }
   gnutls_free(Z.data);
   r_jwk_free(jwk_ephemeral_pub);
   json_decref(j_epk);
+  gnutls_memset(priv_k, 0, sizeof(priv_k));
+  gnutls_memset(derived_key, 0, sizeof(derived_key));
+  gnutls_memset(key_data, 0, sizeof(key_data));
 
   return ret;
 }
@@ -1369,6 +1624,143 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
 
 // PBES2
 #if GNUTLS_VERSION_NUMBER >= 0x03060d
+/**
+ * Cache of PBES2-derived KEKs, the key of an entry is the HMAC of
+ * the mac, the iteration count, the salt (alg included) and the password
+ * with a random key generated when the cache is started, so an entry id
+ * can't be used to test passwords offline
+ * Entries and the id key are held in secure memory and zeroized when evicted
+ */
+struct _r_pbes2_kek {
+  unsigned char id[32];
+  unsigned char kek[_R_PBES2_KEK_MAX_SIZE];
+  size_t        kek_len;
+  unsigned long last_used;
+};
+
+struct _r_pbes2_cache {
+  size_t                cache_size;
+  size_t                count;
+  unsigned long         clock;
+  unsigned int          max_iterations;
+  unsigned char       * id_key;
+  struct _r_pbes2_kek * entries;
+};
+
+static struct _r_pbes2_cache _r_pbes2_cache_global;
+static pthread_mutex_t _r_pbes2_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _r_pbes2_cache_once = PTHREAD_ONCE_INIT;
+
+static void _r_pbes2_cache_atfork_child(void) {
+  pthread_mutex_init(&_r_pbes2_cache_lock, NULL);
+}
+
+static void _r_pbes2_cache_register_atfork(void) {
+  pthread_atfork(NULL, NULL, _r_pbes2_cache_atfork_child);
+}
+
+static void _r_pbes2_cache_clear(void) {
+  // The entries are zeroized by _r_secure_free
+  _r_secure_free(_r_pbes2_cache_global.entries);
+  _r_secure_free(_r_pbes2_cache_global.id_key);
+  _r_pbes2_cache_global.entries = NULL;
+  _r_pbes2_cache_global.id_key = NULL;
+  _r_pbes2_cache_global.cache_size = 0;
+  _r_pbes2_cache_global.count = 0;
+  _r_pbes2_cache_global.clock = 0;
+}
+
+static unsigned int _r_pbes2_max_iterations(void) {
+  unsigned int max_iterations;
+
+  pthread_mutex_lock(&_r_pbes2_cache_lock);
+  max_iterations = _r_pbes2_cache_global.max_iterations;
+  pthread_mutex_unlock(&_r_pbes2_cache_lock);
+  return max_iterations;
+}
+
+/**
+ * Computes the id of a cache entry, must be called with the cache lock held
+ */
+static int _r_pbes2_kek_id(gnutls_mac_algorithm_t mac, const gnutls_datum_t * password, const gnutls_datum_t * salt, unsigned int p2c, unsigned char * id) {
+  gnutls_hmac_hd_t hmac;
+  unsigned char params[8];
+  int ret = RHN_ERROR;
+
+  params[0] = (unsigned char)((unsigned int)mac >> 24);
+  params[1] = (unsigned char)((unsigned int)mac >> 16);
+  params[2] = (unsigned char)((unsigned int)mac >> 8);
+  params[3] = (unsigned char)mac;
+  params[4] = (unsigned char)(p2c >> 24);
+  params[5] = (unsigned char)(p2c >> 16);
+  params[6] = (unsigned char)(p2c >> 8);
+  params[7] = (unsigned char)p2c;
+  if (!gnutls_hmac_init(&hmac, GNUTLS_MAC_SHA256, _r_pbes2_cache_global.id_key, _R_PBES2_ID_KEY_SIZE)) {
+    if (!gnutls_hmac(hmac, params, sizeof(params)) &&
+        !gnutls_hmac(hmac, salt->data, salt->size) &&
+        !gnutls_hmac(hmac, password->data, password->size)) {
+      ret = RHN_OK;
+    }
+    gnutls_hmac_deinit(hmac, id);
+  }
+  return ret;
+}
+
+/**
+ * Derives the PBES2 KEK, using the cache if enabled and use_cache is set
+ */
+static int _r_pbes2_derive_kek(gnutls_mac_algorithm_t mac, const gnutls_datum_t * password, const gnutls_datum_t * salt, unsigned int p2c, unsigned char * kek, size_t kek_len, int use_cache) {
+  unsigned char id[32] = {0};
+  struct _r_pbes2_kek * entry = NULL;
+  int cached = 0, has_id = 0;
+  size_t i;
+
+  if (use_cache && kek_len <= _R_PBES2_KEK_MAX_SIZE) {
+    pthread_mutex_lock(&_r_pbes2_cache_lock);
+    if (_r_pbes2_cache_global.cache_size && _r_pbes2_kek_id(mac, password, salt, p2c, id) == RHN_OK) {
+      has_id = 1;
+      for (i=0; i<_r_pbes2_cache_global.count; i++) {
+        if (_r_pbes2_cache_global.entries[i].kek_len == kek_len && !memcmp(_r_pbes2_cache_global.entries[i].id, id, sizeof(id))) {
+          memcpy(kek, _r_pbes2_cache_global.entries[i].kek, kek_len);
+          _r_pbes2_cache_global.entries[i].last_used = ++_r_pbes2_cache_global.clock;
+          cached = 1;
+          break;
+        }
+      }
+    }
+    pthread_mutex_unlock(&_r_pbes2_cache_lock);
+  }
+  if (!cached) {
+    if (gnutls_pbkdf2(mac, password, salt, p2c, kek, kek_len) != GNUTLS_E_SUCCESS) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_pbes2_derive_kek - Error gnutls_pbkdf2");
+      return RHN_ERROR;
+    }
+    if (has_id) {
+      pthread_mutex_lock(&_r_pbes2_cache_lock);
+      if (_r_pbes2_cache_global.cache_size) {
+        if (_r_pbes2_cache_global.count < _r_pbes2_cache_global.cache_size) {
+          entry = &_r_pbes2_cache_global.entries[_r_pbes2_cache_global.count];
+          _r_pbes2_cache_global.count++;
+        } else {
+          entry = &_r_pbes2_cache_global.entries[0];
+          for (i=1; i<_r_pbes2_cache_global.count; i++) {
+            if (_r_pbes2_cache_global.entries[i].last_used < entry->last_used) {
+              entry = &_r_pbes2_cache_global.entries[i];
+            }
+          }
+          gnutls_memset(entry, 0, sizeof(struct _r_pbes2_kek));
+        }
+        memcpy(entry->id, id, sizeof(id));
+        memcpy(entry->kek, kek, kek_len);
+        entry->kek_len = kek_len;
+        entry->last_used = ++_r_pbes2_cache_global.clock;
+      }
+      pthread_mutex_unlock(&_r_pbes2_cache_lock);
+    }
+  }
+  return RHN_OK;
+}
+
 static json_t * r_jwe_pbes2_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u_flags, int * ret) {
   unsigned char salt_seed[_R_PBES_DEFAULT_SALT_LENGTH] = {0}, salt_seed_b64[_R_PBES_DEFAULT_SALT_LENGTH*2], * salt = NULL, kek[64] = {0}, * key = NULL, wrapped_key[72] = {0}, cipherkey_b64url[256] = {0};
   size_t alg_len, salt_len, key_len = 0, cipherkey_b64url_len = 0, salt_seed_b64_len = 0, kek_len = 0;
@@ -1428,9 +1820,14 @@ static json_t * r_jwe_pbes2_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
       if ((p2c = (unsigned int)r_jwe_get_header_int_value(jwe, "p2c")) <= 0) {
         p2c = _R_PBES_DEFAULT_ITERATION;
       }
+      if (_r_pbes2_max_iterations() && p2c > _r_pbes2_max_iterations()) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_wrap - Error p2c %u exceeds the maximum iteration count", p2c);
+        *ret = RHN_ERROR_PARAM;
+        break;
+      }
 
       key_len = (bits/8)+4;
-      if ((key = o_malloc(key_len)) == NULL) {
+      if ((key = _r_secure_malloc(key_len)) == NULL) {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_wrap - Error o_malloc key");
         *ret = RHN_ERROR_MEMORY;
         break;
@@ -1454,8 +1851,8 @@ static json_t * r_jwe_pbes2_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
         kek_len = 32;
         mac = GNUTLS_MAC_SHA512;
       }
-      if (gnutls_pbkdf2(mac, &password, &g_salt, p2c, kek, kek_len) != GNUTLS_E_SUCCESS) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error gnutls_pbkdf2");
+      if (_r_pbes2_derive_kek(mac, &password, &g_salt, p2c, kek, kek_len, p2s!=NULL) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_wrap - Error _r_pbes2_derive_kek");
         *ret = RHN_ERROR;
         break;
       }
@@ -1471,7 +1868,7 @@ static json_t * r_jwe_pbes2_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
                                                "p2s", p2s!=NULL?p2s:(const char*)salt_seed_b64,
                                                "p2c", p2c);
     } while (0);
-    o_free(key);
+    _r_secure_free(key);
     o_free(salt);
     o_free(dat_dec.data);
   } else {
@@ -1500,6 +1897,11 @@ static int r_jwe_pbes2_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u
         ret = RHN_ERROR_PARAM;
         break;
       }
+      if (_r_pbes2_max_iterations() && p2c > _r_pbes2_max_iterations()) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error p2c %u exceeds the maximum iteration count", p2c);
+        ret = RHN_ERROR_PARAM;
+        break;
+      }
       if (o_strlen(r_jwe_get_header_str_value(jwe, "p2s")) < 8) {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error invalid p2s");
         ret = RHN_ERROR_PARAM;
@@ -1522,7 +1924,7 @@ static int r_jwe_pbes2_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u
       memcpy(salt+alg_len+1, dat_dec.data, dat_dec.size);
 
       key_len = (bits/8)+4;
-      if ((key = o_malloc(key_len)) == NULL) {
+      if ((key = _r_secure_malloc(key_len)) == NULL) {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error o_malloc key");
         ret = RHN_ERROR_MEMORY;
         break;
@@ -1546,8 +1948,8 @@ static int r_jwe_pbes2_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u
         kek_len = 32;
         mac = GNUTLS_MAC_SHA512;
       }
-      if (gnutls_pbkdf2(mac, &password, &g_salt, p2c, kek, kek_len) != GNUTLS_E_SUCCESS) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error gnutls_pbkdf2");
+      if (_r_pbes2_derive_kek(mac, &password, &g_salt, p2c, kek, kek_len, 1) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error _r_pbes2_derive_kek");
         ret = RHN_ERROR;
         break;
       }
@@ -1565,7 +1967,7 @@ static int r_jwe_pbes2_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u
         ret = RHN_ERROR;
       }
     } while (0);
-    o_free(key);
+    _r_secure_free(key);
     o_free(salt);
     o_free(dat_dec.data);
   } else {
@@ -1643,7 +2045,7 @@ static json_t * r_jwe_aesgcm_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
     key_len = bits;
 
     do {
-      if ((key = o_malloc(key_len+4)) == NULL) {
+      if ((key = _r_secure_malloc(key_len+4)) == NULL) {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error allocating resources for key");
         *ret = RHN_ERROR_MEMORY;
         break;
@@ -1723,7 +2125,7 @@ static json_t * r_jwe_aesgcm_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
         json_object_set_new(json_object_get(j_return, "header"), "iv", json_string(r_jwe_get_header_str_value(jwe, "iv")));
       }
     } while (0);
-    o_free(key);
+    _r_secure_free(key);
     o_free(dat_iv_enc.data);
     o_free(dat_iv_dec.data);
     if (handle != NULL) {
@@ -1842,7 +2244,7 @@ static int r_jwe_aesgcm_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5
     key_len = bits;
 
     do {
-      if ((key = o_malloc(key_len+4)) == NULL) {
+      if ((key = _r_secure_malloc(key_len+4)) == NULL) {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error allocating resources for key");
         ret = RHN_ERROR_MEMORY;
         break;
@@ -1898,7 +2300,7 @@ static int r_jwe_aesgcm_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5
       }
 
     } while (0);
-    o_free(key);
+    _r_secure_free(key);
     o_free(dat_key.data);
     o_free(dat_iv.data);
     if (handle != NULL) {
@@ -1950,46 +2352,48 @@ static int r_jwe_set_ptext_with_block(unsigned char * data, size_t data_len, uns
 static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_flags, int x5u_flags) {
   int ret;
   jwk_t * jwk;
+  json_t * j_value;
+  jwa_alg alg;
+  jwa_enc enc;
+  size_t jwks_size = r_jwks_size(jwe->jwks_pubkey);
 
   if (json_is_object(j_header)) {
     ret = RHN_OK;
 
-    if (json_object_get(j_header, "alg") != NULL) {
-      if (0 != o_strcmp("RSA1_5", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("RSA-OAEP", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("RSA-OAEP-256", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("A128KW", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("A192KW", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("A256KW", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("dir", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("ECDH-ES", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("ECDH-ES+A128KW", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("ECDH-ES+A192KW", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("ECDH-ES+A256KW", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("A128GCMKW", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("A192GCMKW", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("A256GCMKW", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("PBES2-HS256+A128KW", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("PBES2-HS384+A192KW", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("PBES2-HS512+A256KW", json_string_value(json_object_get(j_header, "alg")))) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Invalid alg");
-        ret = RHN_ERROR_PARAM;
-      } else {
-        jwe->alg = r_str_to_jwa_alg(json_string_value(json_object_get(j_header, "alg")));
+    if ((j_value = json_object_get(j_header, "alg")) != NULL) {
+      switch ((alg = _r_str_to_jwa_alg_len(json_string_value(j_value), json_string_length(j_value)))) {
+        case R_JWA_ALG_RSA1_5:
+        case R_JWA_ALG_RSA_OAEP:
+        case R_JWA_ALG_RSA_OAEP_256:
+        case R_JWA_ALG_A128KW:
+        case R_JWA_ALG_A192KW:
+        case R_JWA_ALG_A256KW:
+        case R_JWA_ALG_DIR:
+        case R_JWA_ALG_ECDH_ES:
+        case R_JWA_ALG_ECDH_ES_A128KW:
+        case R_JWA_ALG_ECDH_ES_A192KW:
+        case R_JWA_ALG_ECDH_ES_A256KW:
+        case R_JWA_ALG_A128GCMKW:
+        case R_JWA_ALG_A192GCMKW:
+        case R_JWA_ALG_A256GCMKW:
+        case R_JWA_ALG_PBES2_H256:
+        case R_JWA_ALG_PBES2_H384:
+        case R_JWA_ALG_PBES2_H512:
+          jwe->alg = alg;
+          break;
+        default:
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Invalid alg");
+          ret = RHN_ERROR_PARAM;
+          break;
       }
     }
 
-    if (json_object_get(j_header, "enc") != NULL) {
-      if (0 != o_strcmp("A128CBC-HS256", json_string_value(json_object_get(j_header, "enc"))) &&
-      0 != o_strcmp("A192CBC-HS384", json_string_value(json_object_get(j_header, "enc"))) &&
-      0 != o_strcmp("A256CBC-HS512", json_string_value(json_object_get(j_header, "enc"))) &&
-      0 != o_strcmp("A128GCM", json_string_value(json_object_get(j_header, "enc"))) &&
-      0 != o_strcmp("A192GCM", json_string_value(json_object_get(j_header, "enc"))) &&
-      0 != o_strcmp("A256GCM", json_string_value(json_object_get(j_header, "enc")))) {
+    if ((j_value = json_object_get(j_header, "enc")) != NULL) {
+      if ((enc = _r_str_to_jwa_enc_len(json_string_value(j_value), json_string_length(j_value))) != R_JWA_ENC_UNKNOWN) {
+        jwe->enc = enc;
+      } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Invalid enc");
         ret = RHN_ERROR_PARAM;
-      } else {
-        jwe->enc = r_str_to_jwa_enc(json_string_value(json_object_get(j_header, "enc")));
       }
     }
 
@@ -2037,6 +2441,9 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
       }
       r_jwk_free(jwk);
     }
+    if (_r_jwks_add_header_keys(jwe->jwks_pubkey, jwks_size, &jwe->j_jwks_pubkey_header) != RHN_OK) {
+      ret = RHN_ERROR_MEMORY;
+    }
   } else {
     ret = RHN_ERROR_PARAM;
   }
@@ -2060,20 +2467,20 @@ static void r_jwe_remove_padding(unsigned char * text, size_t * text_len, unsign
   }
 }
 
-static int r_jwe_compute_hmac_tag(jwe_t * jwe, unsigned char * ciphertext, size_t cyphertext_len, const unsigned char * aad, unsigned char * tag, size_t * tag_len) {
+static int r_jwe_compute_hmac_tag(jwe_t * jwe, unsigned char * ciphertext, size_t cyphertext_len, const unsigned char * aad, size_t aad_size, unsigned char * tag, size_t * tag_len) {
   int ret, res;
   unsigned char al[8], * compute_hmac = NULL;
   uint64_t aad_len;
-  size_t hmac_size = 0, aad_size = o_strlen((const char *)aad), i;
+  size_t hmac_size = 0, i;
   gnutls_mac_algorithm_t mac = r_jwe_get_digest_from_enc(jwe->enc);
 
-  aad_len = (uint64_t)(o_strlen((const char *)aad)*8);
+  aad_len = (uint64_t)(aad_size*8);
   memset(al, 0, 8);
   for(i = 0; i < 8; i++) {
     al[i] = (uint8_t)((aad_len >> 8*(7 - i)) & 0xFF);
   }
 
-  if ((compute_hmac = o_malloc(aad_size+jwe->iv_len+cyphertext_len+8)) != NULL) {
+  if ((compute_hmac = _r_scratch_get(_R_SCRATCH_HMAC_INPUT, aad_size+jwe->iv_len+cyphertext_len+8)) != NULL) {
     if (aad_size) {
       memcpy(compute_hmac, aad, aad_size);
       hmac_size += aad_size;
@@ -2092,7 +2499,7 @@ static int r_jwe_compute_hmac_tag(jwe_t * jwe, unsigned char * ciphertext, size_
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compute_hmac_tag - Error gnutls_hmac_fast: '%s'", gnutls_strerror(res));
       ret = RHN_ERROR;
     }
-    o_free(compute_hmac);
+    _r_scratch_release(_R_SCRATCH_HMAC_INPUT, 0);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compute_hmac_tag - Error allocating resources for compute_hmac");
     ret = RHN_ERROR;
@@ -2261,7 +2668,7 @@ static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * j
     case R_JWA_ALG_ECDH_ES_A192KW:
     case R_JWA_ALG_ECDH_ES_A256KW:
       res = r_jwk_key_type(jwk, &bits, x5u_flags);
-      if ((res & R_KEY_TYPE_ECDH || res & R_KEY_TYPE_EC) && res & R_KEY_TYPE_PUBLIC && bits < 521) {
+      if ((res & R_KEY_TYPE_ECDH || res & R_KEY_TYPE_EC) && res & R_KEY_TYPE_PUBLIC) {
         *ret = RHN_OK;
         if (r_jwks_size(jwe->jwks_privkey) == 1) {
           jwk_priv = r_jwks_get_at(jwe->jwks_privkey, 0);
@@ -2366,7 +2773,7 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
       if (res & R_KEY_TYPE_RSA && res & R_KEY_TYPE_PRIVATE && bits >= 2048) {
         if (jwk != NULL && !o_strnullempty((const char *)jwe->encrypted_key_b64url) && (g_priv = r_jwk_export_to_gnutls_privkey(jwk)) != NULL) {
           if (o_base64url_decode_alloc(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat)) {
-            if ((clearkey = o_malloc(bits+1)) != NULL) {
+            if ((clearkey = _r_secure_malloc(bits+1)) != NULL) {
               clearkey_len = bits+1;
               if (_r_rsa_oaep_decrypt(g_priv, alg, dat.data, dat.size, clearkey, &clearkey_len) == RHN_OK) {
                 if (_r_get_key_size(jwe->enc) == clearkey_len) {
@@ -2388,7 +2795,7 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
               y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error o_malloc clearkey");
               ret = RHN_ERROR_MEMORY;
             }
-            o_free(clearkey);
+            _r_secure_free(clearkey);
             o_free(dat.data);
             dat.data = NULL;
           } else {
@@ -2412,7 +2819,7 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
       if (jwk != NULL) {
         if (r_jwk_key_type(jwk, &bits, x5u_flags) & R_KEY_TYPE_SYMMETRIC && bits == _r_get_key_size(jwe->enc)*8) {
           key_len = (size_t)(bits/8);
-          if ((key = o_malloc(key_len+4)) != NULL) {
+          if ((key = _r_secure_malloc(key_len+4)) != NULL) {
             if (r_jwk_export_to_symmetric_key(jwk, key, &key_len) == RHN_OK) {
               o_free(jwe->encrypted_key_b64url);
               jwe->encrypted_key_b64url = NULL;
@@ -2421,7 +2828,7 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
               y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error r_jwk_export_to_symmetric_key");
               ret = RHN_ERROR_MEMORY;
             }
-            o_free(key);
+            _r_secure_free(key);
           } else {
             y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error allocating resources for key");
             ret = RHN_ERROR_MEMORY;
@@ -2494,7 +2901,7 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
     case R_JWA_ALG_ECDH_ES_A192KW:
     case R_JWA_ALG_ECDH_ES_A256KW:
       res = r_jwk_key_type(jwk, &bits, x5u_flags);
-      if (res & (R_KEY_TYPE_EC|R_KEY_TYPE_ECDH) && res & R_KEY_TYPE_PRIVATE && bits < 521) {
+      if (res & (R_KEY_TYPE_EC|R_KEY_TYPE_ECDH) && res & R_KEY_TYPE_PRIVATE) {
         if ((res = _r_jwe_ecdh_decrypt(jwe, alg, jwk, res, bits, x5u_flags)) == RHN_OK) {
           ret = RHN_OK;
         } else {
@@ -2544,6 +2951,9 @@ int r_jwe_init(jwe_t ** jwe) {
             (*jwe)->payload_len = 0;
             (*jwe)->j_json_serialization = NULL;
             (*jwe)->token_mode = R_JSON_MODE_COMPACT;
+            (*jwe)->j_jwks_pubkey_header = NULL;
+            (*jwe)->jwks_shared_privkey = NULL;
+            (*jwe)->jwks_shared_pubkey = NULL;
             ret = RHN_OK;
           } else {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_init - Error allocating resources for jwks_privkey");
@@ -2571,6 +2981,49 @@ int r_jwe_init(jwe_t ** jwe) {
   return ret;
 }
 
+int r_jwe_reset(jwe_t * jwe) {
+  int ret;
+
+  if (jwe != NULL) {
+    _r_jwks_remove_header_keys(jwe->jwks_pubkey, jwe->j_jwks_pubkey_header);
+    o_free(jwe->header_b64url);
+    jwe->header_b64url = NULL;
+    o_free(jwe->encrypted_key_b64url);
+    jwe->encrypted_key_b64url = NULL;
+    o_free(jwe->iv_b64url);
+    jwe->iv_b64url = NULL;
+    o_free(jwe->aad_b64url);
+    jwe->aad_b64url = NULL;
+    o_free(jwe->ciphertext_b64url);
+    jwe->ciphertext_b64url = NULL;
+    o_free(jwe->auth_tag_b64url);
+    jwe->auth_tag_b64url = NULL;
+    json_decref(jwe->j_unprotected_header);
+    jwe->j_unprotected_header = NULL;
+    json_decref(jwe->j_json_serialization);
+    jwe->j_json_serialization = NULL;
+    _r_secure_free(jwe->key);
+    jwe->key = NULL;
+    jwe->key_len = 0;
+    o_free(jwe->iv);
+    jwe->iv = NULL;
+    jwe->iv_len = 0;
+    o_free(jwe->aad);
+    jwe->aad = NULL;
+    jwe->aad_len = 0;
+    o_free(jwe->payload);
+    jwe->payload = NULL;
+    jwe->payload_len = 0;
+    jwe->alg = R_JWA_ALG_UNKNOWN;
+    jwe->enc = R_JWA_ENC_UNKNOWN;
+    jwe->token_mode = R_JSON_MODE_COMPACT;
+    ret = _r_json_object_reset(&jwe->j_header);
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
 void r_jwe_free(jwe_t * jwe) {
   if (jwe != NULL) {
     r_jwks_free(jwe->jwks_privkey);
@@ -2584,10 +3037,13 @@ void r_jwe_free(jwe_t * jwe) {
     json_decref(jwe->j_header);
     json_decref(jwe->j_unprotected_header);
     json_decref(jwe->j_json_serialization);
-    o_free(jwe->key);
+    _r_secure_free(jwe->key);
     o_free(jwe->iv);
     o_free(jwe->aad);
     o_free(jwe->payload);
+    r_jwks_shared_free(jwe->jwks_shared_privkey);
+    r_jwks_shared_free(jwe->jwks_shared_pubkey);
+    json_decref(jwe->j_jwks_pubkey_header);
     o_free(jwe);
   }
 }
@@ -2613,6 +3069,8 @@ jwe_t * r_jwe_copy(jwe_t * jwe) {
         jwe_copy->jwks_privkey = r_jwks_copy(jwe->jwks_privkey);
         r_jwks_free(jwe_copy->jwks_pubkey);
         jwe_copy->jwks_pubkey = r_jwks_copy(jwe->jwks_pubkey);
+        jwe_copy->jwks_shared_privkey = r_jwks_shared_ref(jwe->jwks_shared_privkey);
+        jwe_copy->jwks_shared_pubkey = r_jwks_shared_ref(jwe->jwks_shared_pubkey);
         json_decref(jwe_copy->j_header);
         jwe_copy->j_header = json_deep_copy(jwe->j_header);
         jwe_copy->j_unprotected_header = json_deep_copy(jwe->j_unprotected_header);
@@ -2666,9 +3124,9 @@ int r_jwe_set_cypher_key(jwe_t * jwe, const unsigned char * key, size_t key_len)
   int ret;
 
   if (jwe != NULL) {
-    o_free(jwe->key);
+    _r_secure_free(jwe->key);
     if (key != NULL && key_len) {
-      if ((jwe->key = o_malloc(key_len)) != NULL) {
+      if ((jwe->key = _r_secure_malloc(key_len)) != NULL) {
         memcpy(jwe->key, key, key_len);
         jwe->key_len = key_len;
         ret = RHN_OK;
@@ -2704,10 +3162,10 @@ int r_jwe_generate_cypher_key(jwe_t * jwe) {
     o_free(jwe->encrypted_key_b64url);
     jwe->encrypted_key_b64url = NULL;
     jwe->key_len = _r_get_key_size(jwe->enc);
-    o_free(jwe->key);
+    _r_secure_free(jwe->key);
     if (!jwe->key_len) {
       ret = RHN_ERROR_PARAM;
-    } else if ((jwe->key = o_malloc(jwe->key_len)) != NULL) {
+    } else if ((jwe->key = _r_secure_malloc(jwe->key_len)) != NULL) {
       if (!gnutls_rnd(GNUTLS_RND_KEY, jwe->key, jwe->key_len)) {
         ret = RHN_OK;
       } else {
@@ -3051,6 +3509,16 @@ int r_jwe_add_jwks(jwe_t * jwe, jwks_t * jwks_privkey, jwks_t * jwks_pubkey) {
   return ret;
 }
 
+int r_jwe_set_shared_jwks(jwe_t * jwe, jwks_shared_t * jwks_shared_privkey, jwks_shared_t * jwks_shared_pubkey) {
+  if (jwe != NULL) {
+    _r_jwks_shared_set(&jwe->jwks_shared_privkey, jwks_shared_privkey);
+    _r_jwks_shared_set(&jwe->jwks_shared_pubkey, jwks_shared_pubkey);
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
 int r_jwe_add_keys_json_str(jwe_t * jwe, const char * privkey, const char * pubkey) {
   int ret = RHN_OK;
   jwa_alg alg;
@@ -3248,19 +3716,27 @@ jwks_t * r_jwe_get_jwks_pubkey(jwe_t * jwe) {
   }
 }
 
-int r_jwe_encrypt_payload(jwe_t * jwe) {
+/**
+ * Encrypts text, the payload compressed if required
+ * If output is NULL, the encoded header, ciphertext and tag are set in the jwe,
+ * otherwise the first header_len bytes of output are the encoded header,
+ * the ciphertext and the tag are encoded in output from offset,
+ * then offset is set after the tag
+ */
+static int _r_jwe_encrypt_text(jwe_t * jwe, const unsigned char * text, size_t text_len, char * output, size_t header_len, size_t * offset) {
   int ret = RHN_OK, res;
   gnutls_cipher_hd_t handle;
   gnutls_datum_t key, iv;
-  unsigned char * ptext = NULL, * text_zip = NULL, * ciphertext_b64url = NULL, tag[128] = {0}, * tag_b64url = NULL, * aad = NULL;
-  size_t ptext_len = 0, ciphertext_b64url_len = 0, tag_len = 0, text_zip_len = 0;
+  unsigned char * ptext = NULL, * ciphertext_b64url = NULL, tag[128] = {0}, * aad = NULL;
+  size_t ptext_len = 0, ciphertext_b64url_len = 0, tag_len = 0, aad_len = 0;
   char * str_header = NULL;
   int cipher_cbc;
   struct _o_datum dat = {0, NULL};
+  struct _r_b64url_writer writer;
 
   if (jwe != NULL &&
-      jwe->payload != NULL &&
-      jwe->payload_len &&
+      text != NULL &&
+      text_len &&
       jwe->enc != R_JWA_ENC_UNKNOWN &&
       jwe->key != NULL &&
       jwe->iv != NULL &&
@@ -3269,41 +3745,29 @@ int r_jwe_encrypt_payload(jwe_t * jwe) {
       r_jwe_set_enc_header(jwe, jwe->j_header) == RHN_OK) {
     cipher_cbc = (jwe->enc == R_JWA_ENC_A128CBC || jwe->enc == R_JWA_ENC_A192CBC || jwe->enc == R_JWA_ENC_A256CBC);
 
-    if ((str_header = json_dumps(jwe->j_header, JSON_COMPACT)) != NULL) {
-      if (o_base64url_encode_alloc((const unsigned char *)str_header, o_strlen(str_header), &dat)) {
-        o_free(jwe->header_b64url);
-        jwe->header_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
-        o_free(dat.data);
-        dat.data = NULL;
-      } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error o_base64url_encode str_header");
-        ret = RHN_ERROR;
-      }
-      o_free(str_header);
-    } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error json_dumps j_header");
-      ret = RHN_ERROR;
-    }
-
-    ptext_len = gnutls_cipher_get_block_size(_r_get_alg_from_enc(jwe->enc));
-    if (0 == o_strcmp("DEF", r_jwe_get_header_str_value(jwe, "zip"))) {
-      if (_r_deflate_payload(jwe->payload, jwe->payload_len, &text_zip, &text_zip_len) == RHN_OK) {
-        if (r_jwe_set_ptext_with_block(text_zip, text_zip_len, &ptext, &ptext_len, _r_get_alg_from_enc(jwe->enc), cipher_cbc) != RHN_OK) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error r_jwe_set_ptext_with_block");
+    if (output == NULL) {
+      if ((str_header = json_dumps(jwe->j_header, JSON_COMPACT)) != NULL) {
+        if (o_base64url_encode_alloc((const unsigned char *)str_header, o_strlen(str_header), &dat)) {
+          o_free(jwe->header_b64url);
+          jwe->header_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
+          o_free(dat.data);
+          dat.data = NULL;
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error o_base64url_encode str_header");
           ret = RHN_ERROR;
         }
+        o_free(str_header);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error _r_deflate_payload");
-        ret = RHN_ERROR;
-      }
-      o_free(text_zip);
-    } else {
-      if (r_jwe_set_ptext_with_block(jwe->payload, jwe->payload_len, &ptext, &ptext_len, _r_get_alg_from_enc(jwe->enc), cipher_cbc) != RHN_OK) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error r_jwe_set_ptext_with_block");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error json_dumps j_header");
         ret = RHN_ERROR;
       }
     }
 
+    if (ret == RHN_OK && r_jwe_set_ptext_with_block((unsigned char *)text, text_len, &ptext, &ptext_len, _r_get_alg_from_enc(jwe->enc), cipher_cbc) != RHN_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error r_jwe_set_ptext_with_block");
+      ret = RHN_ERROR;
+    }
+
     if (ret == RHN_OK) {
       if (cipher_cbc) {
         key.data = jwe->key+(jwe->key_len/2);
@@ -3315,18 +3779,27 @@ int r_jwe_encrypt_payload(jwe_t * jwe) {
       iv.data = jwe->iv;
       iv.size = jwe->iv_len;
       if (!(res = gnutls_cipher_init(&handle, _r_get_alg_from_enc(jwe->enc), &key, &iv))) {
-        if (jwe->aad_b64url == NULL || jwe->token_mode == R_JSON_MODE_COMPACT) {
+        if (output != NULL) {
+          // The encoded header is already in output
+          aad_len = header_len;
+        } else if (jwe->aad_b64url == NULL || jwe->token_mode == R_JSON_MODE_COMPACT) {
           aad = (unsigned char *)o_strdup((const char *)jwe->header_b64url);
+          aad_len = o_strlen((const char *)aad);
         } else {
           aad = (unsigned char *)msprintf("%s.%s", jwe->header_b64url, jwe->aad_b64url);
+          aad_len = o_strlen((const char *)aad);
         }
-        if (!cipher_cbc && (res = gnutls_cipher_add_auth(handle, aad, o_strlen((const char *)aad)))) {
+        if (!cipher_cbc && (res = gnutls_cipher_add_auth(handle, output!=NULL?(const unsigned char *)output:aad, aad_len))) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error gnutls_cipher_add_auth: '%s'", gnutls_strerror(res));
           ret = RHN_ERROR;
         }
         if (ret == RHN_OK) {
           if (!(res = gnutls_cipher_encrypt(handle, ptext, ptext_len))) {
-            if ((ciphertext_b64url = o_malloc(2*ptext_len)) != NULL) {
+            if (output != NULL) {
+              _r_b64url_writer_init(&writer, (unsigned char *)output+*offset, _r_get_base64url_len(ptext_len));
+              _r_b64url_writer_write((const char *)ptext, ptext_len, &writer);
+              *offset += _r_b64url_writer_end(&writer);
+            } else if ((ciphertext_b64url = _r_scratch_get(_R_SCRATCH_CIPHERTEXT, 2*ptext_len)) != NULL) {
               if (o_base64url_encode(ptext, ptext_len, ciphertext_b64url, &ciphertext_b64url_len)) {
                 o_free(jwe->ciphertext_b64url);
                 jwe->ciphertext_b64url = (unsigned char *)o_strndup((const char *)ciphertext_b64url, ciphertext_b64url_len);
@@ -3334,22 +3807,19 @@ int r_jwe_encrypt_payload(jwe_t * jwe) {
                 y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error o_base64url_encode ciphertext");
                 ret = RHN_ERROR;
               }
+              _r_scratch_release(_R_SCRATCH_CIPHERTEXT, 0);
             } else {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error allocating resources for ciphertext_b64url");
               ret = RHN_ERROR_MEMORY;
             }
-            o_free(ciphertext_b64url);
           } else {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error gnutls_cipher_encrypt: '%s'", gnutls_strerror(res));
             ret = RHN_ERROR;
           }
-        } else if (!cipher_cbc) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error gnutls_cipher_add_auth: '%s'", gnutls_strerror(res));
-          ret = RHN_ERROR;
         }
         if (ret == RHN_OK) {
           if (cipher_cbc) {
-            if (r_jwe_compute_hmac_tag(jwe, ptext, ptext_len, aad, tag, &tag_len) != RHN_OK) {
+            if (r_jwe_compute_hmac_tag(jwe, ptext, ptext_len, output!=NULL?(const unsigned char *)output:aad, aad_len, tag, &tag_len) != RHN_OK) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error r_jwe_compute_hmac_tag");
               ret = RHN_ERROR;
             }
@@ -3362,20 +3832,19 @@ int r_jwe_encrypt_payload(jwe_t * jwe) {
             }
           }
           if (ret == RHN_OK && tag_len) {
-            if ((tag_b64url = o_malloc(tag_len*2)) != NULL) {
-              if (o_base64url_encode_alloc(tag, tag_len, &dat)) {
-                o_free(jwe->auth_tag_b64url);
-                jwe->auth_tag_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
-                o_free(dat.data);
-                dat.data = NULL;
-              } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error o_base64url_encode tag_b64url");
-                ret = RHN_ERROR;
-              }
-              o_free(tag_b64url);
+            if (output != NULL) {
+              output[(*offset)++] = '.';
+              _r_b64url_writer_init(&writer, (unsigned char *)output+*offset, _r_get_base64url_len(tag_len));
+              _r_b64url_writer_write((const char *)tag, tag_len, &writer);
+              *offset += _r_b64url_writer_end(&writer);
+            } else if (o_base64url_encode_alloc(tag, tag_len, &dat)) {
+              o_free(jwe->auth_tag_b64url);
+              jwe->auth_tag_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
+              o_free(dat.data);
+              dat.data = NULL;
             } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error allocating resources for tag_b64url");
-              ret = RHN_ERROR_MEMORY;
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error o_base64url_encode tag_b64url");
+              ret = RHN_ERROR;
             }
           }
         }
@@ -3394,16 +3863,40 @@ int r_jwe_encrypt_payload(jwe_t * jwe) {
   return ret;
 }
 
+int r_jwe_encrypt_payload(jwe_t * jwe) {
+  unsigned char * text_zip = NULL;
+  size_t text_zip_len = 0;
+  int ret;
+
+  if (jwe != NULL && jwe->payload != NULL && jwe->payload_len) {
+    if (0 == o_strcmp("DEF", r_jwe_get_header_str_value(jwe, "zip"))) {
+      if (_r_deflate_payload(jwe->payload, jwe->payload_len, &text_zip, &text_zip_len) == RHN_OK) {
+        ret = _r_jwe_encrypt_text(jwe, text_zip, text_zip_len, NULL, 0, NULL);
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error _r_deflate_payload");
+        ret = RHN_ERROR;
+      }
+      o_free(text_zip);
+    } else {
+      ret = _r_jwe_encrypt_text(jwe, jwe->payload, jwe->payload_len, NULL, 0, NULL);
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error input parameters");
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
 int r_jwe_decrypt_payload(jwe_t * jwe) {
   int ret = RHN_OK, res;
   gnutls_cipher_hd_t handle;
   gnutls_datum_t key, iv;
-  unsigned char * payload_enc = NULL, * unzip = NULL, * aad = NULL;
-  size_t payload_enc_len = 0, unzip_len = 0;
+  unsigned char * payload_enc = NULL, * unzip = NULL, * aad = NULL, * ciphertext = NULL;
+  size_t payload_enc_len = 0, unzip_len = 0, ciphertext_len = 0, ciphertext_b64url_len;
   unsigned char tag[128];
   size_t tag_len = 0;
   int cipher_cbc;
-  struct _o_datum dat = {0, NULL}, dat_ciph = {0, NULL}, dat_tag = {0, NULL};
+  struct _o_datum dat = {0, NULL}, dat_tag = {0, NULL};
 
   if (jwe != NULL && jwe->enc != R_JWA_ENC_UNKNOWN && !o_strnullempty((const char *)jwe->ciphertext_b64url) && !o_strnullempty((const char *)jwe->iv_b64url) && jwe->key != NULL && jwe->key_len && jwe->key_len == _r_get_key_size(jwe->enc)) {
     // Decode iv and payload_b64
@@ -3412,13 +3905,16 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
       if ((jwe->iv = o_malloc(dat.size)) != NULL) {
         jwe->iv_len = dat.size;
         memcpy(jwe->iv, dat.data, dat.size);
-        if (o_base64url_decode_alloc(jwe->ciphertext_b64url, o_strlen((const char *)jwe->ciphertext_b64url), &dat_ciph)) {
-          if ((payload_enc = o_malloc(dat_ciph.size)) == NULL) {
+        // The decoded ciphertext and the plaintext are in the scratch buffers of the thread
+        ciphertext_b64url_len = o_strlen((const char *)jwe->ciphertext_b64url);
+        if ((ciphertext = _r_scratch_get(_R_SCRATCH_CIPHERTEXT, ciphertext_b64url_len)) != NULL &&
+            o_base64url_decode(jwe->ciphertext_b64url, ciphertext_b64url_len, ciphertext, &ciphertext_len)) {
+          if ((payload_enc = _r_scratch_get(_R_SCRATCH_PAYLOAD, ciphertext_len)) == NULL) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error allocating resources for payload_enc");
             ret = RHN_ERROR_MEMORY;
           }
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error o_base64url_decode_alloc ciphertext_b64url");
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error o_base64url_decode ciphertext_b64url");
           ret = RHN_ERROR;
         }
       } else {
@@ -3443,7 +3939,7 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
       }
       iv.data = jwe->iv;
       iv.size = jwe->iv_len;
-      payload_enc_len = dat_ciph.size;
+      payload_enc_len = ciphertext_len;
       if (!(res = gnutls_cipher_init(&handle, _r_get_alg_from_enc(jwe->enc), &key, &iv))) {
         if (jwe->aad_b64url == NULL || jwe->token_mode == R_JSON_MODE_COMPACT) {
           aad = (unsigned char *)o_strdup((const char *)jwe->header_b64url);
@@ -3454,7 +3950,7 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error gnutls_cipher_add_auth: '%s'", gnutls_strerror(res));
           ret = RHN_ERROR;
         }
-        if (!(res = gnutls_cipher_decrypt2(handle, dat_ciph.data, dat_ciph.size, payload_enc, payload_enc_len))) {
+        if (!(res = gnutls_cipher_decrypt2(handle, ciphertext, ciphertext_len, payload_enc, payload_enc_len))) {
           if (cipher_cbc) {
             r_jwe_remove_padding(payload_enc, &payload_enc_len, gnutls_cipher_get_block_size(_r_get_alg_from_enc(jwe->enc)));
           }
@@ -3484,7 +3980,7 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
         }
         if (ret == RHN_OK) {
           if (cipher_cbc) {
-            if (r_jwe_compute_hmac_tag(jwe, dat_ciph.data, dat_ciph.size, aad, tag, &tag_len) != RHN_OK) {
+            if (r_jwe_compute_hmac_tag(jwe, ciphertext, ciphertext_len, aad, o_strlen((const char *)aad), tag, &tag_len) != RHN_OK) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error r_jwe_compute_hmac_tag");
               ret = RHN_ERROR;
             }
@@ -3520,8 +4016,12 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error input parameters");
     ret = RHN_ERROR_PARAM;
   }
-  o_free(payload_enc);
-  o_free(dat_ciph.data);
+  if (payload_enc != NULL) {
+    _r_scratch_release(_R_SCRATCH_PAYLOAD, ciphertext_len);
+  }
+  if (ciphertext != NULL) {
+    _r_scratch_release(_R_SCRATCH_CIPHERTEXT, 0);
+  }
 
   return ret;
 }
@@ -3545,6 +4045,9 @@ int r_jwe_encrypt_key(jwe_t * jwe, jwk_t * jwk_s, int x5u_flags) {
       } else if (r_jwks_size(jwe->jwks_pubkey) == 1) {
         jwk = r_jwks_get_at(jwe->jwks_pubkey, 0);
       }
+      if (jwk == NULL && jwe->jwks_shared_pubkey != NULL) {
+        jwk = _r_jwks_shared_get_key(jwe->jwks_shared_pubkey, r_jwe_get_header_str_value(jwe, "kid"));
+      }
     }
   }
 
@@ -3587,6 +4090,9 @@ int r_jwe_decrypt_key(jwe_t * jwe, jwk_t * jwk_s, int x5u_flags) {
       } else if (r_jwks_size(jwe->jwks_privkey) == 1) {
         jwk = r_jwks_get_at(jwe->jwks_privkey, 0);
       }
+      if (jwk == NULL && jwe->jwks_shared_privkey != NULL) {
+        jwk = _r_jwks_shared_get_key(jwe->jwks_shared_privkey, r_jwe_get_header_str_value(jwe, "kid"));
+      }
     }
   }
 
@@ -3600,6 +4106,164 @@ int r_jwe_decrypt_key(jwe_t * jwe, jwk_t * jwk_s, int x5u_flags) {
   return ret;
 }
 
+int r_jwe_ecdh_pool_start(size_t pool_size) {
+#if NETTLE_VERSION_NUMBER >= 0x030600
+  int ret = RHN_OK;
+  size_t i;
+  rhn_arena_t * arena;
+
+  if (pool_size) {
+    pthread_once(&_r_ecdh_pool_once, _r_ecdh_pool_register_atfork);
+    // The pool lives until r_jwe_ecdh_pool_stop, it's never allocated in the caller arena
+    arena = _r_arena_suspend();
+    pthread_mutex_lock(&_r_ecdh_pool_lock);
+    if (!_r_ecdh_pool_global.running) {
+      _r_ecdh_pool_global.pool_size = pool_size;
+      for (i=0; ret==RHN_OK && i<_R_ECDH_POOL_CURVES; i++) {
+        _r_ecdh_pool_global.count[i] = 0;
+        if ((_r_ecdh_pool_global.keys[i] = _r_secure_malloc(pool_size*sizeof(struct _r_ecdh_pool_key))) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_ecdh_pool_start - Error allocating resources for keys");
+          ret = RHN_ERROR_MEMORY;
+        }
+      }
+      if (ret == RHN_OK) {
+        _r_ecdh_pool_global.running = 1;
+        if (pthread_create(&_r_ecdh_pool_global.thread, NULL, _r_ecdh_pool_refill, NULL)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_ecdh_pool_start - Error pthread_create");
+          _r_ecdh_pool_global.running = 0;
+          ret = RHN_ERROR;
+        }
+      }
+      if (ret != RHN_OK) {
+        _r_ecdh_pool_clear();
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_ecdh_pool_start - Pool already started");
+      ret = RHN_ERROR_PARAM;
+    }
+    pthread_mutex_unlock(&_r_ecdh_pool_lock);
+    _r_arena_resume(arena);
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+#else
+  (void)pool_size;
+  return RHN_ERROR_UNSUPPORTED;
+#endif
+}
+
+void r_jwe_ecdh_pool_stop(void) {
+#if NETTLE_VERSION_NUMBER >= 0x030600
+  int running;
+
+  pthread_mutex_lock(&_r_ecdh_pool_lock);
+  running = _r_ecdh_pool_global.running;
+  _r_ecdh_pool_global.running = 0;
+  pthread_cond_signal(&_r_ecdh_pool_refill_cond);
+  pthread_mutex_unlock(&_r_ecdh_pool_lock);
+  if (running) {
+    pthread_join(_r_ecdh_pool_global.thread, NULL);
+    pthread_mutex_lock(&_r_ecdh_pool_lock);
+    _r_ecdh_pool_clear();
+    pthread_mutex_unlock(&_r_ecdh_pool_lock);
+  }
+#endif
+}
+
+size_t r_jwe_ecdh_pool_available(int type, unsigned int bits) {
+#if NETTLE_VERSION_NUMBER >= 0x030600
+  size_t count = 0;
+  int index = _r_ecdh_pool_index(type, bits);
+
+  if (index >= 0) {
+    pthread_mutex_lock(&_r_ecdh_pool_lock);
+    count = _r_ecdh_pool_global.count[index];
+    pthread_mutex_unlock(&_r_ecdh_pool_lock);
+  }
+  return count;
+#else
+  (void)type;
+  (void)bits;
+  return 0;
+#endif
+}
+
+int r_jwe_pbes2_cache_start(size_t cache_size) {
+#if GNUTLS_VERSION_NUMBER >= 0x03060d
+  int ret = RHN_OK;
+  rhn_arena_t * arena;
+
+  if (cache_size) {
+    pthread_once(&_r_pbes2_cache_once, _r_pbes2_cache_register_atfork);
+    // The cache lives until r_jwe_pbes2_cache_stop, it's never allocated in the caller arena
+    arena = _r_arena_suspend();
+    pthread_mutex_lock(&_r_pbes2_cache_lock);
+    if (!_r_pbes2_cache_global.cache_size) {
+      if ((_r_pbes2_cache_global.entries = _r_secure_malloc(cache_size*sizeof(struct _r_pbes2_kek))) != NULL &&
+          (_r_pbes2_cache_global.id_key = _r_secure_malloc(_R_PBES2_ID_KEY_SIZE)) != NULL) {
+        if (!gnutls_rnd(GNUTLS_RND_KEY, _r_pbes2_cache_global.id_key, _R_PBES2_ID_KEY_SIZE)) {
+          memset(_r_pbes2_cache_global.entries, 0, cache_size*sizeof(struct _r_pbes2_kek));
+          _r_pbes2_cache_global.cache_size = cache_size;
+          _r_pbes2_cache_global.count = 0;
+          _r_pbes2_cache_global.clock = 0;
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_cache_start - Error gnutls_rnd");
+          _r_pbes2_cache_clear();
+          ret = RHN_ERROR;
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_cache_start - Error allocating resources for entries");
+        _r_pbes2_cache_clear();
+        ret = RHN_ERROR_MEMORY;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_cache_start - Cache already started");
+      ret = RHN_ERROR_PARAM;
+    }
+    pthread_mutex_unlock(&_r_pbes2_cache_lock);
+    _r_arena_resume(arena);
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+#else
+  (void)cache_size;
+  return RHN_ERROR_UNSUPPORTED;
+#endif
+}
+
+void r_jwe_pbes2_cache_stop(void) {
+#if GNUTLS_VERSION_NUMBER >= 0x03060d
+  pthread_mutex_lock(&_r_pbes2_cache_lock);
+  _r_pbes2_cache_clear();
+  pthread_mutex_unlock(&_r_pbes2_cache_lock);
+#endif
+}
+
+size_t r_jwe_pbes2_cache_count(void) {
+#if GNUTLS_VERSION_NUMBER >= 0x03060d
+  size_t count;
+
+  pthread_mutex_lock(&_r_pbes2_cache_lock);
+  count = _r_pbes2_cache_global.count;
+  pthread_mutex_unlock(&_r_pbes2_cache_lock);
+  return count;
+#else
+  return 0;
+#endif
+}
+
+void r_jwe_pbes2_set_max_iterations(unsigned int max_iterations) {
+#if GNUTLS_VERSION_NUMBER >= 0x03060d
+  pthread_mutex_lock(&_r_pbes2_cache_lock);
+  _r_pbes2_cache_global.max_iterations = max_iterations;
+  pthread_mutex_unlock(&_r_pbes2_cache_lock);
+#else
+  (void)max_iterations;
+#endif
+}
+
 int r_jwe_parse(jwe_t * jwe, const char * jwe_str, int x5u_flags) {
   return r_jwe_parsen(jwe, jwe_str, o_strlen(jwe_str), x5u_flags);
 }
@@ -3698,9 +4362,11 @@ int r_jwe_advanced_compact_parsen(jwe_t * jwe, const char * jwe_str, size_t jwe_
             ret = RHN_ERROR_PARAM;
             break;
           }
-          json_decref(jwe->j_header);
-
-          jwe->j_header = json_incref(j_header);
+          if (_r_json_object_replace(&jwe->j_header, j_header) != RHN_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compact_parsen - Error setting header");
+            ret = RHN_ERROR;
+            break;
+          }
 
           // Decode iv
           if (r_jwe_set_iv(jwe, dat_iv.data, dat_iv.size) != RHN_OK) {
@@ -3802,8 +4468,7 @@ int r_jwe_advanced_parse_json_t(jwe_t * jwe, json_t * jwe_json, uint32_t parse_f
       jwe->auth_tag_b64url = NULL;
       o_free(jwe->aad_b64url);
       jwe->aad_b64url = NULL;
-      json_decref(jwe->j_header);
-      jwe->j_header = json_object();
+      _r_json_object_reset(&jwe->j_header);
       json_decref(jwe->j_unprotected_header);
       jwe->j_unprotected_header = NULL;
       do {
@@ -3837,9 +4502,11 @@ int r_jwe_advanced_parse_json_t(jwe_t * jwe, json_t * jwe_json, uint32_t parse_f
           ret = RHN_ERROR_PARAM;
           break;
         }
-        json_decref(jwe->j_header);
-
-        jwe->j_header = json_incref(j_header);
+        if (_r_json_object_replace(&jwe->j_header, j_header) != RHN_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_parse_json_t - Error setting header");
+          ret = RHN_ERROR;
+          break;
+        }
 
         // Decode iv
         if (!o_base64url_decode_alloc((unsigned char *)json_string_value(json_object_get(jwe_json, "iv")), json_string_length(json_object_get(jwe_json, "iv")), &dat_iv)) {
@@ -3942,6 +4609,9 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
       } else if (r_jwks_size(jwe->jwks_privkey) == 1) {
         jwk = r_jwks_get_at(jwe->jwks_privkey, 0);
       }
+      if (jwk == NULL && jwe->jwks_shared_privkey != NULL) {
+        jwk = _r_jwks_shared_get_key(jwe->jwks_shared_privkey, r_jwe_get_header_str_value(jwe, "kid"));
+      }
     }
   }
 
@@ -3973,22 +4643,29 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
             }
           } else {
             if (json_object_get(json_object_get(j_recipient, "header"), "kid") != NULL) {
-              cur_jwk = r_jwks_get_by_kid(jwe->jwks_privkey, json_string_value(json_object_get(json_object_get(j_recipient, "header"), "kid")));
-              if ((res = _r_preform_key_decryption(jwe, alg, cur_jwk, x5u_flags)) != RHN_ERROR_INVALID) {
-                ret = res;
+              if ((cur_jwk = r_jwks_get_by_kid(jwe->jwks_privkey, json_string_value(json_object_get(json_object_get(j_recipient, "header"), "kid")))) != NULL) {
+                res = _r_preform_key_decryption(jwe, alg, cur_jwk, x5u_flags);
                 r_jwk_free(cur_jwk);
+              } else {
+                // The shared key is used in place, not copied
+                res = _r_preform_key_decryption(jwe, alg, _r_jwks_shared_key(jwe->jwks_shared_privkey, json_string_value(json_object_get(json_object_get(j_recipient, "header"), "kid"))), x5u_flags);
+              }
+              if (res != RHN_ERROR_INVALID) {
+                ret = res;
                 break;
               }
-              r_jwk_free(cur_jwk);
             } else {
-              for (i=0; i<r_jwks_size(jwe->jwks_privkey); i++) {
-                cur_jwk = r_jwks_get_at(jwe->jwks_privkey, i);
+              // The keys are used in place, not copied
+              for (i=0; i<r_jwks_size(jwe->jwks_privkey)+r_jwks_shared_size(jwe->jwks_shared_privkey); i++) {
+                if (i < r_jwks_size(jwe->jwks_privkey)) {
+                  cur_jwk = _r_jwks_key_at(jwe->jwks_privkey, i);
+                } else {
+                  cur_jwk = _r_jwks_key_at(_r_jwks_shared_jwks(jwe->jwks_shared_privkey), i-r_jwks_size(jwe->jwks_privkey));
+                }
                 if ((res = _r_preform_key_decryption(jwe, alg, cur_jwk, x5u_flags)) != RHN_ERROR_INVALID) {
                   ret = res;
-                  r_jwk_free(cur_jwk);
                   break;
                 }
-                r_jwk_free(cur_jwk);
               }
               if (ret != RHN_ERROR_INVALID) {
                 break;
@@ -4036,8 +4713,11 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
   return ret;
 }
 
-char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
-  char * jwe_str = NULL;
+/**
+ * Sets the cypher key, the iv and the encrypted key of a compact serialization,
+ * the payload isn't encrypted
+ */
+static int _r_jwe_prepare_compact_key(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
   int res = RHN_OK;
   unsigned int bits = 0;
   unsigned char * key = NULL;
@@ -4046,14 +4726,14 @@ char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
   if (jwk_pubkey != NULL && jwe != NULL && jwe->alg == R_JWA_ALG_DIR) {
     if (r_jwk_key_type(jwk_pubkey, &bits, x5u_flags) & R_KEY_TYPE_SYMMETRIC && bits == _r_get_key_size(jwe->enc)*8) {
       key_len = (size_t)(bits/8);
-      if ((key = o_malloc(key_len+4)) != NULL) {
+      if ((key = _r_secure_malloc(key_len+4)) != NULL) {
         if (r_jwk_export_to_symmetric_key(jwk_pubkey, key, &key_len) == RHN_OK) {
           res = r_jwe_set_cypher_key(jwe, key, key_len);
         } else {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize - Error r_jwk_export_to_symmetric_key");
           res = RHN_ERROR_MEMORY;
         }
-        o_free(key);
+        _r_secure_free(key);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize - Error allocating resources for key");
         res = RHN_ERROR_MEMORY;
@@ -4062,8 +4742,8 @@ char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize - Error invalid key type");
       res = RHN_ERROR_PARAM;
     }
-  } else {
-    res = RHN_OK;
+  } else if (jwe == NULL) {
+    res = RHN_ERROR_PARAM;
   }
 
   if (res == RHN_OK) {
@@ -4080,7 +4760,74 @@ char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
       }
     }
   }
-  if (res == RHN_OK && r_jwe_set_alg_header(jwe, jwe->j_header) == RHN_OK && r_jwe_encrypt_key(jwe, jwk_pubkey, x5u_flags) == RHN_OK && r_jwe_encrypt_payload(jwe) == RHN_OK) {
+  if (res == RHN_OK && (r_jwe_set_alg_header(jwe, jwe->j_header) != RHN_OK || r_jwe_encrypt_key(jwe, jwk_pubkey, x5u_flags) != RHN_OK)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize - Error input parameters");
+    res = RHN_ERROR_PARAM;
+  }
+  return res;
+}
+
+/**
+ * Encrypts the key and the payload, and sets the compact serialization values in the jwe
+ */
+static int _r_jwe_prepare_compact(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
+  int res;
+
+  if ((res = _r_jwe_prepare_compact_key(jwe, jwk_pubkey, x5u_flags)) == RHN_OK && r_jwe_encrypt_payload(jwe) != RHN_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize - Error input parameters");
+    res = RHN_ERROR_PARAM;
+  }
+  return res;
+}
+
+/**
+ * Returns a json string with the length of the base64url encoded data of size len
+ * Used to predict the size of the header values set during the key encryption
+ */
+static json_t * _r_jwe_get_b64url_placeholder(size_t len) {
+  char placeholder[128];
+  size_t b64url_len = _r_get_base64url_len(len);
+
+  if (b64url_len > sizeof(placeholder)) {
+    return NULL;
+  } else {
+    memset(placeholder, 'A', b64url_len);
+    return json_stringn(placeholder, b64url_len);
+  }
+}
+
+/**
+ * Returns the ephemeral public key that will be used in the ECDH-ES header,
+ * if the ephemeral key isn't set, the coordinates have the max length
+ */
+static json_t * _r_jwe_get_epk_placeholder(jwe_t * jwe, jwk_t * jwk, int x5u_flags) {
+  json_t * j_epk = NULL;
+  jwk_t * jwk_priv, * jwk_ephemeral_pub = NULL;
+  unsigned int bits = 0;
+  int type;
+
+  if (r_jwks_size(jwe->jwks_privkey) == 1) {
+    jwk_priv = r_jwks_get_at(jwe->jwks_privkey, 0);
+    if (r_jwk_init(&jwk_ephemeral_pub) == RHN_OK && r_jwk_extract_pubkey(jwk_priv, jwk_ephemeral_pub, x5u_flags) == RHN_OK) {
+      j_epk = r_jwk_export_to_json_t(jwk_ephemeral_pub);
+    }
+    r_jwk_free(jwk_ephemeral_pub);
+    r_jwk_free(jwk_priv);
+  } else {
+    type = r_jwk_key_type(jwk, &bits, x5u_flags);
+    if (type & R_KEY_TYPE_EC && (bits == 256 || bits == 384 || bits == 521)) {
+      j_epk = json_pack("{sssssoso}", "kty", "EC", "crv", bits==256?"P-256":(bits==384?"P-384":"P-521"), "x", _r_jwe_get_b64url_placeholder((bits+7)/8), "y", _r_jwe_get_b64url_placeholder((bits+7)/8));
+    } else if (type & R_KEY_TYPE_ECDH && (bits == 256 || bits == 448)) {
+      j_epk = json_pack("{ssssso}", "kty", "OKP", "crv", bits==256?"X25519":"X448", "x", _r_jwe_get_b64url_placeholder(bits/8));
+    }
+  }
+  return j_epk;
+}
+
+char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
+  char * jwe_str = NULL;
+
+  if (_r_jwe_prepare_compact(jwe, jwk_pubkey, x5u_flags) == RHN_OK) {
     jwe_str = msprintf("%s.%s.%s.%s.%s",
                       jwe->header_b64url,
                       jwe->encrypted_key_b64url!=NULL?(const char *)jwe->encrypted_key_b64url:"",
@@ -4088,12 +4835,218 @@ char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
                       jwe->ciphertext_b64url,
                       jwe->auth_tag_b64url);
 
-  } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize - Error input parameters");
   }
   return jwe_str;
 }
 
+size_t r_jwe_serialized_length(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
+  jwk_t * jwk = NULL;
+  jwa_alg alg = R_JWA_ALG_UNKNOWN;
+  json_t * j_header = NULL;
+  char * header_str = NULL;
+  unsigned char * text_zip = NULL;
+  size_t length = 0, key_len, iv_len, encrypted_key_len = 0, data_len, block_size, tag_len;
+  unsigned int bits = 0;
+  int res = RHN_OK;
+
+  if (jwe != NULL && jwe->enc != R_JWA_ENC_UNKNOWN && jwe->payload != NULL && jwe->payload_len) {
+    if (jwk_pubkey != NULL) {
+      jwk = r_jwk_copy(jwk_pubkey);
+    } else if (r_jwe_get_header_str_value(jwe, "kid") != NULL) {
+      jwk = r_jwks_get_by_kid(jwe->jwks_pubkey, r_jwe_get_header_str_value(jwe, "kid"));
+    } else if (r_jwks_size(jwe->jwks_pubkey) == 1) {
+      jwk = r_jwks_get_at(jwe->jwks_pubkey, 0);
+    }
+    if (jwk == NULL && jwe->jwks_shared_pubkey != NULL) {
+      jwk = _r_jwks_shared_get_key(jwe->jwks_shared_pubkey, r_jwe_get_header_str_value(jwe, "kid"));
+    }
+    if ((alg = jwe->alg) == R_JWA_ALG_UNKNOWN) {
+      alg = r_str_to_jwa_alg(r_jwk_get_property_str(jwk, "alg"));
+    }
+    key_len = (jwe->key != NULL && jwe->key_len)?jwe->key_len:_r_get_key_size(jwe->enc);
+    iv_len = (jwe->iv != NULL && jwe->iv_len)?jwe->iv_len:(size_t)gnutls_cipher_get_iv_size(_r_get_alg_from_enc(jwe->enc));
+    j_header = json_deep_copy(jwe->j_header);
+    json_object_set_new(j_header, "alg", json_string(r_jwa_alg_to_str(alg)));
+    json_object_set_new(j_header, "enc", json_string(r_jwa_enc_to_str(jwe->enc)));
+    if (r_jwk_get_property_str(jwk, "kid") != NULL && json_object_get(j_header, "kid") == NULL) {
+      json_object_set_new(j_header, "kid", json_string(r_jwk_get_property_str(jwk, "kid")));
+    }
+
+    switch (alg) {
+      case R_JWA_ALG_RSA1_5:
+      case R_JWA_ALG_RSA_OAEP:
+      case R_JWA_ALG_RSA_OAEP_256:
+        if (r_jwk_key_type(jwk, &bits, x5u_flags) & R_KEY_TYPE_RSA) {
+          encrypted_key_len = _r_get_rsa_modulus_len(jwk, bits);
+        } else {
+          res = RHN_ERROR_PARAM;
+        }
+        break;
+      case R_JWA_ALG_DIR:
+        break;
+      case R_JWA_ALG_A128KW:
+      case R_JWA_ALG_A192KW:
+      case R_JWA_ALG_A256KW:
+        encrypted_key_len = key_len+8;
+        break;
+      case R_JWA_ALG_A128GCMKW:
+      case R_JWA_ALG_A192GCMKW:
+      case R_JWA_ALG_A256GCMKW:
+        encrypted_key_len = key_len;
+        if (json_object_get(j_header, "iv") == NULL) {
+          json_object_set_new(j_header, "iv", _r_jwe_get_b64url_placeholder((size_t)gnutls_cipher_get_iv_size(r_jwe_get_alg_from_alg(alg))));
+        }
+        json_object_set_new(j_header, "tag", _r_jwe_get_b64url_placeholder((size_t)gnutls_cipher_get_tag_size(r_jwe_get_alg_from_alg(alg))));
+        break;
+      case R_JWA_ALG_PBES2_H256:
+      case R_JWA_ALG_PBES2_H384:
+      case R_JWA_ALG_PBES2_H512:
+        encrypted_key_len = key_len+8;
+        if (json_object_get(j_header, "p2s") == NULL) {
+          json_object_set_new(j_header, "p2s", _r_jwe_get_b64url_placeholder(_R_PBES_DEFAULT_SALT_LENGTH));
+        }
+        if (r_jwe_get_header_int_value(jwe, "p2c") <= 0) {
+          json_object_set_new(j_header, "p2c", json_integer(_R_PBES_DEFAULT_ITERATION));
+        }
+        break;
+      case R_JWA_ALG_ECDH_ES:
+      case R_JWA_ALG_ECDH_ES_A128KW:
+      case R_JWA_ALG_ECDH_ES_A192KW:
+      case R_JWA_ALG_ECDH_ES_A256KW:
+        if (alg == R_JWA_ALG_ECDH_ES) {
+          key_len = _r_get_key_size(jwe->enc);
+        } else {
+          encrypted_key_len = key_len+8;
+        }
+        if (json_object_set_new(j_header, "epk", _r_jwe_get_epk_placeholder(jwe, jwk, x5u_flags))) {
+          res = RHN_ERROR_PARAM;
+        }
+        break;
+      default:
+        res = RHN_ERROR_PARAM;
+        break;
+    }
+
+    if (res == RHN_OK && (header_str = json_dumps(j_header, JSON_COMPACT)) != NULL) {
+      data_len = jwe->payload_len;
+      if (0 == o_strcmp("DEF", r_jwe_get_header_str_value(jwe, "zip"))) {
+        if (_r_deflate_payload(jwe->payload, jwe->payload_len, &text_zip, &data_len) != RHN_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialized_length - Error _r_deflate_payload");
+          res = RHN_ERROR;
+        }
+        o_free(text_zip);
+      }
+      if (res == RHN_OK) {
+        if (jwe->enc == R_JWA_ENC_A128CBC || jwe->enc == R_JWA_ENC_A192CBC || jwe->enc == R_JWA_ENC_A256CBC) {
+          block_size = (size_t)gnutls_cipher_get_block_size(_r_get_alg_from_enc(jwe->enc));
+          if (data_len % block_size) {
+            data_len = ((data_len/block_size)+1)*block_size;
+          }
+          tag_len = key_len/2;
+        } else {
+          tag_len = (size_t)gnutls_cipher_get_tag_size(_r_get_alg_from_enc(jwe->enc));
+        }
+        length = _r_get_base64url_len(o_strlen(header_str)) + 1 +
+                 _r_get_base64url_len(encrypted_key_len) + 1 +
+                 _r_get_base64url_len(iv_len) + 1 +
+                 _r_get_base64url_len(data_len) + 1 +
+                 _r_get_base64url_len(tag_len);
+      }
+      o_free(header_str);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialized_length - Error invalid alg or key");
+    }
+    json_decref(j_header);
+    r_jwk_free(jwk);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialized_length - Error input parameters");
+  }
+  return length;
+}
+
+int r_jwe_serialize_to(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags, char * output, size_t * output_len) {
+  unsigned char * text_zip = NULL;
+  const unsigned char * text = NULL;
+  size_t text_len = 0, length, header_len, encrypted_key_len, tag_len, block_size, offset;
+  struct _r_b64url_writer writer;
+  int ret;
+
+  if (jwe != NULL && output != NULL && output_len != NULL && jwe->payload != NULL && jwe->payload_len) {
+    // The length is computed from the header set by the key encryption, the payload isn't encrypted if output is too small
+    if ((ret = _r_jwe_prepare_compact_key(jwe, jwk_pubkey, x5u_flags)) == RHN_OK && (ret = r_jwe_set_enc_header(jwe, jwe->j_header)) == RHN_OK) {
+      if (0 == o_strcmp("DEF", r_jwe_get_header_str_value(jwe, "zip"))) {
+        if (_r_deflate_payload(jwe->payload, jwe->payload_len, &text_zip, &text_len) == RHN_OK) {
+          text = text_zip;
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize_to - Error _r_deflate_payload");
+          ret = RHN_ERROR;
+        }
+      } else {
+        text = jwe->payload;
+        text_len = jwe->payload_len;
+      }
+      if (ret == RHN_OK) {
+        _r_b64url_writer_init(&writer, (unsigned char *)output, *output_len);
+        if (!json_dump_callback(jwe->j_header, _r_b64url_writer_write, &writer, JSON_COMPACT)) {
+          header_len = _r_b64url_writer_end(&writer);
+          encrypted_key_len = o_strlen((const char *)jwe->encrypted_key_b64url);
+          if (jwe->enc == R_JWA_ENC_A128CBC || jwe->enc == R_JWA_ENC_A192CBC || jwe->enc == R_JWA_ENC_A256CBC) {
+            block_size = (size_t)gnutls_cipher_get_block_size(_r_get_alg_from_enc(jwe->enc));
+            length = (text_len%block_size)?((text_len/block_size)+1)*block_size:text_len;
+            tag_len = jwe->key_len/2;
+          } else {
+            length = text_len;
+            tag_len = (size_t)gnutls_cipher_get_tag_size(_r_get_alg_from_enc(jwe->enc));
+          }
+          length = header_len + 1 +
+                   encrypted_key_len + 1 +
+                   _r_get_base64url_len(jwe->iv_len) + 1 +
+                   _r_get_base64url_len(length) + 1 +
+                   _r_get_base64url_len(tag_len);
+          if (length <= *output_len) {
+            offset = header_len;
+            output[offset++] = '.';
+            if (encrypted_key_len) {
+              memcpy(output+offset, jwe->encrypted_key_b64url, encrypted_key_len);
+              offset += encrypted_key_len;
+            }
+            output[offset++] = '.';
+            _r_b64url_writer_init(&writer, (unsigned char *)output+offset, _r_get_base64url_len(jwe->iv_len));
+            _r_b64url_writer_write((const char *)jwe->iv, jwe->iv_len, &writer);
+            offset += _r_b64url_writer_end(&writer);
+            output[offset++] = '.';
+            if ((ret = _r_jwe_encrypt_text(jwe, text, text_len, output, header_len, &offset)) == RHN_OK) {
+              *output_len = offset;
+              // The encoded values of a previous serialization don't match the jwe anymore
+              o_free(jwe->header_b64url);
+              jwe->header_b64url = NULL;
+              o_free(jwe->ciphertext_b64url);
+              jwe->ciphertext_b64url = NULL;
+              o_free(jwe->auth_tag_b64url);
+              jwe->auth_tag_b64url = NULL;
+            } else {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize_to - Error _r_jwe_encrypt_text");
+            }
+          } else {
+            *output_len = length;
+            ret = RHN_ERROR_PARAM;
+          }
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize_to - Error json_dump_callback header");
+          ret = RHN_ERROR;
+        }
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize_to - Error _r_jwe_prepare_compact_key");
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_serialize_to - Error input parameters");
+    ret = RHN_ERROR_PARAM;
+  }
+  o_free(text_zip);
+  return ret;
+}
+
 char * r_jwe_serialize_json_str(jwe_t * jwe, jwks_t * jwks_pubkey, int x5u_flags, int mode) {
   json_t * j_result = r_jwe_serialize_json_t(jwe, jwks_pubkey, x5u_flags, mode);
   char * str_result = json_dumps(j_result, JSON_COMPACT);
@@ -4111,6 +5064,9 @@ json_t * r_jwe_serialize_json_t(jwe_t * jwe, jwks_t * jwks_pubkey, int x5u_flags
 
   if (jwks_pubkey == NULL) {
     jwks_pubkey = jwe->jwks_pubkey;
+    if (!r_jwks_size(jwks_pubkey) && jwe->jwks_shared_pubkey != NULL) {
+      jwks_pubkey = _r_jwks_shared_jwks(jwe->jwks_shared_pubkey);
+    }
   }
   if (jwe != NULL && r_jwks_size(jwks_pubkey)) {
     jwe->token_mode = mode;
@@ -21,10 +21,164 @@
  *
  */
 
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <libgen.h>
+#include <sys/inotify.h>
+#endif
 #include <orcania.h>
 #include <yder.h>
 #include <rhonabwy.h>
 
+#define _R_JWKS_STORE_URI    1
+#define _R_JWKS_STORE_FILE   2
+#define _R_JWKS_STORE_MAPPED 3
+
+#define _R_JWKS_STORE_WATCH_PERIOD 250
+
+#define _R_JWKS_KEY_UNCHECKED 0
+#define _R_JWKS_KEY_VALID     1
+#define _R_JWKS_KEY_INVALID   2
+
+#define _R_JSON_SCAN_ERROR ((size_t)-1)
+#define _R_JSON_SCAN_MAX_DEPTH 2048
+
+/**
+ * Binary JWKS format, all integers are little-endian
+ * header: magic "RHNK", u16 version, u16 reserved, u32 number of keys, u32 crc32 of the rest
+ * entry, one per key: u64 kid hash, u32 record offset, u32 record length
+ * record: u16 number of members, then for each member
+ * u16 name length, u8 value type, u32 value length, name, value
+ */
+#define _R_JWKS_BINARY_MAGIC        "RHNK"
+#define _R_JWKS_BINARY_VERSION      1
+#define _R_JWKS_BINARY_HEADER_SIZE  16
+#define _R_JWKS_BINARY_ENTRY_SIZE   16
+
+#define _R_JWKS_BINARY_STRING       1
+#define _R_JWKS_BINARY_INTEGER      2
+#define _R_JWKS_BINARY_TRUE         3
+#define _R_JWKS_BINARY_FALSE        4
+#define _R_JWKS_BINARY_STRING_ARRAY 5
+#define _R_JWKS_BINARY_JSON         6
+
+/**
+ * A key of a memory-mapped JWKS file, located by its offset
+ * jwk is parsed on the first lookup and set atomically
+ */
+struct _r_jwks_mapped_key {
+  char   * kid;
+  size_t   offset;
+  size_t   len;
+  jwk_t  * jwk;
+};
+
+/**
+ * A memory-mapped JWKS file and its keys sorted by kid,
+ * shared by the source and the snapshots, refcount is
+ * protected by store->lock
+ */
+struct _r_jwks_mapped {
+  unsigned int                refcount;
+  char                      * data;
+  size_t                      size;
+  struct _r_jwks_mapped_key * keys;
+  size_t                      nb_keys;
+};
+
+/**
+ * A source of the store, generation is the refresh
+ * the keys of an url were downloaded by, so a slow download
+ * can't replace the keys of a more recent refresh
+ */
+struct _r_jwks_store_source {
+  int                     type;
+  char                  * location;
+  int                     x5u_flags;
+  jwks_t                * jwks;
+  int                     unchecked;
+  struct _r_jwks_mapped * mapped;
+  struct stat             st;
+  unsigned int            generation;
+};
+
+/**
+ * An url downloaded by a refresh without holding store->lock
+ */
+struct _r_jwks_store_fetch {
+  size_t   index;
+  char   * location;
+  int      x5u_flags;
+  jwks_t * jwks;
+  int      unchecked;
+  int      ret;
+};
+
+/**
+ * Immutable set of keys published by a jwks_store_t
+ * j_kid indexes the keys by kid with the list of their positions in jwks,
+ * mapped_at is the number of keys in jwks from the sources before each mapped file,
+ * so the keys are looked up in the order of the sources and the first valid key wins
+ * state holds the validation state of each key in jwks, the keys imported
+ * with deferred validation are validated on their first lookup
+ */
+struct _r_jwks_snapshot {
+  jwks_t                 * jwks;
+  unsigned char          * state;
+  json_t                 * j_kid;
+  struct _r_jwks_mapped ** mapped;
+  size_t                 * mapped_at;
+  size_t                   nb_mapped;
+};
+
+/**
+ * The snapshot pointer is swapped atomically, readers register
+ * in the counter of the current epoch, and the writer waits
+ * on publish_cond for the counter of the previous epoch to drop to 0
+ * before freeing the previous snapshot
+ * lock protects the sources and the refresher thread, it's released
+ * while the urls are downloaded
+ */
+struct _jwks_store {
+  pthread_mutex_t               lock;
+  pthread_cond_t                cond;
+  pthread_t                     thread;
+  int                           running;
+  int                           joinable;
+  unsigned int                  generation;
+  unsigned int                  interval;
+  int                           validation;
+  unsigned int                  nb_threads;
+  struct _r_jwks_store_source * sources;
+  size_t                        nb_sources;
+  struct _r_jwks_snapshot     * snapshot;
+  unsigned int                  epoch;
+  unsigned int                  readers[2];
+  pthread_mutex_t               publish_lock;
+  pthread_cond_t                publish_cond;
+  unsigned int                  publishing;
+  int                           inotify_fd;
+};
+
+/**
+ * Immutable set of keys shared by reference between tokens
+ * j_kid indexes the keys by kid, the first key wins
+ */
+struct _jwks_shared {
+  unsigned int   refcount;
+  jwks_t       * jwks;
+  json_t       * j_kid;
+};
+
 char * _r_get_http_content(const char * url, int x5u_flags, const char * expected_content_type);
 
 int r_jwks_init(jwks_t ** jwks) {
@@ -307,6 +461,111 @@ int r_jwks_import_from_json_t(jwks_t * jwks, json_t * j_input) {
   return ret;
 }
 
+/**
+ * Keys validated by the threads of r_jwks_import_from_json_t_parallel
+ * Each thread takes the next key index atomically and stores its result
+ * at the same index, so the keys can be appended in their original order
+ */
+struct _r_jwks_import_job {
+  json_t    * j_keys;
+  size_t      nb_keys;
+  size_t      next;
+  jwk_t    ** jwk;
+  int       * res;
+};
+
+static void * _r_jwks_import_worker(void * args) {
+  struct _r_jwks_import_job * job = (struct _r_jwks_import_job *)args;
+  size_t index;
+  jwk_t * jwk;
+
+  while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_SEQ_CST)) < job->nb_keys) {
+    if (r_jwk_init(&jwk) == RHN_OK) {
+      if ((job->res[index] = r_jwk_import_from_json_t(jwk, json_array_get(job->j_keys, index))) == RHN_OK) {
+        job->jwk[index] = jwk;
+      } else {
+        r_jwk_free(jwk);
+      }
+    } else {
+      job->res[index] = RHN_ERROR_MEMORY;
+    }
+  }
+  return NULL;
+}
+
+int r_jwks_import_from_json_t_parallel(jwks_t * jwks, json_t * j_input, unsigned int nb_threads) {
+  int ret = RHN_OK;
+  struct _r_jwks_import_job job;
+  pthread_t * threads = NULL;
+  unsigned int started = 0, i;
+  size_t index;
+  long nb_cpus;
+  char * tmp;
+
+  if (jwks != NULL && j_input != NULL && json_is_array(json_object_get(j_input, "keys"))) {
+    if (!nb_threads) {
+      nb_threads = (nb_cpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? (unsigned int)nb_cpus : 1;
+    }
+    job.j_keys = json_object_get(j_input, "keys");
+    job.nb_keys = json_array_size(job.j_keys);
+    job.next = 0;
+    if (nb_threads > job.nb_keys) {
+      nb_threads = (unsigned int)job.nb_keys;
+    }
+    if (nb_threads <= 1) {
+      return r_jwks_import_from_json_t(jwks, j_input);
+    }
+    job.jwk = o_malloc(job.nb_keys*sizeof(jwk_t *));
+    job.res = o_malloc(job.nb_keys*sizeof(int));
+    threads = o_malloc((nb_threads-1)*sizeof(pthread_t));
+    if (job.jwk != NULL && job.res != NULL && threads != NULL) {
+      memset(job.jwk, 0, job.nb_keys*sizeof(jwk_t *));
+      // The calling thread validates keys too, so the import completes even if no thread can be started
+      for (i=0; i<nb_threads-1; i++) {
+        if (pthread_create(&threads[started], NULL, _r_jwks_import_worker, &job)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_import_from_json_t_parallel - Error pthread_create");
+          break;
+        }
+        started++;
+      }
+      _r_jwks_import_worker(&job);
+      for (i=0; i<started; i++) {
+        pthread_join(threads[i], NULL);
+      }
+      for (index=0; index<job.nb_keys; index++) {
+        if (job.res[index] == RHN_OK) {
+          r_jwks_append_jwk(jwks, job.jwk[index]);
+          r_jwk_free(job.jwk[index]);
+        } else if (job.res[index] == RHN_ERROR_PARAM) {
+          y_log_message(Y_LOG_LEVEL_DEBUG, "jwks import json_t parallel - Invalid jwk format");
+          tmp = json_dumps(json_array_get(job.j_keys, index), JSON_INDENT(2));
+          y_log_message(Y_LOG_LEVEL_DEBUG, "%s", tmp);
+          o_free(tmp);
+          ret = RHN_ERROR_PARAM;
+        } else if (job.res[index] == RHN_ERROR_MEMORY) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "jwks import json_t parallel - Error memory");
+          ret = RHN_ERROR_MEMORY;
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "jwks import json_t parallel - Error r_jwk_import_from_json_t");
+          if (ret == RHN_OK) {
+            ret = RHN_ERROR;
+          }
+        }
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_import_from_json_t_parallel - Error allocating resources");
+      ret = RHN_ERROR_MEMORY;
+    }
+    o_free(job.jwk);
+    o_free(job.res);
+    o_free(threads);
+  } else {
+    y_log_message(Y_LOG_LEVEL_DEBUG, "jwks import json_t parallel - Invalid jwks format");
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
 int r_jwks_import_from_uri(jwks_t * jwks, const char * uri, int x5u_flags) {
   int ret;
   json_t * j_result = NULL;
@@ -497,3 +756,1731 @@ jwks_t * r_jwks_search_json_str(jwks_t * jwks, const char * str_match) {
   json_decref(j_match);
   return jwks_ret;
 }
+
+struct _r_binary_buffer {
+  unsigned char * data;
+  size_t          len;
+  size_t          alloc;
+  int             error;
+};
+
+static void _r_binary_append(struct _r_binary_buffer * buffer, const void * data, size_t len) {
+  unsigned char * new_data;
+  size_t alloc;
+
+  if (!buffer->error && len) {
+    if (buffer->len + len > buffer->alloc) {
+      alloc = buffer->alloc?buffer->alloc:1024;
+      while (alloc < buffer->len + len) {
+        alloc *= 2;
+      }
+      if ((new_data = o_realloc(buffer->data, alloc)) != NULL) {
+        buffer->data = new_data;
+        buffer->alloc = alloc;
+      } else {
+        buffer->error = 1;
+        return;
+      }
+    }
+    memcpy(buffer->data+buffer->len, data, len);
+    buffer->len += len;
+  }
+}
+
+static void _r_binary_put_u16(unsigned char * out, uint16_t value) {
+  out[0] = (unsigned char)(value & 0xff);
+  out[1] = (unsigned char)(value >> 8);
+}
+
+static void _r_binary_put_u32(unsigned char * out, uint32_t value) {
+  _r_binary_put_u16(out, (uint16_t)(value & 0xffff));
+  _r_binary_put_u16(out+2, (uint16_t)(value >> 16));
+}
+
+static void _r_binary_put_u64(unsigned char * out, uint64_t value) {
+  _r_binary_put_u32(out, (uint32_t)(value & 0xffffffff));
+  _r_binary_put_u32(out+4, (uint32_t)(value >> 32));
+}
+
+static uint16_t _r_binary_get_u16(const unsigned char * in) {
+  return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+static uint32_t _r_binary_get_u32(const unsigned char * in) {
+  return (uint32_t)_r_binary_get_u16(in) | ((uint32_t)_r_binary_get_u16(in+2) << 16);
+}
+
+static uint64_t _r_binary_get_u64(const unsigned char * in) {
+  return (uint64_t)_r_binary_get_u32(in) | ((uint64_t)_r_binary_get_u32(in+4) << 32);
+}
+
+/**
+ * FNV-1a 64 bits hash of the kid, 0 if the key has no kid
+ */
+static uint64_t _r_jwks_binary_kid_hash(const char * kid) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  if (kid == NULL) {
+    return 0;
+  }
+  while (*kid) {
+    hash ^= (unsigned char)*kid++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash?hash:1;
+}
+
+static void _r_jwks_binary_append_member(struct _r_binary_buffer * buffer, const char * name, json_t * j_value) {
+  unsigned char header[7], len[4];
+  struct _r_binary_buffer value = {NULL, 0, 0, 0};
+  json_t * j_element = NULL;
+  size_t index = 0;
+  char * str;
+  int type;
+
+  if (json_is_string(j_value)) {
+    type = _R_JWKS_BINARY_STRING;
+    _r_binary_append(&value, json_string_value(j_value), json_string_length(j_value));
+  } else if (json_is_integer(j_value)) {
+    type = _R_JWKS_BINARY_INTEGER;
+    value.data = o_malloc(8);
+    if (value.data != NULL) {
+      _r_binary_put_u64(value.data, (uint64_t)json_integer_value(j_value));
+      value.len = 8;
+    } else {
+      value.error = 1;
+    }
+  } else if (json_is_true(j_value)) {
+    type = _R_JWKS_BINARY_TRUE;
+  } else if (json_is_false(j_value)) {
+    type = _R_JWKS_BINARY_FALSE;
+  } else {
+    type = _R_JWKS_BINARY_STRING_ARRAY;
+    json_array_foreach(j_value, index, j_element) {
+      if (!json_is_string(j_element)) {
+        type = _R_JWKS_BINARY_JSON;
+      }
+    }
+    if (type == _R_JWKS_BINARY_STRING_ARRAY && json_is_array(j_value)) {
+      _r_binary_put_u32(len, (uint32_t)json_array_size(j_value));
+      _r_binary_append(&value, len, 4);
+      json_array_foreach(j_value, index, j_element) {
+        _r_binary_put_u32(len, (uint32_t)json_string_length(j_element));
+        _r_binary_append(&value, len, 4);
+        _r_binary_append(&value, json_string_value(j_element), json_string_length(j_element));
+      }
+    } else {
+      type = _R_JWKS_BINARY_JSON;
+      if ((str = json_dumps(j_value, JSON_COMPACT|JSON_ENCODE_ANY)) != NULL) {
+        _r_binary_append(&value, str, o_strlen(str));
+        o_free(str);
+      } else {
+        value.error = 1;
+      }
+    }
+  }
+  _r_binary_put_u16(header, (uint16_t)o_strlen(name));
+  header[2] = (unsigned char)type;
+  _r_binary_put_u32(header+3, (uint32_t)value.len);
+  _r_binary_append(buffer, header, 7);
+  _r_binary_append(buffer, name, o_strlen(name));
+  _r_binary_append(buffer, value.data, value.len);
+  if (value.error) {
+    buffer->error = 1;
+  }
+  o_free(value.data);
+}
+
+/**
+ * Builds the jwk from its binary record, without parsing nor validating it
+ */
+static jwk_t * _r_jwks_binary_read_key(const unsigned char * data, size_t len) {
+  json_t * j_jwk = json_object(), * j_value, * j_array;
+  size_t offset = 2, name_len, value_len, i, count, item_len;
+  uint16_t nb_members, member;
+  char * name;
+
+  if (j_jwk == NULL || len < 2) {
+    json_decref(j_jwk);
+    return NULL;
+  }
+  nb_members = _r_binary_get_u16(data);
+  for (member=0; member<nb_members; member++) {
+    if (offset + 7 > len) {
+      break;
+    }
+    name_len = _r_binary_get_u16(data+offset);
+    value_len = _r_binary_get_u32(data+offset+3);
+    if (offset + 7 + name_len + value_len > len || (name = o_strndup((const char *)data+offset+7, name_len)) == NULL) {
+      break;
+    }
+    j_value = NULL;
+    switch (data[offset+2]) {
+      case _R_JWKS_BINARY_STRING:
+        j_value = json_stringn((const char *)data+offset+7+name_len, value_len);
+        break;
+      case _R_JWKS_BINARY_INTEGER:
+        if (value_len == 8) {
+          j_value = json_integer((json_int_t)_r_binary_get_u64(data+offset+7+name_len));
+        }
+        break;
+      case _R_JWKS_BINARY_TRUE:
+        j_value = json_true();
+        break;
+      case _R_JWKS_BINARY_FALSE:
+        j_value = json_false();
+        break;
+      case _R_JWKS_BINARY_STRING_ARRAY:
+        if (value_len >= 4 && (j_array = json_array()) != NULL) {
+          count = _r_binary_get_u32(data+offset+7+name_len);
+          for (i=4; count && i+4 <= value_len; count--) {
+            item_len = _r_binary_get_u32(data+offset+7+name_len+i);
+            if (i + 4 + item_len > value_len) {
+              break;
+            }
+            json_array_append_new(j_array, json_stringn((const char *)data+offset+7+name_len+i+4, item_len));
+            i += 4 + item_len;
+          }
+          if (!count) {
+            j_value = j_array;
+          } else {
+            json_decref(j_array);
+          }
+        }
+        break;
+      case _R_JWKS_BINARY_JSON:
+        j_value = json_loadb((const char *)data+offset+7+name_len, value_len, JSON_DECODE_ANY, NULL);
+        break;
+      default:
+        break;
+    }
+    if (j_value == NULL || json_object_set_new(j_jwk, name, j_value)) {
+      o_free(name);
+      break;
+    }
+    o_free(name);
+    offset += 7 + name_len + value_len;
+  }
+  if (member < nb_members) {
+    json_decref(j_jwk);
+    j_jwk = NULL;
+  }
+  return j_jwk;
+}
+
+/**
+ * Checks the binary header, returns the number of keys
+ */
+static int _r_jwks_binary_check_header(const unsigned char * input, size_t input_len, size_t * nb_keys) {
+  if (input == NULL || input_len < _R_JWKS_BINARY_HEADER_SIZE || memcmp(input, _R_JWKS_BINARY_MAGIC, 4)) {
+    y_log_message(Y_LOG_LEVEL_DEBUG, "jwks import binary - Invalid format");
+    return RHN_ERROR_PARAM;
+  }
+  if (_r_binary_get_u16(input+4) != _R_JWKS_BINARY_VERSION) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "jwks import binary - Unsupported version %u", _r_binary_get_u16(input+4));
+    return RHN_ERROR_UNSUPPORTED;
+  }
+  *nb_keys = _r_binary_get_u32(input+8);
+  if (*nb_keys > (input_len - _R_JWKS_BINARY_HEADER_SIZE)/_R_JWKS_BINARY_ENTRY_SIZE) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "jwks import binary - Invalid number of keys");
+    return RHN_ERROR_PARAM;
+  }
+  return RHN_OK;
+}
+
+/**
+ * Checks the bounds of the record of the entry at index
+ */
+static int _r_jwks_binary_check_entry(const unsigned char * input, size_t input_len, size_t index) {
+  size_t offset = _r_binary_get_u32(input+_R_JWKS_BINARY_HEADER_SIZE+index*_R_JWKS_BINARY_ENTRY_SIZE+8),
+         len = _r_binary_get_u32(input+_R_JWKS_BINARY_HEADER_SIZE+index*_R_JWKS_BINARY_ENTRY_SIZE+12);
+
+  if (offset > input_len || len > input_len - offset) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "jwks import binary - Invalid key offset");
+    return RHN_ERROR_PARAM;
+  }
+  return RHN_OK;
+}
+
+/**
+ * Checks the binary header, the checksum and the entries bounds, returns the number of keys
+ */
+static int _r_jwks_binary_check(const unsigned char * input, size_t input_len, size_t * nb_keys) {
+  size_t i;
+  int ret;
+
+  if ((ret = _r_jwks_binary_check_header(input, input_len, nb_keys)) != RHN_OK) {
+    return ret;
+  }
+  if ((uint32_t)crc32(0L, input+_R_JWKS_BINARY_HEADER_SIZE, (uInt)(input_len-_R_JWKS_BINARY_HEADER_SIZE)) != _r_binary_get_u32(input+12)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "jwks import binary - Invalid checksum");
+    return RHN_ERROR_PARAM;
+  }
+  for (i=0; i<*nb_keys; i++) {
+    if (_r_jwks_binary_check_entry(input, input_len, i) != RHN_OK) {
+      return RHN_ERROR_PARAM;
+    }
+  }
+  return RHN_OK;
+}
+
+unsigned char * r_jwks_export_to_binary(jwks_t * jwks, size_t * output_len) {
+  struct _r_binary_buffer records = {NULL, 0, 0, 0}, out = {NULL, 0, 0, 0};
+  unsigned char header[_R_JWKS_BINARY_HEADER_SIZE], entry[_R_JWKS_BINARY_ENTRY_SIZE], nb_members[2];
+  json_t * j_jwk, * j_value;
+  const char * name;
+  size_t index = 0, table_len, start;
+
+  if (jwks == NULL || output_len == NULL || r_jwks_size(jwks) > UINT32_MAX) {
+    return NULL;
+  }
+  table_len = _R_JWKS_BINARY_HEADER_SIZE + r_jwks_size(jwks)*_R_JWKS_BINARY_ENTRY_SIZE;
+  memcpy(header, _R_JWKS_BINARY_MAGIC, 4);
+  _r_binary_put_u16(header+4, _R_JWKS_BINARY_VERSION);
+  _r_binary_put_u16(header+6, 0);
+  _r_binary_put_u32(header+8, (uint32_t)r_jwks_size(jwks));
+  _r_binary_append(&out, header, _R_JWKS_BINARY_HEADER_SIZE);
+  json_array_foreach(json_object_get(jwks, "keys"), index, j_jwk) {
+    if (r_jwk_is_valid(j_jwk) != RHN_OK || r_jwk_key_type(j_jwk, NULL, R_FLAG_IGNORE_REMOTE) == R_KEY_TYPE_NONE) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_export_to_binary - Invalid key at index %zu", index);
+      out.error = 1;
+      break;
+    }
+    start = records.len;
+    _r_binary_put_u16(nb_members, (uint16_t)json_object_size(j_jwk));
+    _r_binary_append(&records, nb_members, 2);
+    json_object_foreach(j_jwk, name, j_value) {
+      _r_jwks_binary_append_member(&records, name, j_value);
+    }
+    _r_binary_put_u64(entry, _r_jwks_binary_kid_hash(r_jwk_get_property_str(j_jwk, "kid")));
+    _r_binary_put_u32(entry+8, (uint32_t)(table_len+start));
+    _r_binary_put_u32(entry+12, (uint32_t)(records.len-start));
+    _r_binary_append(&out, entry, _R_JWKS_BINARY_ENTRY_SIZE);
+  }
+  _r_binary_append(&out, records.data, records.len);
+  if (!out.error && !records.error && out.len <= UINT32_MAX) {
+    _r_binary_put_u32(out.data+12, (uint32_t)crc32(0L, out.data+_R_JWKS_BINARY_HEADER_SIZE, (uInt)(out.len-_R_JWKS_BINARY_HEADER_SIZE)));
+    *output_len = out.len;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_export_to_binary - Error exporting keys");
+    o_free(out.data);
+    out.data = NULL;
+  }
+  o_free(records.data);
+  return out.data;
+}
+
+int r_jwks_import_from_binary(jwks_t * jwks, const unsigned char * input, size_t input_len) {
+  int ret;
+  size_t nb_keys = 0, i;
+  const unsigned char * entry;
+  json_t * j_keys;
+  jwk_t * jwk;
+
+  if (jwks != NULL) {
+    if ((ret = _r_jwks_binary_check(input, input_len, &nb_keys)) == RHN_OK) {
+      // The keys are appended to jwks only if all the records are valid
+      if ((j_keys = json_array()) != NULL) {
+        for (i=0; i<nb_keys && ret == RHN_OK; i++) {
+          entry = input+_R_JWKS_BINARY_HEADER_SIZE+i*_R_JWKS_BINARY_ENTRY_SIZE;
+          if ((jwk = _r_jwks_binary_read_key(input+_r_binary_get_u32(entry+8), _r_binary_get_u32(entry+12))) == NULL || json_array_append_new(j_keys, jwk)) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_import_from_binary - Invalid key at index %zu", i);
+            ret = RHN_ERROR_PARAM;
+          }
+        }
+        if (ret == RHN_OK && json_array_extend(json_object_get(jwks, "keys"), j_keys)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_import_from_binary - Error appending keys");
+          ret = RHN_ERROR_MEMORY;
+        }
+        json_decref(j_keys);
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_import_from_binary - Error allocating resources for j_keys");
+        ret = RHN_ERROR_MEMORY;
+      }
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwks_binary_verify(const unsigned char * input, size_t input_len) {
+  size_t nb_keys = 0;
+
+  return _r_jwks_binary_check(input, input_len, &nb_keys);
+}
+
+jwk_t * r_jwks_binary_get_by_kid(const unsigned char * input, size_t input_len, const char * kid) {
+  size_t nb_keys = 0, i;
+  uint64_t hash = _r_jwks_binary_kid_hash(kid);
+  const unsigned char * entry;
+  jwk_t * jwk = NULL;
+
+  // The checksum is verified once by r_jwks_binary_verify, a lookup only reads the entry table and the matching records
+  if (!o_strnullempty(kid) && _r_jwks_binary_check_header(input, input_len, &nb_keys) == RHN_OK) {
+    for (i=0; i<nb_keys; i++) {
+      entry = input+_R_JWKS_BINARY_HEADER_SIZE+i*_R_JWKS_BINARY_ENTRY_SIZE;
+      if (_r_binary_get_u64(entry) == hash && _r_jwks_binary_check_entry(input, input_len, i) == RHN_OK) {
+        if ((jwk = _r_jwks_binary_read_key(input+_r_binary_get_u32(entry+8), _r_binary_get_u32(entry+12))) != NULL && 0 == o_strcmp(kid, r_jwk_get_property_str(jwk, "kid"))) {
+          break;
+        }
+        r_jwk_free(jwk);
+        jwk = NULL;
+      }
+    }
+  }
+  return jwk;
+}
+
+static void _r_jwks_mapped_decref(struct _r_jwks_mapped * mapped) {
+  size_t i;
+
+  if (mapped != NULL && !(--mapped->refcount)) {
+    for (i=0; i<mapped->nb_keys; i++) {
+      o_free(mapped->keys[i].kid);
+      r_jwk_free(mapped->keys[i].jwk);
+    }
+    o_free(mapped->keys);
+    munmap(mapped->data, mapped->size);
+    o_free(mapped);
+  }
+}
+
+static void _r_jwks_snapshot_free(struct _r_jwks_snapshot * snapshot) {
+  size_t i;
+
+  if (snapshot != NULL) {
+    r_jwks_free(snapshot->jwks);
+    o_free(snapshot->state);
+    json_decref(snapshot->j_kid);
+    for (i=0; i<snapshot->nb_mapped; i++) {
+      _r_jwks_mapped_decref(snapshot->mapped[i]);
+    }
+    o_free(snapshot->mapped);
+    o_free(snapshot->mapped_at);
+    o_free(snapshot);
+  }
+}
+
+/**
+ * Enters the read side of the store, returns the current snapshot
+ * The epoch is checked again after registering, so the writer
+ * can't miss a reader that registered in a stale epoch
+ */
+static void _r_jwks_store_read_unlock(jwks_store_t * store, unsigned int slot) {
+  // The last reader of the slot wakes up the writer waiting for it
+  if (!__atomic_sub_fetch(&store->readers[slot], 1, __ATOMIC_SEQ_CST) && __atomic_load_n(&store->publishing, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&store->publish_lock);
+    pthread_cond_broadcast(&store->publish_cond);
+    pthread_mutex_unlock(&store->publish_lock);
+  }
+}
+
+static struct _r_jwks_snapshot * _r_jwks_store_read_lock(jwks_store_t * store, unsigned int * slot) {
+  unsigned int epoch;
+
+  do {
+    epoch = __atomic_load_n(&store->epoch, __ATOMIC_SEQ_CST);
+    *slot = epoch & 1;
+    __atomic_add_fetch(&store->readers[*slot], 1, __ATOMIC_SEQ_CST);
+    if (epoch == __atomic_load_n(&store->epoch, __ATOMIC_SEQ_CST)) {
+      break;
+    }
+    _r_jwks_store_read_unlock(store, *slot);
+  } while (1);
+  return __atomic_load_n(&store->snapshot, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Publishes a new snapshot and frees the previous one
+ * when no reader can access it anymore, store->lock must be held
+ * publishing is set before the readers are checked, so the last reader
+ * either is seen by the writer or sees publishing and signals publish_cond
+ */
+static void _r_jwks_store_publish(jwks_store_t * store, struct _r_jwks_snapshot * snapshot) {
+  struct _r_jwks_snapshot * old;
+  unsigned int slot;
+
+  old = __atomic_exchange_n(&store->snapshot, snapshot, __ATOMIC_SEQ_CST);
+  slot = __atomic_fetch_add(&store->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+  pthread_mutex_lock(&store->publish_lock);
+  __atomic_store_n(&store->publishing, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&store->readers[slot], __ATOMIC_SEQ_CST)) {
+    pthread_cond_wait(&store->publish_cond, &store->publish_lock);
+  }
+  __atomic_store_n(&store->publishing, 0, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&store->publish_lock);
+  _r_jwks_snapshot_free(old);
+}
+
+static char * _r_jwks_store_read_file(const char * path, size_t * content_len) {
+  FILE * f;
+  char * content = NULL;
+  long len;
+
+  if ((f = fopen(path, "rb")) != NULL) {
+    if (!fseek(f, 0, SEEK_END) && (len = ftell(f)) > 0 && !fseek(f, 0, SEEK_SET)) {
+      if ((content = o_malloc((size_t)len+1)) != NULL) {
+        if (fread(content, 1, (size_t)len, f) == (size_t)len) {
+          content[len] = '\0';
+          *content_len = (size_t)len;
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_store_read_file - Error reading %s", path);
+          o_free(content);
+          content = NULL;
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_store_read_file - Error allocating resources for content");
+      }
+    }
+    fclose(f);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_store_read_file - Error opening %s", path);
+  }
+  return content;
+}
+
+/**
+ * The mapped files are scanned with the grammar of json_loads,
+ * so a file is rejected by the scanner when json_loads would reject it
+ */
+static size_t _r_json_scan_ws(const char * data, size_t size, size_t i) {
+  while (i < size && (data[i] == ' ' || data[i] == '\t' || data[i] == '\n' || data[i] == '\r')) {
+    i++;
+  }
+  return i;
+}
+
+/**
+ * Returns the length of the UTF-8 sequence at i, 0 if it's overlong,
+ * a surrogate, beyond U+10FFFF or truncated
+ */
+static size_t _r_json_scan_utf8(const unsigned char * data, size_t size, size_t i) {
+  size_t len, n;
+  unsigned int value;
+
+  if (data[i] < 0x80) {
+    return 1;
+  } else if (data[i] < 0xC2) {
+    return 0;
+  } else if (data[i] < 0xE0) {
+    len = 2;
+    value = data[i] & 0x1F;
+  } else if (data[i] < 0xF0) {
+    len = 3;
+    value = data[i] & 0x0F;
+  } else if (data[i] < 0xF5) {
+    len = 4;
+    value = data[i] & 0x07;
+  } else {
+    return 0;
+  }
+  if (len > size-i) {
+    return 0;
+  }
+  for (n=1; n<len; n++) {
+    if ((data[i+n] & 0xC0) != 0x80) {
+      return 0;
+    }
+    value = (value << 6) | (data[i+n] & 0x3F);
+  }
+  if ((len == 3 && value < 0x800) || (len == 4 && value < 0x10000) || (value >= 0xD800 && value <= 0xDFFF) || value > 0x10FFFF) {
+    return 0;
+  }
+  return len;
+}
+
+/**
+ * Reads the 4 hex digits of a \u escape at i
+ */
+static int _r_json_scan_hex4(const char * data, size_t size, size_t i, unsigned int * value) {
+  size_t n;
+
+  if (i > size || 4 > size-i) {
+    return 0;
+  }
+  for (*value=0, n=0; n<4; n++) {
+    if (data[i+n] >= '0' && data[i+n] <= '9') {
+      *value = (*value << 4) | (unsigned int)(data[i+n]-'0');
+    } else if ((data[i+n]|0x20) >= 'a' && (data[i+n]|0x20) <= 'f') {
+      *value = (*value << 4) | (unsigned int)((data[i+n]|0x20)-'a'+10);
+    } else {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static size_t _r_json_scan_string(const char * data, size_t size, size_t i) {
+  unsigned int value, low;
+  size_t len;
+
+  if (i >= size || data[i] != '"') {
+    return _R_JSON_SCAN_ERROR;
+  }
+  for (i++; i < size; ) {
+    if (data[i] == '"') {
+      return i+1;
+    } else if ((unsigned char)data[i] < 0x20) {
+      return _R_JSON_SCAN_ERROR;
+    } else if (data[i] == '\\') {
+      if (i+1 >= size) {
+        return _R_JSON_SCAN_ERROR;
+      } else if (data[i+1] == 'u') {
+        // \u0000 and unpaired surrogates are rejected
+        if (!_r_json_scan_hex4(data, size, i+2, &value) || !value || (value >= 0xDC00 && value <= 0xDFFF)) {
+          return _R_JSON_SCAN_ERROR;
+        }
+        i += 6;
+        if (value >= 0xD800 && value <= 0xDBFF) {
+          if (i+1 >= size || data[i] != '\\' || data[i+1] != 'u' || !_r_json_scan_hex4(data, size, i+2, &low) || low < 0xDC00 || low > 0xDFFF) {
+            return _R_JSON_SCAN_ERROR;
+          }
+          i += 6;
+        }
+      } else if (memchr("\"\\/bfnrt", data[i+1], 8) != NULL) {
+        i += 2;
+      } else {
+        return _R_JSON_SCAN_ERROR;
+      }
+    } else if ((len = _r_json_scan_utf8((const unsigned char *)data, size, i))) {
+      i += len;
+    } else {
+      return _R_JSON_SCAN_ERROR;
+    }
+  }
+  return _R_JSON_SCAN_ERROR;
+}
+
+/**
+ * Numbers are rare in a JWKS, they're checked by json_loadb
+ * so their grammar and range are exactly the ones of json_loads
+ */
+static size_t _r_json_scan_number(const char * data, size_t size, size_t i) {
+  size_t start = i;
+  json_t * j_number;
+
+  while (i < size && ((data[i] >= '0' && data[i] <= '9') || data[i] == '-' || data[i] == '+' || data[i] == '.' || data[i] == 'e' || data[i] == 'E')) {
+    i++;
+  }
+  if ((j_number = json_loadb(data+start, i-start, JSON_DECODE_ANY, NULL)) != NULL) {
+    json_decref(j_number);
+    return i;
+  } else {
+    return _R_JSON_SCAN_ERROR;
+  }
+}
+
+/**
+ * Returns the offset after the JSON value starting at i, without parsing it
+ * depth is the number of objects and arrays containing the value
+ */
+static size_t _r_json_scan_value(const char * data, size_t size, size_t i, unsigned int depth) {
+  char close;
+
+  if (i >= size || depth >= _R_JSON_SCAN_MAX_DEPTH) {
+    return _R_JSON_SCAN_ERROR;
+  } else if (data[i] == '"') {
+    return _r_json_scan_string(data, size, i);
+  } else if (data[i] == '{' || data[i] == '[') {
+    close = data[i]=='{'?'}':']';
+    if ((i = _r_json_scan_ws(data, size, i+1)) < size && data[i] == close) {
+      return i+1;
+    }
+    while (1) {
+      if (close == '}') {
+        if ((i = _r_json_scan_string(data, size, i)) == _R_JSON_SCAN_ERROR || (i = _r_json_scan_ws(data, size, i)) >= size || data[i] != ':') {
+          return _R_JSON_SCAN_ERROR;
+        }
+        i = _r_json_scan_ws(data, size, i+1);
+      }
+      if ((i = _r_json_scan_value(data, size, i, depth+1)) == _R_JSON_SCAN_ERROR) {
+        return _R_JSON_SCAN_ERROR;
+      }
+      if ((i = _r_json_scan_ws(data, size, i)) < size && data[i] == close) {
+        return i+1;
+      } else if (i >= size || data[i] != ',') {
+        return _R_JSON_SCAN_ERROR;
+      }
+      i = _r_json_scan_ws(data, size, i+1);
+    }
+  } else if (data[i] == '-' || (data[i] >= '0' && data[i] <= '9')) {
+    return _r_json_scan_number(data, size, i);
+  } else if (size-i >= 4 && !memcmp(data+i, "true", 4)) {
+    return i+4;
+  } else if (size-i >= 5 && !memcmp(data+i, "false", 5)) {
+    return i+5;
+  } else if (size-i >= 4 && !memcmp(data+i, "null", 4)) {
+    return i+4;
+  } else {
+    return _R_JSON_SCAN_ERROR;
+  }
+}
+
+static char * _r_json_scan_unescape(const char * data, size_t len) {
+  json_t * j_str;
+  char * str = NULL;
+
+  if (memchr(data, '\\', len) == NULL) {
+    str = o_strndup(data+1, len-2);
+  } else if ((j_str = json_loadb(data, len, JSON_DECODE_ANY, NULL)) != NULL) {
+    str = o_strdup(json_string_value(j_str));
+    json_decref(j_str);
+  }
+  return str;
+}
+
+/**
+ * Compares the member name between start and end with name,
+ * the escaped names are unescaped first
+ */
+static int _r_json_scan_name_is(const char * data, size_t start, size_t end, const char * name) {
+  char * unescaped;
+  int ret;
+
+  if (memchr(data+start, '\\', end-start) == NULL) {
+    return end-start == o_strlen(name)+2 && !memcmp(data+start+1, name, end-start-2);
+  } else {
+    unescaped = _r_json_scan_unescape(data+start, end-start);
+    ret = !o_strcmp(unescaped, name);
+    o_free(unescaped);
+    return ret;
+  }
+}
+
+static int _r_jwks_mapped_key_cmp(const void * k1, const void * k2) {
+  const struct _r_jwks_mapped_key * key1 = (const struct _r_jwks_mapped_key *)k1, * key2 = (const struct _r_jwks_mapped_key *)k2;
+  int cmp = o_strcmp(key1->kid, key2->kid);
+
+  if (!cmp) {
+    return key1->offset<key2->offset?-1:(key1->offset>key2->offset);
+  } else {
+    return cmp;
+  }
+}
+
+/**
+ * Locates the keys of the "keys" array of the mapped file without parsing them
+ * The keys without kid are parsed and appended to jwks
+ * Like json_loads, the last member wins when a name is repeated
+ */
+static int _r_jwks_mapped_scan(struct _r_jwks_mapped * mapped, jwks_t * jwks) {
+  const char * data = mapped->data;
+  size_t size = mapped->size, i, j, k, start, name, kid_start = 0, kid_len = 0, n;
+  struct _r_jwks_mapped_key * keys;
+  json_t * j_jwk;
+  jwk_t * jwk;
+  int found = 0, is_keys;
+
+  if ((i = _r_json_scan_ws(data, size, 0)) >= size || data[i] != '{') {
+    return RHN_ERROR_PARAM;
+  }
+  for (i++; ; i++) {
+    if ((i = _r_json_scan_ws(data, size, i)) < size && data[i] == '}') {
+      break;
+    }
+    if ((j = _r_json_scan_string(data, size, i)) == _R_JSON_SCAN_ERROR || (k = _r_json_scan_ws(data, size, j)) >= size || data[k] != ':') {
+      return RHN_ERROR_PARAM;
+    }
+    k = _r_json_scan_ws(data, size, k+1);
+    if ((is_keys = _r_json_scan_name_is(data, i, j, "keys"))) {
+      // A previous "keys" member is replaced by this one
+      for (n=0; n<mapped->nb_keys; n++) {
+        o_free(mapped->keys[n].kid);
+      }
+      mapped->nb_keys = 0;
+      r_jwks_empty(jwks);
+      found = (k < size && data[k] == '[');
+    }
+    if (is_keys && found) {
+      for (k++; ; k++) {
+        if ((k = _r_json_scan_ws(data, size, k)) < size && data[k] == ']') {
+          k++;
+          break;
+        }
+        if (k >= size || data[k] != '{') {
+          return RHN_ERROR_PARAM;
+        }
+        start = k;
+        kid_start = 0;
+        kid_len = 0;
+        // Look for the kid in the top level members of the key
+        for (k++; ; k++) {
+          if ((k = _r_json_scan_ws(data, size, k)) < size && data[k] == '}') {
+            break;
+          }
+          if ((j = _r_json_scan_string(data, size, k)) == _R_JSON_SCAN_ERROR) {
+            return RHN_ERROR_PARAM;
+          }
+          name = k;
+          if ((k = _r_json_scan_ws(data, size, j)) >= size || data[k] != ':') {
+            return RHN_ERROR_PARAM;
+          }
+          k = _r_json_scan_ws(data, size, k+1);
+          if (_r_json_scan_name_is(data, name, j, "kid")) {
+            kid_start = k;
+            kid_len = 0;
+          }
+          if ((j = _r_json_scan_value(data, size, k, 3)) == _R_JSON_SCAN_ERROR) {
+            return RHN_ERROR_PARAM;
+          }
+          if (kid_start == k && data[k] == '"') {
+            kid_len = j-k;
+          }
+          if ((k = _r_json_scan_ws(data, size, j)) < size && data[k] == '}') {
+            break;
+          } else if (k >= size || data[k] != ',') {
+            return RHN_ERROR_PARAM;
+          }
+        }
+        k++;
+        if (kid_len) {
+          if ((keys = o_realloc(mapped->keys, (mapped->nb_keys+1)*sizeof(struct _r_jwks_mapped_key))) == NULL) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_mapped_scan - Error allocating resources for keys");
+            return RHN_ERROR_MEMORY;
+          }
+          mapped->keys = keys;
+          if ((mapped->keys[mapped->nb_keys].kid = _r_json_scan_unescape(data+kid_start, kid_len)) == NULL) {
+            return RHN_ERROR_PARAM;
+          }
+          mapped->keys[mapped->nb_keys].offset = start;
+          mapped->keys[mapped->nb_keys].len = k-start;
+          mapped->keys[mapped->nb_keys].jwk = NULL;
+          mapped->nb_keys++;
+        } else if ((j_jwk = json_loadb(data+start, k-start, 0, NULL)) != NULL) {
+          if (r_jwk_init(&jwk) == RHN_OK) {
+            if (r_jwk_import_from_json_t(jwk, j_jwk) == RHN_OK) {
+              r_jwks_append_jwk(jwks, jwk);
+            }
+            r_jwk_free(jwk);
+          }
+          json_decref(j_jwk);
+        }
+        if ((k = _r_json_scan_ws(data, size, k)) < size && data[k] == ']') {
+          k++;
+          break;
+        } else if (k >= size || data[k] != ',') {
+          return RHN_ERROR_PARAM;
+        }
+      }
+      j = k;
+    } else if ((j = _r_json_scan_value(data, size, k, 1)) == _R_JSON_SCAN_ERROR) {
+      return RHN_ERROR_PARAM;
+    }
+    if ((i = _r_json_scan_ws(data, size, j)) < size && data[i] == '}') {
+      break;
+    } else if (i >= size || data[i] != ',') {
+      return RHN_ERROR_PARAM;
+    }
+  }
+  // Nothing but whitespaces after the JWKS
+  if (!found || _r_json_scan_ws(data, size, i+1) != size) {
+    return RHN_ERROR_PARAM;
+  }
+  if (mapped->nb_keys) {
+    qsort(mapped->keys, mapped->nb_keys, sizeof(struct _r_jwks_mapped_key), _r_jwks_mapped_key_cmp);
+  }
+  return RHN_OK;
+}
+
+/**
+ * Returns the first key of the mapped file with the given kid
+ */
+static struct _r_jwks_mapped_key * _r_jwks_mapped_find(struct _r_jwks_mapped * mapped, const char * kid) {
+  size_t low = 0, high = mapped->nb_keys, mid;
+
+  while (low < high) {
+    mid = low + (high-low)/2;
+    if (o_strcmp(mapped->keys[mid].kid, kid) < 0) {
+      low = mid+1;
+    } else {
+      high = mid;
+    }
+  }
+  if (low < mapped->nb_keys && !o_strcmp(mapped->keys[low].kid, kid)) {
+    return &mapped->keys[low];
+  } else {
+    return NULL;
+  }
+}
+
+/**
+ * Returns the mapped key, parses it on the first call
+ * The parsed key is set with a compare and swap, so concurrent readers
+ * don't need a lock
+ * The key belongs to the mapped file, it must not be modified
+ */
+static jwk_t * _r_jwks_mapped_key_get(struct _r_jwks_mapped * mapped, struct _r_jwks_mapped_key * key) {
+  jwk_t * jwk = __atomic_load_n(&key->jwk, __ATOMIC_ACQUIRE), * expected = NULL;
+  json_t * j_jwk;
+  rhn_arena_t * arena;
+
+  if (jwk == NULL) {
+    // The parsed key is kept in the mapped file, not in the caller arena
+    arena = _r_arena_suspend();
+    if ((j_jwk = json_loadb(mapped->data+key->offset, key->len, 0, NULL)) != NULL) {
+      if (r_jwk_init(&jwk) == RHN_OK) {
+        if (r_jwk_import_from_json_t(jwk, j_jwk) != RHN_OK) {
+          y_log_message(Y_LOG_LEVEL_DEBUG, "_r_jwks_mapped_key_get - Invalid jwk format for kid %s", key->kid);
+          r_jwk_free(jwk);
+          jwk = NULL;
+        }
+      }
+      json_decref(j_jwk);
+    }
+    if (jwk != NULL && !__atomic_compare_exchange_n(&key->jwk, &expected, jwk, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      r_jwk_free(jwk);
+      jwk = expected;
+    }
+    _r_arena_resume(arena);
+  }
+  return jwk;
+}
+
+/**
+ * Maps the file of the source if it has changed since the last load
+ * The keys already parsed are kept when their content is unchanged
+ */
+static int _r_jwks_store_load_mapped(struct _r_jwks_store_source * source, jwks_t * jwks) {
+  int ret, fd;
+  struct stat st;
+  struct _r_jwks_mapped * mapped;
+  struct _r_jwks_mapped_key * old_key;
+  jwk_t * old_jwk;
+  size_t i;
+
+  if ((fd = open(source->location, O_RDONLY)) < 0 || fstat(fd, &st) || !st.st_size) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_store_load_mapped - Error opening %s", source->location);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return RHN_ERROR;
+  }
+  if (source->mapped != NULL && st.st_dev == source->st.st_dev && st.st_ino == source->st.st_ino && st.st_size == source->st.st_size &&
+      st.st_mtim.tv_sec == source->st.st_mtim.tv_sec && st.st_mtim.tv_nsec == source->st.st_mtim.tv_nsec) {
+    close(fd);
+    r_jwks_free(jwks);
+    return RHN_OK;
+  }
+  if ((mapped = o_malloc(sizeof(struct _r_jwks_mapped))) != NULL) {
+    mapped->refcount = 1;
+    mapped->keys = NULL;
+    mapped->nb_keys = 0;
+    mapped->size = (size_t)st.st_size;
+    if ((mapped->data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+      if ((ret = _r_jwks_mapped_scan(mapped, jwks)) == RHN_OK) {
+        for (i=0; source->mapped != NULL && i<mapped->nb_keys; i++) {
+          if ((old_key = _r_jwks_mapped_find(source->mapped, mapped->keys[i].kid)) != NULL && old_key->len == mapped->keys[i].len &&
+              (old_jwk = __atomic_load_n(&old_key->jwk, __ATOMIC_ACQUIRE)) != NULL &&
+              !memcmp(source->mapped->data+old_key->offset, mapped->data+mapped->keys[i].offset, old_key->len)) {
+            mapped->keys[i].jwk = r_jwk_copy(old_jwk);
+          }
+        }
+        _r_jwks_mapped_decref(source->mapped);
+        source->mapped = mapped;
+        source->st = st;
+        r_jwks_free(source->jwks);
+        source->jwks = jwks;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_store_load_mapped - Invalid jwks format in %s", source->location);
+        _r_jwks_mapped_decref(mapped);
+        r_jwks_free(jwks);
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_store_load_mapped - Error mmap %s", source->location);
+      o_free(mapped);
+      r_jwks_free(jwks);
+      ret = RHN_ERROR;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_store_load_mapped - Error allocating resources for mapped");
+    r_jwks_free(jwks);
+    ret = RHN_ERROR_MEMORY;
+  }
+  close(fd);
+  return ret;
+}
+
+/**
+ * Imports the keys of a JSON JWKS with the validation mode of the store
+ * With deferred validation, the keys are only checked to be JSON objects
+ */
+static int _r_jwks_store_import_json(int validation, unsigned int nb_threads, jwks_t * jwks, const char * content, int * unchecked) {
+  int ret = RHN_OK;
+  json_t * j_input = json_loads(content, JSON_DECODE_ANY, NULL), * j_jwk = NULL;
+  size_t index = 0;
+
+  *unchecked = 0;
+  if (j_input == NULL || !json_is_array(json_object_get(j_input, "keys"))) {
+    y_log_message(Y_LOG_LEVEL_DEBUG, "_r_jwks_store_import_json - Invalid jwks format");
+    ret = RHN_ERROR_PARAM;
+  } else if (validation == R_JWKS_STORE_VALIDATE_DEFERRED) {
+    json_array_foreach(json_object_get(j_input, "keys"), index, j_jwk) {
+      if (json_is_object(j_jwk)) {
+        r_jwks_append_jwk(jwks, j_jwk);
+      } else {
+        ret = RHN_ERROR_PARAM;
+      }
+    }
+    *unchecked = 1;
+  } else if (validation == R_JWKS_STORE_VALIDATE_PARALLEL) {
+    ret = r_jwks_import_from_json_t_parallel(jwks, j_input, nb_threads);
+  } else {
+    ret = r_jwks_import_from_json_t(jwks, j_input);
+  }
+  json_decref(j_input);
+  return ret;
+}
+
+/**
+ * Downloads the keys of an url, store->lock isn't held
+ */
+static int _r_jwks_store_fetch_uri(struct _r_jwks_store_fetch * fetch, int validation, unsigned int nb_threads) {
+  int ret;
+  char * content;
+
+  if ((ret = r_jwks_init(&fetch->jwks)) == RHN_OK) {
+    if ((content = _r_get_http_content(fetch->location, fetch->x5u_flags, "application/json")) != NULL) {
+      ret = _r_jwks_store_import_json(validation, nb_threads, fetch->jwks, content, &fetch->unchecked);
+      o_free(content);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_store_fetch_uri - Error getting %s", fetch->location);
+      ret = RHN_ERROR;
+    }
+    if (ret != RHN_OK) {
+      r_jwks_free(fetch->jwks);
+      fetch->jwks = NULL;
+    }
+  }
+  return ret;
+}
+
+/**
+ * Loads the keys of a file source, store->lock must be held
+ */
+static int _r_jwks_store_load_source(jwks_store_t * store, struct _r_jwks_store_source * source) {
+  int ret, unchecked = 0;
+  jwks_t * jwks = NULL;
+  char * content;
+  size_t content_len = 0;
+
+  if ((ret = r_jwks_init(&jwks)) == RHN_OK) {
+    if (source->type == _R_JWKS_STORE_MAPPED) {
+      return _r_jwks_store_load_mapped(source, jwks);
+    } else if ((content = _r_jwks_store_read_file(source->location, &content_len)) != NULL) {
+      if (content_len >= 4 && !memcmp(content, _R_JWKS_BINARY_MAGIC, 4)) {
+        ret = r_jwks_import_from_binary(jwks, (const unsigned char *)content, content_len);
+      } else {
+        ret = _r_jwks_store_import_json(store->validation, store->nb_threads, jwks, content, &unchecked);
+      }
+      o_free(content);
+    } else {
+      ret = RHN_ERROR;
+    }
+    if (ret == RHN_OK) {
+      r_jwks_free(source->jwks);
+      source->jwks = jwks;
+      source->unchecked = unchecked;
+    } else {
+      r_jwks_free(jwks);
+    }
+  }
+  return ret;
+}
+
+/**
+ * Downloads the urls of the store, store->lock must be held
+ * The lock is released during the downloads, then the keys
+ * are set in the sources unless a more recent refresh already did
+ */
+static int _r_jwks_store_fetch_sources(jwks_store_t * store) {
+  int ret = RHN_OK, validation = store->validation;
+  unsigned int nb_threads = store->nb_threads, generation = ++store->generation;
+  struct _r_jwks_store_fetch * fetch = NULL;
+  size_t nb_fetch = 0, i;
+
+  for (i=0; i<store->nb_sources; i++) {
+    if (store->sources[i].type == _R_JWKS_STORE_URI) {
+      nb_fetch++;
+    }
+  }
+  if (!nb_fetch) {
+    return RHN_OK;
+  }
+  if ((fetch = o_malloc(nb_fetch*sizeof(struct _r_jwks_store_fetch))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_store_refresh - Error allocating resources for fetch");
+    return RHN_ERROR_MEMORY;
+  }
+  // The sources array may be reallocated while the lock is released, only the indexes are kept
+  nb_fetch = 0;
+  for (i=0; i<store->nb_sources; i++) {
+    if (store->sources[i].type == _R_JWKS_STORE_URI) {
+      fetch[nb_fetch].index = i;
+      fetch[nb_fetch].location = o_strdup(store->sources[i].location);
+      fetch[nb_fetch].x5u_flags = store->sources[i].x5u_flags;
+      fetch[nb_fetch].jwks = NULL;
+      fetch[nb_fetch].unchecked = 0;
+      nb_fetch++;
+    }
+  }
+  pthread_mutex_unlock(&store->lock);
+  for (i=0; i<nb_fetch; i++) {
+    if (fetch[i].location != NULL) {
+      fetch[i].ret = _r_jwks_store_fetch_uri(&fetch[i], validation, nb_threads);
+    } else {
+      fetch[i].ret = RHN_ERROR_MEMORY;
+    }
+  }
+  pthread_mutex_lock(&store->lock);
+  for (i=0; i<nb_fetch; i++) {
+    if (fetch[i].ret != RHN_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_store_refresh - Error loading %s, keeping previous keys", fetch[i].location);
+      ret = RHN_ERROR;
+    } else if ((int)(store->sources[fetch[i].index].generation - generation) < 0) {
+      r_jwks_free(store->sources[fetch[i].index].jwks);
+      store->sources[fetch[i].index].jwks = fetch[i].jwks;
+      store->sources[fetch[i].index].unchecked = fetch[i].unchecked;
+      store->sources[fetch[i].index].generation = generation;
+    } else {
+      r_jwks_free(fetch[i].jwks);
+    }
+    o_free(fetch[i].location);
+  }
+  o_free(fetch);
+  return ret;
+}
+
+/**
+ * Reloads the sources and publishes the new snapshot,
+ * only the mapped files if mapped_only is set,
+ * store->lock must be held, it's released while the urls are downloaded
+ * The snapshot outlives the caller, it's never allocated in its arena
+ */
+static int _r_jwks_store_refresh(jwks_store_t * store, int mapped_only) {
+  int ret = RHN_OK;
+  size_t i, j, nb_keys = 0;
+  struct _r_jwks_snapshot * snapshot;
+  json_t * j_key, * j_index;
+  rhn_arena_t * arena = _r_arena_suspend();
+
+  if (!mapped_only && _r_jwks_store_fetch_sources(store) != RHN_OK) {
+    ret = RHN_ERROR;
+  }
+  for (i=0; i<store->nb_sources; i++) {
+    if (store->sources[i].type != _R_JWKS_STORE_URI && (!mapped_only || store->sources[i].type == _R_JWKS_STORE_MAPPED) && _r_jwks_store_load_source(store, &store->sources[i]) != RHN_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_store_refresh - Error loading %s, keeping previous keys", store->sources[i].location);
+      ret = RHN_ERROR;
+    }
+  }
+  for (i=0; i<store->nb_sources; i++) {
+    nb_keys += r_jwks_size(store->sources[i].jwks);
+  }
+  if ((snapshot = o_malloc(sizeof(struct _r_jwks_snapshot))) != NULL) {
+    snapshot->j_kid = json_object();
+    snapshot->state = o_malloc(nb_keys+1);
+    snapshot->mapped = o_malloc((store->nb_sources+1)*sizeof(struct _r_jwks_mapped *));
+    snapshot->mapped_at = o_malloc((store->nb_sources+1)*sizeof(size_t));
+    snapshot->nb_mapped = 0;
+    if (r_jwks_init(&snapshot->jwks) == RHN_OK && snapshot->j_kid != NULL && snapshot->state != NULL && snapshot->mapped != NULL && snapshot->mapped_at != NULL) {
+      for (i=0; i<store->nb_sources; i++) {
+        for (j=0; j<r_jwks_size(store->sources[i].jwks); j++) {
+          j_key = r_jwks_get_at(store->sources[i].jwks, j);
+          snapshot->state[r_jwks_size(snapshot->jwks)] = store->sources[i].unchecked?_R_JWKS_KEY_UNCHECKED:_R_JWKS_KEY_VALID;
+          if (r_jwk_get_property_str(j_key, "kid") != NULL) {
+            if ((j_index = json_object_get(snapshot->j_kid, r_jwk_get_property_str(j_key, "kid"))) == NULL) {
+              json_object_set_new(snapshot->j_kid, r_jwk_get_property_str(j_key, "kid"), (j_index = json_array()));
+            }
+            json_array_append_new(j_index, json_integer((json_int_t)r_jwks_size(snapshot->jwks)));
+          }
+          r_jwks_append_jwk(snapshot->jwks, j_key);
+          r_jwk_free(j_key);
+        }
+        if (store->sources[i].mapped != NULL) {
+          store->sources[i].mapped->refcount++;
+          snapshot->mapped_at[snapshot->nb_mapped] = r_jwks_size(snapshot->jwks);
+          snapshot->mapped[snapshot->nb_mapped++] = store->sources[i].mapped;
+        }
+      }
+      _r_jwks_store_publish(store, snapshot);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_store_refresh - Error allocating resources for snapshot");
+      _r_jwks_snapshot_free(snapshot);
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_store_refresh - Error allocating resources for snapshot");
+    ret = RHN_ERROR_MEMORY;
+  }
+  _r_arena_resume(arena);
+  return ret;
+}
+
+/**
+ * Returns true if inotify reported a change in the directory of a mapped file
+ */
+static int _r_jwks_store_watch_changed(jwks_store_t * store) {
+#ifdef __linux__
+  char buffer[4096];
+  int changed = 0;
+
+  if (store->inotify_fd >= 0) {
+    while (read(store->inotify_fd, buffer, sizeof(buffer)) > 0) {
+      changed = 1;
+    }
+  }
+  return changed;
+#else
+  (void)store;
+  return 0;
+#endif
+}
+
+static unsigned long long _r_jwks_store_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec*1000 + (unsigned long long)now.tv_nsec/1000000;
+}
+
+static void * _r_jwks_store_refresher(void * args) {
+  jwks_store_t * store = (jwks_store_t *)args;
+  struct timespec deadline;
+  unsigned long long next_refresh, wake;
+
+  pthread_mutex_lock(&store->lock);
+  next_refresh = _r_jwks_store_now() + (unsigned long long)store->interval*1000;
+  while (store->running) {
+    wake = next_refresh;
+    if (store->inotify_fd >= 0 && wake > _r_jwks_store_now() + _R_JWKS_STORE_WATCH_PERIOD) {
+      wake = _r_jwks_store_now() + _R_JWKS_STORE_WATCH_PERIOD;
+    }
+    deadline.tv_sec = (time_t)(wake/1000);
+    deadline.tv_nsec = (long)(wake%1000)*1000000;
+    while (store->running && pthread_cond_timedwait(&store->cond, &store->lock, &deadline) != ETIMEDOUT);
+    if (store->running) {
+      if (_r_jwks_store_now() >= next_refresh) {
+        _r_jwks_store_watch_changed(store);
+        _r_jwks_store_refresh(store, 0);
+        next_refresh = _r_jwks_store_now() + (unsigned long long)store->interval*1000;
+      } else if (_r_jwks_store_watch_changed(store)) {
+        _r_jwks_store_refresh(store, 1);
+      }
+    }
+  }
+  pthread_mutex_unlock(&store->lock);
+  return NULL;
+}
+
+/**
+ * Watches the directory of a mapped file, so replacing the file
+ * with a rename is detected too
+ */
+static void _r_jwks_store_watch(jwks_store_t * store, const char * path) {
+#ifdef __linux__
+  char * path_dup;
+
+  if (store->inotify_fd < 0 && (store->inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_store_watch - Error inotify_init1");
+  } else if ((path_dup = o_strdup(path)) != NULL) {
+    if (inotify_add_watch(store->inotify_fd, dirname(path_dup), IN_CLOSE_WRITE|IN_MOVED_TO|IN_DELETE) < 0) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_store_watch - Error inotify_add_watch for %s", path);
+    }
+    o_free(path_dup);
+  }
+#else
+  (void)store;
+  (void)path;
+#endif
+}
+
+static int _r_jwks_store_add_source(jwks_store_t * store, int type, const char * location, int x5u_flags) {
+  int ret = RHN_OK;
+  struct _r_jwks_store_source * sources;
+
+  pthread_mutex_lock(&store->lock);
+  if ((sources = o_realloc(store->sources, (store->nb_sources+1)*sizeof(struct _r_jwks_store_source))) != NULL) {
+    store->sources = sources;
+    if ((store->sources[store->nb_sources].location = o_strdup(location)) != NULL) {
+      store->sources[store->nb_sources].type = type;
+      store->sources[store->nb_sources].x5u_flags = x5u_flags;
+      store->sources[store->nb_sources].jwks = NULL;
+      store->sources[store->nb_sources].unchecked = 0;
+      store->sources[store->nb_sources].mapped = NULL;
+      store->sources[store->nb_sources].generation = 0;
+      memset(&store->sources[store->nb_sources].st, 0, sizeof(struct stat));
+      store->nb_sources++;
+      if (type == _R_JWKS_STORE_MAPPED) {
+        _r_jwks_store_watch(store, location);
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_store_add - Error allocating resources for location");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_store_add - Error allocating resources for sources");
+    ret = RHN_ERROR_MEMORY;
+  }
+  pthread_mutex_unlock(&store->lock);
+  return ret;
+}
+
+int r_jwks_store_init(jwks_store_t ** store) {
+  int ret;
+  pthread_condattr_t attr;
+
+  if (store != NULL) {
+    if ((*store = o_malloc(sizeof(jwks_store_t))) != NULL) {
+      pthread_mutex_init(&(*store)->lock, NULL);
+      pthread_condattr_init(&attr);
+      pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+      pthread_cond_init(&(*store)->cond, &attr);
+      pthread_condattr_destroy(&attr);
+      pthread_mutex_init(&(*store)->publish_lock, NULL);
+      pthread_cond_init(&(*store)->publish_cond, NULL);
+      (*store)->running = 0;
+      (*store)->joinable = 0;
+      (*store)->generation = 0;
+      (*store)->interval = 0;
+      (*store)->validation = R_JWKS_STORE_VALIDATE_IMPORT;
+      (*store)->nb_threads = 0;
+      (*store)->sources = NULL;
+      (*store)->nb_sources = 0;
+      (*store)->snapshot = NULL;
+      (*store)->epoch = 0;
+      (*store)->readers[0] = 0;
+      (*store)->readers[1] = 0;
+      (*store)->publishing = 0;
+      (*store)->inotify_fd = -1;
+      ret = RHN_OK;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_store_init - Error allocating resources for store");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+void r_jwks_store_free(jwks_store_t * store) {
+  size_t i;
+
+  if (store != NULL) {
+    r_jwks_store_stop(store);
+    for (i=0; i<store->nb_sources; i++) {
+      o_free(store->sources[i].location);
+      r_jwks_free(store->sources[i].jwks);
+      _r_jwks_mapped_decref(store->sources[i].mapped);
+    }
+    o_free(store->sources);
+    _r_jwks_snapshot_free(store->snapshot);
+    if (store->inotify_fd >= 0) {
+      close(store->inotify_fd);
+    }
+    pthread_cond_destroy(&store->publish_cond);
+    pthread_mutex_destroy(&store->publish_lock);
+    pthread_cond_destroy(&store->cond);
+    pthread_mutex_destroy(&store->lock);
+    o_free(store);
+  }
+}
+
+int r_jwks_store_add_uri(jwks_store_t * store, const char * uri, int x5u_flags) {
+  if (store != NULL && !o_strnullempty(uri)) {
+    return _r_jwks_store_add_source(store, _R_JWKS_STORE_URI, uri, x5u_flags);
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwks_store_add_file(jwks_store_t * store, const char * path) {
+  if (store != NULL && !o_strnullempty(path)) {
+    return _r_jwks_store_add_source(store, _R_JWKS_STORE_FILE, path, 0);
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwks_store_add_file_mapped(jwks_store_t * store, const char * path) {
+  if (store != NULL && !o_strnullempty(path)) {
+    return _r_jwks_store_add_source(store, _R_JWKS_STORE_MAPPED, path, 0);
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwks_store_set_validation(jwks_store_t * store, int validation, unsigned int nb_threads) {
+  int ret;
+
+  if (store != NULL && (validation == R_JWKS_STORE_VALIDATE_IMPORT || validation == R_JWKS_STORE_VALIDATE_PARALLEL || validation == R_JWKS_STORE_VALIDATE_DEFERRED)) {
+    pthread_mutex_lock(&store->lock);
+    store->validation = validation;
+    store->nb_threads = nb_threads;
+    pthread_mutex_unlock(&store->lock);
+    ret = RHN_OK;
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwks_store_refresh(jwks_store_t * store) {
+  int ret;
+
+  if (store != NULL) {
+    pthread_mutex_lock(&store->lock);
+    ret = _r_jwks_store_refresh(store, 0);
+    pthread_mutex_unlock(&store->lock);
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwks_store_start(jwks_store_t * store, unsigned int interval) {
+  int ret;
+
+  if (store != NULL && interval) {
+    pthread_mutex_lock(&store->lock);
+    if (!store->running) {
+      // The store is marked running before the first refresh releases the lock,
+      // so a concurrent start fails and a concurrent stop cancels the thread creation
+      store->interval = interval;
+      store->running = 1;
+      _r_jwks_store_refresh(store, 0);
+      if (!store->running) {
+        ret = RHN_OK;
+      } else if (pthread_create(&store->thread, NULL, _r_jwks_store_refresher, store)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_store_start - Error pthread_create");
+        store->running = 0;
+        ret = RHN_ERROR;
+      } else {
+        store->joinable = 1;
+        ret = RHN_OK;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_store_start - Store already started");
+      ret = RHN_ERROR_PARAM;
+    }
+    pthread_mutex_unlock(&store->lock);
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+void r_jwks_store_stop(jwks_store_t * store) {
+  int joinable;
+
+  if (store != NULL) {
+    pthread_mutex_lock(&store->lock);
+    joinable = store->joinable;
+    store->running = 0;
+    store->joinable = 0;
+    pthread_cond_signal(&store->cond);
+    pthread_mutex_unlock(&store->lock);
+    if (joinable) {
+      pthread_join(store->thread, NULL);
+    }
+  }
+}
+
+static size_t _r_jwks_snapshot_size(struct _r_jwks_snapshot * snapshot) {
+  size_t size = r_jwks_size(snapshot->jwks), i;
+
+  for (i=0; i<snapshot->nb_mapped; i++) {
+    size += snapshot->mapped[i]->nb_keys;
+  }
+  return size;
+}
+
+size_t r_jwks_store_size(jwks_store_t * store) {
+  struct _r_jwks_snapshot * snapshot;
+  unsigned int slot;
+  size_t size = 0;
+
+  if (store != NULL) {
+    if ((snapshot = _r_jwks_store_read_lock(store, &slot)) != NULL) {
+      size = _r_jwks_snapshot_size(snapshot);
+    }
+    _r_jwks_store_read_unlock(store, slot);
+  }
+  return size;
+}
+
+/**
+ * Returns the key at index in the snapshot, validates it on the first call
+ * if it was imported with deferred validation
+ * The key belongs to the snapshot, it must not be modified
+ * The validation state is set with a compare and swap, so concurrent readers
+ * don't need a lock, a key may be validated more than once
+ */
+static jwk_t * _r_jwks_snapshot_get_at(struct _r_jwks_snapshot * snapshot, size_t index) {
+  unsigned char state = __atomic_load_n(&snapshot->state[index], __ATOMIC_ACQUIRE), expected = _R_JWKS_KEY_UNCHECKED;
+  json_t * j_key = json_array_get(json_object_get(snapshot->jwks, "keys"), index);
+
+  if (state == _R_JWKS_KEY_UNCHECKED) {
+    if (r_jwk_is_valid(j_key) == RHN_OK) {
+      state = _R_JWKS_KEY_VALID;
+    } else {
+      y_log_message(Y_LOG_LEVEL_DEBUG, "_r_jwks_snapshot_get_at - Invalid jwk format at index %zu", index);
+      state = _R_JWKS_KEY_INVALID;
+    }
+    __atomic_compare_exchange_n(&snapshot->state[index], &expected, state, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  }
+  if (state == _R_JWKS_KEY_VALID) {
+    return j_key;
+  } else {
+    return NULL;
+  }
+}
+
+jwks_t * r_jwks_store_get_jwks(jwks_store_t * store) {
+  struct _r_jwks_snapshot * snapshot;
+  unsigned int slot;
+  jwks_t * jwks = NULL;
+  jwk_t * jwk;
+  size_t i, j, k;
+
+  if (store != NULL) {
+    if ((snapshot = _r_jwks_store_read_lock(store, &slot)) != NULL && r_jwks_init(&jwks) == RHN_OK) {
+      // The keys are returned in the order of the sources
+      for (i=0, k=0; i<=snapshot->nb_mapped; i++) {
+        for (; k<r_jwks_size(snapshot->jwks) && (i == snapshot->nb_mapped || k < snapshot->mapped_at[i]); k++) {
+          if ((jwk = r_jwk_copy(_r_jwks_snapshot_get_at(snapshot, k))) != NULL) {
+            r_jwks_append_jwk(jwks, jwk);
+            r_jwk_free(jwk);
+          }
+        }
+        for (j=0; i<snapshot->nb_mapped && j<snapshot->mapped[i]->nb_keys; j++) {
+          if ((jwk = r_jwk_copy(_r_jwks_mapped_key_get(snapshot->mapped[i], &snapshot->mapped[i]->keys[j]))) != NULL) {
+            r_jwks_append_jwk(jwks, jwk);
+            r_jwk_free(jwk);
+          }
+        }
+      }
+    }
+    _r_jwks_store_read_unlock(store, slot);
+    if (jwks == NULL) {
+      r_jwks_init(&jwks);
+    }
+  }
+  return jwks;
+}
+
+/**
+ * Returns the first valid key of the mapped file with the given kid
+ */
+static jwk_t * _r_jwks_mapped_get_by_kid(struct _r_jwks_mapped * mapped, const char * kid) {
+  struct _r_jwks_mapped_key * key = _r_jwks_mapped_find(mapped, kid);
+  jwk_t * jwk = NULL;
+
+  while (jwk == NULL && key != NULL) {
+    jwk = _r_jwks_mapped_key_get(mapped, key);
+    if (jwk == NULL && key+1 < mapped->keys+mapped->nb_keys && !o_strcmp(key[1].kid, kid)) {
+      key++;
+    } else {
+      key = NULL;
+    }
+  }
+  return jwk;
+}
+
+/**
+ * Looks up a key by kid in the snapshot in the order of the sources,
+ * the keys of the mapped files are parsed on the first lookup
+ * The key belongs to the snapshot, it must not be modified
+ */
+static jwk_t * _r_jwks_snapshot_get_by_kid(struct _r_jwks_snapshot * snapshot, const char * kid) {
+  jwk_t * jwk = NULL;
+  json_t * j_index = json_object_get(snapshot->j_kid, kid);
+  size_t i, n = 0, index;
+
+  // A key invalid on its first lookup falls through to the next key with the same kid
+  for (i=0; jwk == NULL && i<=snapshot->nb_mapped; i++) {
+    // The keys of jwks from the sources before the mapped file come first
+    while (jwk == NULL && n<json_array_size(j_index)) {
+      index = (size_t)json_integer_value(json_array_get(j_index, n));
+      if (i < snapshot->nb_mapped && index >= snapshot->mapped_at[i]) {
+        break;
+      }
+      jwk = _r_jwks_snapshot_get_at(snapshot, index);
+      n++;
+    }
+    if (jwk == NULL && i<snapshot->nb_mapped) {
+      jwk = _r_jwks_mapped_get_by_kid(snapshot->mapped[i], kid);
+    }
+  }
+  return jwk;
+}
+
+jwk_t * r_jwks_store_get_by_kid(jwks_store_t * store, const char * kid) {
+  struct _r_jwks_snapshot * snapshot;
+  unsigned int slot;
+  jwk_t * jwk = NULL;
+
+  if (store != NULL && !o_strnullempty(kid)) {
+    if ((snapshot = _r_jwks_store_read_lock(store, &slot)) != NULL) {
+      jwk = r_jwk_copy(_r_jwks_snapshot_get_by_kid(snapshot, kid));
+    }
+    _r_jwks_store_read_unlock(store, slot);
+  }
+  return jwk;
+}
+
+/**
+ * Returns the key to verify a signature with: the key with the given kid,
+ * or the only key of the store if kid is NULL
+ * The key isn't copied, when a key is returned the read side of the store
+ * is held in slot until _r_jwks_store_put_verify_key, so the snapshot can't be freed
+ */
+jwk_t * _r_jwks_store_get_verify_key(jwks_store_t * store, const char * kid, unsigned int * slot) {
+  struct _r_jwks_snapshot * snapshot;
+  jwk_t * jwk = NULL;
+
+  if (store != NULL && slot != NULL) {
+    if ((snapshot = _r_jwks_store_read_lock(store, slot)) != NULL) {
+      if (kid != NULL) {
+        jwk = _r_jwks_snapshot_get_by_kid(snapshot, kid);
+      } else if (_r_jwks_snapshot_size(snapshot) == 1 && r_jwks_size(snapshot->jwks) == 1) {
+        jwk = _r_jwks_snapshot_get_at(snapshot, 0);
+      }
+    }
+    if (jwk == NULL) {
+      _r_jwks_store_read_unlock(store, *slot);
+    }
+  }
+  return jwk;
+}
+
+/**
+ * Releases the key returned by _r_jwks_store_get_verify_key
+ */
+void _r_jwks_store_put_verify_key(jwks_store_t * store, unsigned int slot) {
+  if (store != NULL) {
+    _r_jwks_store_read_unlock(store, slot);
+  }
+}
+
+jwks_shared_t * r_jwks_shared_new(jwks_t * jwks) {
+  jwks_shared_t * shared;
+  json_t * j_key = NULL;
+  size_t index = 0;
+  rhn_arena_t * arena;
+
+  if (jwks == NULL || !json_is_array(json_object_get(jwks, "keys"))) {
+    return NULL;
+  }
+  // The shared key set is attached to tokens that can outlive an arena scope
+  arena = _r_arena_suspend();
+  if ((shared = o_malloc(sizeof(jwks_shared_t))) != NULL) {
+    shared->refcount = 1;
+    shared->jwks = r_jwks_copy(jwks);
+    shared->j_kid = json_object();
+    if (shared->jwks != NULL && shared->j_kid != NULL) {
+      json_array_foreach(json_object_get(shared->jwks, "keys"), index, j_key) {
+        if (r_jwk_get_property_str(j_key, "kid") != NULL && json_object_get(shared->j_kid, r_jwk_get_property_str(j_key, "kid")) == NULL) {
+          json_object_set(shared->j_kid, r_jwk_get_property_str(j_key, "kid"), j_key);
+        }
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_shared_new - Error allocating resources for keys");
+      r_jwks_free(shared->jwks);
+      json_decref(shared->j_kid);
+      o_free(shared);
+      shared = NULL;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_shared_new - Error allocating resources for shared");
+  }
+  _r_arena_resume(arena);
+  return shared;
+}
+
+jwks_shared_t * r_jwks_shared_ref(jwks_shared_t * shared) {
+  if (shared != NULL) {
+    __atomic_add_fetch(&shared->refcount, 1, __ATOMIC_RELAXED);
+  }
+  return shared;
+}
+
+void r_jwks_shared_free(jwks_shared_t * shared) {
+  if (shared != NULL && !__atomic_sub_fetch(&shared->refcount, 1, __ATOMIC_ACQ_REL)) {
+    json_decref(shared->j_kid);
+    r_jwks_free(shared->jwks);
+    o_free(shared);
+  }
+}
+
+size_t r_jwks_shared_size(jwks_shared_t * shared) {
+  if (shared != NULL) {
+    return r_jwks_size(shared->jwks);
+  } else {
+    return 0;
+  }
+}
+
+jwk_t * r_jwks_shared_get_at(jwks_shared_t * shared, size_t index) {
+  if (shared != NULL) {
+    return r_jwks_get_at(shared->jwks, index);
+  } else {
+    return NULL;
+  }
+}
+
+jwk_t * r_jwks_shared_get_by_kid(jwks_shared_t * shared, const char * kid) {
+  if (shared != NULL && !o_strnullempty(kid)) {
+    return r_jwk_copy(json_object_get(shared->j_kid, kid));
+  } else {
+    return NULL;
+  }
+}
+
+/**
+ * Returns the key at index in jwks, the key isn't copied
+ */
+jwk_t * _r_jwks_key_at(jwks_t * jwks, size_t index) {
+  return json_array_get(json_object_get(jwks, "keys"), index);
+}
+
+/**
+ * Returns the key with the given kid, or the only key
+ * of the shared key set if kid is NULL
+ * The key isn't copied, it's valid as long as the shared key set is referenced
+ */
+jwk_t * _r_jwks_shared_key(jwks_shared_t * shared, const char * kid) {
+  if (shared != NULL) {
+    if (kid != NULL) {
+      return o_strnullempty(kid)?NULL:json_object_get(shared->j_kid, kid);
+    } else if (r_jwks_size(shared->jwks) == 1) {
+      return _r_jwks_key_at(shared->jwks, 0);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Returns a copy of the key with the given kid, or of the only key
+ * of the shared key set if kid is NULL
+ */
+jwk_t * _r_jwks_shared_get_key(jwks_shared_t * shared, const char * kid) {
+  return r_jwk_copy(_r_jwks_shared_key(shared, kid));
+}
+
+/**
+ * Replaces the shared key set referenced by dest
+ */
+int _r_jwks_shared_set(jwks_shared_t ** dest, jwks_shared_t * shared) {
+  jwks_shared_t * old = *dest;
+
+  *dest = r_jwks_shared_ref(shared);
+  r_jwks_shared_free(old);
+  return RHN_OK;
+}
+
+/**
+ * Returns the keys of the shared key set, they must not be modified
+ */
+jwks_t * _r_jwks_shared_jwks(jwks_shared_t * shared) {
+  return shared!=NULL?shared->jwks:NULL;
+}
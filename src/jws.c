@@ -46,28 +46,68 @@ static json_t * r_jws_parse_protected(const unsigned char * header_b64url) {
   return j_return;
 }
 
+/**
+ * Records a remote key to download by the application
+ * instead of downloading it during the parsing
+ */
+static int _r_jws_add_remote_pending(jws_t * jws, int type, const char * url) {
+  int ret = RHN_OK;
+
+  if (o_strnullempty(url)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_add_remote_pending - Invalid url");
+    ret = RHN_ERROR_PARAM;
+  } else if (jws->j_remote_pending == NULL && (jws->j_remote_pending = json_array()) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_add_remote_pending - Error allocating resources for j_remote_pending");
+    ret = RHN_ERROR_MEMORY;
+  } else if (json_array_append_new(jws->j_remote_pending, json_pack("{siss}", "type", type, "url", url))) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_add_remote_pending - Error json_array_append_new");
+    ret = RHN_ERROR_MEMORY;
+  }
+  return ret;
+}
+
 static int r_jws_extract_header(jws_t * jws, json_t * j_header, uint32_t parse_flags, int x5u_flags) {
   int ret;
   jwk_t * jwk;
+  json_t * j_alg;
+  jwa_alg alg;
+  size_t jwks_size = r_jwks_size(jws->jwks_pubkey);
 
   if (json_is_object(j_header)) {
     ret = RHN_OK;
 
-    if (json_object_get(j_header, "alg") != NULL) {
-      if (0 != o_strcmp("HS256", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("HS384", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("HS512", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("RS256", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("RS384", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("RS512", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("PS256", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("PS384", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("PS512", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("ES256", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("ES384", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("ES512", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("EdDSA", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("ES256K", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("none", json_string_value(json_object_get(j_header, "alg")))) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_extract_header - Invalid alg");
-        ret = RHN_ERROR_PARAM;
-      } else {
-        jws->alg = r_str_to_jwa_alg(json_string_value(json_object_get(j_header, "alg")));
+    if ((j_alg = json_object_get(j_header, "alg")) != NULL) {
+      switch ((alg = _r_str_to_jwa_alg_len(json_string_value(j_alg), json_string_length(j_alg)))) {
+        case R_JWA_ALG_NONE:
+        case R_JWA_ALG_HS256:
+        case R_JWA_ALG_HS384:
+        case R_JWA_ALG_HS512:
+        case R_JWA_ALG_RS256:
+        case R_JWA_ALG_RS384:
+        case R_JWA_ALG_RS512:
+        case R_JWA_ALG_PS256:
+        case R_JWA_ALG_PS384:
+        case R_JWA_ALG_PS512:
+        case R_JWA_ALG_ES256:
+        case R_JWA_ALG_ES384:
+        case R_JWA_ALG_ES512:
+        case R_JWA_ALG_EDDSA:
+        case R_JWA_ALG_ES256K:
+          jws->alg = alg;
+          break;
+        default:
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_extract_header - Invalid alg");
+          ret = RHN_ERROR_PARAM;
+          break;
       }
     }
 
     if (json_string_length(json_object_get(j_header, "jku")) && (parse_flags&R_PARSE_HEADER_JKU)) {
-      if (r_jwks_import_from_uri(jws->jwks_pubkey, json_string_value(json_object_get(j_header, "jku")), x5u_flags) != RHN_OK) {
+      if (x5u_flags & R_FLAG_DEFER_REMOTE) {
+        if (_r_jws_add_remote_pending(jws, R_REMOTE_JKU, json_string_value(json_object_get(j_header, "jku"))) != RHN_OK) {
+          ret = RHN_ERROR_PARAM;
+        }
+      } else if (r_jwks_import_from_uri(jws->jwks_pubkey, json_string_value(json_object_get(j_header, "jku")), x5u_flags) != RHN_OK) {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_extract_header - Error loading jwks from uri %s", json_string_value(json_object_get(j_header, "jku")));
       }
     }
@@ -85,7 +125,11 @@ static int r_jws_extract_header(jws_t * jws, json_t * j_header, uint32_t parse_f
       r_jwk_free(jwk);
     }
 
-    if (json_object_get(j_header, "x5u") != NULL && (parse_flags&R_PARSE_HEADER_X5U)) {
+    if (json_object_get(j_header, "x5u") != NULL && (parse_flags&R_PARSE_HEADER_X5U) && (x5u_flags & R_FLAG_DEFER_REMOTE)) {
+      if (_r_jws_add_remote_pending(jws, R_REMOTE_X5U, json_string_value(json_object_get(j_header, "x5u"))) != RHN_OK) {
+        ret = RHN_ERROR_PARAM;
+      }
+    } else if (json_object_get(j_header, "x5u") != NULL && (parse_flags&R_PARSE_HEADER_X5U)) {
       r_jwk_init(&jwk);
       if (r_jwk_import_from_x5u(jwk, x5u_flags, json_string_value(json_object_get(j_header, "x5u"))) == RHN_OK) {
         if (r_jwks_append_jwk(jws->jwks_pubkey, jwk) != RHN_OK) {
@@ -110,6 +154,9 @@ static int r_jws_extract_header(jws_t * jws, json_t * j_header, uint32_t parse_f
       }
       r_jwk_free(jwk);
     }
+    if (_r_jwks_add_header_keys(jws->jwks_pubkey, jwks_size, &jws->j_jwks_pubkey_header) != RHN_OK) {
+      ret = RHN_ERROR_MEMORY;
+    }
   } else {
     ret = RHN_ERROR_PARAM;
   }
@@ -196,11 +243,14 @@ static int r_jws_set_token_values(jws_t * jws, int force) {
   return ret;
 }
 
-static unsigned char * r_jws_sign_hmac(jws_t * jws, jwk_t * jwk) {
-  int alg = GNUTLS_DIG_NULL;
-  unsigned char * data = NULL, * key = NULL, * sig = NULL, * to_return = NULL;
-  size_t key_len = 0, sig_len = 0;
-  struct _o_datum dat_sig = {0, NULL};
+/**
+ * The sign functions write the binary signature in sig,
+ * sig_len is the size of sig and is set to the signature length
+ */
+static int r_jws_sign_hmac(jws_t * jws, jwk_t * jwk, const unsigned char * data, size_t data_len, unsigned char * sig, size_t * sig_len) {
+  int alg = GNUTLS_DIG_NULL, ret = RHN_ERROR;
+  unsigned char * key = NULL;
+  size_t key_len = 0;
 
   if (jws->alg == R_JWA_ALG_HS256) {
     alg = GNUTLS_DIG_SHA256;
@@ -210,18 +260,15 @@ static unsigned char * r_jws_sign_hmac(jws_t * jws, jwk_t * jwk) {
     alg = GNUTLS_DIG_SHA512;
   }
 
-  if (alg != GNUTLS_DIG_NULL) {
-    sig_len = gnutls_hmac_get_len(alg);
-    sig = o_malloc(sig_len);
-
+  if (alg != GNUTLS_DIG_NULL && gnutls_hmac_get_len(alg) <= *sig_len) {
     key_len = o_strlen(r_jwk_get_property_str(jwk, "k"));
     if (key_len) {
-      key = o_malloc(key_len);
+      key = _r_secure_malloc(key_len);
 
       if (key != NULL) {
         if (r_jwk_export_to_symmetric_key(jwk, key, &key_len) != RHN_OK) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error r_jwk_export_to_symmetric_key");
-          o_free(key);
+          _r_secure_free(key);
           key = NULL;
         }
       } else {
@@ -234,33 +281,24 @@ static unsigned char * r_jws_sign_hmac(jws_t * jws, jwk_t * jwk) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error key invalid, 'alg' invalid");
   }
 
-  if (key != NULL && sig != NULL) {
-    data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    if (!gnutls_hmac_fast(alg, key, key_len, data, o_strlen((const char *)data), sig)) {
-      if (o_base64url_encode_alloc(sig, sig_len, &dat_sig)) {
-        to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
-        o_free(dat_sig.data);
-      } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error o_base64url_encode sig_b64");
-      }
+  if (key != NULL) {
+    if (!gnutls_hmac_fast(alg, key, key_len, data, data_len, sig)) {
+      *sig_len = gnutls_hmac_get_len(alg);
+      ret = RHN_OK;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error gnutls_hmac_fast");
     }
   }
 
-  o_free(data);
-  o_free(sig);
-  o_free(key);
+  _r_secure_free(key);
 
-  return to_return;
+  return ret;
 }
 
-static unsigned char * r_jws_sign_rsa(jws_t * jws, jwk_t * jwk) {
+static int r_jws_sign_rsa(jws_t * jws, jwk_t * jwk, const unsigned char * data, size_t data_len, unsigned char * sig, size_t * sig_len) {
   gnutls_privkey_t privkey = r_jwk_export_to_gnutls_privkey(jwk);
   gnutls_datum_t body_dat, sig_dat;
-  unsigned char * to_return = NULL;
-  int alg = GNUTLS_DIG_NULL, res, flag = 0;
-  struct _o_datum dat_sig = {0, NULL};
+  int alg = GNUTLS_DIG_NULL, res, flag = 0, ret = RHN_ERROR;
 
   switch (jws->alg) {
     case R_JWA_ALG_RS256:
@@ -292,8 +330,8 @@ static unsigned char * r_jws_sign_rsa(jws_t * jws, jwk_t * jwk) {
   }
 
   if (privkey != NULL && GNUTLS_PK_RSA == gnutls_privkey_get_pk_algorithm(privkey, NULL)) {
-    body_dat.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    body_dat.size = o_strlen((const char *)body_dat.data);
+    body_dat.data = (unsigned char *)data;
+    body_dat.size = (unsigned int)data_len;
 
     if (!(res =
 #if GNUTLS_VERSION_NUMBER >= 0x030600
@@ -302,36 +340,32 @@ static unsigned char * r_jws_sign_rsa(jws_t * jws, jwk_t * jwk) {
                  gnutls_privkey_sign_data
 #endif
                                            (privkey, alg, flag, &body_dat, &sig_dat))) {
-      if (o_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
-        to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
-        o_free(dat_sig.data);
+      if (sig_dat.size <= *sig_len) {
+        memcpy(sig, sig_dat.data, sig_dat.size);
+        *sig_len = sig_dat.size;
+        ret = RHN_OK;
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error o_base64url_encode for to_return");
-        o_free(to_return);
-        to_return = NULL;
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error unexpected signature length");
       }
       gnutls_free(sig_dat.data);
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error gnutls_privkey_sign_data2, res %d", res);
     }
-    o_free(body_dat.data);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error extracting privkey");
   }
   gnutls_privkey_deinit(privkey);
-  return to_return;
+  return ret;
 }
 
-static unsigned char * r_jws_sign_ecdsa(jws_t * jws, jwk_t * jwk) {
+static int r_jws_sign_ecdsa(jws_t * jws, jwk_t * jwk, const unsigned char * data, size_t data_len, unsigned char * sig, size_t * sig_len) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
   gnutls_privkey_t privkey = r_jwk_export_to_gnutls_privkey(jwk);
   gnutls_datum_t body_dat, sig_dat, r, s;
-  unsigned char * binary_sig = NULL, * to_return = NULL;
-  int alg = GNUTLS_DIG_NULL, res;
+  int alg = GNUTLS_DIG_NULL, res, ret = RHN_ERROR;
   unsigned int adj = 0;
   int r_padding = 0, s_padding = 0, r_out_padding = 0, s_out_padding = 0;
   size_t sig_size;
-  struct _o_datum dat_sig = {0, NULL};
 
   if (jws->alg == R_JWA_ALG_ES256) {
     alg = GNUTLS_DIG_SHA256;
@@ -345,8 +379,8 @@ static unsigned char * r_jws_sign_ecdsa(jws_t * jws, jwk_t * jwk) {
   }
 
   if (privkey != NULL && GNUTLS_PK_EC == gnutls_privkey_get_pk_algorithm(privkey, NULL)) {
-    body_dat.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    body_dat.size = o_strlen((const char *)body_dat.data);
+    body_dat.data = (unsigned char *)data;
+    body_dat.size = (unsigned int)data_len;
 
     if (!(res = gnutls_privkey_sign_data(privkey, alg, 0, &body_dat, &sig_dat))) {
       if (!gnutls_decode_rs_value(&sig_dat, &r, &s)) {
@@ -364,19 +398,14 @@ static unsigned char * r_jws_sign_ecdsa(jws_t * jws, jwk_t * jwk) {
 
         sig_size = adj << 1;
 
-        if ((binary_sig = o_malloc(sig_size)) != NULL) {
-          memset(binary_sig, 0, sig_size);
-          memcpy(binary_sig + r_out_padding, r.data + r_padding, r.size - r_padding);
-          memcpy(binary_sig + (r.size - r_padding + r_out_padding) + s_out_padding, s.data + s_padding, (s.size - s_padding));
-          if (o_base64url_encode_alloc(binary_sig, sig_size, &dat_sig)) {
-            to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
-            o_free(dat_sig.data);
-          } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error o_base64url_encode_alloc for dat_sig");
-          }
-          o_free(binary_sig);
+        if (sig_size <= *sig_len) {
+          memset(sig, 0, sig_size);
+          memcpy(sig + r_out_padding, r.data + r_padding, r.size - r_padding);
+          memcpy(sig + (r.size - r_padding + r_out_padding) + s_out_padding, s.data + s_padding, (s.size - s_padding));
+          *sig_len = sig_size;
+          ret = RHN_OK;
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error allocating resources for binary_sig");
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error unexpected signature length");
         }
         gnutls_free(r.data);
         gnutls_free(s.data);
@@ -387,57 +416,61 @@ static unsigned char * r_jws_sign_ecdsa(jws_t * jws, jwk_t * jwk) {
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error gnutls_privkey_sign_data: %d", res);
     }
-    o_free(body_dat.data);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error extracting privkey");
   }
   gnutls_privkey_deinit(privkey);
-  return to_return;
+  return ret;
 #else
   (void)(jws);
   (void)(jwk);
-  return NULL;
+  (void)(data);
+  (void)(data_len);
+  (void)(sig);
+  (void)(sig_len);
+  return RHN_ERROR;
 #endif
 }
 
-static unsigned char * r_jws_sign_eddsa(jws_t * jws, jwk_t * jwk) {
+static int r_jws_sign_eddsa(jwk_t * jwk, const unsigned char * data, size_t data_len, unsigned char * sig, size_t * sig_len) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
   gnutls_privkey_t privkey = r_jwk_export_to_gnutls_privkey(jwk);
   gnutls_datum_t body_dat, sig_dat;
-  unsigned char * to_return = NULL;
-  int res;
-  struct _o_datum dat_sig = {0, NULL};
+  int res, ret = RHN_ERROR;
 
   if (privkey != NULL && GNUTLS_PK_EDDSA_ED25519 == gnutls_privkey_get_pk_algorithm(privkey, NULL)) {
-    body_dat.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    body_dat.size = o_strlen((const char *)body_dat.data);
+    body_dat.data = (unsigned char *)data;
+    body_dat.size = (unsigned int)data_len;
 
     if (!(res = gnutls_privkey_sign_data(privkey, GNUTLS_DIG_SHA512, 0, &body_dat, &sig_dat))) {
-      if (o_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
-        to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
-        o_free(dat_sig.data);
+      if (sig_dat.size <= *sig_len) {
+        memcpy(sig, sig_dat.data, sig_dat.size);
+        *sig_len = sig_dat.size;
+        ret = RHN_OK;
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_eddsa - Error o_base64url_encode_alloc for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_eddsa - Error unexpected signature length");
       }
       gnutls_free(sig_dat.data);
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_eddsa - Error gnutls_privkey_sign_data: %d", res);
     }
-    o_free(body_dat.data);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_eddsa - Error extracting privkey");
   }
   gnutls_privkey_deinit(privkey);
-  return to_return;
+  return ret;
 #else
-  (void)(jws);
   (void)(jwk);
-  return NULL;
+  (void)(data);
+  (void)(data_len);
+  (void)(sig);
+  (void)(sig_len);
+  return RHN_ERROR;
 #endif
 }
 
 #if 0
-static unsigned char * r_jws_sign_es256k(jws_t * jws, jwk_t * jwk) {
+static unsigned char * r_jws_sign_es256k(jwk_t * jwk, const unsigned char * data, size_t data_len) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
   gnutls_privkey_t privkey = r_jwk_export_to_gnutls_privkey(jwk);
   gnutls_datum_t body_dat, sig_dat;
@@ -446,8 +479,8 @@ static unsigned char * r_jws_sign_es256k(jws_t * jws, jwk_t * jwk) {
   struct _o_datum dat_sig = {0, NULL};
 
   if (privkey != NULL && GNUTLS_PK_EC == gnutls_privkey_get_pk_algorithm(privkey, NULL)) {
-    body_dat.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    body_dat.size = o_strlen((const char *)body_dat.data);
+    body_dat.data = (unsigned char *)data;
+    body_dat.size = (unsigned int)data_len;
 
     if (!(res = gnutls_privkey_sign_data(privkey, GNUTLS_DIG_SHA256, 0, &body_dat, &sig_dat))) {
       if (o_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
@@ -460,30 +493,82 @@ static unsigned char * r_jws_sign_es256k(jws_t * jws, jwk_t * jwk) {
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_es256k - Error gnutls_privkey_sign_data: %d", res);
     }
-    o_free(body_dat.data);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_es256k - Error extracting privkey");
   }
   gnutls_privkey_deinit(privkey);
   return to_return;
 #else
-  (void)(jws);
   (void)(jwk);
+  (void)(data);
+  (void)(data_len);
   return NULL;
 #endif
 }
 #endif
 
-static int r_jws_verify_sig_hmac(jws_t * jws, jwk_t * jwk) {
-  unsigned char * sig = r_jws_sign_hmac(jws, jwk);
-  int ret;
+/**
+ * Builds the signing input header.payload in a scratch buffer of the thread,
+ * released with _r_scratch_release(_R_SCRATCH_SIGNING_INPUT, 0)
+ */
+static unsigned char * _r_jws_signing_input(jws_t * jws, size_t * data_len) {
+  size_t header_len = o_strlen((const char *)jws->header_b64url), payload_len = o_strlen((const char *)jws->payload_b64url);
+  unsigned char * data;
 
-  if (sig != NULL && 0 == o_strcmp((const char *)jws->signature_b64url, (const char *)sig)) {
-    ret = RHN_OK;
+  if ((data = _r_scratch_get(_R_SCRATCH_SIGNING_INPUT, header_len+payload_len+2)) != NULL) {
+    if (header_len) {
+      memcpy(data, jws->header_b64url, header_len);
+    }
+    data[header_len] = '.';
+    if (payload_len) {
+      memcpy(data+header_len+1, jws->payload_b64url, payload_len);
+    }
+    data[header_len+1+payload_len] = '\0';
+    *data_len = header_len+1+payload_len;
   } else {
-    ret = RHN_ERROR_INVALID;
+    *data_len = 0;
+  }
+  return data;
+}
+
+/**
+ * Decodes the signature in a scratch buffer of the thread,
+ * released with _r_scratch_release(_R_SCRATCH_SIGNATURE, 0)
+ */
+static int _r_jws_decode_signature(jws_t * jws, struct _o_datum * dat_sig) {
+  size_t signature_len = o_strlen((const char *)jws->signature_b64url);
+
+  dat_sig->size = 0;
+  if ((dat_sig->data = _r_scratch_get(_R_SCRATCH_SIGNATURE, signature_len)) != NULL) {
+    if (o_base64url_decode(jws->signature_b64url, signature_len, dat_sig->data, &dat_sig->size)) {
+      return 1;
+    } else {
+      _r_scratch_release(_R_SCRATCH_SIGNATURE, 0);
+      dat_sig->data = NULL;
+      return 0;
+    }
+  } else {
+    return 0;
+  }
+}
+
+static int r_jws_verify_sig_hmac(jws_t * jws, jwk_t * jwk) {
+  size_t data_len = 0, sig_len = 64, sig_b64url_len;
+  unsigned char * data = _r_jws_signing_input(jws, &data_len), sig[64], sig_b64url[88];
+  struct _r_b64url_writer writer;
+  int ret = RHN_ERROR_INVALID;
+
+  if (data != NULL) {
+    if (r_jws_sign_hmac(jws, jwk, data, data_len, sig, &sig_len) == RHN_OK) {
+      _r_b64url_writer_init(&writer, sig_b64url, sizeof(sig_b64url));
+      _r_b64url_writer_write((const char *)sig, sig_len, &writer);
+      sig_b64url_len = _r_b64url_writer_end(&writer);
+      if (o_strlen((const char *)jws->signature_b64url) == sig_b64url_len && 0 == memcmp(jws->signature_b64url, sig_b64url, sig_b64url_len)) {
+        ret = RHN_OK;
+      }
+    }
+    _r_scratch_release(_R_SCRATCH_SIGNING_INPUT, 0);
   }
-  o_free(sig);
   return ret;
 }
 
@@ -492,9 +577,10 @@ static int r_jws_verify_sig_rsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
   gnutls_datum_t sig_dat = {NULL, 0}, data;
   gnutls_pubkey_t pubkey = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags);
   struct _o_datum dat_sig = {0, NULL};
+  size_t data_len = 0;
 
-  data.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-  data.size = o_strlen((const char *)data.data);
+  data.data = _r_jws_signing_input(jws, &data_len);
+  data.size = (unsigned int)data_len;
 
   switch (jws->alg) {
     case R_JWA_ALG_RS256:
@@ -526,16 +612,16 @@ static int r_jws_verify_sig_rsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
 
   if (pubkey != NULL && GNUTLS_PK_RSA == gnutls_pubkey_get_pk_algorithm(pubkey, NULL)) {
     if (!o_strnullempty((const char *)jws->signature_b64url)) {
-      if (o_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
+      if (_r_jws_decode_signature(jws, &dat_sig)) {
         sig_dat.data = dat_sig.data;
         sig_dat.size = dat_sig.size;
         if (gnutls_pubkey_verify_data2(pubkey, alg, flag, &data, &sig_dat)) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Error invalid signature");
           ret = RHN_ERROR_INVALID;
         }
-        o_free(dat_sig.data);
+        _r_scratch_release(_R_SCRATCH_SIGNATURE, 0);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Error o_base64url_decode_alloc for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Error _r_jws_decode_signature for dat_sig");
         ret = RHN_ERROR;
       }
     } else {
@@ -546,7 +632,9 @@ static int r_jws_verify_sig_rsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Invalid public key");
     ret = RHN_ERROR_PARAM;
   }
-  o_free(data.data);
+  if (data.data != NULL) {
+    _r_scratch_release(_R_SCRATCH_SIGNING_INPUT, 0);
+  }
   gnutls_pubkey_deinit(pubkey);
   return ret;
 }
@@ -557,9 +645,10 @@ static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
   gnutls_datum_t sig_dat = {NULL, 0}, r, s, data;
   gnutls_pubkey_t pubkey = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags);
   struct _o_datum dat_sig = {0, NULL};
+  size_t data_len = 0;
 
-  data.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-  data.size = o_strlen((const char *)data.data);
+  data.data = _r_jws_signing_input(jws, &data_len);
+  data.size = (unsigned int)data_len;
 
   switch (jws->alg) {
     case R_JWA_ALG_ES256:
@@ -577,7 +666,7 @@ static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
 
   if (pubkey != NULL && GNUTLS_PK_EC == gnutls_pubkey_get_pk_algorithm(pubkey, NULL)) {
     if (!o_strnullempty((const char *)jws->signature_b64url)) {
-      if (o_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
+      if (_r_jws_decode_signature(jws, &dat_sig)) {
         if (dat_sig.size == 64) {
           r.size = 32;
           r.data = dat_sig.data;
@@ -612,9 +701,9 @@ static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
             ret = RHN_ERROR;
           }
         }
-        o_free(dat_sig.data);
+        _r_scratch_release(_R_SCRATCH_SIGNATURE, 0);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_ecdsa - Error o_base64url_decode_alloc for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_ecdsa - Error _r_jws_decode_signature for dat_sig");
         ret = RHN_ERROR;
       }
     } else {
@@ -625,7 +714,9 @@ static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_ecdsa - Invalid public key");
     ret = RHN_ERROR_PARAM;
   }
-  o_free(data.data);
+  if (data.data != NULL) {
+    _r_scratch_release(_R_SCRATCH_SIGNING_INPUT, 0);
+  }
   gnutls_pubkey_deinit(pubkey);
   return ret;
 #else
@@ -642,22 +733,23 @@ static int r_jws_verify_sig_eddsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
   gnutls_datum_t sig_dat = {NULL, 0}, data;
   gnutls_pubkey_t pubkey = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags);
   struct _o_datum dat_sig = {0, NULL};
+  size_t data_len = 0;
 
-  data.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-  data.size = o_strlen((const char *)data.data);
+  data.data = _r_jws_signing_input(jws, &data_len);
+  data.size = (unsigned int)data_len;
 
   if (pubkey != NULL && GNUTLS_PK_EDDSA_ED25519 == gnutls_pubkey_get_pk_algorithm(pubkey, NULL)) {
     if (!o_strnullempty((const char *)jws->signature_b64url)) {
-      if (o_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
+      if (_r_jws_decode_signature(jws, &dat_sig)) {
         sig_dat.data = dat_sig.data;
         sig_dat.size = dat_sig.size;
         if (gnutls_pubkey_verify_data2(pubkey, GNUTLS_SIGN_EDDSA_ED25519, 0, &data, &sig_dat)) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_eddsa - Error invalid signature");
           ret = RHN_ERROR_INVALID;
         }
-        o_free(dat_sig.data);
+        _r_scratch_release(_R_SCRATCH_SIGNATURE, 0);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_eddsa - Error o_base64url_decode for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_eddsa - Error _r_jws_decode_signature for dat_sig");
         ret = RHN_ERROR;
       }
     } else {
@@ -668,7 +760,9 @@ static int r_jws_verify_sig_eddsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_eddsa - Invalid public key");
     ret = RHN_ERROR_PARAM;
   }
-  o_free(data.data);
+  if (data.data != NULL) {
+    _r_scratch_release(_R_SCRATCH_SIGNING_INPUT, 0);
+  }
   gnutls_pubkey_deinit(pubkey);
   return ret;
 #else
@@ -781,9 +875,56 @@ static int _r_verify_signature(jws_t * jws, jwk_t * jwk, jwa_alg alg, int x5u_fl
   return ret;
 }
 
-static unsigned char * _r_generate_signature(jws_t * jws, jwk_t * jwk, jwa_alg alg, int x5u_flags) {
-  unsigned char * str_ret = NULL;
-  int res;
+/**
+ * Returns the size of the binary signature generated with the key for the alg, 0 if the key doesn't match the alg
+ */
+static size_t _r_jws_get_signature_len(jwa_alg alg, jwk_t * jwk, int x5u_flags) {
+  size_t sig_len = 0;
+  unsigned int bits = 0;
+  int type = r_jwk_key_type(jwk, &bits, x5u_flags);
+
+  switch (alg) {
+    case R_JWA_ALG_HS256:
+    case R_JWA_ALG_HS384:
+    case R_JWA_ALG_HS512:
+      if (type & R_KEY_TYPE_HMAC) {
+        sig_len = alg==R_JWA_ALG_HS256?32:(alg==R_JWA_ALG_HS384?48:64);
+      }
+      break;
+    case R_JWA_ALG_RS256:
+    case R_JWA_ALG_RS384:
+    case R_JWA_ALG_RS512:
+    case R_JWA_ALG_PS256:
+    case R_JWA_ALG_PS384:
+    case R_JWA_ALG_PS512:
+      if (type & R_KEY_TYPE_RSA && type & R_KEY_TYPE_PRIVATE) {
+        sig_len = _r_get_rsa_modulus_len(jwk, bits);
+      }
+      break;
+    case R_JWA_ALG_ES256:
+    case R_JWA_ALG_ES384:
+    case R_JWA_ALG_ES512:
+      if (type & R_KEY_TYPE_EC && type & R_KEY_TYPE_PRIVATE) {
+        sig_len = alg==R_JWA_ALG_ES256?64:(alg==R_JWA_ALG_ES384?96:132);
+      }
+      break;
+    case R_JWA_ALG_EDDSA:
+      if (type & R_KEY_TYPE_EDDSA && type & R_KEY_TYPE_PRIVATE) {
+        sig_len = bits==256?64:114;
+      }
+      break;
+    default:
+      break;
+  }
+  return sig_len;
+}
+
+/**
+ * Writes the binary signature of data in sig, sig_len is the size of sig
+ * and is set to the signature length, 0 for the alg none
+ */
+static int _r_generate_signature_raw(jws_t * jws, jwk_t * jwk, jwa_alg alg, const unsigned char * data, size_t data_len, unsigned char * sig, size_t * sig_len, int x5u_flags) {
+  int ret = RHN_ERROR, res;
 
   if (jws != NULL && (jwk != NULL || alg == R_JWA_ALG_NONE)) {
     switch (alg) {
@@ -791,7 +932,7 @@ static unsigned char * _r_generate_signature(jws_t * jws, jwk_t * jwk, jwa_alg a
       case R_JWA_ALG_HS384:
       case R_JWA_ALG_HS512:
         if (r_jwk_key_type(jwk, NULL, x5u_flags) & R_KEY_TYPE_HMAC) {
-          str_ret = r_jws_sign_hmac(jws, jwk);
+          ret = r_jws_sign_hmac(jws, jwk, data, data_len, sig, sig_len);
         }
         break;
       case R_JWA_ALG_RS256:
@@ -802,7 +943,7 @@ static unsigned char * _r_generate_signature(jws_t * jws, jwk_t * jwk, jwa_alg a
       case R_JWA_ALG_PS512:
         res = r_jwk_key_type(jwk, NULL, x5u_flags);
         if (res & R_KEY_TYPE_RSA && res &R_KEY_TYPE_PRIVATE) {
-          str_ret = r_jws_sign_rsa(jws, jwk);
+          ret = r_jws_sign_rsa(jws, jwk, data, data_len, sig, sig_len);
         }
         break;
       case R_JWA_ALG_ES256:
@@ -810,32 +951,68 @@ static unsigned char * _r_generate_signature(jws_t * jws, jwk_t * jwk, jwa_alg a
       case R_JWA_ALG_ES512:
         res = r_jwk_key_type(jwk, NULL, x5u_flags);
         if (res & R_KEY_TYPE_EC && res & R_KEY_TYPE_PRIVATE) {
-          str_ret = r_jws_sign_ecdsa(jws, jwk);
+          ret = r_jws_sign_ecdsa(jws, jwk, data, data_len, sig, sig_len);
         }
         break;
       case R_JWA_ALG_EDDSA:
         res = r_jwk_key_type(jwk, NULL, x5u_flags);
         if (res & R_KEY_TYPE_EDDSA && res & R_KEY_TYPE_PRIVATE) {
-          str_ret = r_jws_sign_eddsa(jws, jwk);
+          ret = r_jws_sign_eddsa(jwk, data, data_len, sig, sig_len);
         }
         break;
       case R_JWA_ALG_NONE:
-        str_ret = (unsigned char *)o_strdup("");
-        break;
-#if 0
-      case R_JWA_ALG_ES256K:
-        res = r_jwk_key_type(jwk, NULL, x5u_flags);
-        if (res & R_KEY_TYPE_EC && res & R_KEY_TYPE_PRIVATE) {
-          str_ret = r_jws_sign_es256k(jws, jwk);
-        }
+        *sig_len = 0;
+        ret = RHN_OK;
         break;
-#endif
       default:
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_generate_signature - Unsupported algorithm");
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_generate_signature_raw - Unsupported algorithm");
         break;
     }
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "_r_generate_signature - Error input parameters");
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_generate_signature_raw - Error input parameters");
+  }
+  return ret;
+}
+
+static unsigned char * _r_generate_signature_data(jws_t * jws, jwk_t * jwk, jwa_alg alg, const unsigned char * data, size_t data_len, int x5u_flags) {
+  unsigned char * str_ret = NULL, * sig;
+  size_t sig_len = _r_jws_get_signature_len(alg, jwk, x5u_flags);
+  struct _r_b64url_writer writer;
+
+  if (alg == R_JWA_ALG_NONE) {
+    str_ret = (unsigned char *)o_strdup("");
+  } else if (sig_len) {
+    if ((sig = _r_scratch_get(_R_SCRATCH_SIGNATURE, sig_len)) != NULL) {
+      if (_r_generate_signature_raw(jws, jwk, alg, data, data_len, sig, &sig_len, x5u_flags) == RHN_OK) {
+        if ((str_ret = o_malloc(_r_get_base64url_len(sig_len)+1)) != NULL) {
+          _r_b64url_writer_init(&writer, str_ret, _r_get_base64url_len(sig_len));
+          _r_b64url_writer_write((const char *)sig, sig_len, &writer);
+          str_ret[_r_b64url_writer_end(&writer)] = '\0';
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_generate_signature_data - Error allocating resources for str_ret");
+        }
+      }
+      _r_scratch_release(_R_SCRATCH_SIGNATURE, 0);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_generate_signature_data - Error allocating resources for sig");
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_generate_signature_data - Error invalid key for alg");
+  }
+  return str_ret;
+}
+
+static unsigned char * _r_generate_signature(jws_t * jws, jwk_t * jwk, jwa_alg alg, int x5u_flags) {
+  unsigned char * data, * str_ret = NULL;
+  size_t data_len = 0;
+
+  if (jws != NULL) {
+    if ((data = _r_jws_signing_input(jws, &data_len)) != NULL) {
+      str_ret = _r_generate_signature_data(jws, jwk, alg, data, data_len, x5u_flags);
+      _r_scratch_release(_R_SCRATCH_SIGNING_INPUT, 0);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_generate_signature - Error allocating resources for data");
+    }
   }
   return str_ret;
 }
@@ -856,6 +1033,11 @@ int r_jws_init(jws_t ** jws) {
             (*jws)->payload_len = 0;
             (*jws)->j_json_serialization = NULL;
             (*jws)->token_mode = R_JSON_MODE_COMPACT;
+            (*jws)->j_jwks_pubkey_header = NULL;
+            (*jws)->j_remote_pending = NULL;
+            (*jws)->jwks_store = NULL;
+            (*jws)->jwks_shared_privkey = NULL;
+            (*jws)->jwks_shared_pubkey = NULL;
             ret = RHN_OK;
           } else {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_init - Error allocating resources for jwks_privkey");
@@ -883,6 +1065,33 @@ int r_jws_init(jws_t ** jws) {
   return ret;
 }
 
+int r_jws_reset(jws_t * jws) {
+  int ret;
+
+  if (jws != NULL) {
+    _r_jwks_remove_header_keys(jws->jwks_pubkey, jws->j_jwks_pubkey_header);
+    o_free(jws->header_b64url);
+    jws->header_b64url = NULL;
+    o_free(jws->payload_b64url);
+    jws->payload_b64url = NULL;
+    o_free(jws->signature_b64url);
+    jws->signature_b64url = NULL;
+    o_free(jws->payload);
+    jws->payload = NULL;
+    jws->payload_len = 0;
+    json_decref(jws->j_json_serialization);
+    jws->j_json_serialization = NULL;
+    json_decref(jws->j_remote_pending);
+    jws->j_remote_pending = NULL;
+    jws->alg = R_JWA_ALG_UNKNOWN;
+    jws->token_mode = R_JSON_MODE_COMPACT;
+    ret = _r_json_object_reset(&jws->j_header);
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
 void r_jws_free(jws_t * jws) {
   if (jws != NULL) {
     r_jwks_free(jws->jwks_privkey);
@@ -893,6 +1102,10 @@ void r_jws_free(jws_t * jws) {
     json_decref(jws->j_header);
     o_free(jws->payload);
     json_decref(jws->j_json_serialization);
+    json_decref(jws->j_remote_pending);
+    r_jwks_shared_free(jws->jwks_shared_privkey);
+    r_jwks_shared_free(jws->jwks_shared_pubkey);
+    json_decref(jws->j_jwks_pubkey_header);
     o_free(jws);
   }
 }
@@ -913,6 +1126,10 @@ jws_t * r_jws_copy(jws_t * jws) {
         json_decref(jws_copy->j_header);
         jws_copy->j_header = json_deep_copy(jws->j_header);
         jws_copy->j_json_serialization = json_deep_copy(jws->j_json_serialization);
+        jws_copy->j_remote_pending = json_deep_copy(jws->j_remote_pending);
+        jws_copy->jwks_store = jws->jwks_store;
+        jws_copy->jwks_shared_privkey = r_jwks_shared_ref(jws->jwks_shared_privkey);
+        jws_copy->jwks_shared_pubkey = r_jwks_shared_ref(jws->jwks_shared_pubkey);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_copy - Error allocating resources for jws_copy->payload");
         r_jws_free(jws_copy);
@@ -1179,6 +1396,25 @@ int r_jws_add_jwks(jws_t * jws, jwks_t * jwks_privkey, jwks_t * jwks_pubkey) {
   return ret;
 }
 
+int r_jws_set_jwks_store(jws_t * jws, jwks_store_t * store) {
+  if (jws != NULL) {
+    jws->jwks_store = store;
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jws_set_shared_jwks(jws_t * jws, jwks_shared_t * jwks_shared_privkey, jwks_shared_t * jwks_shared_pubkey) {
+  if (jws != NULL) {
+    _r_jwks_shared_set(&jws->jwks_shared_privkey, jwks_shared_privkey);
+    _r_jwks_shared_set(&jws->jwks_shared_pubkey, jwks_shared_pubkey);
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
 int r_jws_add_keys_json_str(jws_t * jws, const char * privkey, const char * pubkey) {
   int ret = RHN_OK;
   jwa_alg alg;
@@ -1471,9 +1707,11 @@ int r_jws_advanced_compact_parsen(jws_t * jws, const char * jws_str, size_t jws_
             ret = RHN_ERROR_PARAM;
             break;
           }
-          json_decref(jws->j_header);
-
-          jws->j_header = json_incref(j_header);
+          if (_r_json_object_replace(&jws->j_header, j_header) != RHN_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error setting header");
+            ret = RHN_ERROR;
+            break;
+          }
 
           if (!(parse_flags&R_PARSE_UNSIGNED)) {
             if (r_jws_get_alg(jws) == R_JWA_ALG_NONE) {
@@ -1630,9 +1868,11 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
             ret = RHN_ERROR_PARAM;
             break;
           }
-          json_decref(jws->j_header);
-
-          jws->j_header = json_incref(j_header);
+          if (_r_json_object_replace(&jws->j_header, j_header) != RHN_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error setting header");
+            ret = RHN_ERROR;
+            break;
+          }
 
           // Decode payload
           if (!o_base64url_decode_alloc((unsigned char *)jws->payload_b64url, o_strlen((const char *)jws->payload_b64url), &dat_payload)) {
@@ -1768,10 +2008,11 @@ jws_t * r_jws_quick_parsen(const char * jws_str, size_t jws_str_len, uint32_t pa
 
 int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
   int ret, res;
-  jwk_t * jwk = NULL, * cur_jwk;
+  jwk_t * jwk = NULL, * cur_jwk, * shared_jwk = NULL, * store_jwk = NULL;
   const char * kid;
   json_t * j_signature = NULL, * j_header;
   size_t index = 0, i;
+  unsigned int slot = 0, cur_slot = 0;
 
   if (jws != NULL) {
     if (jwk_pubkey != NULL) {
@@ -1782,6 +2023,13 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
       } else if (r_jwks_size(jws->jwks_pubkey) == 1) {
         jwk = r_jwks_get_at(jws->jwks_pubkey, 0);
       }
+      // The shared and store keys are used in place, not copied
+      if (jwk == NULL) {
+        shared_jwk = _r_jwks_shared_key(jws->jwks_shared_pubkey, kid);
+      }
+      if (jwk == NULL && shared_jwk == NULL && jws->jwks_store != NULL) {
+        store_jwk = _r_jwks_store_get_verify_key(jws->jwks_store, kid, &slot);
+      }
     }
   }
 
@@ -1805,6 +2053,11 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
                 if ((cur_jwk = r_jwks_get_by_kid(jws->jwks_pubkey, kid)) != NULL) {
                   ret = _r_verify_signature(jws, cur_jwk, jws->alg, x5u_flags);
                   r_jwk_free(cur_jwk);
+                } else if ((cur_jwk = _r_jwks_shared_key(jws->jwks_shared_pubkey, kid)) != NULL) {
+                  ret = _r_verify_signature(jws, cur_jwk, jws->alg, x5u_flags);
+                } else if ((cur_jwk = _r_jwks_store_get_verify_key(jws->jwks_store, kid, &cur_slot)) != NULL) {
+                  ret = _r_verify_signature(jws, cur_jwk, jws->alg, x5u_flags);
+                  _r_jwks_store_put_verify_key(jws->jwks_store, cur_slot);
                 }
               }
               if (ret != RHN_ERROR_INVALID) {
@@ -1815,11 +2068,15 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
                 if ((ret = _r_verify_signature(jws, jwk_pubkey, jws->alg, x5u_flags)) != RHN_ERROR_INVALID) {
                   break;
                 }
-              } else if (r_jwks_size(jws->jwks_pubkey)) {
-                for (i=0; i<r_jwks_size(jws->jwks_pubkey); i++) {
-                  cur_jwk = r_jwks_get_at(jws->jwks_pubkey, i);
+              } else if (r_jwks_size(jws->jwks_pubkey) || r_jwks_shared_size(jws->jwks_shared_pubkey)) {
+                // The keys are used in place, not copied
+                for (i=0; i<r_jwks_size(jws->jwks_pubkey)+r_jwks_shared_size(jws->jwks_shared_pubkey); i++) {
+                  if (i < r_jwks_size(jws->jwks_pubkey)) {
+                    cur_jwk = _r_jwks_key_at(jws->jwks_pubkey, i);
+                  } else {
+                    cur_jwk = _r_jwks_key_at(_r_jwks_shared_jwks(jws->jwks_shared_pubkey), i-r_jwks_size(jws->jwks_pubkey));
+                  }
                   ret = _r_verify_signature(jws, cur_jwk, jws->alg, x5u_flags);
-                  r_jwk_free(cur_jwk);
                   if (ret != RHN_ERROR_INVALID) {
                     break;
                   }
@@ -1844,6 +2101,10 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
       if (r_jws_set_token_values(jws, 0) == RHN_OK && jws->signature_b64url != NULL) {
         if (jwk != NULL) {
           ret = _r_verify_signature(jws, jwk, jws->alg, x5u_flags);
+        } else if (shared_jwk != NULL) {
+          ret = _r_verify_signature(jws, shared_jwk, jws->alg, x5u_flags);
+        } else if (store_jwk != NULL) {
+          ret = _r_verify_signature(jws, store_jwk, jws->alg, x5u_flags);
         } else {
           ret = RHN_ERROR_INVALID;
         }
@@ -1851,10 +2112,202 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
         ret = RHN_ERROR_PARAM;
       }
     }
+    // The available keys don't verify the signature, the key may be in a pending url
+    if (ret == RHN_ERROR_INVALID && jwk_pubkey == NULL && json_array_size(jws->j_remote_pending)) {
+      ret = RHN_NEED_KEY;
+    }
   } else {
     ret = RHN_ERROR_PARAM;
   }
   r_jwk_free(jwk);
+  if (store_jwk != NULL) {
+    _r_jwks_store_put_verify_key(jws->jwks_store, slot);
+  }
+  return ret;
+}
+
+/**
+ * Size of the stack buffer used by _r_jws_verify_compact,
+ * larger tokens use a buffer allocated on the heap
+ */
+#define _R_JWS_COMPACT_SCRATCH_SIZE 4096
+
+/**
+ * Verifies the signature of a compact JWS without building a jws_t,
+ * the token segments are decoded in a buffer on the stack
+ * The key is looked up by kid in jwks_pubkey, or is its only key
+ * The decoded header and payload are returned as json objects
+ */
+int _r_jws_verify_compact(const char * token, size_t token_len, jwks_shared_t * jwks_pubkey, json_t ** j_header, json_t ** j_payload) {
+  int ret;
+  unsigned char scratch[_R_JWS_COMPACT_SCRATCH_SIZE], * buffer = scratch, * decoded, * inflated = NULL;
+  const char * dot_payload = NULL, * dot_signature = NULL;
+  size_t header_len = 0, payload_len = 0, buffer_len, decoded_len = 0, inflated_len = 0;
+  jwa_alg alg;
+  jwk_t * jwk = NULL;
+  jws_t jws;
+
+  *j_header = NULL;
+  *j_payload = NULL;
+  if (token != NULL && token_len && jwks_pubkey != NULL) {
+    if ((dot_payload = memchr(token, '.', token_len)) != NULL) {
+      dot_signature = memchr(dot_payload+1, '.', token_len-(size_t)(dot_payload-token)-1);
+    }
+    if (dot_signature != NULL && memchr(dot_signature+1, '.', token_len-(size_t)(dot_signature-token)-1) == NULL) {
+      header_len = (size_t)(dot_payload-token);
+      payload_len = (size_t)(dot_signature-dot_payload)-1;
+      // The copy of the token is followed by the decoded header or payload
+      buffer_len = token_len + 1 + (header_len>payload_len?header_len:payload_len) + 1;
+      if (buffer_len > _R_JWS_COMPACT_SCRATCH_SIZE) {
+        buffer = _r_scratch_get(_R_SCRATCH_TOKEN, buffer_len);
+      }
+      if (buffer != NULL) {
+        memcpy(buffer, token, token_len);
+        buffer[header_len] = '\0';
+        buffer[header_len+1+payload_len] = '\0';
+        buffer[token_len] = '\0';
+        decoded = buffer + token_len + 1;
+        ret = RHN_OK;
+        do {
+          if (!header_len || !o_base64url_decode(buffer, header_len, decoded, &decoded_len) || (*j_header = json_loadb((const char *)decoded, decoded_len, JSON_DECODE_ANY, NULL)) == NULL || !json_is_object(*j_header)) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_verify_compact - Invalid header");
+            ret = RHN_ERROR_PARAM;
+            break;
+          }
+          alg = r_str_to_jwa_alg(json_string_value(json_object_get(*j_header, "alg")));
+          if (alg == R_JWA_ALG_NONE) {
+            y_log_message(Y_LOG_LEVEL_DEBUG, "_r_jws_verify_compact - error unsigned jws");
+            ret = RHN_ERROR_INVALID;
+            break;
+          } else if (alg == R_JWA_ALG_UNKNOWN) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_verify_compact - Invalid alg");
+            ret = RHN_ERROR_PARAM;
+            break;
+          }
+          if ((jwk = _r_jwks_shared_key(jwks_pubkey, json_string_value(json_object_get(*j_header, "kid")))) == NULL) {
+            y_log_message(Y_LOG_LEVEL_DEBUG, "_r_jws_verify_compact - No key found");
+            ret = RHN_ERROR_INVALID;
+            break;
+          }
+          memset(&jws, 0, sizeof(jws_t));
+          jws.header_b64url = buffer;
+          jws.payload_b64url = buffer+header_len+1;
+          jws.signature_b64url = buffer+header_len+1+payload_len+1;
+          jws.alg = alg;
+          if ((ret = _r_verify_signature(&jws, jwk, alg, 0)) != RHN_OK) {
+            break;
+          }
+          if (!o_base64url_decode(jws.payload_b64url, payload_len, decoded, &decoded_len)) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_verify_compact - Invalid payload");
+            ret = RHN_ERROR_PARAM;
+            break;
+          }
+          if (0 == o_strcmp("DEF", json_string_value(json_object_get(*j_header, "zip")))) {
+            if (_r_inflate_payload(decoded, decoded_len, &inflated, &inflated_len) != RHN_OK) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_verify_compact - error _r_inflate_payload");
+              ret = RHN_ERROR_PARAM;
+              break;
+            }
+            decoded = inflated;
+            decoded_len = inflated_len;
+          }
+          if ((*j_payload = json_loadb((const char *)decoded, decoded_len, JSON_DECODE_ANY, NULL)) == NULL || !json_is_object(*j_payload)) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_verify_compact - Invalid payload");
+            ret = RHN_ERROR_PARAM;
+            break;
+          }
+        } while (0);
+        if (ret != RHN_OK) {
+          json_decref(*j_header);
+          *j_header = NULL;
+          json_decref(*j_payload);
+          *j_payload = NULL;
+        }
+        o_free(inflated);
+        if (buffer != scratch) {
+          _r_scratch_release(_R_SCRATCH_TOKEN, 0);
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_verify_compact - Error allocating resources for buffer");
+        ret = RHN_ERROR_MEMORY;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_verify_compact - token invalid format");
+      ret = RHN_ERROR_PARAM;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+size_t r_jws_remote_pending_size(jws_t * jws) {
+  if (jws != NULL) {
+    return json_array_size(jws->j_remote_pending);
+  } else {
+    return 0;
+  }
+}
+
+const char * r_jws_remote_pending_get_at(jws_t * jws, size_t index, int * type) {
+  json_t * j_pending;
+
+  if (jws != NULL && (j_pending = json_array_get(jws->j_remote_pending, index)) != NULL) {
+    if (type != NULL) {
+      *type = (int)json_integer_value(json_object_get(j_pending, "type"));
+    }
+    return json_string_value(json_object_get(j_pending, "url"));
+  } else {
+    return NULL;
+  }
+}
+
+int r_jws_remote_resume(jws_t * jws, const char * url, const char * content, size_t content_len) {
+  int ret = RHN_ERROR_PARAM, type = 0;
+  size_t index = 0, jwks_size;
+  json_t * j_pending = NULL, * j_jwks;
+  jwk_t * jwk;
+
+  if (jws != NULL && url != NULL) {
+    json_array_foreach(jws->j_remote_pending, index, j_pending) {
+      if (0 == o_strcmp(url, json_string_value(json_object_get(j_pending, "url")))) {
+        type = (int)json_integer_value(json_object_get(j_pending, "type"));
+        break;
+      }
+    }
+    if (type) {
+      jwks_size = r_jwks_size(jws->jwks_pubkey);
+      if (content == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_remote_resume - No content for %s", url);
+        ret = RHN_OK;
+      } else if (type == R_REMOTE_JKU) {
+        if ((j_jwks = json_loadb(content, content_len, JSON_DECODE_ANY, NULL)) != NULL) {
+          ret = r_jwks_import_from_json_t(jws->jwks_pubkey, j_jwks);
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_remote_resume - Error parsing jku content");
+          ret = RHN_ERROR_PARAM;
+        }
+        json_decref(j_jwks);
+      } else {
+        if ((ret = r_jwk_init(&jwk)) == RHN_OK) {
+          if (r_jwk_import_from_pem_der(jwk, R_X509_TYPE_CERTIFICATE, R_FORMAT_PEM, (const unsigned char *)content, content_len) == RHN_OK) {
+            ret = r_jwks_append_jwk(jws->jwks_pubkey, jwk);
+          } else {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_remote_resume - Error importing x5u content");
+            ret = RHN_ERROR_PARAM;
+          }
+          r_jwk_free(jwk);
+        }
+      }
+      if (_r_jwks_add_header_keys(jws->jwks_pubkey, jwks_size, &jws->j_jwks_pubkey_header) != RHN_OK) {
+        ret = RHN_ERROR_MEMORY;
+      }
+      // Removed last, url may point into the pending entry itself
+      json_array_remove(jws->j_remote_pending, index);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_remote_resume - url not pending");
+    }
+  }
   return ret;
 }
 
@@ -1866,33 +2319,123 @@ char * r_jws_serialize(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags) {
   }
 }
 
-char * r_jws_serialize_unsecure(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags) {
+/**
+ * Returns the key to sign the jws with, the key isn't copied
+ */
+static jwk_t * _r_jws_get_sign_key_in_place(jws_t * jws, jwk_t * jwk_privkey) {
+  const char * kid = r_jws_get_header_str_value(jws, "kid");
   jwk_t * jwk = NULL;
-  char * jws_str = NULL;
+  size_t i;
+
+  if (jwk_privkey != NULL) {
+    jwk = jwk_privkey;
+  } else {
+    if (kid != NULL) {
+      for (i=0; jwk == NULL && !o_strnullempty(kid) && i<r_jwks_size(jws->jwks_privkey); i++) {
+        if (0 == o_strcmp(kid, r_jwk_get_property_str(_r_jwks_key_at(jws->jwks_privkey, i), "kid"))) {
+          jwk = _r_jwks_key_at(jws->jwks_privkey, i);
+        }
+      }
+    } else if (r_jwks_size(jws->jwks_privkey) == 1) {
+      jwk = _r_jwks_key_at(jws->jwks_privkey, 0);
+    }
+    if (jwk == NULL) {
+      jwk = _r_jwks_shared_key(jws->jwks_shared_privkey, kid);
+    }
+  }
+  return jwk;
+}
+
+/**
+ * Returns a copy of the key to sign the jws with
+ */
+static jwk_t * _r_jws_get_sign_key(jws_t * jws, jwk_t * jwk_privkey) {
+  return r_jwk_copy(_r_jws_get_sign_key_in_place(jws, jwk_privkey));
+}
+
+/**
+ * Returns the alg to sign the jws with, the key alg if the jws alg isn't set
+ */
+static jwa_alg _r_jws_get_sign_alg(jws_t * jws, jwk_t * jwk) {
   jwa_alg alg;
 
-  if (jws != NULL) {
-    if (jwk_privkey != NULL) {
-      jwk = r_jwk_copy(jwk_privkey);
-      if (jws->alg == R_JWA_ALG_UNKNOWN && (alg = r_str_to_jwa_alg(r_jwk_get_property_str(jwk, "alg"))) != R_JWA_ALG_NONE && alg != R_JWA_ALG_UNKNOWN) {
-        r_jws_set_alg(jws, alg);
+  if (jws->alg == R_JWA_ALG_UNKNOWN && (alg = r_str_to_jwa_alg(r_jwk_get_property_str(jwk, "alg"))) != R_JWA_ALG_NONE && alg != R_JWA_ALG_UNKNOWN) {
+    return alg;
+  } else {
+    return jws->alg;
+  }
+}
+
+/**
+ * Sets the alg and kid header values from the key if missing
+ */
+static void _r_jws_set_sign_header(jws_t * jws, jwk_t * jwk) {
+  jwa_alg alg;
+
+  if (jws->alg == R_JWA_ALG_UNKNOWN && (alg = _r_jws_get_sign_alg(jws, jwk)) != R_JWA_ALG_UNKNOWN) {
+    r_jws_set_alg(jws, alg);
+  }
+  if (r_jwk_get_property_str(jwk, "kid") != NULL && r_jws_get_header_str_value(jws, "kid") == NULL) {
+    r_jws_set_header_str_value(jws, "kid", r_jwk_get_property_str(jwk, "kid"));
+  }
+}
+
+/**
+ * Returns the header the jws would be signed with, without changing the jws
+ */
+static json_t * _r_jws_get_sign_header(jws_t * jws, jwk_t * jwk, jwa_alg alg) {
+  json_t * j_header = json_copy(jws->j_header);
+
+  if (j_header != NULL) {
+    if (jws->alg == R_JWA_ALG_UNKNOWN && alg != R_JWA_ALG_UNKNOWN) {
+      json_object_set_new(j_header, "alg", json_string(r_jwa_alg_to_str(alg)));
+    }
+    if (r_jwk_get_property_str(jwk, "kid") != NULL && json_object_get(j_header, "kid") == NULL) {
+      json_object_set_new(j_header, "kid", json_string(r_jwk_get_property_str(jwk, "kid")));
+    }
+  }
+  return j_header;
+}
+
+/**
+ * Sets the compact header and the payload, compressed if required, to encode
+ */
+static int _r_jws_get_compact_values(jws_t * jws, json_t * j_header, char ** header_str, unsigned char ** payload, size_t * payload_len, int * zip) {
+  int ret = RHN_OK;
+
+  *zip = 0;
+  *payload = NULL;
+  *payload_len = 0;
+  if ((*header_str = json_dumps(j_header, JSON_COMPACT)) != NULL) {
+    if (!jws->payload_len) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_get_compact_values - Error empty payload");
+      ret = RHN_ERROR_PARAM;
+    } else if (0 == o_strcmp("DEF", r_jws_get_header_str_value(jws, "zip"))) {
+      *zip = 1;
+      if ((ret = _r_deflate_payload(jws->payload, jws->payload_len, payload, payload_len)) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_get_compact_values - Error _r_deflate_payload");
       }
     } else {
-      if (r_jws_get_header_str_value(jws, "kid") != NULL) {
-        jwk = r_jwks_get_by_kid(jws->jwks_privkey, r_jws_get_header_str_value(jws, "kid"));
-      } else if (jws != NULL && r_jwks_size(jws->jwks_privkey) == 1) {
-        jwk = r_jwks_get_at(jws->jwks_privkey, 0);
-      }
-      if (jws->alg == R_JWA_ALG_UNKNOWN && (alg = r_str_to_jwa_alg(r_jwk_get_property_str(jwk, "alg"))) != R_JWA_ALG_NONE && alg != R_JWA_ALG_UNKNOWN) {
-        r_jws_set_alg(jws, alg);
-      }
+      *payload = jws->payload;
+      *payload_len = jws->payload_len;
     }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_jws_get_compact_values - Error json_dumps header");
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
 
-    if (r_jwk_get_property_str(jwk, "kid") != NULL && r_jws_get_header_str_value(jws, "kid") == NULL) {
-      r_jws_set_header_str_value(jws, "kid", r_jwk_get_property_str(jwk, "kid"));
-    }
+char * r_jws_serialize_unsecure(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags) {
+  jwk_t * jwk = NULL;
+  char * jws_str = NULL;
+
+  if (jws != NULL) {
+    jwk = _r_jws_get_sign_key(jws, jwk_privkey);
+    _r_jws_set_sign_header(jws, jwk);
 
     o_free(jws->signature_b64url);
+    jws->signature_b64url = NULL;
     if (r_jws_set_token_values(jws, 1) == RHN_OK) {
       jws->signature_b64url = _r_generate_signature(jws, jwk, jws->alg, x5u_flags);
       if (jws->signature_b64url != NULL) {
@@ -1911,6 +2454,117 @@ char * r_jws_serialize_unsecure(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags)
   return jws_str;
 }
 
+size_t r_jws_serialized_length(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags) {
+  jwk_t * jwk = NULL;
+  json_t * j_header = NULL;
+  char * header_str = NULL;
+  unsigned char * payload = NULL;
+  size_t length = 0, payload_len = 0, sig_len = 0;
+  jwa_alg alg;
+  int zip = 0;
+
+  if (jws != NULL && r_jws_get_alg(jws) != R_JWA_ALG_NONE) {
+    jwk = _r_jws_get_sign_key(jws, jwk_privkey);
+    alg = _r_jws_get_sign_alg(jws, jwk);
+    if ((sig_len = _r_jws_get_signature_len(alg, jwk, x5u_flags))) {
+      // The header is computed on a copy, so the jws isn't changed
+      if ((j_header = _r_jws_get_sign_header(jws, jwk, alg)) != NULL && _r_jws_get_compact_values(jws, j_header, &header_str, &payload, &payload_len, &zip) == RHN_OK) {
+        length = _r_get_base64url_len(o_strlen(header_str)) + 1 + _r_get_base64url_len(payload_len) + 1 + _r_get_base64url_len(sig_len);
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialized_length - Error invalid key for alg");
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialized_length - Error input parameters");
+  }
+  if (zip) {
+    o_free(payload);
+  }
+  o_free(header_str);
+  json_decref(j_header);
+  r_jwk_free(jwk);
+  return length;
+}
+
+int r_jws_serialize_to(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags, char * output, size_t * output_len) {
+  jwk_t * jwk = NULL;
+  unsigned char * payload = NULL, * sig = NULL;
+  size_t length, payload_len = 0, sig_len = 0, header_len = 0, encoded_len;
+  struct _r_b64url_writer writer;
+  int ret = RHN_OK, zip = 0;
+
+  if (jws != NULL && output != NULL && output_len != NULL && r_jws_get_alg(jws) != R_JWA_ALG_NONE) {
+    // The key is used in place and the token is written straight into output
+    jwk = _r_jws_get_sign_key_in_place(jws, jwk_privkey);
+    _r_jws_set_sign_header(jws, jwk);
+    if ((sig_len = _r_jws_get_signature_len(jws->alg, jwk, x5u_flags))) {
+      if (!jws->payload_len) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialize_to - Error empty payload");
+        ret = RHN_ERROR_PARAM;
+      } else if (0 == o_strcmp("DEF", r_jws_get_header_str_value(jws, "zip"))) {
+        zip = 1;
+        if ((ret = _r_deflate_payload(jws->payload, jws->payload_len, &payload, &payload_len)) != RHN_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialize_to - Error _r_deflate_payload");
+        }
+      } else {
+        payload = jws->payload;
+        payload_len = jws->payload_len;
+      }
+      if (ret == RHN_OK) {
+        _r_b64url_writer_init(&writer, (unsigned char *)output, *output_len);
+        if (!json_dump_callback(jws->j_header, _r_b64url_writer_write, &writer, JSON_COMPACT)) {
+          header_len = _r_b64url_writer_end(&writer);
+          length = header_len + 1 + _r_get_base64url_len(payload_len) + 1 + _r_get_base64url_len(sig_len);
+          if (length <= *output_len) {
+            output[header_len] = '.';
+            _r_b64url_writer_init(&writer, (unsigned char *)output+header_len+1, _r_get_base64url_len(payload_len));
+            _r_b64url_writer_write((const char *)payload, payload_len, &writer);
+            encoded_len = header_len + 1 + _r_b64url_writer_end(&writer);
+            if ((sig = _r_scratch_get(_R_SCRATCH_SIGNATURE, sig_len)) != NULL) {
+              if (_r_generate_signature_raw(jws, jwk, jws->alg, (const unsigned char *)output, encoded_len, sig, &sig_len, x5u_flags) == RHN_OK) {
+                output[encoded_len++] = '.';
+                _r_b64url_writer_init(&writer, (unsigned char *)output+encoded_len, *output_len-encoded_len);
+                _r_b64url_writer_write((const char *)sig, sig_len, &writer);
+                *output_len = encoded_len + _r_b64url_writer_end(&writer);
+                // The encoded values of a previous serialization don't match the jws anymore
+                o_free(jws->header_b64url);
+                jws->header_b64url = NULL;
+                o_free(jws->payload_b64url);
+                jws->payload_b64url = NULL;
+                o_free(jws->signature_b64url);
+                jws->signature_b64url = NULL;
+              } else {
+                y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialize_to - No signature");
+                ret = RHN_ERROR;
+              }
+              _r_scratch_release(_R_SCRATCH_SIGNATURE, 0);
+            } else {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialize_to - Error allocating resources for sig");
+              ret = RHN_ERROR_MEMORY;
+            }
+          } else {
+            *output_len = length;
+            ret = RHN_ERROR_PARAM;
+          }
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialize_to - Error json_dump_callback header");
+          ret = RHN_ERROR;
+        }
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialize_to - Error invalid key for alg");
+      ret = RHN_ERROR_PARAM;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialize_to - Error input parameters");
+    ret = RHN_ERROR_PARAM;
+  }
+  if (zip) {
+    o_free(payload);
+  }
+  return ret;
+}
+
 char * r_jws_serialize_json_str(jws_t * jws, jwks_t * jwks_privkey, int x5u_flags, int mode) {
   json_t * j_result = r_jws_serialize_json_t(jws, jwks_privkey, x5u_flags, mode);
   char * str_result = json_dumps(j_result, JSON_COMPACT);
@@ -1928,6 +2582,9 @@ json_t * r_jws_serialize_json_t(jws_t * jws, jwks_t * jwks_privkey, int x5u_flag
 
   if (jwks_privkey == NULL) {
     jwks_privkey = jws->jwks_privkey;
+    if (!r_jwks_size(jwks_privkey) && jws->jwks_shared_privkey != NULL) {
+      jwks_privkey = _r_jwks_shared_jwks(jws->jwks_shared_privkey);
+    }
   }
   if (jws != NULL && r_jwks_size(jwks_privkey)) {
     jws->token_mode = mode;
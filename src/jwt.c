@@ -22,7 +22,10 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <math.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 #include <gnutls/abstract.h>
@@ -31,6 +34,775 @@
 #include <yder.h>
 #include <rhonabwy.h>
 
+/**
+ * Clears the internal jws and its keys, or allocates it if needed
+ */
+static int _r_jwt_reset_jws(jwt_t * jwt) {
+  int ret;
+
+  if (jwt->jws == NULL) {
+    ret = r_jws_init(&jwt->jws);
+  } else if ((ret = r_jws_reset(jwt->jws)) == RHN_OK) {
+    r_jwks_empty(jwt->jws->jwks_privkey);
+    r_jwks_empty(jwt->jws->jwks_pubkey);
+  }
+  return ret;
+}
+
+/**
+ * Clears the internal jwe and its keys, or allocates it if needed
+ */
+static int _r_jwt_reset_jwe(jwt_t * jwt) {
+  int ret;
+
+  if (jwt->jwe == NULL) {
+    ret = r_jwe_init(&jwt->jwe);
+  } else if ((ret = r_jwe_reset(jwt->jwe)) == RHN_OK) {
+    r_jwks_empty(jwt->jwe->jwks_privkey);
+    r_jwks_empty(jwt->jwe->jwks_pubkey);
+  }
+  return ret;
+}
+
+/**
+ * Attaches the jwt signature keys to the internal jws before a verification
+ * The key arrays are set by reference, not copied, the previous arrays
+ * of the jws are emptied and kept in j_keys for _r_jwt_detach_sign_keys
+ */
+static void _r_jwt_attach_sign_keys(jwt_t * jwt, json_t ** j_keys) {
+  j_keys[0] = json_incref(json_object_get(jwt->jws->jwks_privkey, "keys"));
+  j_keys[1] = json_incref(json_object_get(jwt->jws->jwks_pubkey, "keys"));
+  json_array_clear(j_keys[0]);
+  json_array_clear(j_keys[1]);
+  json_object_set(jwt->jws->jwks_privkey, "keys", json_object_get(jwt->jwks_privkey_sign, "keys"));
+  json_object_set(jwt->jws->jwks_pubkey, "keys", json_object_get(jwt->jwks_pubkey_sign, "keys"));
+  r_jws_set_shared_jwks(jwt->jws, jwt->jwks_shared_privkey_sign, jwt->jwks_shared_pubkey_sign);
+  r_jws_set_jwks_store(jwt->jws, jwt->jwks_store_sign);
+}
+
+/**
+ * Gives the internal jws its own key arrays back after a verification
+ */
+static void _r_jwt_detach_sign_keys(jwt_t * jwt, json_t ** j_keys) {
+  json_object_set_new(jwt->jws->jwks_privkey, "keys", j_keys[0]);
+  json_object_set_new(jwt->jws->jwks_pubkey, "keys", j_keys[1]);
+}
+
+/**
+ * Adds the keys extracted from the jws header to the jwt signature keys
+ * and records them so r_jwt_reset can remove them
+ */
+static int _r_jwt_add_sign_header_jwks(jwt_t * jwt) {
+  size_t jwks_size = r_jwks_size(jwt->jwks_pubkey_sign);
+  int ret = RHN_OK;
+
+  if (r_jwks_size(jwt->jws->jwks_pubkey)) {
+    ret = r_jwt_add_sign_jwks(jwt, NULL, jwt->jws->jwks_pubkey);
+    if (_r_jwks_add_header_keys(jwt->jwks_pubkey_sign, jwks_size, &jwt->j_jwks_pubkey_sign_header) != RHN_OK) {
+      ret = RHN_ERROR_MEMORY;
+    }
+  }
+  return ret;
+}
+
+/**
+ * Adds the keys extracted from the jwe header to the jwt encryption keys
+ * and records them so r_jwt_reset can remove them
+ */
+static int _r_jwt_add_enc_header_jwks(jwt_t * jwt) {
+  size_t jwks_size = r_jwks_size(jwt->jwks_pubkey_enc);
+  int ret = RHN_OK;
+
+  if (r_jwks_size(jwt->jwe->jwks_pubkey)) {
+    ret = r_jwt_add_enc_jwks(jwt, NULL, jwt->jwe->jwks_pubkey);
+    if (_r_jwks_add_header_keys(jwt->jwks_pubkey_enc, jwks_size, &jwt->j_jwks_pubkey_enc_header) != RHN_OK) {
+      ret = RHN_ERROR_MEMORY;
+    }
+  }
+  return ret;
+}
+
+/**
+ * Decodes a base64url token segment one byte at a time,
+ * so the segment is never decoded as a whole,
+ * or reads plain JSON text if raw is set
+ */
+struct _r_peek_reader {
+  const char    * src;
+  size_t          src_len;
+  size_t          src_pos;
+  unsigned char   bytes[3];
+  size_t          nb_bytes;
+  size_t          byte_pos;
+  int             raw;
+  int             error;
+};
+
+/**
+ * Options of _r_peek_json_values_list
+ * _R_PEEK_RAW: the source is JSON text instead of a base64url segment
+ * _R_PEEK_LAST: scan the whole object, the last occurrence of a member is kept as jansson does
+ * _R_PEEK_TYPED: each value is preceded in the buffer by '"' if it's a string, ' ' otherwise
+ */
+#define _R_PEEK_RAW   0x01
+#define _R_PEEK_LAST  0x02
+#define _R_PEEK_TYPED 0x04
+
+/**
+ * Maximum nesting of the skipped values, so a value is never deeper than jansson's parser limit
+ * A scalar longer than _R_PEEK_MAX_SCALAR is rejected, the caller falls back to jansson
+ */
+#define _R_PEEK_MAX_DEPTH  2046
+#define _R_PEEK_MAX_SCALAR 128
+
+static int _r_peek_b64url_value(char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A';
+  } else if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 26;
+  } else if (c >= '0' && c <= '9') {
+    return c - '0' + 52;
+  } else if (c == '-') {
+    return 62;
+  } else if (c == '_') {
+    return 63;
+  } else {
+    return -1;
+  }
+}
+
+/**
+ * Returns the next decoded byte of the segment,
+ * or -1 at the end of the segment or on error
+ */
+static int _r_peek_getc(struct _r_peek_reader * reader) {
+  unsigned int block = 0;
+  size_t nb_chars = 0;
+  int value;
+
+  if (reader->raw) {
+    if (reader->src_pos < reader->src_len) {
+      return (unsigned char)reader->src[reader->src_pos++];
+    }
+    return -1;
+  } else if (reader->byte_pos >= reader->nb_bytes) {
+    while (nb_chars < 4 && reader->src_pos < reader->src_len && reader->src[reader->src_pos] != '=') {
+      if ((value = _r_peek_b64url_value(reader->src[reader->src_pos])) < 0) {
+        reader->error = 1;
+        return -1;
+      }
+      block = (block << 6) | (unsigned int)value;
+      nb_chars++;
+      reader->src_pos++;
+    }
+    if (nb_chars < 2) {
+      if (nb_chars == 1) {
+        reader->error = 1;
+      }
+      return -1;
+    }
+    block <<= 6*(4-nb_chars);
+    reader->bytes[0] = (unsigned char)((block >> 16) & 0xff);
+    reader->bytes[1] = (unsigned char)((block >> 8) & 0xff);
+    reader->bytes[2] = (unsigned char)(block & 0xff);
+    reader->nb_bytes = nb_chars-1;
+    reader->byte_pos = 0;
+  }
+  return reader->bytes[reader->byte_pos++];
+}
+
+static int _r_peek_skip_ws(struct _r_peek_reader * reader, int c) {
+  while (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+    c = _r_peek_getc(reader);
+  }
+  return c;
+}
+
+/**
+ * Appends a byte to out if there's enough space,
+ * len is always increased so the caller can detect a truncated value
+ */
+static void _r_peek_put(char * out, size_t out_len, size_t * len, unsigned int c) {
+  if (out != NULL && *len < out_len) {
+    out[*len] = (char)c;
+  }
+  (*len)++;
+}
+
+static int _r_peek_read_hex4(struct _r_peek_reader * reader, unsigned int * code) {
+  int c, i;
+
+  *code = 0;
+  for (i=0; i<4; i++) {
+    c = _r_peek_getc(reader);
+    if (c >= '0' && c <= '9') {
+      *code = (*code << 4) | (unsigned int)(c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      *code = (*code << 4) | (unsigned int)(c - 'a' + 10);
+    } else if (c >= 'A' && c <= 'F') {
+      *code = (*code << 4) | (unsigned int)(c - 'A' + 10);
+    } else {
+      return RHN_ERROR_PARAM;
+    }
+  }
+  return RHN_OK;
+}
+
+/**
+ * Reads the continuation bytes of the UTF-8 sequence starting with c and appends the sequence to out
+ * Overlong sequences, surrogates and code points above U+10FFFF are rejected as jansson does
+ */
+static int _r_peek_read_utf8(struct _r_peek_reader * reader, int c, char * out, size_t out_len, size_t * len) {
+  unsigned int code, min;
+  int i, size, next;
+
+  if (c >= 0xC2 && c <= 0xDF) {
+    size = 2;
+    code = (unsigned int)c & 0x1F;
+    min = 0x80;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    size = 3;
+    code = (unsigned int)c & 0x0F;
+    min = 0x800;
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    size = 4;
+    code = (unsigned int)c & 0x07;
+    min = 0x10000;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+  _r_peek_put(out, out_len, len, (unsigned int)c);
+  for (i=1; i<size; i++) {
+    if ((next = _r_peek_getc(reader)) < 0x80 || next > 0xBF) {
+      return RHN_ERROR_PARAM;
+    }
+    code = (code << 6) | ((unsigned int)next & 0x3F);
+    _r_peek_put(out, out_len, len, (unsigned int)next);
+  }
+  if (code < min || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF)) {
+    return RHN_ERROR_PARAM;
+  }
+  return RHN_OK;
+}
+
+/**
+ * Reads a JSON string after its opening quote and writes its unescaped value in out
+ * The string is rejected if it contains \u0000, as json_loads does without JSON_ALLOW_NUL
+ */
+static int _r_peek_read_string(struct _r_peek_reader * reader, char * out, size_t out_len, size_t * len) {
+  int c;
+  unsigned int code, low;
+
+  *len = 0;
+  while ((c = _r_peek_getc(reader)) != '"') {
+    if (c < 0x20) {
+      return RHN_ERROR_PARAM;
+    } else if (c >= 0x80) {
+      if (_r_peek_read_utf8(reader, c, out, out_len, len) != RHN_OK) {
+        return RHN_ERROR_PARAM;
+      }
+    } else if (c == '\\') {
+      c = _r_peek_getc(reader);
+      if (c == '"' || c == '\\' || c == '/') {
+        _r_peek_put(out, out_len, len, (unsigned int)c);
+      } else if (c == 'b') {
+        _r_peek_put(out, out_len, len, '\b');
+      } else if (c == 'f') {
+        _r_peek_put(out, out_len, len, '\f');
+      } else if (c == 'n') {
+        _r_peek_put(out, out_len, len, '\n');
+      } else if (c == 'r') {
+        _r_peek_put(out, out_len, len, '\r');
+      } else if (c == 't') {
+        _r_peek_put(out, out_len, len, '\t');
+      } else if (c == 'u' && _r_peek_read_hex4(reader, &code) == RHN_OK) {
+        if (code >= 0xD800 && code <= 0xDBFF) {
+          if (_r_peek_getc(reader) != '\\' || _r_peek_getc(reader) != 'u' || _r_peek_read_hex4(reader, &low) != RHN_OK || low < 0xDC00 || low > 0xDFFF) {
+            return RHN_ERROR_PARAM;
+          }
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+        } else if ((code >= 0xDC00 && code <= 0xDFFF) || !code) {
+          return RHN_ERROR_PARAM;
+        }
+        if (code < 0x80) {
+          _r_peek_put(out, out_len, len, code);
+        } else if (code < 0x800) {
+          _r_peek_put(out, out_len, len, 0xC0 | (code >> 6));
+          _r_peek_put(out, out_len, len, 0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+          _r_peek_put(out, out_len, len, 0xE0 | (code >> 12));
+          _r_peek_put(out, out_len, len, 0x80 | ((code >> 6) & 0x3F));
+          _r_peek_put(out, out_len, len, 0x80 | (code & 0x3F));
+        } else {
+          _r_peek_put(out, out_len, len, 0xF0 | (code >> 18));
+          _r_peek_put(out, out_len, len, 0x80 | ((code >> 12) & 0x3F));
+          _r_peek_put(out, out_len, len, 0x80 | ((code >> 6) & 0x3F));
+          _r_peek_put(out, out_len, len, 0x80 | (code & 0x3F));
+        }
+      } else {
+        return RHN_ERROR_PARAM;
+      }
+    } else {
+      _r_peek_put(out, out_len, len, (unsigned int)c);
+    }
+  }
+  return RHN_OK;
+}
+
+static int _r_peek_is_scalar_char(int c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '+' || c == '.';
+}
+
+static int _r_peek_is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+/**
+ * Checks that value is a JSON literal or a number that jansson can load:
+ * an integer must fit in a json_int_t and a real must not overflow
+ */
+static int _r_peek_check_scalar(const char * value) {
+  const char * cur = value;
+  double real;
+  int is_real = 0;
+
+  if (0 == o_strcmp(value, "true") || 0 == o_strcmp(value, "false") || 0 == o_strcmp(value, "null")) {
+    return RHN_OK;
+  }
+  if (*cur == '-') {
+    cur++;
+  }
+  if (*cur == '0') {
+    cur++;
+  } else if (*cur >= '1' && *cur <= '9') {
+    while (_r_peek_is_digit(*cur)) {
+      cur++;
+    }
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+  if (*cur == '.') {
+    is_real = 1;
+    cur++;
+    if (!_r_peek_is_digit(*cur)) {
+      return RHN_ERROR_PARAM;
+    }
+    while (_r_peek_is_digit(*cur)) {
+      cur++;
+    }
+  }
+  if (*cur == 'e' || *cur == 'E') {
+    is_real = 1;
+    cur++;
+    if (*cur == '+' || *cur == '-') {
+      cur++;
+    }
+    if (!_r_peek_is_digit(*cur)) {
+      return RHN_ERROR_PARAM;
+    }
+    while (_r_peek_is_digit(*cur)) {
+      cur++;
+    }
+  }
+  if (*cur != '\0') {
+    return RHN_ERROR_PARAM;
+  }
+  errno = 0;
+  if (is_real) {
+    real = strtod(value, NULL);
+    if ((real == HUGE_VAL || real == -HUGE_VAL) && errno == ERANGE) {
+      return RHN_ERROR_PARAM;
+    }
+  } else if (strtoll(value, NULL, 10) && errno == ERANGE) {
+    return RHN_ERROR_PARAM;
+  }
+  return RHN_OK;
+}
+
+/**
+ * Reads a JSON scalar starting with *c and writes it in out
+ * *c is set to the character following the scalar
+ */
+static int _r_peek_read_scalar(struct _r_peek_reader * reader, int * c, char * out, size_t out_len, size_t * len) {
+  char value[_R_PEEK_MAX_SCALAR+1];
+  size_t value_len = 0;
+
+  *len = 0;
+  while (_r_peek_is_scalar_char(*c)) {
+    _r_peek_put(value, _R_PEEK_MAX_SCALAR, &value_len, (unsigned int)*c);
+    _r_peek_put(out, out_len, len, (unsigned int)*c);
+    *c = _r_peek_getc(reader);
+  }
+  if (value_len > _R_PEEK_MAX_SCALAR) {
+    return RHN_ERROR_PARAM;
+  }
+  value[value_len] = '\0';
+  return _r_peek_check_scalar(value);
+}
+
+/**
+ * Reads an object member name starting with *c and its following colon,
+ * *c is set to the first character of the member value
+ */
+static int _r_peek_skip_member_name(struct _r_peek_reader * reader, int * c) {
+  size_t len;
+
+  if (*c != '"' || _r_peek_read_string(reader, NULL, 0, &len) != RHN_OK || _r_peek_skip_ws(reader, _r_peek_getc(reader)) != ':') {
+    return RHN_ERROR_PARAM;
+  }
+  *c = _r_peek_skip_ws(reader, _r_peek_getc(reader));
+  return RHN_OK;
+}
+
+/**
+ * Skips a JSON value starting with *c, *c is set to the character following the value
+ * The value is fully validated, so a scan accepts only what json_loads accepts
+ */
+static int _r_peek_skip_value(struct _r_peek_reader * reader, int * c) {
+  char stack[_R_PEEK_MAX_DEPTH];
+  size_t depth = 0, len;
+  int ret = RHN_OK, complete;
+
+  do {
+    complete = 0;
+    if (*c == '"') {
+      ret = _r_peek_read_string(reader, NULL, 0, &len);
+      *c = _r_peek_getc(reader);
+      complete = 1;
+    } else if ((*c == '{' || *c == '[') && depth < _R_PEEK_MAX_DEPTH) {
+      stack[depth++] = (char)(*c == '{'?'}':']');
+      *c = _r_peek_skip_ws(reader, _r_peek_getc(reader));
+      if (*c == stack[depth-1]) {
+        depth--;
+        *c = _r_peek_getc(reader);
+        complete = 1;
+      } else if (stack[depth-1] == '}') {
+        ret = _r_peek_skip_member_name(reader, c);
+      }
+    } else if (_r_peek_is_scalar_char(*c)) {
+      ret = _r_peek_read_scalar(reader, c, NULL, 0, &len);
+      complete = 1;
+    } else {
+      ret = RHN_ERROR_PARAM;
+    }
+    // Close the containers ended by this value
+    while (ret == RHN_OK && complete && depth) {
+      *c = _r_peek_skip_ws(reader, *c);
+      if (*c == ',') {
+        *c = _r_peek_skip_ws(reader, _r_peek_getc(reader));
+        if (stack[depth-1] == '}') {
+          ret = _r_peek_skip_member_name(reader, c);
+        }
+        complete = 0;
+      } else if (*c == stack[depth-1]) {
+        depth--;
+        *c = _r_peek_getc(reader);
+      } else {
+        ret = RHN_ERROR_PARAM;
+      }
+    }
+  } while (ret == RHN_OK && depth);
+  return ret;
+}
+
+/**
+ * Returns the output pointer of the member name key,
+ * NULL if the member isn't requested or is already found
+ */
+typedef const char ** (* _r_peek_output_cb)(void * cls, int flags, const char * key, size_t key_len);
+
+/**
+ * List of const char * name, const char ** value, ending with NULL
+ */
+struct _r_peek_va_output {
+  va_list vl;
+};
+
+/**
+ * _r_peek_output_cb of a va_list of names and values
+ */
+static const char ** _r_peek_get_output(void * cls, int flags, const char * key, size_t key_len) {
+  const char * name, ** value, ** ret = NULL;
+  va_list vl_copy;
+
+  va_copy(vl_copy, ((struct _r_peek_va_output *)cls)->vl);
+  for (name = va_arg(vl_copy, const char *); name != NULL && ret == NULL; name = va_arg(vl_copy, const char *)) {
+    value = va_arg(vl_copy, const char **);
+    if (o_strlen(name) == key_len && 0 == memcmp(name, key, key_len) && (*value == NULL || (flags & _R_PEEK_LAST))) {
+      ret = value;
+    }
+  }
+  va_end(vl_copy);
+  return ret;
+}
+
+/**
+ * Scans the JSON object encoded in a base64url segment
+ * and copies the values of the members returned by get_output in buffer
+ * The scan stops when nb_names values are found, unless _R_PEEK_LAST is set
+ */
+static int _r_peek_json_scan(const char * segment, size_t segment_len, int flags, char * buffer, size_t buffer_len, size_t nb_names, _r_peek_output_cb get_output, void * cls) {
+  struct _r_peek_reader reader;
+  const char ** value;
+  char key[64];
+  size_t nb_found = 0, offset = 0, start, len;
+  int ret = RHN_OK, c, is_string;
+
+  if (segment != NULL && segment_len && buffer != NULL) {
+    memset(&reader, 0, sizeof(struct _r_peek_reader));
+    reader.src = segment;
+    reader.src_len = segment_len;
+    reader.raw = flags & _R_PEEK_RAW;
+    if ((c = _r_peek_skip_ws(&reader, _r_peek_getc(&reader))) == '{') {
+      c = _r_peek_skip_ws(&reader, _r_peek_getc(&reader));
+      while (ret == RHN_OK && c != '}' && (nb_found < nb_names || (flags & _R_PEEK_LAST))) {
+        if (c != '"' || _r_peek_read_string(&reader, key, sizeof(key), &len) != RHN_OK) {
+          ret = RHN_ERROR_PARAM;
+          break;
+        }
+        if (_r_peek_skip_ws(&reader, _r_peek_getc(&reader)) != ':') {
+          ret = RHN_ERROR_PARAM;
+          break;
+        }
+        c = _r_peek_skip_ws(&reader, _r_peek_getc(&reader));
+        value = NULL;
+        if (len <= sizeof(key)) {
+          value = get_output(cls, flags, key, len);
+        }
+        if (value != NULL && (c == '"' || _r_peek_is_scalar_char(c))) {
+          start = offset;
+          if (flags & _R_PEEK_TYPED) {
+            _r_peek_put(buffer, buffer_len, &offset, c == '"'?'"':' ');
+          }
+          if ((is_string = (c == '"'))) {
+            ret = _r_peek_read_string(&reader, buffer+offset, offset<buffer_len?buffer_len-offset:0, &len);
+            c = _r_peek_getc(&reader);
+          } else {
+            ret = _r_peek_read_scalar(&reader, &c, buffer+offset, offset<buffer_len?buffer_len-offset:0, &len);
+          }
+          if (ret == RHN_OK && offset+len < buffer_len) {
+            buffer[offset+len] = '\0';
+            if (is_string || 0 != o_strcmp(buffer+offset, "null")) {
+              *value = buffer+start;
+            } else {
+              *value = NULL;
+            }
+            offset += len+1;
+            nb_found++;
+          } else if (ret == RHN_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "_r_peek_json_values_list - Error buffer too small");
+            ret = RHN_ERROR_PARAM;
+            break;
+          }
+        } else {
+          if (value != NULL) {
+            *value = NULL;
+          }
+          if (_r_peek_skip_value(&reader, &c) != RHN_OK) {
+            ret = RHN_ERROR_PARAM;
+            break;
+          }
+        }
+        c = _r_peek_skip_ws(&reader, c);
+        if (c == ',') {
+          c = _r_peek_skip_ws(&reader, _r_peek_getc(&reader));
+        } else if (c != '}') {
+          ret = RHN_ERROR_PARAM;
+        }
+      }
+      if (ret == RHN_OK && (flags & _R_PEEK_LAST) && _r_peek_skip_ws(&reader, _r_peek_getc(&reader)) != -1) {
+        // Trailing characters after the object
+        ret = RHN_ERROR_PARAM;
+      }
+    } else {
+      ret = RHN_ERROR_PARAM;
+    }
+    if (reader.error) {
+      ret = RHN_ERROR_PARAM;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+/**
+ * Scans the JSON object encoded in a base64url segment
+ * and copies the values of the requested members in buffer
+ * vl is a list of const char * name, const char ** value, ending with NULL
+ */
+static int _r_peek_json_values_list(const char * segment, size_t segment_len, int flags, char * buffer, size_t buffer_len, va_list vl) {
+  struct _r_peek_va_output output;
+  const char * name, ** value;
+  size_t nb_names = 0;
+  int ret = RHN_OK;
+  va_list vl_copy;
+
+  va_copy(vl_copy, vl);
+  for (name = va_arg(vl_copy, const char *); name != NULL; name = va_arg(vl_copy, const char *)) {
+    value = va_arg(vl_copy, const char **);
+    if (value != NULL) {
+      *value = NULL;
+      nb_names++;
+    } else {
+      ret = RHN_ERROR_PARAM;
+    }
+  }
+  va_end(vl_copy);
+
+  if (ret == RHN_OK) {
+    va_copy(output.vl, vl);
+    ret = _r_peek_json_scan(segment, segment_len, flags, buffer, buffer_len, nb_names, _r_peek_get_output, &output);
+    va_end(output.vl);
+  }
+  return ret;
+}
+
+static int _r_peek_json_values(const char * segment, size_t segment_len, int flags, char * buffer, size_t buffer_len, ...) {
+  int ret;
+  va_list vl;
+
+  va_start(vl, buffer_len);
+  ret = _r_peek_json_values_list(segment, segment_len, flags, buffer, buffer_len, vl);
+  va_end(vl);
+  return ret;
+}
+
+/**
+ * Claims of a token parsed with R_PARSE_LAZY_CLAIMS
+ * payload is the claims JSON text, NULL once it's loaded in j_claims
+ * values points to the registered claims values in buffer, each value is
+ * preceded by its type: '"' for a string, ' ' for another scalar
+ * buffer is kept until the token is reset so the returned values remain valid
+ */
+struct _r_jwt_lazy_claims {
+  char       * payload;
+  size_t       payload_len;
+  char       * buffer;
+  const char * values[7];
+  int          scanned;
+};
+
+static const char * const _r_jwt_registered_claims[7] = {"iss", "sub", "aud", "exp", "nbf", "iat", "jti"};
+
+/**
+ * Frees the lazy claims of the jwt
+ */
+static void _r_jwt_lazy_claims_free(jwt_t * jwt) {
+  if (jwt->lazy_claims != NULL) {
+    o_free(jwt->lazy_claims->payload);
+    o_free(jwt->lazy_claims->buffer);
+    o_free(jwt->lazy_claims);
+    jwt->lazy_claims = NULL;
+  }
+}
+
+/**
+ * Loads the lazy claims payload in j_claims if it's not already done
+ */
+static int _r_jwt_claims_load(jwt_t * jwt) {
+  int ret = RHN_OK;
+
+  if (jwt->lazy_claims != NULL && jwt->lazy_claims->payload != NULL) {
+    json_decref(jwt->j_claims);
+    if ((jwt->j_claims = json_loads(jwt->lazy_claims->payload, JSON_DECODE_ANY, NULL)) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwt_claims_load - Error parsing payload as JSON");
+      ret = RHN_ERROR;
+    }
+    o_free(jwt->lazy_claims->payload);
+    jwt->lazy_claims->payload = NULL;
+  }
+  return ret;
+}
+
+/**
+ * Gets the value of a registered claim without loading the claims
+ * value is set to the typed value, or NULL if the claim is missing or isn't a scalar
+ * Returns RHN_ERROR_PARAM if the claims must be loaded to get the value
+ */
+static int _r_jwt_lazy_claims_get(jwt_t * jwt, const char * key, const char ** value) {
+  struct _r_jwt_lazy_claims * lazy = jwt->lazy_claims;
+  size_t i;
+  int ret = RHN_ERROR_PARAM;
+
+  if (lazy != NULL && lazy->payload != NULL) {
+    if (!lazy->scanned) {
+      lazy->scanned = -1;
+      if ((lazy->buffer = o_malloc(lazy->payload_len+16)) != NULL) {
+        if (_r_peek_json_values(lazy->payload, lazy->payload_len, _R_PEEK_RAW|_R_PEEK_LAST|_R_PEEK_TYPED, lazy->buffer, lazy->payload_len+16,
+                                _r_jwt_registered_claims[0], &lazy->values[0],
+                                _r_jwt_registered_claims[1], &lazy->values[1],
+                                _r_jwt_registered_claims[2], &lazy->values[2],
+                                _r_jwt_registered_claims[3], &lazy->values[3],
+                                _r_jwt_registered_claims[4], &lazy->values[4],
+                                _r_jwt_registered_claims[5], &lazy->values[5],
+                                _r_jwt_registered_claims[6], &lazy->values[6],
+                                NULL) == RHN_OK) {
+          lazy->scanned = 1;
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwt_lazy_claims_get - Error allocating resources for buffer");
+      }
+    }
+    if (lazy->scanned == 1) {
+      for (i=0; i<7; i++) {
+        if (0 == o_strcmp(key, _r_jwt_registered_claims[i])) {
+          *value = lazy->values[i];
+          ret = RHN_OK;
+          break;
+        }
+      }
+    }
+  }
+  return ret;
+}
+
+/**
+ * Checks that a scalar value is an integer as jansson parses it
+ */
+static int _r_jwt_lazy_is_integer(const char * value) {
+  if (*value == '-') {
+    value++;
+  }
+  if (*value < '0' || *value > '9') {
+    return 0;
+  }
+  while (*value >= '0' && *value <= '9') {
+    value++;
+  }
+  return *value == '\0';
+}
+
+/**
+ * Builds a JSON object with the registered claims without loading the claims
+ * Returns NULL if the claims must be loaded
+ */
+static json_t * _r_jwt_lazy_claims_registered(jwt_t * jwt) {
+  json_t * j_claims = NULL, * j_value;
+  const char * value = NULL;
+  size_t i;
+
+  if (_r_jwt_lazy_claims_get(jwt, _r_jwt_registered_claims[0], &value) == RHN_OK && (j_claims = json_object()) != NULL) {
+    for (i=0; i<7; i++) {
+      if ((value = jwt->lazy_claims->values[i]) != NULL) {
+        if (*value == '"') {
+          j_value = json_string(value+1);
+        } else if (_r_jwt_lazy_is_integer(value+1)) {
+          j_value = json_integer((json_int_t)strtoll(value+1, NULL, 10));
+        } else if (0 == o_strcmp(value+1, "true")) {
+          j_value = json_true();
+        } else if (0 == o_strcmp(value+1, "false")) {
+          j_value = json_false();
+        } else {
+          j_value = json_real(strtod(value+1, NULL));
+        }
+        json_object_set_new(j_claims, _r_jwt_registered_claims[i], j_value);
+      }
+    }
+  }
+  return j_claims;
+}
+
 int r_jwt_init(jwt_t ** jwt) {
   int ret;
 
@@ -53,6 +825,14 @@ int r_jwt_init(jwt_t ** jwt) {
                   (*jwt)->key_len = 0;
                   (*jwt)->iv = NULL;
                   (*jwt)->iv_len = 0;
+                  (*jwt)->j_jwks_pubkey_sign_header = NULL;
+                  (*jwt)->j_jwks_pubkey_enc_header = NULL;
+                  (*jwt)->jwks_store_sign = NULL;
+                  (*jwt)->jwks_shared_privkey_sign = NULL;
+                  (*jwt)->jwks_shared_pubkey_sign = NULL;
+                  (*jwt)->jwks_shared_privkey_enc = NULL;
+                  (*jwt)->jwks_shared_pubkey_enc = NULL;
+                  (*jwt)->lazy_claims = NULL;
                   ret = RHN_OK;
                 } else {
                   y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_init - Error allocating resources for jwks_pubkey_enc");
@@ -92,6 +872,42 @@ int r_jwt_init(jwt_t ** jwt) {
   return ret;
 }
 
+int r_jwt_reset(jwt_t * jwt) {
+  int ret;
+
+  if (jwt != NULL) {
+    _r_jwks_remove_header_keys(jwt->jwks_pubkey_sign, jwt->j_jwks_pubkey_sign_header);
+    _r_jwks_remove_header_keys(jwt->jwks_pubkey_enc, jwt->j_jwks_pubkey_enc_header);
+    _r_secure_free(jwt->key);
+    jwt->key = NULL;
+    jwt->key_len = 0;
+    o_free(jwt->iv);
+    jwt->iv = NULL;
+    jwt->iv_len = 0;
+    jwt->sign_alg = R_JWA_ALG_UNKNOWN;
+    jwt->enc_alg = R_JWA_ALG_UNKNOWN;
+    jwt->enc = R_JWA_ENC_UNKNOWN;
+    jwt->type = R_JWT_TYPE_NONE;
+    jwt->parse_flags = R_PARSE_HEADER_ALL;
+    _r_jwt_lazy_claims_free(jwt);
+    if (_r_json_object_reset(&jwt->j_header) != RHN_OK || _r_json_object_reset(&jwt->j_claims) != RHN_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_reset - Error resetting header or claims");
+      ret = RHN_ERROR_MEMORY;
+    } else if (jwt->jws != NULL && _r_jwt_reset_jws(jwt) != RHN_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_reset - Error resetting jws");
+      ret = RHN_ERROR;
+    } else if (jwt->jwe != NULL && _r_jwt_reset_jwe(jwt) != RHN_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_reset - Error resetting jwe");
+      ret = RHN_ERROR;
+    } else {
+      ret = RHN_OK;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
 void r_jwt_free(jwt_t * jwt) {
   if (jwt != NULL) {
     r_jwks_free(jwt->jwks_privkey_sign);
@@ -100,10 +916,17 @@ void r_jwt_free(jwt_t * jwt) {
     r_jwks_free(jwt->jwks_pubkey_enc);
     r_jwe_free(jwt->jwe);
     r_jws_free(jwt->jws);
-    o_free(jwt->key);
+    _r_secure_free(jwt->key);
     o_free(jwt->iv);
     json_decref(jwt->j_header);
     json_decref(jwt->j_claims);
+    _r_jwt_lazy_claims_free(jwt);
+    r_jwks_shared_free(jwt->jwks_shared_privkey_sign);
+    r_jwks_shared_free(jwt->jwks_shared_pubkey_sign);
+    r_jwks_shared_free(jwt->jwks_shared_privkey_enc);
+    r_jwks_shared_free(jwt->jwks_shared_pubkey_enc);
+    json_decref(jwt->j_jwks_pubkey_sign_header);
+    json_decref(jwt->j_jwks_pubkey_enc_header);
     o_free(jwt);
   }
 }
@@ -117,7 +940,8 @@ jwt_t * r_jwt_copy(jwt_t * jwt) {
       jwt_copy->enc_alg = jwt->enc_alg;
       jwt_copy->enc = jwt->enc;
       json_decref(jwt_copy->j_header);
-      if (r_jwt_set_full_claims_json_t(jwt_copy, jwt->j_claims) != RHN_OK ||
+      if (_r_jwt_claims_load(jwt) != RHN_OK ||
+        r_jwt_set_full_claims_json_t(jwt_copy, jwt->j_claims) != RHN_OK ||
         r_jwt_add_enc_jwks(jwt_copy, jwt->jwks_privkey_enc, jwt->jwks_pubkey_enc) != RHN_OK ||
         r_jwt_add_sign_jwks(jwt_copy, jwt->jwks_privkey_sign, jwt->jwks_pubkey_sign) != RHN_OK ||
         (jwt_copy->j_header = json_deep_copy(jwt->j_header)) == NULL) {
@@ -127,6 +951,9 @@ jwt_t * r_jwt_copy(jwt_t * jwt) {
       } else {
         jwt_copy->jwe = r_jwe_copy(jwt->jwe);
         jwt_copy->jws = r_jws_copy(jwt->jws);
+        jwt_copy->jwks_store_sign = jwt->jwks_store_sign;
+        r_jwt_set_sign_shared_jwks(jwt_copy, jwt->jwks_shared_privkey_sign, jwt->jwks_shared_pubkey_sign);
+        r_jwt_set_enc_shared_jwks(jwt_copy, jwt->jwks_shared_privkey_enc, jwt->jwks_shared_pubkey_enc);
       }
     }
   }
@@ -194,7 +1021,7 @@ char * r_jwt_get_full_header_str(jwt_t * jwt) {
 }
 
 int r_jwt_set_claim_str_value(jwt_t * jwt, const char * key, const char * str_value) {
-  if (jwt != NULL) {
+  if (jwt != NULL && _r_jwt_claims_load(jwt) == RHN_OK) {
     return _r_json_set_str_value(jwt->j_claims, key, str_value);
   } else {
     return RHN_ERROR_PARAM;
@@ -202,7 +1029,7 @@ int r_jwt_set_claim_str_value(jwt_t * jwt, const char * key, const char * str_va
 }
 
 int r_jwt_set_claim_int_value(jwt_t * jwt, const char * key, rhn_int_t i_value) {
-  if (jwt != NULL) {
+  if (jwt != NULL && _r_jwt_claims_load(jwt) == RHN_OK) {
     return _r_json_set_int_value(jwt->j_claims, key, i_value);
   } else {
     return RHN_ERROR_PARAM;
@@ -210,7 +1037,7 @@ int r_jwt_set_claim_int_value(jwt_t * jwt, const char * key, rhn_int_t i_value)
 }
 
 int r_jwt_set_claim_json_t_value(jwt_t * jwt, const char * key, json_t * j_value) {
-  if (jwt != NULL) {
+  if (jwt != NULL && _r_jwt_claims_load(jwt) == RHN_OK) {
     return _r_json_set_json_t_value(jwt->j_claims, key, j_value);
   } else {
     return RHN_ERROR_PARAM;
@@ -218,28 +1045,40 @@ int r_jwt_set_claim_json_t_value(jwt_t * jwt, const char * key, json_t * j_value
 }
 
 const char * r_jwt_get_claim_str_value(jwt_t * jwt, const char * key) {
+  const char * value = NULL;
+
   if (jwt != NULL) {
-    return _r_json_get_str_value(jwt->j_claims, key);
+    if (_r_jwt_lazy_claims_get(jwt, key, &value) == RHN_OK) {
+      return (value != NULL && *value == '"')?value+1:NULL;
+    } else if (_r_jwt_claims_load(jwt) == RHN_OK) {
+      return _r_json_get_str_value(jwt->j_claims, key);
+    }
   }
   return NULL;
 }
 
 rhn_int_t r_jwt_get_claim_int_value(jwt_t * jwt, const char * key) {
+  const char * value = NULL;
+
   if (jwt != NULL) {
-    return _r_json_get_int_value(jwt->j_claims, key);
+    if (_r_jwt_lazy_claims_get(jwt, key, &value) == RHN_OK) {
+      return (value != NULL && *value == ' ' && _r_jwt_lazy_is_integer(value+1))?(rhn_int_t)strtoll(value+1, NULL, 10):0;
+    } else if (_r_jwt_claims_load(jwt) == RHN_OK) {
+      return _r_json_get_int_value(jwt->j_claims, key);
+    }
   }
   return 0;
 }
 
 json_t * r_jwt_get_claim_json_t_value(jwt_t * jwt, const char * key) {
-  if (jwt != NULL) {
+  if (jwt != NULL && _r_jwt_claims_load(jwt) == RHN_OK) {
     return _r_json_get_json_t_value(jwt->j_claims, key);
   }
   return NULL;
 }
 
 json_t * r_jwt_get_full_claims_json_t(jwt_t * jwt) {
-  if (jwt != NULL) {
+  if (jwt != NULL && _r_jwt_claims_load(jwt) == RHN_OK) {
     return _r_json_get_full_json_t(jwt->j_claims);
   }
   return NULL;
@@ -247,7 +1086,7 @@ json_t * r_jwt_get_full_claims_json_t(jwt_t * jwt) {
 
 char * r_jwt_get_full_claims_str(jwt_t * jwt) {
   char * to_return = NULL;
-  if (jwt != NULL) {
+  if (jwt != NULL && _r_jwt_claims_load(jwt) == RHN_OK) {
     to_return = json_dumps(jwt->j_claims, JSON_COMPACT);
   }
   return to_return;
@@ -255,6 +1094,7 @@ char * r_jwt_get_full_claims_str(jwt_t * jwt) {
 
 int r_jwt_set_full_claims_json_t(jwt_t * jwt, json_t * j_claim) {
   if (jwt != NULL && json_is_object(j_claim)) {
+    _r_jwt_lazy_claims_free(jwt);
     json_decref(jwt->j_claims);
     jwt->j_claims = json_deep_copy(j_claim);
     return RHN_OK;
@@ -285,7 +1125,7 @@ int r_jwt_append_claims_json_t(jwt_t * jwt, json_t * j_claim) {
   json_t * j_claim_copy = json_deep_copy(j_claim);
   int ret;
 
-  if (jwt != NULL && j_claim_copy != NULL) {
+  if (jwt != NULL && j_claim_copy != NULL && _r_jwt_claims_load(jwt) == RHN_OK) {
     if (!json_object_update(jwt->j_claims, j_claim_copy)) {
       ret = RHN_OK;
     } else {
@@ -358,6 +1198,25 @@ int r_jwt_add_sign_jwks(jwt_t * jwt, jwks_t * jwks_privkey, jwks_t * jwks_pubkey
   return ret;
 }
 
+int r_jwt_set_sign_jwks_store(jwt_t * jwt, jwks_store_t * store) {
+  if (jwt != NULL) {
+    jwt->jwks_store_sign = store;
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwt_set_sign_shared_jwks(jwt_t * jwt, jwks_shared_t * jwks_shared_privkey, jwks_shared_t * jwks_shared_pubkey) {
+  if (jwt != NULL) {
+    _r_jwks_shared_set(&jwt->jwks_shared_privkey_sign, jwks_shared_privkey);
+    _r_jwks_shared_set(&jwt->jwks_shared_pubkey_sign, jwks_shared_pubkey);
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
 int r_jwt_add_sign_keys_json_str(jwt_t * jwt, const char * privkey, const char * pubkey) {
   int ret = RHN_OK;
   jwa_alg alg;
@@ -811,6 +1670,16 @@ jwks_t * r_jwt_get_enc_jwks_pubkey(jwt_t * jwt) {
   }
 }
 
+int r_jwt_set_enc_shared_jwks(jwt_t * jwt, jwks_shared_t * jwks_shared_privkey, jwks_shared_t * jwks_shared_pubkey) {
+  if (jwt != NULL) {
+    _r_jwks_shared_set(&jwt->jwks_shared_privkey_enc, jwks_shared_privkey);
+    _r_jwks_shared_set(&jwt->jwks_shared_pubkey_enc, jwks_shared_pubkey);
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
 int r_jwt_set_sign_alg(jwt_t * jwt, jwa_alg alg) {
   int ret;
 
@@ -867,9 +1736,9 @@ int r_jwt_set_enc_cypher_key(jwt_t * jwt, const unsigned char * key, size_t key_
   int ret;
 
   if (jwt != NULL) {
-    o_free(jwt->key);
+    _r_secure_free(jwt->key);
     if (key != NULL && key_len) {
-      if ((jwt->key = o_malloc(key_len)) != NULL) {
+      if ((jwt->key = _r_secure_malloc(key_len)) != NULL) {
         memcpy(jwt->key, key, key_len);
         jwt->key_len = key_len;
         ret = RHN_OK;
@@ -903,10 +1772,10 @@ int r_jwt_generate_enc_cypher_key(jwt_t * jwt) {
 
   if (jwt != NULL && jwt->enc != R_JWA_ENC_UNKNOWN) {
     jwt->key_len = _r_get_key_size(jwt->enc);
-    o_free(jwt->key);
+    _r_secure_free(jwt->key);
     if (!jwt->key_len) {
       ret = RHN_ERROR_PARAM;
-    } else if ((jwt->key = o_malloc(jwt->key_len)) != NULL) {
+    } else if ((jwt->key = _r_secure_malloc(jwt->key_len)) != NULL) {
       if (!gnutls_rnd(GNUTLS_RND_KEY, jwt->key, jwt->key_len)) {
         ret = RHN_OK;
       } else {
@@ -1011,16 +1880,21 @@ char * r_jwt_serialize_signed(jwt_t * jwt, jwk_t * privkey, int x5u_flags) {
   }
 }
 
-char * r_jwt_serialize_signed_unsecure(jwt_t * jwt, jwk_t * privkey, int x5u_flags) {
+/**
+ * Returns a new jws_t with the jwt header, claims and signing keys
+ * The missing typ header is set in the jwt if update_jwt is set, in the jws only otherwise
+ */
+static jws_t * _r_jwt_get_signed_jws(jwt_t * jwt, jwk_t * privkey, int update_jwt) {
   jws_t * jws = NULL;
-  char * token = NULL, * payload = NULL;
+  char * payload = NULL;
   jwa_alg alg;
   json_t * j_header, * j_value = NULL;
   const char * key = NULL;
+  int res = RHN_ERROR;
 
   if (jwt != NULL && ((alg = r_jwt_get_sign_alg(jwt)) != R_JWA_ALG_UNKNOWN || (alg = r_str_to_jwa_alg(r_jwk_get_property_str(privkey, "alg"))) != R_JWA_ALG_NONE)) {
     if (r_jws_init(&jws) == RHN_OK) {
-      if (r_jwt_get_header_str_value(jwt, "typ") == NULL) {
+      if (update_jwt && r_jwt_get_header_str_value(jwt, "typ") == NULL) {
         r_jwt_set_header_str_value(jwt, "typ", "JWT");
       }
       j_header = r_jwt_get_full_header_json_t(jwt);
@@ -1028,10 +1902,13 @@ char * r_jwt_serialize_signed_unsecure(jwt_t * jwt, jwk_t * privkey, int x5u_fla
         r_jws_set_header_json_t_value(jws, key, j_value);
       }
       json_decref(j_header);
-      if (r_jws_add_jwks(jws, jwt->jwks_privkey_sign, jwt->jwks_pubkey_sign) == RHN_OK) {
-        if ((payload = json_dumps(jwt->j_claims, JSON_COMPACT)) != NULL) {
+      if (r_jws_get_header_str_value(jws, "typ") == NULL) {
+        r_jws_set_header_str_value(jws, "typ", "JWT");
+      }
+      if (r_jws_add_jwks(jws, jwt->jwks_privkey_sign, jwt->jwks_pubkey_sign) == RHN_OK && r_jws_set_shared_jwks(jws, jwt->jwks_shared_privkey_sign, jwt->jwks_shared_pubkey_sign) == RHN_OK) {
+        if (_r_jwt_claims_load(jwt) == RHN_OK && (payload = json_dumps(jwt->j_claims, JSON_COMPACT)) != NULL) {
           if (r_jws_set_alg(jws, alg) == RHN_OK && r_jws_set_payload(jws, (const unsigned char *)payload, o_strlen(payload)) == RHN_OK) {
-            token = r_jws_serialize_unsecure(jws, privkey, x5u_flags);
+            res = RHN_OK;
           } else {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_signed - Error setting jws");
           }
@@ -1042,16 +1919,58 @@ char * r_jwt_serialize_signed_unsecure(jwt_t * jwt, jwk_t * privkey, int x5u_fla
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_signed - Error r_jws_add_jwks");
       }
-      r_jws_free(jws);
+      if (res != RHN_OK) {
+        r_jws_free(jws);
+        jws = NULL;
+      }
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_signed - Error r_jws_init");
     }
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_signed - Error invalid input parameters");
   }
+  return jws;
+}
+
+char * r_jwt_serialize_signed_unsecure(jwt_t * jwt, jwk_t * privkey, int x5u_flags) {
+  jws_t * jws;
+  char * token = NULL;
+
+  if ((jws = _r_jwt_get_signed_jws(jwt, privkey, 1)) != NULL) {
+    token = r_jws_serialize_unsecure(jws, privkey, x5u_flags);
+    r_jws_free(jws);
+  }
   return token;
 }
 
+size_t r_jwt_serialized_signed_length(jwt_t * jwt, jwk_t * privkey, int x5u_flags) {
+  jws_t * jws;
+  size_t length = 0;
+
+  if ((jws = _r_jwt_get_signed_jws(jwt, privkey, 0)) != NULL) {
+    length = r_jws_serialized_length(jws, privkey, x5u_flags);
+    r_jws_free(jws);
+  }
+  return length;
+}
+
+int r_jwt_serialize_signed_to(jwt_t * jwt, jwk_t * privkey, int x5u_flags, char * output, size_t * output_len) {
+  jws_t * jws;
+  int ret;
+
+  if (r_jwt_get_sign_alg(jwt) != R_JWA_ALG_NONE && output != NULL && output_len != NULL) {
+    if ((jws = _r_jwt_get_signed_jws(jwt, privkey, 1)) != NULL) {
+      ret = r_jws_serialize_to(jws, privkey, x5u_flags, output, output_len);
+      r_jws_free(jws);
+    } else {
+      ret = RHN_ERROR_PARAM;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
 char * r_jwt_serialize_encrypted(jwt_t * jwt, jwk_t * pubkey, int x5u_flags) {
   jwe_t * jwe = NULL;
   char * token = NULL, * payload = NULL;
@@ -1078,8 +1997,8 @@ char * r_jwt_serialize_encrypted(jwt_t * jwt, jwk_t * pubkey, int x5u_flags) {
         r_jwe_set_iv(jwe, key_iv, key_iv_len);
       }
       json_decref(j_header);
-      if (r_jwe_add_jwks(jwe, jwt->jwks_privkey_enc, jwt->jwks_pubkey_enc) == RHN_OK) {
-        if ((payload = json_dumps(jwt->j_claims, JSON_COMPACT)) != NULL) {
+      if (r_jwe_add_jwks(jwe, jwt->jwks_privkey_enc, jwt->jwks_pubkey_enc) == RHN_OK && r_jwe_set_shared_jwks(jwe, jwt->jwks_shared_privkey_enc, jwt->jwks_shared_pubkey_enc) == RHN_OK) {
+        if (_r_jwt_claims_load(jwt) == RHN_OK && (payload = json_dumps(jwt->j_claims, JSON_COMPACT)) != NULL) {
           if (r_jwe_set_alg(jwe, alg) == RHN_OK && r_jwe_set_enc(jwe, enc) == RHN_OK && r_jwe_set_payload(jwe, (const unsigned char *)payload, o_strlen(payload)) == RHN_OK) {
             token = r_jwe_serialize(jwe, pubkey, x5u_flags);
           } else {
@@ -1130,7 +2049,7 @@ char * r_jwt_serialize_nested(jwt_t * jwt, unsigned int type, jwk_t * sign_key,
           }
           json_decref(j_header);
           r_jwe_set_header_str_value(jwe, "cty", "JWT");
-          if (r_jwe_add_jwks(jwe, jwt->jwks_privkey_enc, jwt->jwks_pubkey_enc) == RHN_OK) {
+          if (r_jwe_add_jwks(jwe, jwt->jwks_privkey_enc, jwt->jwks_pubkey_enc) == RHN_OK && r_jwe_set_shared_jwks(jwe, jwt->jwks_shared_privkey_enc, jwt->jwks_shared_pubkey_enc) == RHN_OK) {
             if (r_jwe_set_alg(jwe, enc_alg) == RHN_OK && r_jwe_set_enc(jwe, enc) == RHN_OK && r_jwe_set_payload(jwe, (const unsigned char *)token_intermediate, o_strlen(token_intermediate)) == RHN_OK) {
               token = r_jwe_serialize(jwe, encrypt_key, encrypt_key_x5u_flags);
             } else {
@@ -1159,7 +2078,7 @@ char * r_jwt_serialize_nested(jwt_t * jwt, unsigned int type, jwk_t * sign_key,
           }
           json_decref(j_header);
           r_jwt_set_header_str_value(jwt, "cty", "JWT");
-          if (r_jws_add_jwks(jws, jwt->jwks_privkey_sign, jwt->jwks_pubkey_sign) == RHN_OK) {
+          if (r_jws_add_jwks(jws, jwt->jwks_privkey_sign, jwt->jwks_pubkey_sign) == RHN_OK && r_jws_set_shared_jwks(jws, jwt->jwks_shared_privkey_sign, jwt->jwks_shared_pubkey_sign) == RHN_OK) {
             if (r_jws_set_alg(jws, sign_alg) == RHN_OK && r_jws_set_payload(jws, (const unsigned char *)token_intermediate, o_strlen(token_intermediate)) == RHN_OK) {
               token = r_jws_serialize(jws, sign_key, sign_key_x5u_flags);
             } else {
@@ -1203,6 +2122,17 @@ int r_jwt_advanced_parse(jwt_t * jwt, const char * token, uint32_t parse_flags,
   return r_jwt_advanced_parsen(jwt, token, o_strlen(token), parse_flags, x5u_flags);
 }
 
+/**
+ * Copies the parsed jws or jwe header in jwt->j_header, the jwt object is cleared and reused
+ */
+static int _r_jwt_copy_header(jwt_t * jwt, json_t * j_header) {
+  json_t * j_copy = json_deep_copy(j_header);
+  int ret = _r_json_object_replace(&jwt->j_header, j_copy);
+
+  json_decref(j_copy);
+  return ret;
+}
+
 int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uint32_t parse_flags, int x5u_flags) {
   size_t payload_len = 0;
   int ret, res, token_type = R_JWT_TYPE_NONE;
@@ -1213,20 +2143,31 @@ int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uin
     jwt->parse_flags = parse_flags;
     token_type = r_jwt_token_typen(token, token_len);
     if (R_JWT_TYPE_SIGN == token_type) { // JWS
-      r_jws_free(jwt->jws);
-      if ((r_jws_init(&jwt->jws)) == RHN_OK) {
+      if (_r_jwt_reset_jws(jwt) == RHN_OK) {
         if ((res = r_jws_advanced_compact_parsen(jwt->jws, token, token_len, parse_flags, x5u_flags)) == RHN_OK) {
-          json_decref(jwt->j_header);
-          jwt->j_header = json_deep_copy(jwt->jws->j_header);
+          _r_jwt_copy_header(jwt, jwt->jws->j_header);
           json_decref(jwt->j_claims);
           jwt->j_claims = NULL;
+          _r_jwt_lazy_claims_free(jwt);
           jwt->sign_alg = jwt->jws->alg;
-          r_jwt_add_sign_jwks(jwt, jwt->jws->jwks_privkey, jwt->jws->jwks_pubkey);
+          _r_jwt_add_sign_header_jwks(jwt);
           if (0 != o_strcmp("JWT", r_jwt_get_header_str_value(jwt, "cty"))) {
             jwt->type = R_JWT_TYPE_SIGN;
             if ((payload = r_jws_get_payload(jwt->jws, &payload_len)) != NULL && payload_len > 0) {
               payload_str = o_strndup((const char *)payload, payload_len);
-              if ((jwt->j_claims = json_loads(payload_str, JSON_DECODE_ANY, NULL)) != NULL) {
+              if (parse_flags & R_PARSE_LAZY_CLAIMS) {
+                // The claims are loaded in j_claims when they're needed
+                if (payload_str != NULL && (jwt->lazy_claims = o_malloc(sizeof(struct _r_jwt_lazy_claims))) != NULL) {
+                  memset(jwt->lazy_claims, 0, sizeof(struct _r_jwt_lazy_claims));
+                  jwt->lazy_claims->payload = payload_str;
+                  jwt->lazy_claims->payload_len = o_strlen(payload_str);
+                  payload_str = NULL;
+                  ret = RHN_OK;
+                } else {
+                  y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_parsen - Error allocating resources for lazy_claims");
+                  ret = RHN_ERROR_MEMORY;
+                }
+              } else if ((jwt->j_claims = json_loads(payload_str, JSON_DECODE_ANY, NULL)) != NULL) {
                 ret = RHN_OK;
               } else {
                 y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_parsen - Error parsing payload as JSON");
@@ -1242,8 +2183,7 @@ int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uin
             jwt->type = R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN;
             if (r_jws_get_alg(jwt->jws) != R_JWA_ALG_NONE) {
               if ((payload = r_jws_get_payload(jwt->jws, &payload_len)) != NULL && payload_len > 0) {
-                r_jwe_free(jwt->jwe);
-                if (r_jwe_init(&jwt->jwe) == RHN_OK) {
+                if (_r_jwt_reset_jwe(jwt) == RHN_OK) {
                   if (r_jwe_advanced_compact_parsen(jwt->jwe, (const char *)payload, payload_len, parse_flags, x5u_flags) == RHN_OK) {
                     ret = RHN_OK;
                   } else {
@@ -1273,14 +2213,12 @@ int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uin
         ret = RHN_ERROR;
       }
     } else if (R_JWT_TYPE_ENCRYPT == token_type) { // JWE
-      r_jwe_free(jwt->jwe);
-      if ((r_jwe_init(&jwt->jwe)) == RHN_OK) {
+      if (_r_jwt_reset_jwe(jwt) == RHN_OK) {
         if ((res = r_jwe_advanced_compact_parsen(jwt->jwe, token, token_len, parse_flags, x5u_flags)) == RHN_OK) {
-          json_decref(jwt->j_header);
-          jwt->j_header = json_deep_copy(jwt->jwe->j_header);
+          _r_jwt_copy_header(jwt, jwt->jwe->j_header);
           jwt->enc_alg = jwt->jwe->alg;
           jwt->enc = jwt->jwe->enc;
-          r_jwt_add_enc_jwks(jwt, jwt->jwe->jwks_privkey, jwt->jwe->jwks_pubkey);
+          _r_jwt_add_enc_header_jwks(jwt);
           ret = RHN_OK;
           if (0 != o_strcmp("JWT", r_jwt_get_header_str_value(jwt, "cty"))) {
             jwt->type = R_JWT_TYPE_ENCRYPT;
@@ -1339,28 +2277,57 @@ int r_jwt_get_type(jwt_t * jwt) {
 }
 
 int r_jwt_verify_signature(jwt_t * jwt, jwk_t * pubkey, int x5u_flags) {
-  size_t jwks_size, i;
+  int ret;
+  json_t * j_keys[2];
+
+  if (jwt != NULL && jwt->jws != NULL) {
+    _r_jwt_attach_sign_keys(jwt, j_keys);
+    ret = r_jws_verify_signature(jwt->jws, pubkey, x5u_flags);
+    _r_jwt_detach_sign_keys(jwt, j_keys);
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+size_t r_jwt_remote_pending_size(jwt_t * jwt) {
+  if (jwt != NULL) {
+    return r_jws_remote_pending_size(jwt->jws);
+  } else {
+    return 0;
+  }
+}
+
+const char * r_jwt_remote_pending_get_at(jwt_t * jwt, size_t index, int * type) {
+  if (jwt != NULL) {
+    return r_jws_remote_pending_get_at(jwt->jws, index, type);
+  } else {
+    return NULL;
+  }
+}
+
+int r_jwt_remote_resume(jwt_t * jwt, const char * url, const char * content, size_t content_len) {
+  int ret;
+  size_t jws_size, jwt_size, i;
   jwk_t * jwk;
 
   if (jwt != NULL && jwt->jws != NULL) {
-    r_jwks_empty(jwt->jws->jwks_privkey);
-    r_jwks_empty(jwt->jws->jwks_pubkey);
-    jwks_size = r_jwks_size(jwt->jwks_privkey_sign);
-    for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_privkey_sign, i);
-      r_jws_add_keys(jwt->jws, jwk, NULL);
-      r_jwk_free(jwk);
-    }
-    jwks_size = r_jwks_size(jwt->jwks_pubkey_sign);
-    for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_pubkey_sign, i);
-      r_jws_add_keys(jwt->jws, NULL, jwk);
-      r_jwk_free(jwk);
+    jws_size = r_jwks_size(jwt->jws->jwks_pubkey);
+    jwt_size = r_jwks_size(jwt->jwks_pubkey_sign);
+    if ((ret = r_jws_remote_resume(jwt->jws, url, content, content_len)) == RHN_OK) {
+      for (i=jws_size; ret == RHN_OK && i<r_jwks_size(jwt->jws->jwks_pubkey); i++) {
+        jwk = r_jwks_get_at(jwt->jws->jwks_pubkey, i);
+        ret = r_jwt_add_sign_keys(jwt, NULL, jwk);
+        r_jwk_free(jwk);
+      }
+      if (_r_jwks_add_header_keys(jwt->jwks_pubkey_sign, jwt_size, &jwt->j_jwks_pubkey_sign_header) != RHN_OK) {
+        ret = RHN_ERROR_MEMORY;
+      }
     }
-    return r_jws_verify_signature(jwt->jws, pubkey, x5u_flags);
   } else {
-    return RHN_ERROR_PARAM;
+    ret = RHN_ERROR_PARAM;
   }
+  return ret;
 }
 
 int r_jwt_decrypt(jwt_t * jwt, jwk_t * privkey, int x5u_flags) {
@@ -1386,6 +2353,7 @@ int r_jwt_decrypt(jwt_t * jwt, jwk_t * privkey, int x5u_flags) {
       r_jwe_add_keys(jwt->jwe, NULL, jwk);
       r_jwk_free(jwk);
     }
+    r_jwe_set_shared_jwks(jwt->jwe, jwt->jwks_shared_privkey_enc, jwt->jwks_shared_pubkey_enc);
     if ((res = r_jwe_decrypt(jwt->jwe, privkey, x5u_flags)) == RHN_OK) {
       if ((payload = r_jwe_get_payload(jwt->jwe, &payload_len)) != NULL && payload_len > 0) {
         str_payload = o_strndup((const char *)payload, payload_len);
@@ -1421,25 +2389,16 @@ int r_jwt_decrypt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int v
   const unsigned char * payload = NULL;
   char * str_payload;
   size_t payload_len = 0, jwks_size, i;
-  json_t * j_payload = NULL;
+  json_t * j_payload = NULL, * j_keys[2];
   int res, ret;
   jwk_t * jwk;
 
   if (jwt != NULL && 0 == o_strcmp("JWT", r_jwt_get_header_str_value(jwt, "cty"))) {
     if (jwt->type == R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN && jwt->jwe != NULL) {
-      jwks_size = r_jwks_size(jwt->jwks_privkey_sign);
-      for (i=0; i<jwks_size; i++) {
-        jwk = r_jwks_get_at(jwt->jwks_privkey_sign, i);
-        r_jws_add_keys(jwt->jws, jwk, NULL);
-        r_jwk_free(jwk);
-      }
-      jwks_size = r_jwks_size(jwt->jwks_pubkey_sign);
-      for (i=0; i<jwks_size; i++) {
-        jwk = r_jwks_get_at(jwt->jwks_pubkey_sign, i);
-        r_jws_add_keys(jwt->jws, NULL, jwk);
-        r_jwk_free(jwk);
-      }
-      if ((res = r_jws_verify_signature(jwt->jws, verify_key, verify_key_x5u_flags)) == RHN_OK) {
+      _r_jwt_attach_sign_keys(jwt, j_keys);
+      res = r_jws_verify_signature(jwt->jws, verify_key, verify_key_x5u_flags);
+      _r_jwt_detach_sign_keys(jwt, j_keys);
+      if (res == RHN_OK) {
         jwks_size = r_jwks_size(jwt->jwks_privkey_enc);
         for (i=0; i<jwks_size; i++) {
           jwk = r_jwks_get_at(jwt->jwks_privkey_enc, i);
@@ -1452,6 +2411,7 @@ int r_jwt_decrypt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int v
           r_jwe_add_keys(jwt->jwe, NULL, jwk);
           r_jwk_free(jwk);
         }
+        r_jwe_set_shared_jwks(jwt->jwe, jwt->jwks_shared_privkey_enc, jwt->jwks_shared_pubkey_enc);
         if ((res = r_jwe_decrypt(jwt->jwe, decrypt_key, decrypt_key_x5u_flags)) == RHN_OK) {
           if ((payload = r_jwe_get_payload(jwt->jwe, &payload_len)) != NULL && payload_len > 0) {
             str_payload = o_strndup((const char *)payload, payload_len);
@@ -1492,27 +2452,21 @@ int r_jwt_decrypt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int v
         r_jwe_add_keys(jwt->jwe, NULL, jwk);
         r_jwk_free(jwk);
       }
+      r_jwe_set_shared_jwks(jwt->jwe, jwt->jwks_shared_privkey_enc, jwt->jwks_shared_pubkey_enc);
       if ((res = r_jwe_decrypt(jwt->jwe, decrypt_key, decrypt_key_x5u_flags)) == RHN_OK) {
         if ((payload = r_jwe_get_payload(jwt->jwe, &payload_len)) != NULL && payload_len > 0) {
-          r_jws_free(jwt->jws);
-          if ((r_jws_init(&jwt->jws)) == RHN_OK) {
+          if (_r_jwt_reset_jws(jwt) == RHN_OK) {
             if (r_jws_advanced_compact_parsen(jwt->jws, (const char *)payload, payload_len, jwt->parse_flags, verify_key_x5u_flags) == RHN_OK) {
-              jwks_size = r_jwks_size(jwt->jwks_privkey_sign);
-              for (i=0; i<jwks_size; i++) {
-                jwk = r_jwks_get_at(jwt->jwks_privkey_sign, i);
-                r_jws_add_keys(jwt->jws, jwk, NULL);
-                r_jwk_free(jwk);
-              }
-              jwks_size = r_jwks_size(jwt->jwks_pubkey_sign);
-              for (i=0; i<jwks_size; i++) {
-                jwk = r_jwks_get_at(jwt->jwks_pubkey_sign, i);
-                r_jws_add_keys(jwt->jws, NULL, jwk);
-                r_jwk_free(jwk);
-              }
+              // The keys of the inner header are kept in the jwt, like r_jwt_decrypt_nested does
+              _r_jwt_add_sign_header_jwks(jwt);
               json_decref(jwt->j_claims);
               jwt->j_claims = NULL;
+              _r_jwt_lazy_claims_free(jwt);
               jwt->sign_alg = jwt->jws->alg;
-              if ((res = r_jws_verify_signature(jwt->jws, verify_key, verify_key_x5u_flags)) == RHN_OK) {
+              _r_jwt_attach_sign_keys(jwt, j_keys);
+              res = r_jws_verify_signature(jwt->jws, verify_key, verify_key_x5u_flags);
+              _r_jwt_detach_sign_keys(jwt, j_keys);
+              if (res == RHN_OK) {
                 if ((payload = r_jws_get_payload(jwt->jws, &payload_len)) != NULL && payload_len > 0) {
                   str_payload = o_strndup((const char *)payload, payload_len);
                   if ((jwt->j_claims = json_loads(str_payload, JSON_DECODE_ANY, NULL)) != NULL) {
@@ -1582,13 +2536,13 @@ int r_jwt_decrypt_nested(jwt_t * jwt, jwk_t * decrypt_key, int decrypt_key_x5u_f
       r_jwe_add_keys(jwt->jwe, NULL, jwk);
       r_jwk_free(jwk);
     }
+    r_jwe_set_shared_jwks(jwt->jwe, jwt->jwks_shared_privkey_enc, jwt->jwks_shared_pubkey_enc);
     if ((res = r_jwe_decrypt(jwt->jwe, decrypt_key, decrypt_key_x5u_flags)) == RHN_OK) {
       if ((payload = r_jwe_get_payload(jwt->jwe, &payload_len)) != NULL && payload_len > 0) {
         if (jwt->type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT) {
-          r_jws_free(jwt->jws);
-          if ((r_jws_init(&jwt->jws)) == RHN_OK) {
+          if (_r_jwt_reset_jws(jwt) == RHN_OK) {
             if ((res = r_jws_advanced_compact_parsen(jwt->jws, (const char *)payload, payload_len, jwt->parse_flags, decrypt_key_x5u_flags)) == RHN_OK) {
-              if (r_jwt_add_sign_jwks(jwt, jwt->jws->jwks_privkey, jwt->jws->jwks_pubkey) == RHN_OK) {
+              if (_r_jwt_add_sign_header_jwks(jwt) == RHN_OK) {
                 if (r_jwt_set_sign_alg(jwt, r_jws_get_alg(jwt->jws)) == RHN_OK) {
                   if ((payload = r_jws_get_payload(jwt->jws, &payload_len)) != NULL && payload_len > 0) {
                     str_payload = o_strndup((const char *)payload, payload_len);
@@ -1660,23 +2614,13 @@ int r_jwt_decrypt_nested(jwt_t * jwt, jwk_t * decrypt_key, int decrypt_key_x5u_f
 
 int r_jwt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int verify_key_x5u_flags) {
   int ret, res;
-  jwk_t * jwk;
-  size_t jwks_size, i;
+  json_t * j_keys[2];
 
   if (jwt != NULL && jwt->jws != NULL && (jwt->type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT || jwt->type == R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN)) {
-    jwks_size = r_jwks_size(jwt->jwks_privkey_sign);
-    for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_privkey_sign, i);
-      r_jws_add_keys(jwt->jws, jwk, NULL);
-      r_jwk_free(jwk);
-    }
-    jwks_size = r_jwks_size(jwt->jwks_pubkey_sign);
-    for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_pubkey_sign, i);
-      r_jws_add_keys(jwt->jws, NULL, jwk);
-      r_jwk_free(jwk);
-    }
-    if ((res = r_jws_verify_signature(jwt->jws, verify_key, verify_key_x5u_flags)) == RHN_OK) {
+    _r_jwt_attach_sign_keys(jwt, j_keys);
+    res = r_jws_verify_signature(jwt->jws, verify_key, verify_key_x5u_flags);
+    _r_jwt_detach_sign_keys(jwt, j_keys);
+    if (res == RHN_OK) {
       ret = RHN_OK;
     } else if (res == RHN_ERROR_INVALID || res == RHN_ERROR_PARAM || res == RHN_ERROR_UNSUPPORTED) {
       ret = res;
@@ -1687,188 +2631,326 @@ int r_jwt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int verify_ke
   } else {
     ret = RHN_ERROR_PARAM;
   }
-  return ret;
-}
-
-int r_jwt_validate_claims(jwt_t * jwt, ...) {
-  rhn_claim_opt option;
-  unsigned int ret = RHN_OK;
-  int i_value;
-  const char * str_key, * str_value;
-  json_t * j_value, * j_expected_value;
-  va_list vl;
-  time_t now, t_value;
-
-  if (jwt != NULL) {
-    time(&now);
-    va_start(vl, jwt);
-    for (option = va_arg(vl, rhn_claim_opt); option != R_JWT_CLAIM_NOP && ret == RHN_OK; option = va_arg(vl, rhn_claim_opt)) {
-      switch (option) {
-        case R_JWT_CLAIM_ISS:
-          str_value = va_arg(vl, const char *);
-          if (!o_strnullempty(str_value)) {
-            if (0 != o_strcmp(str_value, r_jwt_get_claim_str_value(jwt, "iss"))) {
-              ret = RHN_ERROR_PARAM;
-            }
-          } else {
-            if (o_strnullempty(r_jwt_get_claim_str_value(jwt, "iss"))) {
-              ret = RHN_ERROR_PARAM;
-            }
-          }
-          break;
-        case R_JWT_CLAIM_SUB:
-          str_value = va_arg(vl, const char *);
-          if (!o_strnullempty(str_value)) {
-            if (0 != o_strcmp(str_value, r_jwt_get_claim_str_value(jwt, "sub"))) {
-              ret = RHN_ERROR_PARAM;
-            }
-          } else {
-            if (o_strnullempty(r_jwt_get_claim_str_value(jwt, "sub"))) {
-              ret = RHN_ERROR_PARAM;
-            }
-          }
-          break;
-        case R_JWT_CLAIM_AUD:
-          str_value = va_arg(vl, const char *);
-          if (!o_strnullempty(str_value)) {
-            if (0 != o_strcmp(str_value, r_jwt_get_claim_str_value(jwt, "aud"))) {
-              ret = RHN_ERROR_PARAM;
-            }
-          } else {
-            if (o_strnullempty(r_jwt_get_claim_str_value(jwt, "aud"))) {
-              ret = RHN_ERROR_PARAM;
-            }
-          }
-          break;
-        case R_JWT_CLAIM_JTI:
-          str_value = va_arg(vl, const char *);
-          if (!o_strnullempty(str_value)) {
-            if (0 != o_strcmp(str_value, r_jwt_get_claim_str_value(jwt, "jti"))) {
-              ret = RHN_ERROR_PARAM;
-            }
-          } else {
-            if (o_strnullempty(r_jwt_get_claim_str_value(jwt, "jti"))) {
-              ret = RHN_ERROR_PARAM;
-            }
-          }
-          break;
-        case R_JWT_CLAIM_EXP:
-          i_value = va_arg(vl, int);
-          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(jwt->j_claims, "exp"))) {
-            ret = RHN_ERROR_PARAM;
-          } else if (json_is_integer(json_object_get(jwt->j_claims, "exp"))) {
-            t_value = (time_t)r_jwt_get_claim_int_value(jwt, "exp");
-            if (i_value == R_JWT_CLAIM_NOW) {
-              if (t_value < now) {
-                ret = RHN_ERROR_PARAM;
-              }
-            } else if (i_value > 0) {
-              if (t_value < (time_t)i_value) {
-                ret = RHN_ERROR_PARAM;
-              }
-            }
-          } else {
+  return ret;
+}
+
+/**
+ * Reads the rest of the list of expected claims in vl, starting with option,
+ * and releases the R_JWT_CLAIM_JSN values, so the values are always owned by the function
+ */
+static void _r_jwt_release_claims_list(rhn_claim_opt option, va_list vl) {
+  for (; option != R_JWT_CLAIM_NOP; option = va_arg(vl, rhn_claim_opt)) {
+    switch (option) {
+      case R_JWT_CLAIM_ISS:
+      case R_JWT_CLAIM_SUB:
+      case R_JWT_CLAIM_AUD:
+      case R_JWT_CLAIM_JTI:
+      case R_JWT_CLAIM_TYP:
+      case R_JWT_CLAIM_CTY:
+        va_arg(vl, const char *);
+        break;
+      case R_JWT_CLAIM_EXP:
+      case R_JWT_CLAIM_NBF:
+      case R_JWT_CLAIM_IAT:
+        va_arg(vl, int);
+        break;
+      case R_JWT_CLAIM_STR:
+        va_arg(vl, const char *);
+        va_arg(vl, const char *);
+        break;
+      case R_JWT_CLAIM_INT:
+        va_arg(vl, const char *);
+        va_arg(vl, int);
+        break;
+      case R_JWT_CLAIM_JSN:
+        va_arg(vl, const char *);
+        json_decref(va_arg(vl, json_t *));
+        break;
+      default:
+        // The arguments of an unknown option can't be read
+        return;
+    }
+  }
+}
+
+/**
+ * Validates the header and claims given with the list of expected claims in vl
+ */
+static int _r_jwt_validate_claims_list(json_t * j_header, json_t * j_claims, va_list vl) {
+  rhn_claim_opt option;
+  unsigned int ret = RHN_OK;
+  int i_value, is_known = 1;
+  const char * str_key, * str_value;
+  json_t * j_value, * j_expected_value;
+  time_t now, t_value;
+
+  time(&now);
+  for (option = va_arg(vl, rhn_claim_opt); option != R_JWT_CLAIM_NOP && ret == RHN_OK; option = va_arg(vl, rhn_claim_opt)) {
+    switch (option) {
+      case R_JWT_CLAIM_ISS:
+        str_value = va_arg(vl, const char *);
+        if (!o_strnullempty(str_value)) {
+          if (0 != o_strcmp(str_value, _r_json_get_str_value(j_claims, "iss"))) {
             ret = RHN_ERROR_PARAM;
           }
-          break;
-        case R_JWT_CLAIM_NBF:
-          i_value = va_arg(vl, int);
-          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(jwt->j_claims, "nbf"))) {
-            ret = RHN_ERROR_PARAM;
-          } else if (json_is_integer(json_object_get(jwt->j_claims, "nbf"))) {
-            t_value = (time_t)r_jwt_get_claim_int_value(jwt, "nbf");
-            if (i_value == R_JWT_CLAIM_NOW) {
-              if (t_value > now) {
-                ret = RHN_ERROR_PARAM;
-              }
-            } else if (i_value > 0) {
-              if (t_value > (time_t)i_value) {
-                ret = RHN_ERROR_PARAM;
-              }
-            }
-          } else {
+        } else {
+          if (o_strnullempty(_r_json_get_str_value(j_claims, "iss"))) {
             ret = RHN_ERROR_PARAM;
           }
-          break;
-        case R_JWT_CLAIM_IAT:
-          i_value = va_arg(vl, int);
-          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(jwt->j_claims, "iat"))) {
-            ret = RHN_ERROR_PARAM;
-          } else if (json_is_integer(json_object_get(jwt->j_claims, "iat"))) {
-            t_value = (time_t)r_jwt_get_claim_int_value(jwt, "iat");
-            if (i_value == R_JWT_CLAIM_NOW) {
-              if (t_value > now) {
-                ret = RHN_ERROR_PARAM;
-              }
-            } else if (i_value > 0) {
-              if (t_value > (time_t)i_value) {
-                ret = RHN_ERROR_PARAM;
-              }
-            }
-          } else {
+        }
+        break;
+      case R_JWT_CLAIM_SUB:
+        str_value = va_arg(vl, const char *);
+        if (!o_strnullempty(str_value)) {
+          if (0 != o_strcmp(str_value, _r_json_get_str_value(j_claims, "sub"))) {
             ret = RHN_ERROR_PARAM;
           }
-          break;
-        case R_JWT_CLAIM_STR:
-          str_key = va_arg(vl, const char *);
-          str_value = va_arg(vl, const char *);
-          if (str_value == NULL && r_jwt_get_claim_str_value(jwt, str_key) == NULL) {
+        } else {
+          if (o_strnullempty(_r_json_get_str_value(j_claims, "sub"))) {
             ret = RHN_ERROR_PARAM;
-          } else if (str_value != NULL && 0 != o_strcmp(str_value, r_jwt_get_claim_str_value(jwt, str_key))) {
+          }
+        }
+        break;
+      case R_JWT_CLAIM_AUD:
+        str_value = va_arg(vl, const char *);
+        if (!o_strnullempty(str_value)) {
+          if (0 != o_strcmp(str_value, _r_json_get_str_value(j_claims, "aud"))) {
             ret = RHN_ERROR_PARAM;
           }
-          break;
-        case R_JWT_CLAIM_INT:
-          str_key = va_arg(vl, const char *);
-          i_value = va_arg(vl, int);
-          if (r_jwt_get_claim_int_value(jwt, str_key) != i_value) {
+        } else {
+          if (o_strnullempty(_r_json_get_str_value(j_claims, "aud"))) {
             ret = RHN_ERROR_PARAM;
           }
-          break;
-        case R_JWT_CLAIM_JSN:
-          str_key = va_arg(vl, const char *);
-          j_expected_value = va_arg(vl, json_t *);
-          j_value = r_jwt_get_claim_json_t_value(jwt, str_key);
-          if (j_value == NULL && j_expected_value == NULL) {
+        }
+        break;
+      case R_JWT_CLAIM_JTI:
+        str_value = va_arg(vl, const char *);
+        if (!o_strnullempty(str_value)) {
+          if (0 != o_strcmp(str_value, _r_json_get_str_value(j_claims, "jti"))) {
             ret = RHN_ERROR_PARAM;
-          } else if (j_expected_value != NULL && !json_equal(j_expected_value, j_value)) {
+          }
+        } else {
+          if (o_strnullempty(_r_json_get_str_value(j_claims, "jti"))) {
             ret = RHN_ERROR_PARAM;
           }
-          json_decref(j_expected_value);
-          break;
-        case R_JWT_CLAIM_TYP:
-          str_value = va_arg(vl, const char *);
-          if (!o_strnullempty(str_value)) {
-            if (0 != o_strcmp(str_value, r_jwt_get_header_str_value(jwt, "typ"))) {
+        }
+        break;
+      case R_JWT_CLAIM_EXP:
+        i_value = va_arg(vl, int);
+        if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(j_claims, "exp"))) {
+          ret = RHN_ERROR_PARAM;
+        } else if (json_is_integer(json_object_get(j_claims, "exp"))) {
+          t_value = (time_t)_r_json_get_int_value(j_claims, "exp");
+          if (i_value == R_JWT_CLAIM_NOW) {
+            if (t_value < now) {
               ret = RHN_ERROR_PARAM;
             }
-          } else {
-            if (o_strnullempty(r_jwt_get_header_str_value(jwt, "typ"))) {
+          } else if (i_value > 0) {
+            if (t_value < (time_t)i_value) {
               ret = RHN_ERROR_PARAM;
             }
           }
-          break;
-        case R_JWT_CLAIM_CTY:
-          str_value = va_arg(vl, const char *);
-          if (!o_strnullempty(str_value)) {
-            if (0 != o_strcmp(str_value, r_jwt_get_header_str_value(jwt, "cty"))) {
+        } else {
+          ret = RHN_ERROR_PARAM;
+        }
+        break;
+      case R_JWT_CLAIM_NBF:
+        i_value = va_arg(vl, int);
+        if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(j_claims, "nbf"))) {
+          ret = RHN_ERROR_PARAM;
+        } else if (json_is_integer(json_object_get(j_claims, "nbf"))) {
+          t_value = (time_t)_r_json_get_int_value(j_claims, "nbf");
+          if (i_value == R_JWT_CLAIM_NOW) {
+            if (t_value > now) {
               ret = RHN_ERROR_PARAM;
             }
-          } else {
-            if (o_strnullempty(r_jwt_get_header_str_value(jwt, "cty"))) {
+          } else if (i_value > 0) {
+            if (t_value > (time_t)i_value) {
               ret = RHN_ERROR_PARAM;
             }
           }
-          break;
-        default:
+        } else {
           ret = RHN_ERROR_PARAM;
-          break;
-      }
+        }
+        break;
+      case R_JWT_CLAIM_IAT:
+        i_value = va_arg(vl, int);
+        if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(j_claims, "iat"))) {
+          ret = RHN_ERROR_PARAM;
+        } else if (json_is_integer(json_object_get(j_claims, "iat"))) {
+          t_value = (time_t)_r_json_get_int_value(j_claims, "iat");
+          if (i_value == R_JWT_CLAIM_NOW) {
+            if (t_value > now) {
+              ret = RHN_ERROR_PARAM;
+            }
+          } else if (i_value > 0) {
+            if (t_value > (time_t)i_value) {
+              ret = RHN_ERROR_PARAM;
+            }
+          }
+        } else {
+          ret = RHN_ERROR_PARAM;
+        }
+        break;
+      case R_JWT_CLAIM_STR:
+        str_key = va_arg(vl, const char *);
+        str_value = va_arg(vl, const char *);
+        if (str_value == NULL && _r_json_get_str_value(j_claims, str_key) == NULL) {
+          ret = RHN_ERROR_PARAM;
+        } else if (str_value != NULL && 0 != o_strcmp(str_value, _r_json_get_str_value(j_claims, str_key))) {
+          ret = RHN_ERROR_PARAM;
+        }
+        break;
+      case R_JWT_CLAIM_INT:
+        str_key = va_arg(vl, const char *);
+        i_value = va_arg(vl, int);
+        if (_r_json_get_int_value(j_claims, str_key) != i_value) {
+          ret = RHN_ERROR_PARAM;
+        }
+        break;
+      case R_JWT_CLAIM_JSN:
+        str_key = va_arg(vl, const char *);
+        j_expected_value = va_arg(vl, json_t *);
+        j_value = json_object_get(j_claims, str_key);
+        if (j_value == NULL && j_expected_value == NULL) {
+          ret = RHN_ERROR_PARAM;
+        } else if (j_expected_value != NULL && !json_equal(j_expected_value, j_value)) {
+          ret = RHN_ERROR_PARAM;
+        }
+        json_decref(j_expected_value);
+        break;
+      case R_JWT_CLAIM_TYP:
+        str_value = va_arg(vl, const char *);
+        if (!o_strnullempty(str_value)) {
+          if (0 != o_strcmp(str_value, _r_json_get_str_value(j_header, "typ"))) {
+            ret = RHN_ERROR_PARAM;
+          }
+        } else {
+          if (o_strnullempty(_r_json_get_str_value(j_header, "typ"))) {
+            ret = RHN_ERROR_PARAM;
+          }
+        }
+        break;
+      case R_JWT_CLAIM_CTY:
+        str_value = va_arg(vl, const char *);
+        if (!o_strnullempty(str_value)) {
+          if (0 != o_strcmp(str_value, _r_json_get_str_value(j_header, "cty"))) {
+            ret = RHN_ERROR_PARAM;
+          }
+        } else {
+          if (o_strnullempty(_r_json_get_str_value(j_header, "cty"))) {
+            ret = RHN_ERROR_PARAM;
+          }
+        }
+        break;
+      default:
+        ret = RHN_ERROR_PARAM;
+        is_known = 0;
+        break;
+    }
+  }
+  if (ret != RHN_OK && is_known) {
+    _r_jwt_release_claims_list(option, vl);
+  }
+  return ret;
+}
+
+/**
+ * Validates the claims of a token parsed with R_PARSE_LAZY_CLAIMS
+ * The claims are loaded only if a claim other than the registered ones is expected
+ */
+static int _r_jwt_validate_lazy_claims_list(jwt_t * jwt, va_list vl) {
+  rhn_claim_opt option;
+  const char * str_key, * value = NULL;
+  json_t * j_claims = NULL;
+  int ret, load = 0;
+  va_list vl_copy;
+
+  va_copy(vl_copy, vl);
+  for (option = va_arg(vl_copy, rhn_claim_opt); option != R_JWT_CLAIM_NOP && !load; option = va_arg(vl_copy, rhn_claim_opt)) {
+    switch (option) {
+      case R_JWT_CLAIM_ISS:
+      case R_JWT_CLAIM_SUB:
+      case R_JWT_CLAIM_AUD:
+      case R_JWT_CLAIM_JTI:
+      case R_JWT_CLAIM_TYP:
+      case R_JWT_CLAIM_CTY:
+        va_arg(vl_copy, const char *);
+        break;
+      case R_JWT_CLAIM_EXP:
+      case R_JWT_CLAIM_NBF:
+      case R_JWT_CLAIM_IAT:
+        va_arg(vl_copy, int);
+        break;
+      case R_JWT_CLAIM_STR:
+        str_key = va_arg(vl_copy, const char *);
+        va_arg(vl_copy, const char *);
+        load = (_r_jwt_lazy_claims_get(jwt, str_key, &value) != RHN_OK);
+        break;
+      case R_JWT_CLAIM_INT:
+        str_key = va_arg(vl_copy, const char *);
+        va_arg(vl_copy, int);
+        load = (_r_jwt_lazy_claims_get(jwt, str_key, &value) != RHN_OK);
+        break;
+      default:
+        // R_JWT_CLAIM_JSN values may be objects or arrays
+        load = 1;
+        break;
+    }
+  }
+  va_end(vl_copy);
+
+  if (!load && (j_claims = _r_jwt_lazy_claims_registered(jwt)) != NULL) {
+    ret = _r_jwt_validate_claims_list(jwt->j_header, j_claims, vl);
+    json_decref(j_claims);
+  } else if (_r_jwt_claims_load(jwt) == RHN_OK) {
+    ret = _r_jwt_validate_claims_list(jwt->j_header, jwt->j_claims, vl);
+  } else {
+    _r_jwt_release_claims_list(va_arg(vl, rhn_claim_opt), vl);
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwt_validate_claims(jwt_t * jwt, ...) {
+  int ret;
+  va_list vl;
+
+  va_start(vl, jwt);
+  if (jwt != NULL) {
+    if (jwt->lazy_claims != NULL && jwt->lazy_claims->payload != NULL) {
+      ret = _r_jwt_validate_lazy_claims_list(jwt, vl);
+    } else {
+      ret = _r_jwt_validate_claims_list(jwt->j_header, jwt->j_claims, vl);
     }
-    va_end(vl);
   } else {
+    _r_jwt_release_claims_list(va_arg(vl, rhn_claim_opt), vl);
     ret = RHN_ERROR_PARAM;
   }
+  va_end(vl);
+  return ret;
+}
+
+int r_jwt_verify_compact(const char * token, size_t token_len, jwks_shared_t * jwks_pubkey, json_t ** j_claims, ...) {
+  int ret;
+  json_t * j_header = NULL, * j_payload = NULL;
+  va_list vl;
+
+  if (j_claims != NULL) {
+    *j_claims = NULL;
+  }
+  va_start(vl, j_claims);
+  if ((ret = _r_jws_verify_compact(token, token_len, jwks_pubkey, &j_header, &j_payload)) == RHN_OK) {
+    ret = _r_jwt_validate_claims_list(j_header, j_payload, vl);
+    if (ret == RHN_OK && j_claims != NULL) {
+      *j_claims = json_incref(j_payload);
+    }
+  } else {
+    _r_jwt_release_claims_list(va_arg(vl, rhn_claim_opt), vl);
+  }
+  va_end(vl);
+  json_decref(j_header);
+  json_decref(j_payload);
   return ret;
 }
 
@@ -2288,3 +3370,265 @@ int r_jwt_token_typen(const char * token, size_t token_len) {
   }
   return ret;
 }
+
+int r_jwt_peek_header(const char * token, size_t token_len, char * buffer, size_t buffer_len, ...) {
+  const char * dot = NULL;
+  int ret;
+  va_list vl;
+
+  if (token != NULL && token_len) {
+    dot = memchr(token, '.', token_len);
+  }
+  va_start(vl, buffer_len);
+  // The whole header is scanned so a duplicate member returns the value a parsed token would use
+  ret = _r_peek_json_values_list(token, dot!=NULL?(size_t)(dot-token):0, _R_PEEK_LAST, buffer, buffer_len, vl);
+  va_end(vl);
+  if (ret != RHN_OK) {
+    y_log_message(Y_LOG_LEVEL_DEBUG, "r_jwt_peek_header - Error peeking header");
+  }
+  return ret;
+}
+
+int r_jwt_peek_claims(const char * token, size_t token_len, char * buffer, size_t buffer_len, ...) {
+  const char * dot_payload, * dot_signature, * zip = NULL;
+  char zip_buffer[16];
+  int ret, type = r_jwt_token_typen(token, token_len);
+  va_list vl;
+
+  va_start(vl, buffer_len);
+  if (type == R_JWT_TYPE_SIGN) {
+    dot_payload = memchr(token, '.', token_len);
+    dot_signature = memchr(dot_payload+1, '.', token_len-(size_t)(dot_payload-token)-1);
+    if ((ret = _r_peek_json_values(token, (size_t)(dot_payload-token), _R_PEEK_LAST, zip_buffer, sizeof(zip_buffer), "zip", &zip, NULL)) == RHN_OK && zip == NULL) {
+      ret = _r_peek_json_values_list(dot_payload+1, (size_t)(dot_signature-dot_payload)-1, _R_PEEK_LAST, buffer, buffer_len, vl);
+    } else {
+      // A compressed payload can't be scanned without being inflated
+      if (ret == RHN_OK) {
+        ret = RHN_ERROR_UNSUPPORTED;
+      }
+      _r_peek_json_values_list(NULL, 0, 0, NULL, 0, vl);
+    }
+  } else {
+    ret = (type == R_JWT_TYPE_ENCRYPT)?RHN_ERROR_UNSUPPORTED:RHN_ERROR_PARAM;
+    _r_peek_json_values_list(NULL, 0, 0, NULL, 0, vl);
+  }
+  va_end(vl);
+  if (ret != RHN_OK) {
+    y_log_message(Y_LOG_LEVEL_DEBUG, "r_jwt_peek_claims - Error peeking claims");
+  }
+  return ret;
+}
+
+struct _jwt_claims_schema {
+  size_t         nb_claims;
+  rhn_claim_desc claims[R_CLAIMS_SCHEMA_MAX];
+  size_t         name_len[R_CLAIMS_SCHEMA_MAX];
+};
+
+/**
+ * Values of the claims of a schema found by _r_peek_json_scan
+ */
+struct _r_jwt_schema_output {
+  const jwt_claims_schema_t * schema;
+  const char               ** values;
+};
+
+/**
+ * _r_peek_output_cb of a claims schema
+ */
+static const char ** _r_jwt_schema_get_output(void * cls, int flags, const char * key, size_t key_len) {
+  struct _r_jwt_schema_output * output = (struct _r_jwt_schema_output *)cls;
+  size_t i;
+
+  (void)flags;
+  for (i=0; i<output->schema->nb_claims; i++) {
+    if (output->schema->name_len[i] == key_len && 0 == memcmp(output->schema->claims[i].name, key, key_len)) {
+      return &output->values[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Sets a member of the claims struct, str_value is used for R_CLAIM_TYPE_STR, i_value otherwise
+ */
+static int _r_jwt_claims_struct_set(const rhn_claim_desc * desc, unsigned char * claims, const char * str_value, rhn_int_t i_value) {
+  size_t len;
+  int b_value, ret = RHN_OK;
+
+  if (desc->type == R_CLAIM_TYPE_STR) {
+    if (str_value != NULL && (len = o_strlen(str_value)) < desc->max_len) {
+      memcpy(claims+desc->offset, str_value, len+1);
+    } else {
+      if (str_value != NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwt_claims_struct_set - Error value too long for claim %s", desc->name);
+        ret = RHN_ERROR_PARAM;
+      }
+      claims[desc->offset] = '\0';
+    }
+  } else if (desc->type == R_CLAIM_TYPE_INT) {
+    memcpy(claims+desc->offset, &i_value, sizeof(rhn_int_t));
+  } else {
+    b_value = (i_value != 0);
+    memcpy(claims+desc->offset, &b_value, sizeof(int));
+  }
+  return ret;
+}
+
+jwt_claims_schema_t * r_jwt_claims_schema_new(const rhn_claim_desc * claims, size_t nb_claims) {
+  jwt_claims_schema_t * schema = NULL;
+  size_t i, j;
+  int ret = RHN_OK;
+
+  if (claims != NULL && nb_claims && nb_claims <= R_CLAIMS_SCHEMA_MAX) {
+    for (i=0; i<nb_claims && ret == RHN_OK; i++) {
+      if (o_strnullempty(claims[i].name) || o_strlen(claims[i].name) > 64 ||
+          (claims[i].type != R_CLAIM_TYPE_STR && claims[i].type != R_CLAIM_TYPE_INT && claims[i].type != R_CLAIM_TYPE_BOOL) ||
+          (claims[i].type == R_CLAIM_TYPE_STR && !claims[i].max_len)) {
+        ret = RHN_ERROR_PARAM;
+      }
+      for (j=0; j<i && ret == RHN_OK; j++) {
+        if (0 == o_strcmp(claims[i].name, claims[j].name)) {
+          ret = RHN_ERROR_PARAM;
+        }
+      }
+    }
+    if (ret == RHN_OK) {
+      if ((schema = o_malloc(sizeof(jwt_claims_schema_t))) != NULL) {
+        memset(schema, 0, sizeof(jwt_claims_schema_t));
+        for (i=0; i<nb_claims; i++) {
+          schema->claims[i] = claims[i];
+          if ((schema->claims[i].name = o_strdup(claims[i].name)) == NULL) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_claims_schema_new - Error allocating resources for name");
+            r_jwt_claims_schema_free(schema);
+            schema = NULL;
+            break;
+          }
+          schema->name_len[i] = o_strlen(claims[i].name);
+          schema->nb_claims++;
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_claims_schema_new - Error allocating resources for schema");
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_claims_schema_new - Error invalid claim description");
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_claims_schema_new - Error input parameters");
+  }
+  return schema;
+}
+
+void r_jwt_claims_schema_free(jwt_claims_schema_t * schema) {
+  size_t i;
+
+  if (schema != NULL) {
+    for (i=0; i<schema->nb_claims; i++) {
+      o_free((char *)schema->claims[i].name);
+    }
+    o_free(schema);
+  }
+}
+
+/**
+ * Fills the claims structure with the loaded claims
+ */
+static int _r_jwt_get_claims_struct_json(jwt_t * jwt, const jwt_claims_schema_t * schema, void * claims, uint64_t * found) {
+  json_t * j_value;
+  size_t i;
+  int ret = RHN_OK, is_set;
+
+  for (i=0; i<schema->nb_claims; i++) {
+    j_value = json_object_get(jwt->j_claims, schema->claims[i].name);
+    if (schema->claims[i].type == R_CLAIM_TYPE_STR) {
+      is_set = json_is_string(j_value);
+      if (_r_jwt_claims_struct_set(&schema->claims[i], (unsigned char *)claims, json_string_value(j_value), 0) != RHN_OK) {
+        ret = RHN_ERROR_PARAM;
+        is_set = 0;
+      }
+    } else if (schema->claims[i].type == R_CLAIM_TYPE_INT) {
+      is_set = json_is_integer(j_value);
+      _r_jwt_claims_struct_set(&schema->claims[i], (unsigned char *)claims, NULL, json_integer_value(j_value));
+    } else {
+      is_set = json_is_boolean(j_value);
+      _r_jwt_claims_struct_set(&schema->claims[i], (unsigned char *)claims, NULL, json_is_true(j_value));
+    }
+    if (is_set) {
+      *found |= ((uint64_t)1 << i);
+    }
+  }
+  return ret;
+}
+
+int r_jwt_get_claims_struct(jwt_t * jwt, const jwt_claims_schema_t * schema, void * claims, uint64_t * present) {
+  struct _r_jwt_schema_output output;
+  const char * values[R_CLAIMS_SCHEMA_MAX], * value;
+  char scratch[1024], * buffer = scratch;
+  size_t i, buffer_len = sizeof(scratch);
+  uint64_t found = 0;
+  int ret = RHN_OK, is_set;
+
+  if (present != NULL) {
+    *present = 0;
+  }
+  if (jwt != NULL && schema != NULL && claims != NULL) {
+    if (jwt->lazy_claims != NULL && jwt->lazy_claims->payload != NULL) {
+      // Single pass over the claims payload, the claims aren't loaded
+      if (jwt->lazy_claims->payload_len+16 > buffer_len) {
+        buffer_len = jwt->lazy_claims->payload_len+16;
+        buffer = (char *)_r_scratch_get(_R_SCRATCH_CLAIMS, buffer_len);
+      }
+      if (buffer != NULL) {
+        output.schema = schema;
+        output.values = values;
+        for (i=0; i<schema->nb_claims; i++) {
+          values[i] = NULL;
+        }
+        if (_r_peek_json_scan(jwt->lazy_claims->payload, jwt->lazy_claims->payload_len, _R_PEEK_RAW|_R_PEEK_LAST|_R_PEEK_TYPED, buffer, buffer_len, schema->nb_claims, _r_jwt_schema_get_output, &output) == RHN_OK) {
+          for (i=0; i<schema->nb_claims; i++) {
+            value = values[i];
+            if (schema->claims[i].type == R_CLAIM_TYPE_STR) {
+              is_set = (value != NULL && *value == '"');
+              if (_r_jwt_claims_struct_set(&schema->claims[i], (unsigned char *)claims, is_set?value+1:NULL, 0) != RHN_OK) {
+                ret = RHN_ERROR_PARAM;
+                is_set = 0;
+              }
+            } else if (schema->claims[i].type == R_CLAIM_TYPE_INT) {
+              is_set = (value != NULL && *value == ' ' && _r_jwt_lazy_is_integer(value+1));
+              _r_jwt_claims_struct_set(&schema->claims[i], (unsigned char *)claims, NULL, is_set?(rhn_int_t)strtoll(value+1, NULL, 10):0);
+            } else {
+              is_set = (value != NULL && (0 == o_strcmp(value, " true") || 0 == o_strcmp(value, " false")));
+              _r_jwt_claims_struct_set(&schema->claims[i], (unsigned char *)claims, NULL, is_set && value[1] == 't');
+            }
+            if (is_set) {
+              found |= ((uint64_t)1 << i);
+            }
+          }
+        } else if (_r_jwt_claims_load(jwt) == RHN_OK) {
+          // The scanner rejects what it can't validate, jansson has the last word
+          ret = _r_jwt_get_claims_struct_json(jwt, schema, claims, &found);
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_get_claims_struct - Error scanning claims");
+          ret = RHN_ERROR_PARAM;
+        }
+        if (buffer != scratch) {
+          _r_scratch_release(_R_SCRATCH_CLAIMS, 0);
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_get_claims_struct - Error allocating resources for buffer");
+        ret = RHN_ERROR_MEMORY;
+      }
+    } else if (json_is_object(jwt->j_claims)) {
+      ret = _r_jwt_get_claims_struct_json(jwt, schema, claims, &found);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_get_claims_struct - Error invalid claims");
+      ret = RHN_ERROR_PARAM;
+    }
+    if (present != NULL) {
+      *present = found;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
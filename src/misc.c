@@ -21,17 +21,310 @@
  *
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <zlib.h>
 #include <orcania.h>
 #include <yder.h>
 #include <rhonabwy.h>
 
 #define _R_BLOCK_SIZE 256
+#define _R_ZLIB_MAX_BLOCKS 8
+
+#define _R_ARENA_ALIGN(size) (((size)+15)&~((size_t)15))
+#define _R_ARENA_DEFAULT_CHUNK_SIZE (16*1024)
+
+/**
+ * Arena chunk, the allocations follow the chunk header,
+ * each allocation is preceded by its size
+ */
+struct _r_arena_chunk {
+  struct _r_arena_chunk * next;
+  size_t                  size;
+  size_t                  used;
+};
+
+/**
+ * Bump allocator, the chunks are kept on reset and reused in order
+ */
+struct _rhn_arena {
+  struct _r_arena_chunk * first;
+  struct _r_arena_chunk * current;
+  size_t                  chunk_size;
+};
+
+/**
+ * Allocator functions set before r_global_enable_arena,
+ * used outside of an arena scope and for the chunks
+ */
+static o_malloc_t _r_arena_fallback_malloc = malloc;
+static o_realloc_t _r_arena_fallback_realloc = realloc;
+static o_free_t _r_arena_fallback_free = free;
+static int _r_arena_enabled = 0;
+static __thread rhn_arena_t * _r_arena_current = NULL;
+
+/**
+ * Prefix of every block allocated by the hooks, tag tells free and realloc
+ * whether the block is in an arena or on the heap without any lookup,
+ * size is the size requested for an arena block
+ * A block without tag was allocated before r_global_enable_arena
+ */
+struct _r_arena_prefix {
+  size_t size;
+  size_t tag;
+};
+
+#define _R_ARENA_PREFIX_SIZE _R_ARENA_ALIGN(sizeof(struct _r_arena_prefix))
+#define _R_ARENA_TAG_ARENA ((size_t)0xA7E4A5C3B1D2E3F4ULL)
+#define _R_ARENA_TAG_HEAP  ((size_t)0xC3B1A7E4F4E3D2B1ULL)
+
+/**
+ * Memory block allocated by zlib, zeroized when zlib frees it
+ * and kept for the next stream of the thread
+ */
+struct _r_zlib_block {
+  void   * data;
+  size_t   size;
+  int      used;
+};
+
+/**
+ * Per-thread context, the scratch buffers and the zlib memory blocks
+ * are kept between operations of the same thread
+ */
+struct _r_thread_ctx {
+  unsigned char        * scratch[_R_SCRATCH_MAX];
+  size_t                 scratch_size[_R_SCRATCH_MAX];
+  z_stream               deflate_stream;
+  z_stream               inflate_stream;
+  int                    deflate_init;
+  int                    inflate_init;
+  struct _r_zlib_block   zlib_blocks[_R_ZLIB_MAX_BLOCKS];
+};
+
+static __thread struct _r_thread_ctx * _r_thread_ctx_current = NULL;
+static pthread_key_t _r_thread_ctx_key;
+static pthread_once_t _r_thread_ctx_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Allocation accounting scope, the pointers allocated in the scope
+ * and their size are kept in an open addressing table
+ */
+struct _r_alloc_entry {
+  void * ptr;
+  size_t size;
+};
+
+struct _r_alloc_scope {
+  rhn_alloc_stats         stats;
+  size_t                  in_use;
+  struct _r_alloc_entry * entries;
+  size_t                  capacity;
+  size_t                  count;
+};
+
+#define _R_ALLOC_TABLE_MIN_SIZE 256
+
+/**
+ * Allocator functions set before r_global_enable_alloc_stats
+ */
+static o_malloc_t _r_alloc_stats_next_malloc = malloc;
+static o_realloc_t _r_alloc_stats_next_realloc = realloc;
+static o_free_t _r_alloc_stats_next_free = free;
+static int _r_alloc_stats_enabled = 0;
+static __thread struct _r_alloc_scope * _r_alloc_scope_current = NULL;
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define _R_SECMEM_SLAB_SIZE (64*1024)
+#define _R_SECMEM_MIN_BLOCK_SIZE 32
+#define _R_SECMEM_NB_CLASSES 6
+#define _R_SECMEM_MAX_SLABS 16
+#define _R_SECMEM_HEADER_SIZE 32
+
+/**
+ * Memory for secrets, slabs locked in memory and excluded from core dumps,
+ * each slab is split in blocks of one size class
+ */
+struct _r_secmem_slab {
+  unsigned char * data;
+  size_t          block_size;
+  size_t          class_index;
+};
+
+struct _r_secmem {
+  struct _r_secmem_slab slabs[_R_SECMEM_MAX_SLABS];
+  size_t                nb_slabs;
+  size_t                nb_locked;
+  size_t                in_use;
+  size_t                mapped_large;
+  size_t                locked_large;
+  void                * free_list[_R_SECMEM_NB_CLASSES];
+  struct _r_secmem_header * blocks;
+};
+
+/**
+ * Header of a secret that doesn't fit in a slab, before the returned pointer
+ * A dedicated mapping if the secret is larger than the largest block,
+ * a heap block if all the slabs are used
+ * The headers are linked in a list, so a pointer is only released if it's in it
+ */
+struct _r_secmem_header {
+  struct _r_secmem_header * prev;
+  struct _r_secmem_header * next;
+  size_t                    size;
+  int                       mapped;
+  int                       locked;
+};
+
+static struct _r_secmem _r_secmem_global;
+static pthread_mutex_t _r_secmem_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _r_secmem_once = PTHREAD_ONCE_INIT;
 
 #ifdef R_WITH_CURL
 #include <curl/curl.h>
-#include <string.h>
+#include <time.h>
+#include <errno.h>
 #define _R_HEADER_CONTENT_TYPE "Content-Type"
+#define _R_HTTP_POOL_SIZE 8
+#define _R_HTTP_DEFAULT_CONNECT_TIMEOUT 0
+#define _R_HTTP_DEFAULT_TIMEOUT 0
+#define _R_HTTP_DEFAULT_MAX_RESPONSE_SIZE 0
+#define _R_HTTP_DEFAULT_WAIT_TIMEOUT 30000
+
+/**
+ * HTTP client used to download remote content
+ * Idle curl handles are kept in a pool so their live connections are reused,
+ * the DNS and TLS session caches are shared between handles
+ */
+struct _r_http_client {
+  CURLSH                * share;
+  CURL                  * handles[_R_HTTP_POOL_SIZE];
+  size_t                  count;
+  long                    connect_timeout;
+  long                    timeout;
+  size_t                  max_response_size;
+  unsigned int            wait_timeout;
+  unsigned int            min_refresh;
+  unsigned int            backoff_min;
+  unsigned int            backoff_max;
+  struct _r_http_fetch  * fetches;
+};
+
+/**
+ * Fetch of a remote content, shared by all the threads requesting the same url
+ * The last successful response is kept min_refresh milliseconds,
+ * a failed fetch isn't retried before next_retry
+ */
+struct _r_http_fetch {
+  char                 * key;
+  int                    in_flight;
+  unsigned long          generation;
+  size_t                 waiters;
+  pthread_cond_t         cond;
+  char                 * content;
+  unsigned long long     fetched_at;
+  unsigned int           failures;
+  unsigned long long     next_retry;
+  struct _r_http_fetch * next;
+};
+
+static struct _r_http_client _r_http_client_global = {NULL, {NULL}, 0, _R_HTTP_DEFAULT_CONNECT_TIMEOUT, _R_HTTP_DEFAULT_TIMEOUT, _R_HTTP_DEFAULT_MAX_RESPONSE_SIZE, _R_HTTP_DEFAULT_WAIT_TIMEOUT, 0, 0, 0, NULL};
+static pthread_mutex_t _r_http_client_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t _r_http_share_lock[CURL_LOCK_DATA_LAST];
+static pthread_once_t _r_http_client_once = PTHREAD_ONCE_INIT;
+
+static void _r_http_share_lock_func(CURL * handle, curl_lock_data data, curl_lock_access access, void * userptr) {
+  (void)handle;
+  (void)access;
+  (void)userptr;
+  pthread_mutex_lock(&_r_http_share_lock[data]);
+}
+
+static void _r_http_share_unlock_func(CURL * handle, curl_lock_data data, void * userptr) {
+  (void)handle;
+  (void)userptr;
+  pthread_mutex_unlock(&_r_http_share_lock[data]);
+}
+
+/**
+ * A forked child must not use the connections of its parent,
+ * the pooled handles and the share are dropped without cleanup
+ * to keep the parent connections intact
+ */
+static void _r_http_client_atfork_child(void) {
+  pthread_mutex_init(&_r_http_client_lock, NULL);
+  _r_http_client_global.count = 0;
+  _r_http_client_global.share = NULL;
+  _r_http_client_global.fetches = NULL;
+}
+
+static void _r_http_client_register_atfork(void) {
+  pthread_atfork(NULL, NULL, _r_http_client_atfork_child);
+}
+
+static int _r_http_share_init(void) {
+  int ret = RHN_OK;
+  size_t i;
+
+  if (_r_http_client_global.share != NULL) {
+    return RHN_OK;
+  }
+  for (i=0; i<CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_init(&_r_http_share_lock[i], NULL);
+  }
+  if ((_r_http_client_global.share = curl_share_init()) != NULL) {
+    if (curl_share_setopt(_r_http_client_global.share, CURLSHOPT_LOCKFUNC, _r_http_share_lock_func) != CURLSHE_OK ||
+        curl_share_setopt(_r_http_client_global.share, CURLSHOPT_UNLOCKFUNC, _r_http_share_unlock_func) != CURLSHE_OK ||
+        curl_share_setopt(_r_http_client_global.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK ||
+        curl_share_setopt(_r_http_client_global.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_http_share_init - Error curl_share_setopt");
+      curl_share_cleanup(_r_http_client_global.share);
+      _r_http_client_global.share = NULL;
+      ret = RHN_ERROR;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_http_share_init - Error curl_share_init");
+    ret = RHN_ERROR_MEMORY;
+  }
+  return ret;
+}
+
+static void _r_http_fetch_free(struct _r_http_fetch * fetch) {
+  pthread_cond_destroy(&fetch->cond);
+  o_free(fetch->key);
+  o_free(fetch->content);
+  o_free(fetch);
+}
+
+static void _r_http_client_clean(void) {
+  struct _r_http_fetch * fetch;
+  size_t i;
+
+  pthread_mutex_lock(&_r_http_client_lock);
+  while ((fetch = _r_http_client_global.fetches) != NULL) {
+    _r_http_client_global.fetches = fetch->next;
+    _r_http_fetch_free(fetch);
+  }
+  for (i=0; i<_r_http_client_global.count; i++) {
+    curl_easy_cleanup(_r_http_client_global.handles[i]);
+    _r_http_client_global.handles[i] = NULL;
+  }
+  _r_http_client_global.count = 0;
+  if (_r_http_client_global.share != NULL) {
+    curl_share_cleanup(_r_http_client_global.share);
+    _r_http_client_global.share = NULL;
+    for (i=0; i<CURL_LOCK_DATA_LAST; i++) {
+      pthread_mutex_destroy(&_r_http_share_lock[i]);
+    }
+  }
+  pthread_mutex_unlock(&_r_http_client_lock);
+}
 #endif
 
 int r_global_init(void) {
@@ -42,6 +335,12 @@ int r_global_init(void) {
 
   o_get_alloc_funcs(&malloc_fn, &realloc_fn, &free_fn);
   json_set_alloc_funcs((json_malloc_t)malloc_fn, (json_free_t)free_fn);
+  if (_r_arena_enabled) {
+    // curl keeps its handles between calls, they must not be allocated in an arena
+    malloc_fn = _r_arena_fallback_malloc;
+    realloc_fn = _r_arena_fallback_realloc;
+    free_fn = _r_arena_fallback_free;
+  }
 #ifdef R_WITH_CURL
   if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_global_init - Error curl_global_init");
@@ -50,16 +349,744 @@ int r_global_init(void) {
     if (curl_global_init_mem(CURL_GLOBAL_DEFAULT, malloc_fn, free_fn, realloc_fn, *o_strdup, *calloc) != CURLE_OK) {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_global_init - Error curl_global_init_mem");
       ret = RHN_ERROR_MEMORY;
+    } else {
+      pthread_once(&_r_http_client_once, _r_http_client_register_atfork);
+      ret = _r_http_share_init();
+    }
+  }
+#endif
+  return ret;
+}
+
+void r_global_close(void) {
+  r_thread_ctx_release();
+#ifdef R_WITH_CURL
+  _r_http_client_clean();
+  curl_global_cleanup();
+#endif
+}
+
+int r_global_set_http_fetch_options(unsigned int wait_timeout, unsigned int min_refresh, unsigned int backoff_min, unsigned int backoff_max) {
+#ifdef R_WITH_CURL
+  if (backoff_max && backoff_max < backoff_min) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_global_set_http_fetch_options - Error backoff_max lower than backoff_min");
+    return RHN_ERROR_PARAM;
+  }
+  pthread_mutex_lock(&_r_http_client_lock);
+  _r_http_client_global.wait_timeout = wait_timeout;
+  _r_http_client_global.min_refresh = min_refresh;
+  _r_http_client_global.backoff_min = backoff_min;
+  _r_http_client_global.backoff_max = backoff_max;
+  pthread_mutex_unlock(&_r_http_client_lock);
+  return RHN_OK;
+#else
+  (void)wait_timeout;
+  (void)min_refresh;
+  (void)backoff_min;
+  (void)backoff_max;
+  return RHN_ERROR_UNSUPPORTED;
+#endif
+}
+
+int r_global_set_http_options(unsigned int connect_timeout, unsigned int timeout, size_t max_response_size) {
+#ifdef R_WITH_CURL
+  pthread_mutex_lock(&_r_http_client_lock);
+  _r_http_client_global.connect_timeout = (long)connect_timeout;
+  _r_http_client_global.timeout = (long)timeout;
+  _r_http_client_global.max_response_size = max_response_size;
+  pthread_mutex_unlock(&_r_http_client_lock);
+  return RHN_OK;
+#else
+  (void)connect_timeout;
+  (void)timeout;
+  (void)max_response_size;
+  return RHN_ERROR_UNSUPPORTED;
+#endif
+}
+
+/**
+ * Returns the prefix of a block allocated by the hooks
+ */
+static struct _r_arena_prefix * _r_arena_prefix_get(void * ptr) {
+  return (struct _r_arena_prefix *)((unsigned char *)ptr-_R_ARENA_PREFIX_SIZE);
+}
+
+static void * _r_arena_alloc(rhn_arena_t * arena, size_t size) {
+  struct _r_arena_chunk * chunk;
+  size_t need = _R_ARENA_ALIGN(size)+_R_ARENA_PREFIX_SIZE, chunk_size;
+  struct _r_arena_prefix * prefix;
+
+  if (size > ((size_t)-1)/2) {
+    return NULL;
+  }
+  while (arena->current == NULL || arena->current->used+need > arena->current->size) {
+    if (arena->current != NULL && arena->current->next != NULL && arena->current->next->size >= need) {
+      arena->current = arena->current->next;
+      arena->current->used = 0;
+    } else if (arena->current == NULL && arena->first != NULL && arena->first->size >= need) {
+      arena->current = arena->first;
+      arena->current->used = 0;
+    } else {
+      chunk_size = need>arena->chunk_size?need:arena->chunk_size;
+      if ((chunk = _r_arena_fallback_malloc(_R_ARENA_ALIGN(sizeof(struct _r_arena_chunk))+chunk_size)) == NULL) {
+        return NULL;
+      }
+      chunk->size = chunk_size;
+      chunk->used = 0;
+      if (arena->current != NULL) {
+        chunk->next = arena->current->next;
+        arena->current->next = chunk;
+      } else {
+        chunk->next = arena->first;
+        arena->first = chunk;
+      }
+      arena->current = chunk;
+    }
+  }
+  prefix = (struct _r_arena_prefix *)((unsigned char *)arena->current + _R_ARENA_ALIGN(sizeof(struct _r_arena_chunk)) + arena->current->used);
+  arena->current->used += need;
+  prefix->size = size;
+  prefix->tag = _R_ARENA_TAG_ARENA;
+  return (unsigned char *)prefix+_R_ARENA_PREFIX_SIZE;
+}
+
+static void * _r_arena_malloc(size_t size) {
+  struct _r_arena_prefix * prefix;
+
+  if (_r_arena_current != NULL) {
+    return _r_arena_alloc(_r_arena_current, size);
+  } else if (size <= ((size_t)-1)-_R_ARENA_PREFIX_SIZE && (prefix = _r_arena_fallback_malloc(size+_R_ARENA_PREFIX_SIZE)) != NULL) {
+    prefix->size = 0;
+    prefix->tag = _R_ARENA_TAG_HEAP;
+    return (unsigned char *)prefix+_R_ARENA_PREFIX_SIZE;
+  } else {
+    return NULL;
+  }
+}
+
+static void * _r_arena_realloc(void * ptr, size_t size) {
+  struct _r_arena_prefix * prefix;
+  void * new_ptr;
+
+  if (ptr == NULL) {
+    return _r_arena_malloc(size);
+  }
+  prefix = _r_arena_prefix_get(ptr);
+  if (prefix->tag == _R_ARENA_TAG_ARENA) {
+    // The block can't grow in place, its copy is made in the current scope, in an arena or not
+    if (size <= prefix->size) {
+      return ptr;
+    } else if ((new_ptr = _r_arena_malloc(size)) != NULL) {
+      memcpy(new_ptr, ptr, prefix->size);
+    }
+    return new_ptr;
+  } else if (prefix->tag == _R_ARENA_TAG_HEAP) {
+    if (size <= ((size_t)-1)-_R_ARENA_PREFIX_SIZE && (prefix = _r_arena_fallback_realloc(prefix, size+_R_ARENA_PREFIX_SIZE)) != NULL) {
+      return (unsigned char *)prefix+_R_ARENA_PREFIX_SIZE;
+    } else {
+      return NULL;
+    }
+  } else {
+    return _r_arena_fallback_realloc(ptr, size);
+  }
+}
+
+static void _r_arena_free(void * ptr) {
+  struct _r_arena_prefix * prefix;
+
+  // Memory allocated in an arena is released by r_arena_reset or r_arena_free
+  if (ptr != NULL) {
+    prefix = _r_arena_prefix_get(ptr);
+    if (prefix->tag == _R_ARENA_TAG_HEAP) {
+      prefix->tag = 0;
+      _r_arena_fallback_free(prefix);
+    } else if (prefix->tag != _R_ARENA_TAG_ARENA) {
+      _r_arena_fallback_free(ptr);
+    }
+  }
+}
+
+int r_global_enable_arena(void) {
+  if (!_r_arena_enabled) {
+    o_get_alloc_funcs(&_r_arena_fallback_malloc, &_r_arena_fallback_realloc, &_r_arena_fallback_free);
+    o_set_alloc_funcs(_r_arena_malloc, _r_arena_realloc, _r_arena_free);
+    json_set_alloc_funcs(_r_arena_malloc, _r_arena_free);
+    _r_arena_enabled = 1;
+  }
+  return RHN_OK;
+}
+
+rhn_arena_t * r_arena_new(size_t chunk_size) {
+  rhn_arena_t * arena;
+
+  if ((arena = _r_arena_fallback_malloc(sizeof(rhn_arena_t))) != NULL) {
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->chunk_size = chunk_size?_R_ARENA_ALIGN(chunk_size):_R_ARENA_DEFAULT_CHUNK_SIZE;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_arena_new - Error allocating resources for arena");
+  }
+  return arena;
+}
+
+void r_arena_free(rhn_arena_t * arena) {
+  struct _r_arena_chunk * chunk, * next;
+
+  if (arena != NULL) {
+    if (_r_arena_current == arena) {
+      _r_arena_current = NULL;
+    }
+    for (chunk = arena->first; chunk != NULL; chunk = next) {
+      next = chunk->next;
+      _r_arena_fallback_free(chunk);
+    }
+    _r_arena_fallback_free(arena);
+  }
+}
+
+void r_arena_reset(rhn_arena_t * arena) {
+  if (arena != NULL) {
+    arena->current = arena->first;
+    if (arena->current != NULL) {
+      arena->current->used = 0;
+    }
+  }
+}
+
+size_t r_arena_used(rhn_arena_t * arena) {
+  struct _r_arena_chunk * chunk;
+  size_t used = 0;
+
+  if (arena != NULL && arena->current != NULL) {
+    for (chunk = arena->first; chunk != arena->current; chunk = chunk->next) {
+      used += chunk->used;
+    }
+    used += arena->current->used;
+  }
+  return used;
+}
+
+int r_arena_begin(rhn_arena_t * arena) {
+  if (!_r_arena_enabled) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_arena_begin - Error arena not enabled");
+    return RHN_ERROR_UNSUPPORTED;
+  } else if (arena == NULL || _r_arena_current != NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_arena_begin - Error input parameters");
+    return RHN_ERROR_PARAM;
+  } else {
+    _r_arena_current = arena;
+    return RHN_OK;
+  }
+}
+
+void r_arena_end(void) {
+  _r_arena_current = NULL;
+}
+
+rhn_arena_t * _r_arena_suspend(void) {
+  rhn_arena_t * arena = _r_arena_current;
+
+  _r_arena_current = NULL;
+  return arena;
+}
+
+void _r_arena_resume(rhn_arena_t * arena) {
+  _r_arena_current = arena;
+}
+
+/**
+ * Frees a per-thread context, called when the thread exits
+ */
+static void _r_thread_ctx_destroy(void * cls) {
+  struct _r_thread_ctx * ctx = (struct _r_thread_ctx *)cls;
+  rhn_arena_t * arena;
+  size_t i;
+
+  if (ctx != NULL) {
+    arena = _r_arena_suspend();
+    for (i=0; i<_R_SCRATCH_MAX; i++) {
+      o_free(ctx->scratch[i]);
+    }
+    if (ctx->deflate_init) {
+      deflateEnd(&ctx->deflate_stream);
+    }
+    if (ctx->inflate_init) {
+      inflateEnd(&ctx->inflate_stream);
+    }
+    // The blocks are zeroized when zlib frees them
+    for (i=0; i<_R_ZLIB_MAX_BLOCKS; i++) {
+      o_free(ctx->zlib_blocks[i].data);
+    }
+    o_free(ctx);
+    _r_arena_resume(arena);
+  }
+}
+
+static void _r_thread_ctx_key_create(void) {
+  pthread_key_create(&_r_thread_ctx_key, _r_thread_ctx_destroy);
+}
+
+/**
+ * Returns the context of the current thread, created on first use
+ * The context is allocated outside of the arena, it outlives the arena scopes
+ */
+static struct _r_thread_ctx * _r_thread_ctx_get(void) {
+  rhn_arena_t * arena;
+
+  if (_r_thread_ctx_current == NULL) {
+    pthread_once(&_r_thread_ctx_once, _r_thread_ctx_key_create);
+    arena = _r_arena_suspend();
+    if ((_r_thread_ctx_current = o_malloc(sizeof(struct _r_thread_ctx))) != NULL) {
+      memset(_r_thread_ctx_current, 0, sizeof(struct _r_thread_ctx));
+      pthread_setspecific(_r_thread_ctx_key, _r_thread_ctx_current);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_thread_ctx_get - Error allocating resources for _r_thread_ctx_current");
+    }
+    _r_arena_resume(arena);
+  }
+  return _r_thread_ctx_current;
+}
+
+void r_thread_ctx_release(void) {
+  if (_r_thread_ctx_current != NULL) {
+    pthread_setspecific(_r_thread_ctx_key, NULL);
+    _r_thread_ctx_destroy(_r_thread_ctx_current);
+    _r_thread_ctx_current = NULL;
+  }
+}
+
+size_t r_thread_ctx_size(void) {
+  size_t i, size = 0;
+
+  if (_r_thread_ctx_current != NULL) {
+    for (i=0; i<_R_SCRATCH_MAX; i++) {
+      size += _r_thread_ctx_current->scratch_size[i];
+    }
+    for (i=0; i<_R_ZLIB_MAX_BLOCKS; i++) {
+      size += _r_thread_ctx_current->zlib_blocks[i].size;
+    }
+  }
+  return size;
+}
+
+unsigned char * _r_scratch_get(int slot, size_t size) {
+  struct _r_thread_ctx * ctx;
+  rhn_arena_t * arena;
+
+  if (slot >= 0 && slot < _R_SCRATCH_MAX && (ctx = _r_thread_ctx_get()) != NULL) {
+    if (ctx->scratch_size[slot] < size) {
+      // The previous content isn't needed, no realloc
+      size = ((size+_R_BLOCK_SIZE-1)/_R_BLOCK_SIZE)*_R_BLOCK_SIZE;
+      arena = _r_arena_suspend();
+      o_free(ctx->scratch[slot]);
+      if ((ctx->scratch[slot] = o_malloc(size)) != NULL) {
+        ctx->scratch_size[slot] = size;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_scratch_get - Error allocating resources for scratch");
+        ctx->scratch_size[slot] = 0;
+      }
+      _r_arena_resume(arena);
+    }
+    return ctx->scratch[slot];
+  } else {
+    return NULL;
+  }
+}
+
+void _r_scratch_release(int slot, size_t wipe_len) {
+  struct _r_thread_ctx * ctx = _r_thread_ctx_current;
+  rhn_arena_t * arena;
+
+  if (slot >= 0 && slot < _R_SCRATCH_MAX && ctx != NULL && ctx->scratch[slot] != NULL) {
+    if (wipe_len) {
+      gnutls_memset(ctx->scratch[slot], 0, wipe_len<ctx->scratch_size[slot]?wipe_len:ctx->scratch_size[slot]);
+    }
+    if (ctx->scratch_size[slot] > R_THREAD_CTX_SCRATCH_MAX) {
+      arena = _r_arena_suspend();
+      o_free(ctx->scratch[slot]);
+      _r_arena_resume(arena);
+      ctx->scratch[slot] = NULL;
+      ctx->scratch_size[slot] = 0;
+    }
+  }
+}
+
+static size_t _r_alloc_table_index(struct _r_alloc_scope * scope, void * ptr) {
+  return (size_t)((((uintptr_t)ptr)>>4)*(uintptr_t)0x9E3779B97F4A7C15ULL)&(scope->capacity-1);
+}
+
+/**
+ * Adds a pointer to the table of the scope, the table is allocated with
+ * the standard allocator so it isn't counted
+ */
+static void _r_alloc_table_add(struct _r_alloc_scope * scope, void * ptr, size_t size) {
+  struct _r_alloc_entry * entries = scope->entries;
+  size_t i, capacity = scope->capacity, index;
+
+  if ((scope->count+1)*2 > scope->capacity) {
+    if ((scope->entries = calloc(capacity?capacity*2:_R_ALLOC_TABLE_MIN_SIZE, sizeof(struct _r_alloc_entry))) != NULL) {
+      scope->capacity = capacity?capacity*2:_R_ALLOC_TABLE_MIN_SIZE;
+      for (i=0; i<capacity; i++) {
+        if (entries[i].ptr != NULL) {
+          index = _r_alloc_table_index(scope, entries[i].ptr);
+          while (scope->entries[index].ptr != NULL) {
+            index = (index+1)&(scope->capacity-1);
+          }
+          scope->entries[index] = entries[i];
+        }
+      }
+      free(entries);
+    } else {
+      // The allocation isn't tracked, its free won't change in_use
+      scope->entries = entries;
+      return;
+    }
+  }
+  index = _r_alloc_table_index(scope, ptr);
+  while (scope->entries[index].ptr != NULL) {
+    index = (index+1)&(scope->capacity-1);
+  }
+  scope->entries[index].ptr = ptr;
+  scope->entries[index].size = size;
+  scope->count++;
+}
+
+/**
+ * Removes a pointer from the table of the scope
+ * @return 1 if the pointer was allocated in the scope, its size is set in size
+ */
+static int _r_alloc_table_remove(struct _r_alloc_scope * scope, void * ptr, size_t * size) {
+  size_t i, j, k;
+
+  if (scope->capacity) {
+    i = _r_alloc_table_index(scope, ptr);
+    while (scope->entries[i].ptr != NULL) {
+      if (scope->entries[i].ptr == ptr) {
+        *size = scope->entries[i].size;
+        scope->count--;
+        // Backward shift deletion, no tombstone
+        j = i;
+        while (1) {
+          j = (j+1)&(scope->capacity-1);
+          if (scope->entries[j].ptr == NULL) {
+            break;
+          }
+          k = _r_alloc_table_index(scope, scope->entries[j].ptr);
+          if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            scope->entries[i] = scope->entries[j];
+            i = j;
+          }
+        }
+        scope->entries[i].ptr = NULL;
+        return 1;
+      }
+      i = (i+1)&(scope->capacity-1);
+    }
+  }
+  return 0;
+}
+
+static void _r_alloc_scope_add(struct _r_alloc_scope * scope, void * ptr, size_t size) {
+  scope->stats.bytes += size;
+  scope->in_use += size;
+  if (scope->in_use > scope->stats.peak) {
+    scope->stats.peak = scope->in_use;
+  }
+  _r_alloc_table_add(scope, ptr, size);
+}
+
+static void * _r_alloc_stats_malloc(size_t size) {
+  void * ptr = _r_alloc_stats_next_malloc(size);
+
+  if (ptr != NULL && _r_alloc_scope_current != NULL) {
+    _r_alloc_scope_current->stats.allocs++;
+    _r_alloc_scope_add(_r_alloc_scope_current, ptr, size);
+  }
+  return ptr;
+}
+
+static void * _r_alloc_stats_realloc(void * ptr, size_t size) {
+  void * new_ptr;
+  size_t old_size;
+
+  if (ptr == NULL) {
+    return _r_alloc_stats_malloc(size);
+  } else if ((new_ptr = _r_alloc_stats_next_realloc(ptr, size)) != NULL && _r_alloc_scope_current != NULL) {
+    _r_alloc_scope_current->stats.reallocs++;
+    if (_r_alloc_table_remove(_r_alloc_scope_current, ptr, &old_size)) {
+      _r_alloc_scope_current->in_use -= old_size;
+    }
+    _r_alloc_scope_add(_r_alloc_scope_current, new_ptr, size);
+  }
+  return new_ptr;
+}
+
+static void _r_alloc_stats_free(void * ptr) {
+  size_t size;
+
+  if (ptr != NULL) {
+    if (_r_alloc_scope_current != NULL) {
+      _r_alloc_scope_current->stats.frees++;
+      if (_r_alloc_table_remove(_r_alloc_scope_current, ptr, &size)) {
+        _r_alloc_scope_current->in_use -= size;
+      }
+    }
+    _r_alloc_stats_next_free(ptr);
+  }
+}
+
+int r_global_enable_alloc_stats(void) {
+  if (!_r_alloc_stats_enabled) {
+    o_get_alloc_funcs(&_r_alloc_stats_next_malloc, &_r_alloc_stats_next_realloc, &_r_alloc_stats_next_free);
+    o_set_alloc_funcs(_r_alloc_stats_malloc, _r_alloc_stats_realloc, _r_alloc_stats_free);
+    json_set_alloc_funcs(_r_alloc_stats_malloc, _r_alloc_stats_free);
+    _r_alloc_stats_enabled = 1;
+  }
+  return RHN_OK;
+}
+
+int r_alloc_stats_begin(void) {
+  if (!_r_alloc_stats_enabled) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_alloc_stats_begin - Error allocation accounting not enabled");
+    return RHN_ERROR_UNSUPPORTED;
+  } else if (_r_alloc_scope_current != NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_alloc_stats_begin - Error accounting scope already started");
+    return RHN_ERROR_PARAM;
+  } else if ((_r_alloc_scope_current = calloc(1, sizeof(struct _r_alloc_scope))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_alloc_stats_begin - Error allocating resources for _r_alloc_scope_current");
+    return RHN_ERROR_MEMORY;
+  } else {
+    return RHN_OK;
+  }
+}
+
+int r_alloc_stats_end(rhn_alloc_stats * stats) {
+  struct _r_alloc_scope * scope = _r_alloc_scope_current;
+
+  if (scope != NULL) {
+    _r_alloc_scope_current = NULL;
+    if (stats != NULL) {
+      *stats = scope->stats;
+      stats->in_use = scope->in_use;
+    }
+    free(scope->entries);
+    free(scope);
+    return RHN_OK;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_alloc_stats_end - Error no accounting scope started");
+    return RHN_ERROR_PARAM;
+  }
+}
+
+static void _r_secmem_atfork_child(void) {
+  pthread_mutex_init(&_r_secmem_lock, NULL);
+}
+
+static void _r_secmem_register_atfork(void) {
+  pthread_atfork(NULL, NULL, _r_secmem_atfork_child);
+}
+
+/**
+ * Maps a new slab for the size class and adds its blocks to the free list
+ * If the slab can't be locked, e.g. RLIMIT_MEMLOCK is reached, it's used anyway
+ */
+static int _r_secmem_add_slab(size_t class_index) {
+  unsigned char * data;
+  void ** block;
+  size_t block_size = (size_t)_R_SECMEM_MIN_BLOCK_SIZE<<class_index, i;
+
+  if (_r_secmem_global.nb_slabs >= _R_SECMEM_MAX_SLABS) {
+    return RHN_ERROR_MEMORY;
+  }
+  if ((data = mmap(NULL, _R_SECMEM_SLAB_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_secmem_add_slab - Error mmap");
+    return RHN_ERROR_MEMORY;
+  }
+  if (!mlock(data, _R_SECMEM_SLAB_SIZE)) {
+    _r_secmem_global.nb_locked++;
+  } else {
+    y_log_message(Y_LOG_LEVEL_DEBUG, "_r_secmem_add_slab - Error mlock, slab not locked in memory");
+  }
+#ifdef MADV_DONTDUMP
+  madvise(data, _R_SECMEM_SLAB_SIZE, MADV_DONTDUMP);
+#endif
+  for (i=_R_SECMEM_SLAB_SIZE/block_size; i>0; i--) {
+    block = (void **)(data+(i-1)*block_size);
+    *block = _r_secmem_global.free_list[class_index];
+    _r_secmem_global.free_list[class_index] = block;
+  }
+  _r_secmem_global.slabs[_r_secmem_global.nb_slabs].data = data;
+  _r_secmem_global.slabs[_r_secmem_global.nb_slabs].block_size = block_size;
+  _r_secmem_global.slabs[_r_secmem_global.nb_slabs].class_index = class_index;
+  _r_secmem_global.nb_slabs++;
+  return RHN_OK;
+}
+
+static size_t _r_secmem_page_round(size_t size) {
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+  return (size+page_size-1)/page_size*page_size;
+}
+
+/**
+ * Maps size bytes rounded to the page size, locked in memory if possible
+ * and excluded from core dumps
+ */
+static unsigned char * _r_secmem_map(size_t size, int * locked) {
+  unsigned char * data;
+
+  size = _r_secmem_page_round(size);
+  if ((data = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_secmem_map - Error mmap");
+    return NULL;
+  }
+  if (!mlock(data, size)) {
+    *locked = 1;
+  } else {
+    *locked = 0;
+    y_log_message(Y_LOG_LEVEL_DEBUG, "_r_secmem_map - Error mlock, memory not locked");
+  }
+#ifdef MADV_DONTDUMP
+  madvise(data, size, MADV_DONTDUMP);
+#endif
+  return data;
+}
+
+void * _r_secure_malloc(size_t size) {
+  void * ptr = NULL;
+  unsigned char * block = NULL;
+  size_t class_index = 0;
+  int locked = 0;
+  struct _r_secmem_header * header;
+
+  if (size) {
+    while (class_index < _R_SECMEM_NB_CLASSES && ((size_t)_R_SECMEM_MIN_BLOCK_SIZE<<class_index) < size) {
+      class_index++;
+    }
+    pthread_once(&_r_secmem_once, _r_secmem_register_atfork);
+    if (class_index < _R_SECMEM_NB_CLASSES) {
+      pthread_mutex_lock(&_r_secmem_lock);
+      if (_r_secmem_global.free_list[class_index] != NULL || _r_secmem_add_slab(class_index) == RHN_OK) {
+        ptr = _r_secmem_global.free_list[class_index];
+        _r_secmem_global.free_list[class_index] = *(void **)ptr;
+        *(void **)ptr = NULL;
+        _r_secmem_global.in_use += (size_t)_R_SECMEM_MIN_BLOCK_SIZE<<class_index;
+      }
+      pthread_mutex_unlock(&_r_secmem_lock);
+    }
+    if (ptr == NULL) {
+      if (class_index == _R_SECMEM_NB_CLASSES) {
+        // Too large for a slab, dedicated mapping
+        block = _r_secmem_map(size+_R_SECMEM_HEADER_SIZE, &locked);
+      } else {
+        // No slab left, heap block zeroized on free
+        block = malloc(size+_R_SECMEM_HEADER_SIZE);
+      }
+      if (block != NULL) {
+        header = (struct _r_secmem_header *)block;
+        header->size = size;
+        header->mapped = (class_index == _R_SECMEM_NB_CLASSES);
+        header->locked = locked;
+        header->prev = NULL;
+        pthread_mutex_lock(&_r_secmem_lock);
+        if ((header->next = _r_secmem_global.blocks) != NULL) {
+          header->next->prev = header;
+        }
+        _r_secmem_global.blocks = header;
+        if (header->mapped) {
+          _r_secmem_global.mapped_large += _r_secmem_page_round(size+_R_SECMEM_HEADER_SIZE);
+          if (header->locked) {
+            _r_secmem_global.locked_large += _r_secmem_page_round(size+_R_SECMEM_HEADER_SIZE);
+          }
+        }
+        pthread_mutex_unlock(&_r_secmem_lock);
+        ptr = block+_R_SECMEM_HEADER_SIZE;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_secure_malloc - Error allocating resources for block");
+      }
+    }
+  }
+  return ptr;
+}
+
+void _r_secure_free(void * ptr) {
+  unsigned char * block = (unsigned char *)ptr;
+  size_t i, size, class_index;
+  int found = 0, mapped, locked;
+  struct _r_secmem_header * header = NULL;
+
+  if (ptr != NULL) {
+    pthread_mutex_lock(&_r_secmem_lock);
+    for (i=0; i<_r_secmem_global.nb_slabs; i++) {
+      if (block >= _r_secmem_global.slabs[i].data && block < _r_secmem_global.slabs[i].data+_R_SECMEM_SLAB_SIZE) {
+        size = _r_secmem_global.slabs[i].block_size;
+        class_index = _r_secmem_global.slabs[i].class_index;
+        gnutls_memset(block, 0, size);
+        *(void **)block = _r_secmem_global.free_list[class_index];
+        _r_secmem_global.free_list[class_index] = block;
+        _r_secmem_global.in_use -= size;
+        found = 1;
+        break;
+      }
+    }
+    if (!found) {
+      // The pointer is compared with the tracked blocks, it's never read if it's not one of them
+      header = _r_secmem_global.blocks;
+      while (header != NULL && (unsigned char *)header+_R_SECMEM_HEADER_SIZE != block) {
+        header = header->next;
+      }
+      if (header != NULL) {
+        if (header->prev != NULL) {
+          header->prev->next = header->next;
+        } else {
+          _r_secmem_global.blocks = header->next;
+        }
+        if (header->next != NULL) {
+          header->next->prev = header->prev;
+        }
+        if (header->mapped) {
+          size = _r_secmem_page_round(header->size+_R_SECMEM_HEADER_SIZE);
+          _r_secmem_global.mapped_large -= size;
+          if (header->locked) {
+            _r_secmem_global.locked_large -= size;
+          }
+        }
+      }
+    }
+    pthread_mutex_unlock(&_r_secmem_lock);
+    if (header != NULL) {
+      mapped = header->mapped;
+      locked = header->locked;
+      size = header->size+_R_SECMEM_HEADER_SIZE;
+      gnutls_memset(header, 0, size);
+      if (mapped) {
+        size = _r_secmem_page_round(size);
+        if (locked) {
+          munlock(header, size);
+        }
+        munmap(header, size);
+      } else {
+        free(header);
+      }
+    } else if (!found) {
+      // Not allocated with _r_secure_malloc, freeing it would corrupt the heap
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_secure_free - Error invalid pointer %p", ptr);
     }
   }
-#endif
-  return ret;
 }
 
-void r_global_close(void) {
-#ifdef R_WITH_CURL
-  curl_global_cleanup();
-#endif
+void r_secure_memory_info(size_t * mapped, size_t * locked, size_t * in_use) {
+  pthread_mutex_lock(&_r_secmem_lock);
+  if (mapped != NULL) {
+    *mapped = _r_secmem_global.nb_slabs*_R_SECMEM_SLAB_SIZE+_r_secmem_global.mapped_large;
+  }
+  if (locked != NULL) {
+    *locked = _r_secmem_global.nb_locked*_R_SECMEM_SLAB_SIZE+_r_secmem_global.locked_large;
+  }
+  if (in_use != NULL) {
+    *in_use = _r_secmem_global.in_use;
+  }
+  pthread_mutex_unlock(&_r_secmem_lock);
 }
 
 #ifdef R_WITH_CURL
@@ -67,6 +1094,7 @@ void r_global_close(void) {
 struct _r_response_str {
   char * ptr;
   size_t len;
+  size_t max_len;
 };
 
 struct _r_expected_content_type {
@@ -77,6 +1105,10 @@ struct _r_expected_content_type {
 static size_t write_response(char *ptr, size_t size, size_t nmemb, void * userdata) {
   struct _r_response_str * resp = (struct _r_response_str *)userdata;
   size_t len = (size*nmemb);
+  if (resp->max_len && resp->len + len > resp->max_len) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "write_response - Error response too large");
+    return 0;
+  }
   if ((resp->ptr = o_realloc(resp->ptr, (resp->len + len + 1))) != NULL) {
     memcpy(resp->ptr+resp->len, ptr, len);
     resp->len += len;
@@ -97,21 +1129,71 @@ static size_t write_header(void * buffer, size_t size, size_t nitems, void * use
   }
   return nitems * size;
 }
-#endif
 
-char * _r_get_http_content(const char * url, int x5u_flags, const char * expected_content_type) {
+/**
+ * Takes an idle curl handle from the pool or creates a new one
+ */
+static CURL * _r_http_handle_get(long * connect_timeout, long * timeout, size_t * max_response_size) {
+  CURL * curl = NULL;
+  CURLSH * share;
+
+  pthread_once(&_r_http_client_once, _r_http_client_register_atfork);
+  pthread_mutex_lock(&_r_http_client_lock);
+  if (_r_http_client_global.count) {
+    _r_http_client_global.count--;
+    curl = _r_http_client_global.handles[_r_http_client_global.count];
+    _r_http_client_global.handles[_r_http_client_global.count] = NULL;
+  }
+  share = _r_http_client_global.share;
+  *connect_timeout = _r_http_client_global.connect_timeout;
+  *timeout = _r_http_client_global.timeout;
+  *max_response_size = _r_http_client_global.max_response_size;
+  pthread_mutex_unlock(&_r_http_client_lock);
+
+  if (curl == NULL) {
+    curl = curl_easy_init();
+  }
+  // curl_easy_reset clears the share of a pooled handle, so it's set on each use
+  if (curl != NULL && share != NULL) {
+    if (curl_easy_setopt(curl, CURLOPT_SHARE, share) != CURLE_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_http_handle_get - Error curl_easy_setopt CURLOPT_SHARE");
+    }
+  }
+  return curl;
+}
+
+/**
+ * Puts the curl handle back in the pool, its options are reset
+ * but its live connections are kept
+ */
+static void _r_http_handle_release(CURL * curl) {
+  curl_easy_reset(curl);
+  pthread_mutex_lock(&_r_http_client_lock);
+  if (_r_http_client_global.count < _R_HTTP_POOL_SIZE) {
+    _r_http_client_global.handles[_r_http_client_global.count] = curl;
+    _r_http_client_global.count++;
+    curl = NULL;
+  }
+  pthread_mutex_unlock(&_r_http_client_lock);
+  if (curl != NULL) {
+    curl_easy_cleanup(curl);
+  }
+}
+
+static char * _r_http_fetch_content(const char * url, int x5u_flags, const char * expected_content_type) {
   char * to_return = NULL;
-#ifdef R_WITH_CURL
   CURL *curl;
   struct curl_slist *list = NULL;
   struct _r_response_str resp;
   struct _r_expected_content_type ct;
-  long status = 0;
+  long status = 0, connect_timeout = 0, timeout = 0;
+  size_t max_response_size = 0;
 
-  curl = curl_easy_init();
+  curl = _r_http_handle_get(&connect_timeout, &timeout, &max_response_size);
   if(curl != NULL) {
     resp.ptr = NULL;
     resp.len = 0;
+    resp.max_len = max_response_size;
     ct.expected = expected_content_type;
     ct.found = 0;
 
@@ -134,6 +1216,18 @@ char * _r_get_http_content(const char * url, int x5u_flags, const char * expecte
       if (curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L) != CURLE_OK) {
         break;
       }
+      if (curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L) != CURLE_OK) {
+        break;
+      }
+      if (connect_timeout && curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, connect_timeout) != CURLE_OK) {
+        break;
+      }
+      if (timeout && curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout) != CURLE_OK) {
+        break;
+      }
+      if (max_response_size && curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)max_response_size) != CURLE_OK) {
+        break;
+      }
       if (x5u_flags & R_FLAG_FOLLOW_REDIRECT) {
         if (curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1) != CURLE_OK) {
           break;
@@ -164,7 +1258,7 @@ char * _r_get_http_content(const char * url, int x5u_flags, const char * expecte
       }
     } while (0);
 
-    curl_easy_cleanup(curl);
+    _r_http_handle_release(curl);
     curl_slist_free_all(list);
 
     if (status >= 200 && status < 300) {
@@ -181,6 +1275,142 @@ char * _r_get_http_content(const char * url, int x5u_flags, const char * expecte
       o_free(resp.ptr);
     }
   }
+  return to_return;
+}
+
+static unsigned long long _r_http_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((unsigned long long)now.tv_sec*1000) + ((unsigned long long)now.tv_nsec/1000000);
+}
+
+/**
+ * Returns true if the fetch must be kept after its last user,
+ * to serve its content or to hold its backoff
+ */
+static int _r_http_fetch_is_cached(struct _r_http_fetch * fetch, unsigned long long now) {
+  return (fetch->content != NULL && now < fetch->fetched_at + _r_http_client_global.min_refresh) ||
+         (_r_http_client_global.backoff_min && fetch->failures && now < fetch->next_retry);
+}
+
+static void _r_http_fetch_prune(unsigned long long now) {
+  struct _r_http_fetch ** fetch = &_r_http_client_global.fetches, * expired;
+
+  while (*fetch != NULL) {
+    if (!(*fetch)->in_flight && !(*fetch)->waiters && !_r_http_fetch_is_cached(*fetch, now)) {
+      expired = *fetch;
+      *fetch = expired->next;
+      _r_http_fetch_free(expired);
+    } else {
+      fetch = &(*fetch)->next;
+    }
+  }
+}
+
+static struct _r_http_fetch * _r_http_fetch_new(char * key) {
+  struct _r_http_fetch * fetch;
+  pthread_condattr_t attr;
+
+  if ((fetch = o_malloc(sizeof(struct _r_http_fetch))) != NULL) {
+    memset(fetch, 0, sizeof(struct _r_http_fetch));
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&fetch->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    fetch->key = key;
+    fetch->next = _r_http_client_global.fetches;
+    _r_http_client_global.fetches = fetch;
+  }
+  return fetch;
+}
+#endif
+
+/**
+ * Concurrent requests of the same url are coalesced:
+ * one thread fetches the content while the others wait for its result,
+ * at most wait_timeout milliseconds
+ */
+static char * _r_get_http_content_coalesced(const char * url, int x5u_flags, const char * expected_content_type) {
+  char * to_return = NULL;
+#ifdef R_WITH_CURL
+  char * key;
+  struct _r_http_fetch * fetch;
+  struct timespec deadline;
+  unsigned long long now, delay;
+  unsigned long generation;
+  int leader = 0, timeout = 0;
+
+  if ((key = msprintf("%d\n%s\n%s", x5u_flags&(R_FLAG_IGNORE_SERVER_CERTIFICATE|R_FLAG_FOLLOW_REDIRECT), expected_content_type!=NULL?expected_content_type:"", url)) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_get_http_content - Error allocating resources for key");
+    return NULL;
+  }
+  pthread_mutex_lock(&_r_http_client_lock);
+  now = _r_http_now();
+  _r_http_fetch_prune(now);
+  for (fetch = _r_http_client_global.fetches; fetch != NULL && 0 != o_strcmp(fetch->key, key); fetch = fetch->next);
+  if (fetch == NULL) {
+    if ((fetch = _r_http_fetch_new(key)) != NULL) {
+      key = NULL;
+      leader = 1;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_get_http_content - Error allocating resources for fetch");
+    }
+  } else if (fetch->in_flight) {
+    generation = fetch->generation;
+    fetch->waiters++;
+    delay = now + _r_http_client_global.wait_timeout;
+    deadline.tv_sec = (time_t)(delay/1000);
+    deadline.tv_nsec = (long)((delay%1000)*1000000);
+    while (fetch->generation == generation && !timeout) {
+      if (_r_http_client_global.wait_timeout) {
+        timeout = (pthread_cond_timedwait(&fetch->cond, &_r_http_client_lock, &deadline) == ETIMEDOUT);
+      } else {
+        pthread_cond_wait(&fetch->cond, &_r_http_client_lock);
+      }
+    }
+    fetch->waiters--;
+    if (fetch->generation != generation) {
+      to_return = o_strdup(fetch->content);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_get_http_content - Timeout waiting for %s", url);
+    }
+  } else if (fetch->content != NULL && now < fetch->fetched_at + _r_http_client_global.min_refresh) {
+    to_return = o_strdup(fetch->content);
+  } else if (_r_http_client_global.backoff_min && fetch->failures && now < fetch->next_retry) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_get_http_content - Fetch of %s failed recently, next retry in %llu ms", url, fetch->next_retry - now);
+  } else {
+    leader = 1;
+  }
+  if (leader) {
+    fetch->in_flight = 1;
+    pthread_mutex_unlock(&_r_http_client_lock);
+    to_return = _r_http_fetch_content(url, x5u_flags, expected_content_type);
+    pthread_mutex_lock(&_r_http_client_lock);
+    now = _r_http_now();
+    o_free(fetch->content);
+    fetch->content = NULL;
+    if (to_return != NULL) {
+      fetch->content = o_strdup(to_return);
+      fetch->fetched_at = now;
+      fetch->failures = 0;
+    } else if (_r_http_client_global.backoff_min) {
+      delay = _r_http_client_global.backoff_min;
+      if (fetch->failures < 32) {
+        delay <<= fetch->failures;
+      }
+      if (_r_http_client_global.backoff_max && delay > _r_http_client_global.backoff_max) {
+        delay = _r_http_client_global.backoff_max;
+      }
+      fetch->failures++;
+      fetch->next_retry = now + delay;
+    }
+    fetch->in_flight = 0;
+    fetch->generation++;
+    pthread_cond_broadcast(&fetch->cond);
+  }
+  pthread_mutex_unlock(&_r_http_client_lock);
+  o_free(key);
 #else
   (void)url;
   (void)x5u_flags;
@@ -189,6 +1419,17 @@ char * _r_get_http_content(const char * url, int x5u_flags, const char * expecte
   return to_return;
 }
 
+/**
+ * The fetches are kept between calls, so they're never allocated in an arena
+ */
+char * _r_get_http_content(const char * url, int x5u_flags, const char * expected_content_type) {
+  rhn_arena_t * arena = _r_arena_suspend();
+  char * to_return = _r_get_http_content_coalesced(url, x5u_flags, expected_content_type);
+
+  _r_arena_resume(arena);
+  return to_return;
+}
+
 int _r_json_set_str_value(json_t * j_json, const char * key, const char * str_value) {
   int ret;
 
@@ -303,6 +1544,143 @@ size_t _r_get_key_size(jwa_enc enc) {
   return size;
 }
 
+size_t _r_get_base64url_len(size_t len) {
+  // base64url without padding
+  return ((len/3)*4) + (len%3?(len%3)+1:0);
+}
+
+static const char _r_base64url_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/**
+ * Encodes the 1 to 3 bytes of the group, the characters beyond
+ * the size of the output are only counted
+ */
+static void _r_b64url_writer_group(struct _r_b64url_writer * writer) {
+  unsigned char chars[4];
+  size_t nb_chars = writer->rest_len+1, i;
+
+  chars[0] = (unsigned char)_r_base64url_table[writer->rest[0]>>2];
+  chars[1] = (unsigned char)_r_base64url_table[((writer->rest[0]&0x03)<<4)|(writer->rest_len>1?writer->rest[1]>>4:0)];
+  chars[2] = (unsigned char)_r_base64url_table[writer->rest_len>1?(((writer->rest[1]&0x0f)<<2)|(writer->rest_len>2?writer->rest[2]>>6:0)):0];
+  chars[3] = (unsigned char)_r_base64url_table[writer->rest_len>2?writer->rest[2]&0x3f:0];
+  for (i=0; i<nb_chars; i++) {
+    if (writer->len < writer->size) {
+      writer->output[writer->len] = chars[i];
+    }
+    writer->len++;
+  }
+  writer->rest_len = 0;
+}
+
+void _r_b64url_writer_init(struct _r_b64url_writer * writer, unsigned char * output, size_t size) {
+  writer->output = output;
+  writer->size = size;
+  writer->len = 0;
+  writer->rest_len = 0;
+}
+
+int _r_b64url_writer_write(const char * buffer, size_t size, void * data) {
+  struct _r_b64url_writer * writer = (struct _r_b64url_writer *)data;
+  size_t i;
+
+  for (i=0; i<size; i++) {
+    writer->rest[writer->rest_len++] = (unsigned char)buffer[i];
+    if (writer->rest_len == 3) {
+      _r_b64url_writer_group(writer);
+    }
+  }
+  return 0;
+}
+
+size_t _r_b64url_writer_end(struct _r_b64url_writer * writer) {
+  if (writer->rest_len) {
+    _r_b64url_writer_group(writer);
+  }
+  return writer->len;
+}
+
+int _r_json_object_reset(json_t ** j_object) {
+  int ret = RHN_OK;
+
+  // The object is only owned by its jws, jwe or jwt, so it's cleared in place and its hashtable is reused
+  if (json_is_object(*j_object)) {
+    if (json_object_clear(*j_object)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_json_object_reset - Error clearing j_object");
+      ret = RHN_ERROR;
+    }
+  } else {
+    json_decref(*j_object);
+    if ((*j_object = json_object()) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_json_object_reset - Error allocating resources for j_object");
+      ret = RHN_ERROR_MEMORY;
+    }
+  }
+  return ret;
+}
+
+int _r_json_object_replace(json_t ** j_object, json_t * j_source) {
+  int ret;
+
+  if ((ret = _r_json_object_reset(j_object)) == RHN_OK && json_object_update(*j_object, j_source)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_json_object_replace - Error updating j_object");
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
+int _r_jwks_add_header_keys(jwks_t * jwks, size_t jwks_size, json_t ** j_header_keys) {
+  json_t * j_keys = json_object_get(jwks, "keys");
+  size_t i;
+  int ret = RHN_OK;
+
+  if (json_array_size(j_keys) > jwks_size) {
+    if (*j_header_keys == NULL && (*j_header_keys = json_array()) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_add_header_keys - Error allocating resources for j_header_keys");
+      ret = RHN_ERROR_MEMORY;
+    }
+    // The same jwk_t instances are referenced, so they are found wherever they are moved in the jwks
+    for (i=jwks_size; ret == RHN_OK && i<json_array_size(j_keys); i++) {
+      if (json_array_append(*j_header_keys, json_array_get(j_keys, i))) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwks_add_header_keys - Error json_array_append");
+        ret = RHN_ERROR;
+      }
+    }
+  }
+  return ret;
+}
+
+void _r_jwks_remove_header_keys(jwks_t * jwks, json_t * j_header_keys) {
+  json_t * j_keys = json_object_get(jwks, "keys"), * j_key;
+  size_t i, j;
+
+  if (json_array_size(j_header_keys)) {
+    for (i=json_array_size(j_keys); i>0; i--) {
+      j_key = json_array_get(j_keys, i-1);
+      for (j=0; j<json_array_size(j_header_keys); j++) {
+        if (json_array_get(j_header_keys, j) == j_key) {
+          json_array_remove(j_keys, i-1);
+          break;
+        }
+      }
+    }
+    json_array_clear(j_header_keys);
+  }
+}
+
+size_t _r_get_rsa_modulus_len(jwk_t * jwk, unsigned int bits) {
+  struct _o_datum dat = {0, NULL};
+  const char * n = r_jwk_get_property_str(jwk, "n");
+  size_t len = (bits+7)/8, i;
+
+  // The modulus n may have leading zeros, which aren't part of the RSA output length
+  if (n != NULL && o_base64url_decode_alloc((const unsigned char *)n, o_strlen(n), &dat)) {
+    for (i=0; i<dat.size && !dat.data[i]; i++);
+    len = dat.size - i;
+    o_free(dat.data);
+  }
+  return len;
+}
+
 gnutls_cipher_algorithm_t _r_get_alg_from_enc(jwa_enc enc) {
   gnutls_cipher_algorithm_t alg = GNUTLS_CIPHER_UNKNOWN;
 
@@ -336,25 +1714,116 @@ gnutls_cipher_algorithm_t _r_get_alg_from_enc(jwa_enc enc) {
   return alg;
 }
 
+/**
+ * zlib allocation function, reuses a block of the same size
+ * freed by a previous stream of the thread
+ */
+static voidpf _r_zlib_alloc(voidpf opaque, uInt items, uInt size) {
+  struct _r_thread_ctx * ctx = (struct _r_thread_ctx *)opaque;
+  struct _r_zlib_block * block = NULL;
+  rhn_arena_t * arena;
+  size_t i, len = (size_t)items*size;
+
+  for (i=0; block == NULL && i<_R_ZLIB_MAX_BLOCKS; i++) {
+    if (!ctx->zlib_blocks[i].used && ctx->zlib_blocks[i].data != NULL && ctx->zlib_blocks[i].size == len) {
+      block = &ctx->zlib_blocks[i];
+    }
+  }
+  for (i=0; block == NULL && i<_R_ZLIB_MAX_BLOCKS; i++) {
+    if (!ctx->zlib_blocks[i].used) {
+      block = &ctx->zlib_blocks[i];
+      // The blocks live with the context, never in the caller arena
+      arena = _r_arena_suspend();
+      o_free(block->data);
+      if ((block->data = o_malloc(len)) != NULL) {
+        block->size = len;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_zlib_alloc - Error allocating resources for block");
+        block->size = 0;
+        block = NULL;
+      }
+      _r_arena_resume(arena);
+      break;
+    }
+  }
+  if (block != NULL) {
+    block->used = 1;
+    return block->data;
+  } else {
+    return Z_NULL;
+  }
+}
+
+/**
+ * zlib free function, zeroizes the block which may contain
+ * the window or the buffers of a payload
+ */
+static void _r_zlib_free(voidpf opaque, voidpf address) {
+  struct _r_thread_ctx * ctx = (struct _r_thread_ctx *)opaque;
+  size_t i;
+
+  for (i=0; i<_R_ZLIB_MAX_BLOCKS; i++) {
+    if (ctx->zlib_blocks[i].used && ctx->zlib_blocks[i].data == address) {
+      gnutls_memset(ctx->zlib_blocks[i].data, 0, ctx->zlib_blocks[i].size);
+      ctx->zlib_blocks[i].used = 0;
+      break;
+    }
+  }
+}
+
+/**
+ * Returns the deflate stream of the current thread, initialized on each use
+ * with memory blocks kept in the context
+ */
+static z_stream * _r_thread_ctx_deflate(void) {
+  struct _r_thread_ctx * ctx = _r_thread_ctx_get();
+
+  if (ctx != NULL && !ctx->deflate_init) {
+    ctx->deflate_stream.zalloc = _r_zlib_alloc;
+    ctx->deflate_stream.zfree = _r_zlib_free;
+    ctx->deflate_stream.opaque = ctx;
+    if (deflateInit2(&ctx->deflate_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -9, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+      ctx->deflate_init = 1;
+    }
+  }
+  return (ctx != NULL && ctx->deflate_init)?&ctx->deflate_stream:NULL;
+}
+
+/**
+ * Returns the inflate stream of the current thread, initialized on each use
+ * with memory blocks kept in the context
+ */
+static z_stream * _r_thread_ctx_inflate(void) {
+  struct _r_thread_ctx * ctx = _r_thread_ctx_get();
+
+  if (ctx != NULL && !ctx->inflate_init) {
+    ctx->inflate_stream.zalloc = _r_zlib_alloc;
+    ctx->inflate_stream.zfree = _r_zlib_free;
+    ctx->inflate_stream.opaque = ctx;
+    ctx->inflate_stream.avail_in = 0;
+    ctx->inflate_stream.next_in = Z_NULL;
+    if (inflateInit2(&ctx->inflate_stream, -8) == Z_OK) {
+      ctx->inflate_init = 1;
+    }
+  }
+  return (ctx != NULL && ctx->inflate_init)?&ctx->inflate_stream:NULL;
+}
+
 int _r_deflate_payload(const unsigned char * uncompressed, size_t uncompressed_len, unsigned char ** compressed, size_t * compressed_len) {
   int ret = RHN_OK, res;
-  z_stream defstream;
+  z_stream * defstream;
 
   *compressed_len = 0;
   *compressed = NULL;
 
-  defstream.zalloc = Z_NULL;
-  defstream.zfree = Z_NULL;
-  defstream.opaque = Z_NULL;
-  defstream.avail_in = (uInt)uncompressed_len;
-  defstream.next_in = (Bytef *)uncompressed;
-
-  if (deflateInit2(&defstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -9, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+  if ((defstream = _r_thread_ctx_deflate()) != NULL) {
+    defstream->avail_in = (uInt)uncompressed_len;
+    defstream->next_in = (Bytef *)uncompressed;
     do {
       if ((*compressed = o_realloc(*compressed, (*compressed_len)+_R_BLOCK_SIZE)) != NULL) {
-        defstream.avail_out = _R_BLOCK_SIZE;
-        defstream.next_out = ((Bytef *)*compressed)+(*compressed_len);
-        switch ((res = deflate(&defstream, Z_FINISH))) {
+        defstream->avail_out = _R_BLOCK_SIZE;
+        defstream->next_out = ((Bytef *)*compressed)+(*compressed_len);
+        switch ((res = deflate(defstream, Z_FINISH))) {
           case Z_OK:
           case Z_STREAM_END:
           case Z_BUF_ERROR:
@@ -364,14 +1833,16 @@ int _r_deflate_payload(const unsigned char * uncompressed, size_t uncompressed_l
             ret = RHN_ERROR;
             break;
         }
-        (*compressed_len) += _R_BLOCK_SIZE - defstream.avail_out;
+        (*compressed_len) += _R_BLOCK_SIZE - defstream->avail_out;
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "_r_deflate_payload - Error allocating resources for *compressed");
         ret = RHN_ERROR;
       }
-    } while (RHN_OK == ret && defstream.avail_out == 0);
+    } while (RHN_OK == ret && defstream->avail_out == 0);
 
-    deflateEnd(&defstream);
+    // The window and the buffers hold the payload, they are zeroized when the stream ends
+    deflateEnd(defstream);
+    _r_thread_ctx_current->deflate_init = 0;
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "_r_deflate_payload - Error deflateInit");
     ret = RHN_ERROR;
@@ -381,22 +1852,19 @@ int _r_deflate_payload(const unsigned char * uncompressed, size_t uncompressed_l
 
 int _r_inflate_payload(const unsigned char * compressed, size_t compressed_len, unsigned char ** uncompressed, size_t * uncompressed_len) {
   int ret = RHN_OK, res;
-  z_stream infstream;
+  z_stream * infstream;
 
   *uncompressed = NULL;
   *uncompressed_len = 0;
-  infstream.zalloc = Z_NULL;
-  infstream.zfree = Z_NULL;
-  infstream.opaque = Z_NULL;
-  infstream.avail_in = (uInt)compressed_len;
-  infstream.next_in = (Bytef *)compressed;
 
-  if (inflateInit2(&infstream, -8) == Z_OK) {
+  if ((infstream = _r_thread_ctx_inflate()) != NULL) {
+    infstream->avail_in = (uInt)compressed_len;
+    infstream->next_in = (Bytef *)compressed;
     do {
       if (((*uncompressed) = o_realloc((*uncompressed), (*uncompressed_len)+_R_BLOCK_SIZE)) != NULL) {
-        infstream.avail_out = _R_BLOCK_SIZE;
-        infstream.next_out = ((Bytef *)(*uncompressed))+(*uncompressed_len);
-        switch ((res = inflate(&infstream, Z_FINISH))) {
+        infstream->avail_out = _R_BLOCK_SIZE;
+        infstream->next_out = ((Bytef *)(*uncompressed))+(*uncompressed_len);
+        switch ((res = inflate(infstream, Z_FINISH))) {
           case Z_OK:
           case Z_STREAM_END:
           case Z_BUF_ERROR:
@@ -406,14 +1874,16 @@ int _r_inflate_payload(const unsigned char * compressed, size_t compressed_len,
             ret = RHN_ERROR;
             break;
         }
-        (*uncompressed_len) += _R_BLOCK_SIZE - infstream.avail_out;
+        (*uncompressed_len) += _R_BLOCK_SIZE - infstream->avail_out;
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "_r_inflate_payload - Error allocating resources for data_in_suffix");
         ret = RHN_ERROR;
       }
-    } while (RHN_OK == ret && infstream.avail_out == 0);
+    } while (RHN_OK == ret && infstream->avail_out == 0);
 
-    inflateEnd(&infstream);
+    // The window holds the payload, it's zeroized when the stream ends
+    inflateEnd(infstream);
+    _r_thread_ctx_current->inflate_init = 0;
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "_r_inflate_payload - Error inflateInit");
     ret = RHN_ERROR;
@@ -421,78 +1891,6 @@ int _r_inflate_payload(const unsigned char * compressed, size_t compressed_len,
   return ret;
 }
 
-jwa_alg r_str_to_jwa_alg(const char * alg) {
-  if (0 == o_strcmp("none", alg)) {
-    return R_JWA_ALG_NONE;
-  } else if (0 == o_strcmp("HS256", alg)) {
-    return R_JWA_ALG_HS256;
-  } else if (0 == o_strcmp("HS384", alg)) {
-    return R_JWA_ALG_HS384;
-  } else if (0 == o_strcmp("HS512", alg)) {
-    return R_JWA_ALG_HS512;
-  } else if (0 == o_strcmp("RS256", alg)) {
-    return R_JWA_ALG_RS256;
-  } else if (0 == o_strcmp("RS384", alg)) {
-    return R_JWA_ALG_RS384;
-  } else if (0 == o_strcmp("RS512", alg)) {
-    return R_JWA_ALG_RS512;
-  } else if (0 == o_strcmp("ES256", alg)) {
-    return R_JWA_ALG_ES256;
-  } else if (0 == o_strcmp("ES384", alg)) {
-    return R_JWA_ALG_ES384;
-  } else if (0 == o_strcmp("ES512", alg)) {
-    return R_JWA_ALG_ES512;
-  } else if (0 == o_strcmp("EdDSA", alg)) {
-    return R_JWA_ALG_EDDSA;
-  } else if (0 == o_strcmp("ES256K", alg)) {
-    return R_JWA_ALG_ES256K;
-  } else if (0 == o_strcmp("PS256", alg)) {
-    return R_JWA_ALG_PS256;
-  } else if (0 == o_strcmp("PS384", alg)) {
-    return R_JWA_ALG_PS384;
-  } else if (0 == o_strcmp("PS512", alg)) {
-    return R_JWA_ALG_PS512;
-  } else if (0 == o_strcmp("RSA1_5", alg)) {
-    return R_JWA_ALG_RSA1_5;
-  } else if (0 == o_strcmp("RSA-OAEP", alg)) {
-    return R_JWA_ALG_RSA_OAEP;
-  } else if (0 == o_strcmp("RSA-OAEP-256", alg)) {
-    return R_JWA_ALG_RSA_OAEP_256;
-  } else if (0 == o_strcmp("A128KW", alg)) {
-    return R_JWA_ALG_A128KW;
-  } else if (0 == o_strcmp("A192KW", alg)) {
-    return R_JWA_ALG_A192KW;
-  } else if (0 == o_strcmp("A256KW", alg)) {
-    return R_JWA_ALG_A256KW;
-  } else if (0 == o_strcmp("dir", alg)) {
-    return R_JWA_ALG_DIR;
-  } else if (0 == o_strcmp("ECDH-ES", alg)) {
-    return R_JWA_ALG_ECDH_ES;
-  } else if (0 == o_strcmp("ECDH-ES+A128KW", alg)) {
-    return R_JWA_ALG_ECDH_ES_A128KW;
-  } else if (0 == o_strcmp("ECDH-ES+A192KW", alg)) {
-    return R_JWA_ALG_ECDH_ES_A192KW;
-  } else if (0 == o_strcmp("ECDH-ES+A256KW", alg)) {
-    return R_JWA_ALG_ECDH_ES_A256KW;
-  } else if (0 == o_strcmp("A128GCMKW", alg)) {
-    return R_JWA_ALG_A128GCMKW;
-  } else if (0 == o_strcmp("A192GCMKW", alg)) {
-    return R_JWA_ALG_A192GCMKW;
-  } else if (0 == o_strcmp("A256GCMKW", alg)) {
-    return R_JWA_ALG_A256GCMKW;
-  } else if (0 == o_strcmp("PBES2-HS256+A128KW", alg)) {
-    return R_JWA_ALG_PBES2_H256;
-  } else if (0 == o_strcmp("PBES2-HS384+A192KW", alg)) {
-    return R_JWA_ALG_PBES2_H384;
-  } else if (0 == o_strcmp("PBES2-HS512+A256KW", alg)) {
-    return R_JWA_ALG_PBES2_H512;
-  } else if (0 == o_strcmp("ES256K", alg)) {
-    return R_JWA_ALG_ES256K;
-  } else {
-    return R_JWA_ALG_UNKNOWN;
-  }
-}
-
 const char * r_jwa_alg_to_str(jwa_alg alg) {
   switch (alg) {
     case R_JWA_ALG_NONE:
@@ -597,24 +1995,6 @@ const char * r_jwa_alg_to_str(jwa_alg alg) {
   }
 }
 
-jwa_enc r_str_to_jwa_enc(const char * enc) {
-  if (0 == o_strcmp("A128CBC-HS256", enc)) {
-    return R_JWA_ENC_A128CBC;
-  } else if (0 == o_strcmp("A192CBC-HS384", enc)) {
-    return R_JWA_ENC_A192CBC;
-  } else if (0 == o_strcmp("A256CBC-HS512", enc)) {
-    return R_JWA_ENC_A256CBC;
-  } else if (0 == o_strcmp("A128GCM", enc)) {
-    return R_JWA_ENC_A128GCM;
-  } else if (0 == o_strcmp("A192GCM", enc)) {
-    return R_JWA_ENC_A192GCM;
-  } else if (0 == o_strcmp("A256GCM", enc)) {
-    return R_JWA_ENC_A256GCM;
-  } else {
-    return R_JWA_ENC_UNKNOWN;
-  }
-}
-
 const char * r_jwa_enc_to_str(jwa_enc enc) {
   switch (enc) {
     case R_JWA_ENC_A128CBC:
@@ -641,6 +2021,156 @@ const char * r_jwa_enc_to_str(jwa_enc enc) {
   }
 }
 
+/**
+ * Return the index of a SHA-2 size in an alg name, 0 for '256', 1 for '384' and 2 for '512'
+ * c is the first character of the size, return -1 otherwise
+ */
+static int _r_jwa_sha_index(char c) {
+  switch (c) {
+    case '2':
+      return 0;
+    case '3':
+      return 1;
+    case '5':
+      return 2;
+    default:
+      return -1;
+  }
+}
+
+/**
+ * Return the index of an AES key size in an alg or enc name, 0 for '128', 1 for '192' and 2 for '256'
+ * c is the second character of the size, return -1 otherwise
+ */
+static int _r_jwa_aes_index(char c) {
+  switch (c) {
+    case '2':
+      return 0;
+    case '9':
+      return 1;
+    case '5':
+      return 2;
+    default:
+      return -1;
+  }
+}
+
+/**
+ * The candidate is selected with the length and a few characters of alg,
+ * then confirmed by a single comparison against its name
+ */
+jwa_alg _r_str_to_jwa_alg_len(const char * alg, size_t alg_len) {
+  static const jwa_alg hs[] = {R_JWA_ALG_HS256, R_JWA_ALG_HS384, R_JWA_ALG_HS512},
+                       rs[] = {R_JWA_ALG_RS256, R_JWA_ALG_RS384, R_JWA_ALG_RS512},
+                       es[] = {R_JWA_ALG_ES256, R_JWA_ALG_ES384, R_JWA_ALG_ES512},
+                       ps[] = {R_JWA_ALG_PS256, R_JWA_ALG_PS384, R_JWA_ALG_PS512},
+                       kw[] = {R_JWA_ALG_A128KW, R_JWA_ALG_A192KW, R_JWA_ALG_A256KW},
+                       gcmkw[] = {R_JWA_ALG_A128GCMKW, R_JWA_ALG_A192GCMKW, R_JWA_ALG_A256GCMKW},
+                       ecdh_kw[] = {R_JWA_ALG_ECDH_ES_A128KW, R_JWA_ALG_ECDH_ES_A192KW, R_JWA_ALG_ECDH_ES_A256KW},
+                       pbes2[] = {R_JWA_ALG_PBES2_H256, R_JWA_ALG_PBES2_H384, R_JWA_ALG_PBES2_H512};
+  jwa_alg candidate = R_JWA_ALG_UNKNOWN;
+  int index = -1;
+
+  if (alg == NULL) {
+    return R_JWA_ALG_UNKNOWN;
+  }
+  switch (alg_len) {
+    case 3:
+      candidate = R_JWA_ALG_DIR;
+      break;
+    case 4:
+      candidate = R_JWA_ALG_NONE;
+      break;
+    case 5:
+      if ((index = _r_jwa_sha_index(alg[2])) >= 0) {
+        switch (alg[0]) {
+          case 'H':
+            candidate = hs[index];
+            break;
+          case 'R':
+            candidate = rs[index];
+            break;
+          case 'E':
+            candidate = es[index];
+            break;
+          case 'P':
+            candidate = ps[index];
+            break;
+          default:
+            break;
+        }
+      } else {
+        candidate = R_JWA_ALG_EDDSA;
+      }
+      break;
+    case 6:
+      if (alg[0] == 'R') {
+        candidate = R_JWA_ALG_RSA1_5;
+      } else if (alg[0] == 'E') {
+        candidate = R_JWA_ALG_ES256K;
+      } else if ((index = _r_jwa_aes_index(alg[2])) >= 0) {
+        candidate = kw[index];
+      }
+      break;
+    case 7:
+      candidate = R_JWA_ALG_ECDH_ES;
+      break;
+    case 8:
+      candidate = R_JWA_ALG_RSA_OAEP;
+      break;
+    case 9:
+      if ((index = _r_jwa_aes_index(alg[2])) >= 0) {
+        candidate = gcmkw[index];
+      }
+      break;
+    case 12:
+      candidate = R_JWA_ALG_RSA_OAEP_256;
+      break;
+    case 14:
+      if ((index = _r_jwa_aes_index(alg[10])) >= 0) {
+        candidate = ecdh_kw[index];
+      }
+      break;
+    case 18:
+      if ((index = _r_jwa_sha_index(alg[8])) >= 0) {
+        candidate = pbes2[index];
+      }
+      break;
+    default:
+      break;
+  }
+  if (candidate != R_JWA_ALG_UNKNOWN && 0 != memcmp(r_jwa_alg_to_str(candidate), alg, alg_len)) {
+    candidate = R_JWA_ALG_UNKNOWN;
+  }
+  return candidate;
+}
+
+jwa_alg r_str_to_jwa_alg(const char * alg) {
+  return _r_str_to_jwa_alg_len(alg, o_strlen(alg));
+}
+
+/**
+ * Same lookup as _r_str_to_jwa_alg_len for the enc values
+ */
+jwa_enc _r_str_to_jwa_enc_len(const char * enc, size_t enc_len) {
+  static const jwa_enc cbc[] = {R_JWA_ENC_A128CBC, R_JWA_ENC_A192CBC, R_JWA_ENC_A256CBC},
+                       gcm[] = {R_JWA_ENC_A128GCM, R_JWA_ENC_A192GCM, R_JWA_ENC_A256GCM};
+  jwa_enc candidate = R_JWA_ENC_UNKNOWN;
+  int index;
+
+  if (enc != NULL && (enc_len == 7 || enc_len == 13) && (index = _r_jwa_aes_index(enc[2])) >= 0) {
+    candidate = enc_len==7?gcm[index]:cbc[index];
+    if (0 != memcmp(r_jwa_enc_to_str(candidate), enc, enc_len)) {
+      candidate = R_JWA_ENC_UNKNOWN;
+    }
+  }
+  return candidate;
+}
+
+jwa_enc r_str_to_jwa_enc(const char * enc) {
+  return _r_str_to_jwa_enc_len(enc, o_strlen(enc));
+}
+
 json_t * r_library_info_json_t(void) {
   json_t * j_info = json_pack("{sss{s[sssssss]}s{s[ssss]s[sssss]}}",
                               "version", RHONABWY_VERSION_STR,
@@ -1126,6 +1126,56 @@ START_TEST(test_rhonabwy_jwk_in_header_invalid)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_reset)
+{
+  jwe_t * jwe, * jwe_parsed;
+  jwk_t * jwk_pubkey_rsa, * jwk_privkey_rsa;
+  json_t * j_jwk;
+  char * str_jwe;
+  size_t payload_len = 0;
+  
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey_rsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey_rsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey_rsa, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey_rsa, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_RSA_OAEP), RHN_OK);
+  ck_assert_ptr_ne(NULL, j_jwk = json_loads(jwk_pubkey_ecdsa_str, JSON_DECODE_ANY, 0));
+  ck_assert_int_eq(r_jwe_set_header_json_t_value(jwe, "jwk", j_jwk), RHN_OK);
+  ck_assert_ptr_ne(NULL, str_jwe = r_jwe_serialize(jwe, jwk_pubkey_rsa, 0));
+  
+  ck_assert_int_eq(r_jwe_reset(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwe_init(&jwe_parsed), RHN_OK);
+  ck_assert_int_eq(r_jwe_add_keys(jwe_parsed, jwk_privkey_rsa, NULL), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_parsed, str_jwe, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwe_parsed->jwks_pubkey), 1);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_parsed, NULL, 0), RHN_OK);
+  
+  ck_assert_int_eq(r_jwe_reset(jwe_parsed), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwe_parsed->jwks_pubkey), 0);
+  ck_assert_int_eq(r_jwks_size(jwe_parsed->jwks_privkey), 1);
+  ck_assert_int_eq(r_jwe_get_alg(jwe_parsed), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_jwe_get_enc(jwe_parsed), R_JWA_ENC_UNKNOWN);
+  ck_assert_ptr_eq(NULL, r_jwe_get_header_str_value(jwe_parsed, "alg"));
+  ck_assert_ptr_eq(NULL, r_jwe_get_payload(jwe_parsed, &payload_len));
+  ck_assert_int_eq(payload_len, 0);
+  ck_assert_ptr_eq(NULL, jwe_parsed->key);
+  
+  ck_assert_int_eq(r_jwe_parse(jwe_parsed, str_jwe, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_parsed, NULL, 0), RHN_OK);
+  ck_assert_int_eq(0, o_strncmp(PAYLOAD, (const char *)r_jwe_get_payload(jwe_parsed, &payload_len), payload_len));
+  
+  r_jwe_free(jwe);
+  r_jwe_free(jwe_parsed);
+  r_jwk_free(jwk_pubkey_rsa);
+  r_jwk_free(jwk_privkey_rsa);
+  json_decref(j_jwk);
+  o_free(str_jwe);
+}
+END_TEST
+
 #endif
 
 START_TEST(test_rhonabwy_decrypt_key_valid)
@@ -1253,6 +1303,124 @@ START_TEST(test_rhonabwy_decrypt_updated_header_gcm)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_serialize_to)
+{
+  jwe_t * jwe, * jwe_dec;
+  jwk_t * jwk_pubkey_rsa, * jwk_privkey_rsa, * jwk_key, * jwk_key_32, * jwk_password, * jwk_enc, * jwk_dec;
+#if NETTLE_VERSION_NUMBER >= 0x030600
+  jwk_t * jwk_pubkey_ecdsa, * jwk_privkey_ecdsa;
+#endif
+  char * token, output[8192];
+  size_t output_len, length;
+  unsigned int i;
+  struct {
+    jwa_alg alg;
+    jwa_enc enc;
+    int zip;
+  } cases[] = {
+    {R_JWA_ALG_RSA1_5, R_JWA_ENC_A128CBC, 0},
+    {R_JWA_ALG_RSA1_5, R_JWA_ENC_A256GCM, 1},
+    {R_JWA_ALG_DIR, R_JWA_ENC_A128CBC, 0},
+    {R_JWA_ALG_DIR, R_JWA_ENC_A256GCM, 1},
+    {R_JWA_ALG_A128GCMKW, R_JWA_ENC_A128CBC, 0},
+    {R_JWA_ALG_A128GCMKW, R_JWA_ENC_A128GCM, 1},
+#if NETTLE_VERSION_NUMBER >= 0x030400
+    {R_JWA_ALG_A128KW, R_JWA_ENC_A192CBC, 0},
+    {R_JWA_ALG_A128KW, R_JWA_ENC_A128GCM, 1},
+#endif
+#if GNUTLS_VERSION_NUMBER >= 0x03060d
+    {R_JWA_ALG_PBES2_H256, R_JWA_ENC_A256CBC, 0},
+    {R_JWA_ALG_PBES2_H256, R_JWA_ENC_A128GCM, 1},
+#endif
+  };
+  
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey_rsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey_rsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_key), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_key_32), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_password), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey_rsa, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey_rsa, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_symmetric_key(jwk_key, (const unsigned char *)"0123456789abcdef", 16), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_symmetric_key(jwk_key_32, (const unsigned char *)"0123456789abcdef0123456789abcdef", 32), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_password(jwk_password, (const char *)symmetric_key), RHN_OK);
+  
+  for (i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+    if (cases[i].alg == R_JWA_ALG_RSA1_5) {
+      jwk_enc = jwk_pubkey_rsa;
+      jwk_dec = jwk_privkey_rsa;
+    } else if (cases[i].alg == R_JWA_ALG_DIR) {
+      jwk_enc = jwk_dec = jwk_key_32;
+    } else if (cases[i].alg == R_JWA_ALG_PBES2_H256) {
+      jwk_enc = jwk_dec = jwk_password;
+    } else {
+      jwk_enc = jwk_dec = jwk_key;
+    }
+    
+    ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_alg(jwe, cases[i].alg), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_enc(jwe, cases[i].enc), RHN_OK);
+    if (cases[i].zip) {
+      ck_assert_int_eq(r_jwe_set_header_str_value(jwe, "zip", "DEF"), RHN_OK);
+    }
+    ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)HUGE_PAYLOAD, o_strlen(HUGE_PAYLOAD)), RHN_OK);
+    ck_assert_int_gt(length = r_jwe_serialized_length(jwe, jwk_enc, 0), 0);
+    ck_assert_int_lt(length, sizeof(output));
+    
+    output_len = length-1;
+    ck_assert_int_eq(r_jwe_serialize_to(jwe, jwk_enc, 0, output, &output_len), RHN_ERROR_PARAM);
+    ck_assert_int_eq(output_len, length);
+    ck_assert_ptr_eq(NULL, jwe->ciphertext_b64url);
+    
+    output_len = length;
+    ck_assert_int_eq(r_jwe_serialize_to(jwe, jwk_enc, 0, output, &output_len), RHN_OK);
+    ck_assert_int_eq(output_len, length);
+    ck_assert_ptr_ne(NULL, token = r_jwe_serialize(jwe, jwk_enc, 0));
+    ck_assert_int_eq(o_strlen(token), length);
+    o_free(token);
+    r_jwe_free(jwe);
+    
+    ck_assert_int_eq(r_jwe_init(&jwe_dec), RHN_OK);
+    ck_assert_int_eq(r_jwe_compact_parsen(jwe_dec, output, output_len, 0), RHN_OK);
+    ck_assert_int_eq(r_jwe_decrypt(jwe_dec, jwk_dec, 0), RHN_OK);
+    ck_assert_int_eq(0, o_strncmp(HUGE_PAYLOAD, (const char *)r_jwe_get_payload(jwe_dec, NULL), o_strlen(HUGE_PAYLOAD)));
+    r_jwe_free(jwe_dec);
+  }
+  
+#if NETTLE_VERSION_NUMBER >= 0x030600
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey_ecdsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey_ecdsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey_ecdsa, jwk_pubkey_ecdsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey_ecdsa, jwk_privkey_ecdsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_ECDH_ES_A128KW), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128GCM), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_gt(length = r_jwe_serialized_length(jwe, jwk_pubkey_ecdsa, 0), 0);
+  output_len = length;
+  ck_assert_int_eq(r_jwe_serialize_to(jwe, jwk_pubkey_ecdsa, 0, output, &output_len), RHN_OK);
+  ck_assert_int_eq(output_len, length);
+  r_jwe_free(jwe);
+  ck_assert_int_eq(r_jwe_init(&jwe_dec), RHN_OK);
+  ck_assert_int_eq(r_jwe_compact_parsen(jwe_dec, output, output_len, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_dec, jwk_privkey_ecdsa, 0), RHN_OK);
+  r_jwe_free(jwe_dec);
+  r_jwk_free(jwk_pubkey_ecdsa);
+  r_jwk_free(jwk_privkey_ecdsa);
+#endif
+  
+  ck_assert_int_eq(r_jwe_serialized_length(NULL, jwk_key, 0), 0);
+  output_len = sizeof(output);
+  ck_assert_int_eq(r_jwe_serialize_to(NULL, jwk_key, 0, output, &output_len), RHN_ERROR_PARAM);
+  
+  r_jwk_free(jwk_pubkey_rsa);
+  r_jwk_free(jwk_privkey_rsa);
+  r_jwk_free(jwk_key);
+  r_jwk_free(jwk_key_32);
+  r_jwk_free(jwk_password);
+}
+END_TEST
+
 #if GNUTLS_VERSION_NUMBER >= 0x030600 && defined(R_WITH_CURL)
 static char * get_file_content(const char * file_path) {
   char * buffer = NULL;
@@ -1294,6 +1462,67 @@ int callback_jku_ecdsa_crt (const struct _u_request * request, struct _u_respons
   return U_CALLBACK_CONTINUE;
 }
 
+START_TEST(test_rhonabwy_shared_jwks)
+{
+  jwe_t * jwe_enc, * jwe_dec, * jwe_copy;
+  jwks_t * jwks_privkey, * jwks_pubkey;
+  jwks_shared_t * shared_privkey, * shared_pubkey;
+  jwk_t * jwk;
+  char * token, * token_json;
+  
+  // The shared key sets themselves are tested in jwks_core, only their use by a jwe_t is tested here
+  ck_assert_ptr_ne(NULL, jwks_privkey = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_privkey_ecdsa_str, R_IMPORT_JSON_STR, jwk_privkey_rsa_str, R_IMPORT_NONE));
+  ck_assert_ptr_ne(NULL, jwks_pubkey = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_pubkey_ecdsa_str, R_IMPORT_JSON_STR, jwk_pubkey_rsa_str, R_IMPORT_NONE));
+  ck_assert_ptr_ne(NULL, shared_privkey = r_jwks_shared_new(jwks_privkey));
+  ck_assert_ptr_ne(NULL, shared_pubkey = r_jwks_shared_new(jwks_pubkey));
+  ck_assert_int_eq(r_jwe_set_shared_jwks(NULL, shared_privkey, shared_pubkey), RHN_ERROR_PARAM);
+  
+  // The encryption key is selected by the kid header in the shared set
+  ck_assert_int_eq(r_jwe_init(&jwe_enc), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_payload(jwe_enc, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_alg(jwe_enc, R_JWA_ALG_RSA_OAEP_256), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe_enc, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_shared_jwks(jwe_enc, NULL, shared_pubkey), RHN_OK);
+  ck_assert_ptr_eq(NULL, r_jwe_serialize(jwe_enc, NULL, 0));
+  ck_assert_int_eq(r_jwe_set_header_str_value(jwe_enc, "kid", "2011-04-29"), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jwe_serialize(jwe_enc, NULL, 0));
+  
+  // A copy holds its own reference to the shared set
+  ck_assert_int_eq(r_jwe_init(&jwe_dec), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_dec, token, 0), RHN_OK);
+  ck_assert_int_ne(r_jwe_decrypt(jwe_dec, NULL, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_shared_jwks(jwe_dec, shared_privkey, NULL), RHN_OK);
+  ck_assert_ptr_ne(NULL, jwe_copy = r_jwe_copy(jwe_dec));
+  r_jwe_free(jwe_dec);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_copy, NULL, 0), RHN_OK);
+  r_jwe_free(jwe_copy);
+  
+  // Without kid, every key of the shared set is tried
+  ck_assert_ptr_ne(NULL, jwk = r_jwk_quick_import(R_IMPORT_JSON_STR, jwk_pubkey_rsa_str));
+  ck_assert_int_eq(r_jwk_delete_property_str(jwk, "kid"), RHN_OK);
+  ck_assert_int_eq(r_jwks_empty(jwks_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwks_append_jwk(jwks_pubkey, jwk), RHN_OK);
+  r_jwk_free(jwk);
+  ck_assert_int_eq(r_jwe_set_shared_jwks(jwe_enc, NULL, NULL), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_header_str_value(jwe_enc, "kid", NULL), RHN_OK);
+  ck_assert_ptr_ne(NULL, token_json = r_jwe_serialize_json_str(jwe_enc, jwks_pubkey, 0, R_JSON_MODE_GENERAL));
+  ck_assert_ptr_eq(NULL, o_strstr(token_json, "\"kid\""));
+  ck_assert_int_eq(r_jwe_init(&jwe_dec), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse_json_str(jwe_dec, token_json, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_shared_jwks(jwe_dec, shared_privkey, NULL), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_dec, NULL, 0), RHN_OK);
+  r_jwe_free(jwe_dec);
+  
+  o_free(token);
+  o_free(token_json);
+  r_jwe_free(jwe_enc);
+  r_jwks_shared_free(shared_privkey);
+  r_jwks_shared_free(shared_pubkey);
+  r_jwks_free(jwks_privkey);
+  r_jwks_free(jwks_pubkey);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_advanced_parse)
 {
   jwk_t * jwk_pub;
@@ -1462,11 +1691,14 @@ static Suite *rhonabwy_suite(void)
 #if GNUTLS_VERSION_NUMBER >= 0x030600
   tcase_add_test(tc_core, test_rhonabwy_decrypt_key_invalid_encrypted_key);
   tcase_add_test(tc_core, test_rhonabwy_jwk_in_header_invalid);
+  tcase_add_test(tc_core, test_rhonabwy_reset);
 #endif
   tcase_add_test(tc_core, test_rhonabwy_decrypt_key_valid);
   tcase_add_test(tc_core, test_rhonabwy_decrypt_updated_header_cbc);
   tcase_add_test(tc_core, test_rhonabwy_decrypt_updated_header_gcm);
+  tcase_add_test(tc_core, test_rhonabwy_serialize_to);
 #if GNUTLS_VERSION_NUMBER >= 0x030600 && defined(R_WITH_CURL)
+  tcase_add_test(tc_core, test_rhonabwy_shared_jwks);
   tcase_add_test(tc_core, test_rhonabwy_advanced_parse);
   tcase_add_test(tc_core, test_rhonabwy_quick_parse);
 #endif
@@ -1,6 +1,7 @@
 /* Public domain, no copyright. Use at your own risk. */
 
 #include <stdio.h>
+#include <unistd.h>
 
 #include <check.h>
 #include <yder.h>
@@ -211,6 +212,51 @@ START_TEST(test_rhonabwy_encrypt_decrypt_x25519_ok)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_encrypt_decrypt_p521_ok)
+{
+  jwe_t * jwe, * jwe_decrypt;
+  jwk_t * jwk_privkey, * jwk_pubkey;
+  json_t * j_epk;
+  char * token = NULL;
+  size_t i;
+  
+  y_log_message(Y_LOG_LEVEL_DEBUG, "Test P-521");
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, jwk_privkey_ecdsa_p521_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_ecdsa_p521_str), RHN_OK);
+
+  // Every ephemeral key is new, repeat to get coordinates and shared secrets with leading zero bytes
+  for (i=0; i<16; i++) {
+    ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+    ck_assert_int_eq(r_jwe_add_keys(jwe, NULL, jwk_pubkey), RHN_OK);
+    ck_assert_int_eq(r_jwe_add_keys(jwe_decrypt, jwk_privkey, NULL), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_alg(jwe, i%2?R_JWA_ALG_ECDH_ES:R_JWA_ALG_ECDH_ES_A256KW), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A256GCM), RHN_OK);
+    ck_assert_ptr_ne((token = r_jwe_serialize(jwe, NULL, 0)), NULL);
+    ck_assert_ptr_ne((j_epk = r_jwe_get_header_json_t_value(jwe, "epk")), NULL);
+    ck_assert_str_eq(json_string_value(json_object_get(j_epk, "crv")), "P-521");
+    ck_assert_int_eq(json_string_length(json_object_get(j_epk, "x")), 88);
+    ck_assert_int_eq(json_string_length(json_object_get(j_epk, "y")), 88);
+    ck_assert_int_eq(r_jwe_serialized_length(jwe, NULL, 0), o_strlen(token));
+    json_decref(j_epk);
+
+    ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+    ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, NULL, 0), RHN_OK);
+    ck_assert_int_eq(0, memcmp(jwe_decrypt->payload, PAYLOAD, jwe_decrypt->payload_len));
+
+    o_free(token);
+    r_jwe_free(jwe);
+    r_jwe_free(jwe_decrypt);
+  }
+
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_encrypt_decrypt_x448_ok)
 {
   jwe_t * jwe, * jwe_decrypt;
@@ -401,20 +447,27 @@ START_TEST(test_rhonabwy_encrypt_invalid_key_type)
   r_jwk_free(jwk_pubkey);
   
   ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
-  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_ecdsa_p521_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_ecdsa_str), RHN_OK);
   ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_ECDH_ES_A128KW), RHN_OK);
   ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_int_eq(r_jwe_add_keys(jwe, jwk_privkey, NULL), RHN_OK);
   ck_assert_ptr_eq(r_jwe_serialize(jwe, jwk_pubkey, 0), NULL);
   r_jwk_free(jwk_pubkey);
+  r_jwk_free(jwk_privkey);
+  r_jwe_free(jwe);
   
+  // P-521 is supported since 1.2.0, but the ephemeral key must still use the curve of the public key
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, jwk_privkey_ecdsa_str), RHN_OK);
   ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
-  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_ecdsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_ecdsa_p521_str), RHN_OK);
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
   ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_ECDH_ES_A128KW), RHN_OK);
   ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
   ck_assert_int_eq(r_jwe_add_keys(jwe, jwk_privkey, NULL), RHN_OK);
   ck_assert_ptr_eq(r_jwe_serialize(jwe, jwk_pubkey, 0), NULL);
   r_jwk_free(jwk_pubkey);
-  
   r_jwk_free(jwk_privkey);
   r_jwe_free(jwe);
 }
@@ -941,6 +994,79 @@ START_TEST(test_rhonabwy_rfc_ok)
 }
 END_TEST
 
+static void test_pool_encrypt_decrypt(const char * pubkey_str, const char * privkey_str) {
+  jwe_t * jwe, * jwe_decrypt;
+  jwk_t * jwk_privkey, * jwk_pubkey;
+  char * token = NULL, * epk_x = NULL;
+  int i;
+  
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, privkey_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, pubkey_str), RHN_OK);
+  for (i=0; i<2; i++) {
+    ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_ECDH_ES_A128KW), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128GCM), RHN_OK);
+    ck_assert_ptr_ne((token = r_jwe_serialize(jwe, jwk_pubkey, 0)), NULL);
+    ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+    ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk_privkey, 0), RHN_OK);
+    ck_assert_int_eq(0, memcmp(jwe_decrypt->payload, PAYLOAD, jwe_decrypt->payload_len));
+    if (!i) {
+      epk_x = o_strdup(json_string_value(json_object_get(r_jwe_get_header_json_t_value(jwe_decrypt, "epk"), "x")));
+    } else {
+      // Each ephemeral key is used only once
+      ck_assert_str_ne(epk_x, json_string_value(json_object_get(r_jwe_get_header_json_t_value(jwe_decrypt, "epk"), "x")));
+    }
+    o_free(token);
+    r_jwe_free(jwe);
+    r_jwe_free(jwe_decrypt);
+  }
+  o_free(epk_x);
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+}
+
+START_TEST(test_rhonabwy_ecdh_pool)
+{
+  int i;
+  
+  ck_assert_int_eq(r_jwe_ecdh_pool_start(0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwe_ecdh_pool_start(4), RHN_OK);
+  ck_assert_int_eq(r_jwe_ecdh_pool_start(4), RHN_ERROR_PARAM);
+  for (i=0; i<1000 && (r_jwe_ecdh_pool_available(R_KEY_TYPE_EC, 256) < 4 ||
+                       r_jwe_ecdh_pool_available(R_KEY_TYPE_EC, 384) < 4 ||
+                       r_jwe_ecdh_pool_available(R_KEY_TYPE_EC, 521) < 4 ||
+                       r_jwe_ecdh_pool_available(R_KEY_TYPE_ECDH, 256) < 4 ||
+                       r_jwe_ecdh_pool_available(R_KEY_TYPE_ECDH, 448) < 4); i++) {
+    usleep(10000);
+  }
+  ck_assert_int_eq(r_jwe_ecdh_pool_available(R_KEY_TYPE_EC, 256), 4);
+  ck_assert_int_eq(r_jwe_ecdh_pool_available(R_KEY_TYPE_EC, 384), 4);
+  ck_assert_int_eq(r_jwe_ecdh_pool_available(R_KEY_TYPE_ECDH, 256), 4);
+  ck_assert_int_eq(r_jwe_ecdh_pool_available(R_KEY_TYPE_ECDH, 448), 4);
+  ck_assert_int_eq(r_jwe_ecdh_pool_available(R_KEY_TYPE_EC, 521), 4);
+  ck_assert_int_eq(r_jwe_ecdh_pool_available(R_KEY_TYPE_EC, 224), 0);
+  
+  test_pool_encrypt_decrypt(jwk_pubkey_ecdsa_str, jwk_privkey_ecdsa_str);
+  test_pool_encrypt_decrypt(jwk_pubkey_ecdsa_p384_str, jwk_privkey_ecdsa_p384_str);
+  test_pool_encrypt_decrypt(jwk_pubkey_ecdsa_p521_str, jwk_privkey_ecdsa_p521_str);
+  test_pool_encrypt_decrypt(jwk_pubkey_x25519_str, jwk_privkey_x25519_str);
+  test_pool_encrypt_decrypt(jwk_pubkey_x448_str, jwk_privkey_x448_str);
+  
+  r_jwe_ecdh_pool_stop();
+  ck_assert_int_eq(r_jwe_ecdh_pool_available(R_KEY_TYPE_EC, 256), 0);
+  ck_assert_int_eq(r_jwe_ecdh_pool_available(R_KEY_TYPE_EC, 521), 0);
+  ck_assert_int_eq(r_jwe_ecdh_pool_available(R_KEY_TYPE_ECDH, 448), 0);
+  r_jwe_ecdh_pool_stop();
+  
+  // Without the pool, the ephemeral keys are generated on each encryption
+  test_pool_encrypt_decrypt(jwk_pubkey_ecdsa_str, jwk_privkey_ecdsa_str);
+}
+END_TEST
+
 #endif
 
 static Suite *rhonabwy_suite(void)
@@ -954,6 +1080,7 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_ok);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_x25519_ok);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_x448_ok);
+  tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_p521_ok);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_invalid_parameters);
   tcase_add_test(tc_core, test_rhonabwy_decrypt_invalid_key);
   tcase_add_test(tc_core, test_rhonabwy_decrypt_invalid_x25519_key);
@@ -970,6 +1097,7 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_check_key_length_invalid_ecddsa_key);
   tcase_add_test(tc_core, test_rhonabwy_check_key_length_invalid_eddsa_key);
   tcase_add_test(tc_core, test_rhonabwy_rfc_ok);
+  tcase_add_test(tc_core, test_rhonabwy_ecdh_pool);
 #endif
   tcase_set_timeout(tc_core, 30);
   suite_add_tcase(s, tc_core);
@@ -299,6 +299,129 @@ START_TEST(test_rhonabwy_rfc_example)
   r_jwe_free(jwe);
 }
 END_TEST
+
+START_TEST(test_rhonabwy_pbes2_cache)
+{
+  jwe_t * jwe, * jwe_decrypt;
+  jwk_t * jwk, * jwk_invalid;
+  char * token = NULL, * token_other_salt = NULL;
+  int i;
+  
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_invalid), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_key_128_1), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_invalid, jwk_key_128_2), RHN_OK);
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_PBES2_H256), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_ptr_ne((token = r_jwe_serialize(jwe, jwk, 0)), NULL);
+  ck_assert_ptr_ne((token_other_salt = r_jwe_serialize(jwe, jwk, 0)), NULL);
+  r_jwe_free(jwe);
+
+  ck_assert_int_eq(r_jwe_pbes2_cache_start(0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwe_pbes2_cache_start(1), RHN_OK);
+  ck_assert_int_eq(r_jwe_pbes2_cache_start(1), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwe_pbes2_cache_count(), 0);
+
+  for (i=0; i<4; i++) {
+    ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+    ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+    ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk, 0), RHN_OK);
+    ck_assert_int_eq(0, o_strncmp(PAYLOAD, (const char *)r_jwe_get_payload(jwe_decrypt, NULL), o_strlen(PAYLOAD)));
+    ck_assert_int_eq(r_jwe_pbes2_cache_count(), 1);
+    r_jwe_free(jwe_decrypt);
+  }
+
+  // Another password must not use the cached KEK
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk_invalid, 0), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jwe_pbes2_cache_count(), 1);
+  r_jwe_free(jwe_decrypt);
+
+  // Another salt evicts the previous KEK
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token_other_salt, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_pbes2_cache_count(), 1);
+  r_jwe_free(jwe_decrypt);
+
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk, 0), RHN_OK);
+  r_jwe_free(jwe_decrypt);
+
+  r_jwe_pbes2_cache_stop();
+  ck_assert_int_eq(r_jwe_pbes2_cache_count(), 0);
+
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_pbes2_cache_count(), 0);
+  r_jwe_free(jwe_decrypt);
+
+  // A restarted cache uses a new id key
+  ck_assert_int_eq(r_jwe_pbes2_cache_start(2), RHN_OK);
+  for (i=0; i<2; i++) {
+    ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+    ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+    ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk, 0), RHN_OK);
+    ck_assert_int_eq(r_jwe_pbes2_cache_count(), 1);
+    r_jwe_free(jwe_decrypt);
+  }
+  r_jwe_pbes2_cache_stop();
+
+  o_free(token);
+  o_free(token_other_salt);
+  r_jwk_free(jwk);
+  r_jwk_free(jwk_invalid);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_pbes2_max_iterations)
+{
+  jwe_t * jwe, * jwe_decrypt;
+  jwk_t * jwk;
+  char * token = NULL;
+  
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_key_128_1), RHN_OK);
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_PBES2_H256), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_header_int_value(jwe, "p2c", 5000), RHN_OK);
+  ck_assert_ptr_ne((token = r_jwe_serialize(jwe, jwk, 0)), NULL);
+
+  // The limit applies to the key wrapping too
+  r_jwe_pbes2_set_max_iterations(4096);
+  ck_assert_ptr_eq(r_jwe_serialize(jwe, jwk, 0), NULL);
+  r_jwe_pbes2_set_max_iterations(0);
+  r_jwe_free(jwe);
+
+  r_jwe_pbes2_set_max_iterations(4096);
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk, 0), RHN_ERROR_PARAM);
+  r_jwe_free(jwe_decrypt);
+
+  r_jwe_pbes2_set_max_iterations(5000);
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk, 0), RHN_OK);
+  r_jwe_free(jwe_decrypt);
+
+  r_jwe_pbes2_set_max_iterations(0);
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, jwk, 0), RHN_OK);
+  r_jwe_free(jwe_decrypt);
+
+  o_free(token);
+  r_jwk_free(jwk);
+}
+END_TEST
 #endif
 
 static Suite *rhonabwy_suite(void)
@@ -317,6 +440,8 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_pbes2_hs512_ok);
   tcase_add_test(tc_core, test_rhonabwy_flood_ok);
   tcase_add_test(tc_core, test_rhonabwy_rfc_example);
+  tcase_add_test(tc_core, test_rhonabwy_pbes2_cache);
+  tcase_add_test(tc_core, test_rhonabwy_pbes2_max_iterations);
 #endif
   tcase_set_timeout(tc_core, 30);
   suite_add_tcase(s, tc_core);
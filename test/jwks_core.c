@@ -1,6 +1,9 @@
 /* Public domain, no copyright. Use at your own risk. */
 
 #include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include <check.h>
 #include <orcania.h>
@@ -225,6 +228,78 @@ int callback_jwks_error_status (const struct _u_request * request, struct _u_res
   return U_CALLBACK_CONTINUE;
 }
 
+int callback_jwks_slow (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  sleep(1);
+  return callback_jwks_ok(request, response, user_data);
+}
+
+int callback_jwks_count (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  (*(int *)user_data)++;
+  return callback_jwks_ok(request, response, NULL);
+}
+
+int callback_jwks_count_error (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  (*(int *)user_data)++;
+  return callback_jwks_error_status(request, response, NULL);
+}
+
+/**
+ * Holds the requests in the endpoint until the test opens the gate
+ */
+struct jwks_gate {
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  int             entered;
+  int             open;
+};
+
+int callback_jwks_gate (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  struct jwks_gate * gate = (struct jwks_gate *)user_data;
+
+  pthread_mutex_lock(&gate->lock);
+  gate->entered++;
+  pthread_cond_broadcast(&gate->cond);
+  while (!gate->open) {
+    pthread_cond_wait(&gate->cond, &gate->lock);
+  }
+  pthread_mutex_unlock(&gate->lock);
+  return callback_jwks_ok(request, response, NULL);
+}
+
+static void jwks_gate_wait_entered(struct jwks_gate * gate, int entered) {
+  pthread_mutex_lock(&gate->lock);
+  while (gate->entered < entered) {
+    pthread_cond_wait(&gate->cond, &gate->lock);
+  }
+  pthread_mutex_unlock(&gate->lock);
+}
+
+static void jwks_gate_set(struct jwks_gate * gate, int open) {
+  pthread_mutex_lock(&gate->lock);
+  gate->open = open;
+  if (!open) {
+    gate->entered = 0;
+  }
+  pthread_cond_broadcast(&gate->cond);
+  pthread_mutex_unlock(&gate->lock);
+}
+
+struct jwks_import_uri_args {
+  const char * uri;
+  int          ret;
+};
+
+static void * thread_jwks_import_uri(void * args) {
+  struct jwks_import_uri_args * import_args = (struct jwks_import_uri_args *)args;
+  jwks_t * jwks = NULL;
+
+  if (r_jwks_init(&jwks) == RHN_OK) {
+    import_args->ret = r_jwks_import_from_uri(jwks, import_args->uri, 0);
+  }
+  r_jwks_free(jwks);
+  return NULL;
+}
+
 int callback_jwks_redirect (const struct _u_request * request, struct _u_response * response, void * user_data) {
   u_map_put(response->map_header, "Location", "jwks_ok");
   response->status = 302;
@@ -543,6 +618,36 @@ START_TEST(test_rhonabwy_jwks_import)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_jwks_import_parallel)
+{
+  char * jwks_str = msprintf("{\"keys\":[%s,%s,%s,%s,%s]}", jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str, jwk_pubkey_rsa_str_invalid_n, jwk_pubkey_rsa_x5u_str, jwk_pubkey_rsa_x5c_str);
+  json_t * j_input = json_loads(jwks_str, JSON_DECODE_ANY, NULL);
+  jwks_t * jwks, * jwks_serial;
+  unsigned int nb_threads[] = {0, 1, 3, 16}, i;
+  
+  ck_assert_ptr_ne(j_input, NULL);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_json_t_parallel(NULL, j_input, 2), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_import_from_json_t_parallel(jwks, NULL, 2), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_import_from_json_t_parallel(jwks, json_object_get(j_input, "keys"), 2), RHN_ERROR_PARAM);
+  r_jwks_free(jwks);
+  
+  ck_assert_int_eq(r_jwks_init(&jwks_serial), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_json_t(jwks_serial, j_input), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_size(jwks_serial), 4);
+  for (i=0; i<sizeof(nb_threads)/sizeof(unsigned int); i++) {
+    ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+    ck_assert_int_eq(r_jwks_import_from_json_t_parallel(jwks, j_input, nb_threads[i]), RHN_ERROR_PARAM);
+    ck_assert_int_eq(r_jwks_size(jwks), 4);
+    ck_assert_int_eq(r_jwks_equal(jwks, jwks_serial), 1);
+    r_jwks_free(jwks);
+  }
+  r_jwks_free(jwks_serial);
+  json_decref(j_input);
+  o_free(jwks_str);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_jwks_import_uri)
 {
   struct _u_instance instance;
@@ -597,6 +702,717 @@ START_TEST(test_rhonabwy_jwks_import_uri)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_jwks_import_uri_http_options)
+{
+  struct _u_instance instance;
+#ifdef R_WITH_CURL
+  jwks_t * jwks = NULL;
+  int i;
+#endif
+  
+  ck_assert_int_eq(ulfius_init_instance(&instance, 7462, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_ok", NULL, 0, &callback_jwks_ok, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_slow", NULL, 0, &callback_jwks_slow, NULL), U_OK);
+  
+#ifdef R_WITH_CURL
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+  
+  // Sequential requests reuse the pooled curl handle
+  for (i=0; i<4; i++) {
+    ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+    ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_ok", 0), RHN_OK);
+    ck_assert_int_eq(r_jwks_size(jwks), 4);
+    r_jwks_free(jwks);
+  }
+
+  // No timeout by default
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_slow", 0), RHN_OK);
+  r_jwks_free(jwks);
+
+  ck_assert_int_eq(r_global_set_http_options(0, 0, 64), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_ok", 0), RHN_ERROR);
+  r_jwks_free(jwks);
+
+  ck_assert_int_eq(r_global_set_http_options(0, 200, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_slow", 0), RHN_ERROR);
+  r_jwks_free(jwks);
+
+  ck_assert_int_eq(r_global_set_http_options(0, 0, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_slow", 0), RHN_OK);
+  r_jwks_free(jwks);
+
+  ulfius_stop_framework(&instance);
+#else
+  ck_assert_int_eq(r_global_set_http_options(0, 0, 0), RHN_ERROR_UNSUPPORTED);
+#endif
+  ulfius_clean_instance(&instance);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_jwks_import_uri_single_flight)
+{
+  struct _u_instance instance;
+  int count = 0, count_error = 0;
+#ifdef R_WITH_CURL
+  struct jwks_gate gate = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+  jwks_t * jwks = NULL;
+  pthread_t threads[8];
+  struct jwks_import_uri_args args[8];
+  int i;
+#endif
+  
+  ck_assert_int_eq(ulfius_init_instance(&instance, 7462, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_count", NULL, 0, &callback_jwks_count, &count), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_count_error", NULL, 0, &callback_jwks_count_error, &count_error), U_OK);
+  
+#ifdef R_WITH_CURL
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_gate", NULL, 0, &callback_jwks_gate, &gate), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+  
+  // A thread waits for the download in flight instead of making its own,
+  // and doesn't wait longer than wait_timeout
+  ck_assert_int_eq(r_global_set_http_fetch_options(200, 0, 0, 0), RHN_OK);
+  args[0].uri = "http://localhost:7462/jwks_gate?step=timeout";
+  args[0].ret = RHN_ERROR;
+  ck_assert_int_eq(pthread_create(&threads[0], NULL, thread_jwks_import_uri, &args[0]), 0);
+  jwks_gate_wait_entered(&gate, 1);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, args[0].uri, 0), RHN_ERROR);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(gate.entered, 1);
+  jwks_gate_set(&gate, 1);
+  pthread_join(threads[0], NULL);
+  ck_assert_int_eq(args[0].ret, RHN_OK);
+  ck_assert_int_eq(gate.entered, 1);
+
+  // Concurrent requests of the same url make one download,
+  // the threads arriving after the download reuse it during min_refresh,
+  // another url so the response above isn't reused
+  // the gate holds the download until all the threads are started,
+  // the waiting threads don't reach their finite wait_timeout
+  jwks_gate_set(&gate, 0);
+  ck_assert_int_eq(r_global_set_http_fetch_options(60000, 60000, 0, 0), RHN_OK);
+  for (i=0; i<8; i++) {
+    args[i].uri = "http://localhost:7462/jwks_gate?step=single";
+    args[i].ret = RHN_ERROR;
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, thread_jwks_import_uri, &args[i]), 0);
+    if (!i) {
+      jwks_gate_wait_entered(&gate, 1);
+    }
+  }
+  jwks_gate_set(&gate, 1);
+  for (i=0; i<8; i++) {
+    pthread_join(threads[i], NULL);
+    ck_assert_int_eq(args[i].ret, RHN_OK);
+  }
+  ck_assert_int_eq(gate.entered, 1);
+
+  // A successful response is reused during min_refresh
+  ck_assert_int_eq(r_global_set_http_fetch_options(30000, 60000, 0, 0), RHN_OK);
+  for (i=0; i<4; i++) {
+    ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+    ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_count", 0), RHN_OK);
+    ck_assert_int_eq(r_jwks_size(jwks), 4);
+    r_jwks_free(jwks);
+  }
+  ck_assert_int_eq(count, 1);
+
+  // A failed url isn't requested again during the backoff
+  ck_assert_int_eq(r_global_set_http_fetch_options(30000, 0, 200, 100), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_global_set_http_fetch_options(30000, 0, 60000, 0), RHN_OK);
+  for (i=0; i<4; i++) {
+    ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+    ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_count_error", 0), RHN_ERROR);
+    r_jwks_free(jwks);
+  }
+  ck_assert_int_eq(count_error, 1);
+
+  ck_assert_int_eq(r_global_set_http_fetch_options(30000, 0, 0, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_count_error", 0), RHN_ERROR);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(count_error, 2);
+
+  ulfius_stop_framework(&instance);
+#else
+  ck_assert_int_eq(r_global_set_http_fetch_options(0, 0, 0, 0), RHN_ERROR_UNSUPPORTED);
+#endif
+  ulfius_clean_instance(&instance);
+}
+END_TEST
+
+#define JWKS_STORE_FILE "jwks_store.json"
+#define JWKS_STORE_MAPPED_FILE "jwks_store_mapped.json"
+
+static void write_jwks_store_file(const char * jwk1, const char * jwk2) {
+  FILE * f = fopen(JWKS_STORE_FILE ".tmp", "w");
+  
+  ck_assert_ptr_ne(f, NULL);
+  if (jwk2 != NULL) {
+    fprintf(f, "{\"keys\":[%s,%s]}", jwk1, jwk2);
+  } else {
+    fprintf(f, "{\"keys\":[%s]}", jwk1);
+  }
+  fclose(f);
+  ck_assert_int_eq(rename(JWKS_STORE_FILE ".tmp", JWKS_STORE_FILE), 0);
+}
+
+static void * thread_jwks_store_read(void * args) {
+  jwks_store_t * store = (jwks_store_t *)args;
+  jwk_t * jwk;
+  int i;
+  
+  for (i=0; i<500 && r_jwks_store_size(store) < 2; i++) {
+    jwk = r_jwks_store_get_by_kid(store, "1");
+    r_jwk_free(jwk);
+    usleep(10000);
+  }
+  return NULL;
+}
+
+START_TEST(test_rhonabwy_jwks_store)
+{
+  jwks_store_t * store;
+  jwks_t * jwks;
+  jwk_t * jwk, * jwk_priv;
+  jws_t * jws_sign, * jws;
+  char * token;
+  pthread_t threads[4];
+  int i;
+  
+  write_jwks_store_file(jwk_pubkey_ecdsa_str, NULL);
+  ck_assert_int_eq(r_jwks_store_init(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_store_init(&store), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_add_file(store, NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_store_add_file(store, JWKS_STORE_FILE), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_size(store), 0);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_size(store), 1);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "1"));
+  r_jwk_free(jwk);
+  ck_assert_ptr_eq(NULL, r_jwks_store_get_by_kid(store, "error"));
+  
+  // Verify a token with a key from the store
+  ck_assert_int_eq(r_jwk_init(&jwk_priv), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_priv, jwk_privkey_ecdsa_str), RHN_OK);
+  ck_assert_int_eq(r_jws_init(&jws_sign), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws_sign, (const unsigned char *)"payload", 7), RHN_OK);
+  ck_assert_int_eq(r_jws_set_alg(jws_sign, R_JWA_ALG_ES256), RHN_OK);
+  ck_assert_int_eq(r_jws_set_header_str_value(jws_sign, "kid", "1"), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jws_serialize(jws_sign, jwk_priv, 0));
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jws_set_jwks_store(jws, store), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_OK);
+  
+  // A refresh replaces the keys, a missing file keeps its previous keys
+  write_jwks_store_file(jwk_pubkey_rsa_str, NULL);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jwks_store_add_file(store, "error.json"), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_ERROR);
+  ck_assert_int_eq(r_jwks_store_size(store), 1);
+  ck_assert_ptr_ne(NULL, jwks = r_jwks_store_get_jwks(store));
+  ck_assert_int_eq(r_jwks_size(jwks), 1);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_get_by_kid(jwks, "2011-04-29"));
+  r_jwk_free(jwk);
+  r_jwks_free(jwks);
+  
+  // The background refresh publishes new keys while readers run
+  ck_assert_int_eq(r_jwks_store_start(store, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_store_start(store, 1), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_start(store, 1), RHN_ERROR_PARAM);
+  for (i=0; i<4; i++) {
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, thread_jwks_store_read, store), 0);
+  }
+  write_jwks_store_file(jwk_pubkey_rsa_str, jwk_pubkey_ecdsa_str);
+  for (i=0; i<4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  ck_assert_int_eq(r_jwks_store_size(store), 2);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_OK);
+  r_jwks_store_stop(store);
+  
+  o_free(token);
+  r_jws_free(jws);
+  r_jws_free(jws_sign);
+  r_jwk_free(jwk_priv);
+  r_jwks_store_free(store);
+  unlink(JWKS_STORE_FILE);
+}
+END_TEST
+
+struct jwks_store_refresh_args {
+  jwks_store_t * store;
+  int            ret;
+};
+
+static void * thread_jwks_store_refresh(void * args) {
+  struct jwks_store_refresh_args * refresh_args = (struct jwks_store_refresh_args *)args;
+
+  refresh_args->ret = r_jwks_store_refresh(refresh_args->store);
+  return NULL;
+}
+
+START_TEST(test_rhonabwy_jwks_store_uri)
+{
+  struct _u_instance instance;
+#ifdef R_WITH_CURL
+  struct jwks_gate gate = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+  struct jwks_store_refresh_args refresh_args;
+  jwks_store_t * store;
+  jwk_t * jwk, * jwk_priv;
+  jws_t * jws_sign, * jws;
+  char * token;
+  pthread_t thread;
+#endif
+
+  ck_assert_int_eq(ulfius_init_instance(&instance, 7462, NULL, NULL), U_OK);
+#ifdef R_WITH_CURL
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_gate", NULL, 0, &callback_jwks_gate, &gate), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+
+  write_jwks_store_file(jwk_pubkey_ecdsa_str, NULL);
+  ck_assert_int_eq(r_jwks_store_init(&store), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_add_file(store, JWKS_STORE_FILE), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_size(store), 1);
+  ck_assert_int_eq(r_jwks_store_add_uri(store, "http://localhost:7462/jwks_gate", 0), RHN_OK);
+
+  ck_assert_int_eq(r_jwk_init(&jwk_priv), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_priv, jwk_privkey_ecdsa_str), RHN_OK);
+  ck_assert_int_eq(r_jws_init(&jws_sign), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws_sign, (const unsigned char *)"payload", 7), RHN_OK);
+  ck_assert_int_eq(r_jws_set_alg(jws_sign, R_JWA_ALG_ES256), RHN_OK);
+  ck_assert_int_eq(r_jws_set_header_str_value(jws_sign, "kid", "1"), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jws_serialize(jws_sign, jwk_priv, 0));
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_set_jwks_store(jws, store), RHN_OK);
+
+  // The url is downloaded without the store lock, readers and writers don't wait for it
+  refresh_args.store = store;
+  refresh_args.ret = RHN_ERROR;
+  ck_assert_int_eq(pthread_create(&thread, NULL, thread_jwks_store_refresh, &refresh_args), 0);
+  pthread_mutex_lock(&gate.lock);
+  while (!gate.entered) {
+    pthread_cond_wait(&gate.cond, &gate.lock);
+  }
+  pthread_mutex_unlock(&gate.lock);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "1"));
+  r_jwk_free(jwk);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_set_validation(store, R_JWKS_STORE_VALIDATE_IMPORT, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_add_file(store, JWKS_STORE_FILE), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_size(store), 1);
+
+  pthread_mutex_lock(&gate.lock);
+  gate.open = 1;
+  pthread_cond_broadcast(&gate.cond);
+  pthread_mutex_unlock(&gate.lock);
+  pthread_join(thread, NULL);
+  ck_assert_int_eq(refresh_args.ret, RHN_OK);
+  ck_assert_int_eq(r_jwks_store_size(store), 6);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "2011-04-29"));
+  r_jwk_free(jwk);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_OK);
+
+  // The first refresh of start downloads the url too
+  ck_assert_int_eq(r_jwks_store_start(store, 60), RHN_OK);
+  ck_assert_int_eq(gate.entered, 2);
+  r_jwks_store_stop(store);
+
+  o_free(token);
+  r_jws_free(jws);
+  r_jws_free(jws_sign);
+  r_jwk_free(jwk_priv);
+  r_jwks_store_free(store);
+  unlink(JWKS_STORE_FILE);
+  ulfius_stop_framework(&instance);
+#endif
+  ulfius_clean_instance(&instance);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_jwks_store_validation)
+{
+  jwks_store_t * store;
+  jwks_t * jwks;
+  jwk_t * jwk;
+  char * jwk_str;
+  
+  write_jwks_store_file(jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str_invalid_n);
+  ck_assert_int_eq(r_jwks_store_init(&store), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_add_file(store, JWKS_STORE_FILE), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_set_validation(NULL, R_JWKS_STORE_VALIDATE_DEFERRED, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_store_set_validation(store, 42, 0), RHN_ERROR_PARAM);
+  
+  // Parallel validation rejects the whole source if one of its keys is invalid
+  ck_assert_int_eq(r_jwks_store_set_validation(store, R_JWKS_STORE_VALIDATE_PARALLEL, 2), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_ERROR);
+  ck_assert_int_eq(r_jwks_store_size(store), 0);
+  write_jwks_store_file(jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_size(store), 2);
+  
+  // Deferred validation imports all the keys, the invalid key is never returned
+  write_jwks_store_file(jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str_invalid_n);
+  ck_assert_int_eq(r_jwks_store_set_validation(store, R_JWKS_STORE_VALIDATE_DEFERRED, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_size(store), 2);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "1"));
+  r_jwk_free(jwk);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "1"));
+  r_jwk_free(jwk);
+  ck_assert_ptr_eq(NULL, r_jwks_store_get_by_kid(store, "2010-04-29"));
+  ck_assert_ptr_eq(NULL, r_jwks_store_get_by_kid(store, "2010-04-29"));
+  ck_assert_ptr_ne(NULL, jwks = r_jwks_store_get_jwks(store));
+  ck_assert_int_eq(r_jwks_size(jwks), 1);
+  r_jwks_free(jwks);
+  
+  // The lookup falls through to the next key with the same kid
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_set_property_str(jwk, "kid", "2010-04-29"), RHN_OK);
+  ck_assert_ptr_ne(NULL, jwk_str = r_jwk_export_to_json_str(jwk, 0));
+  r_jwk_free(jwk);
+  write_jwks_store_file(jwk_pubkey_rsa_str_invalid_n, jwk_str);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_OK);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "2010-04-29"));
+  ck_assert_int_eq(r_jwk_key_type(jwk, NULL, 0), R_KEY_TYPE_RSA|R_KEY_TYPE_PUBLIC);
+  r_jwk_free(jwk);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "2010-04-29"));
+  r_jwk_free(jwk);
+  o_free(jwk_str);
+  
+  r_jwks_store_free(store);
+  unlink(JWKS_STORE_FILE);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_jwks_store_mapped)
+{
+  jwks_store_t * store;
+  jwks_t * jwks;
+  jwk_t * jwk;
+  char * jwk_str;
+  FILE * f;
+  int i;
+  
+  ck_assert_ptr_ne(NULL, f = fopen(JWKS_STORE_FILE, "w"));
+  fprintf(f, "{\"iss\":{\"a\":[1,\"}]\\\"\"]},\"keys\":[%s,\n%s,{\"kty\":\"oct\",\"k\":\"R3JpbGxlZC9DaGVlc2UvU2FuZHdpY2g\"}],\"n\":null}", jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str);
+  fclose(f);
+  ck_assert_int_eq(r_jwks_store_init(&store), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_add_file_mapped(store, NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_store_add_file_mapped(store, JWKS_STORE_FILE), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_size(store), 3);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "2011-04-29"));
+  ck_assert_int_eq(r_jwk_key_type(jwk, NULL, 0), R_KEY_TYPE_RSA|R_KEY_TYPE_PUBLIC);
+  r_jwk_free(jwk);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "1"));
+  r_jwk_free(jwk);
+  ck_assert_ptr_eq(NULL, r_jwks_store_get_by_kid(store, "error"));
+  ck_assert_ptr_ne(NULL, jwks = r_jwks_store_get_jwks(store));
+  ck_assert_int_eq(r_jwks_size(jwks), 3);
+  r_jwks_free(jwks);
+  
+  // The file is reloaded when it's replaced
+  ck_assert_int_eq(r_jwks_store_start(store, 3600), RHN_OK);
+  write_jwks_store_file(jwk_pubkey_ecdsa_str, NULL);
+  for (i=0; i<300 && r_jwks_store_size(store) != 1; i++) {
+    usleep(10000);
+  }
+  ck_assert_int_eq(r_jwks_store_size(store), 1);
+  ck_assert_ptr_eq(NULL, r_jwks_store_get_by_kid(store, "2011-04-29"));
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "1"));
+  r_jwk_free(jwk);
+  
+  // An invalid file keeps the previous keys
+  r_jwks_store_stop(store);
+  ck_assert_ptr_ne(NULL, f = fopen(JWKS_STORE_FILE ".tmp", "w"));
+  fprintf(f, "{\"keys\":[%s", jwk_pubkey_rsa_str);
+  fclose(f);
+  ck_assert_int_eq(rename(JWKS_STORE_FILE ".tmp", JWKS_STORE_FILE), 0);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_ERROR);
+  ck_assert_int_eq(r_jwks_store_size(store), 1);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "1"));
+  r_jwk_free(jwk);
+  
+  // The lookup falls through to the next key with the same kid
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_set_property_str(jwk, "kid", "2010-04-29"), RHN_OK);
+  ck_assert_ptr_ne(NULL, jwk_str = r_jwk_export_to_json_str(jwk, 0));
+  r_jwk_free(jwk);
+  write_jwks_store_file(jwk_pubkey_rsa_str_invalid_n, jwk_str);
+  o_free(jwk_str);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_OK);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "2010-04-29"));
+  ck_assert_int_eq(r_jwk_key_type(jwk, NULL, 0), R_KEY_TYPE_RSA|R_KEY_TYPE_PUBLIC);
+  r_jwk_free(jwk);
+  r_jwks_store_free(store);
+  
+  // The keys are looked up in the order of the sources, mapped or not
+  write_jwks_store_file(jwk_pubkey_rsa_str, NULL);
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_pubkey_ecdsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_set_property_str(jwk, "kid", "2011-04-29"), RHN_OK);
+  ck_assert_ptr_ne(NULL, jwk_str = r_jwk_export_to_json_str(jwk, 0));
+  r_jwk_free(jwk);
+  ck_assert_ptr_ne(NULL, f = fopen(JWKS_STORE_MAPPED_FILE, "w"));
+  fprintf(f, "{\"keys\":[%s]}", jwk_str);
+  fclose(f);
+  o_free(jwk_str);
+  ck_assert_int_eq(r_jwks_store_init(&store), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_add_file_mapped(store, JWKS_STORE_FILE), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_add_file(store, JWKS_STORE_MAPPED_FILE), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_OK);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "2011-04-29"));
+  ck_assert_int_eq(r_jwk_key_type(jwk, NULL, 0), R_KEY_TYPE_RSA|R_KEY_TYPE_PUBLIC);
+  r_jwk_free(jwk);
+  ck_assert_ptr_ne(NULL, jwks = r_jwks_store_get_jwks(store));
+  ck_assert_int_eq(r_jwks_size(jwks), 2);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_get_at(jwks, 0));
+  ck_assert_int_eq(r_jwk_key_type(jwk, NULL, 0), R_KEY_TYPE_RSA|R_KEY_TYPE_PUBLIC);
+  r_jwk_free(jwk);
+  r_jwks_free(jwks);
+  r_jwks_store_free(store);
+  ck_assert_int_eq(r_jwks_store_init(&store), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_add_file(store, JWKS_STORE_MAPPED_FILE), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_add_file_mapped(store, JWKS_STORE_FILE), RHN_OK);
+  ck_assert_int_eq(r_jwks_store_refresh(store), RHN_OK);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "2011-04-29"));
+  ck_assert_int_eq(r_jwk_key_type(jwk, NULL, 0), R_KEY_TYPE_EC|R_KEY_TYPE_PUBLIC);
+  r_jwk_free(jwk);
+  
+  r_jwks_store_free(store);
+  unlink(JWKS_STORE_FILE);
+  unlink(JWKS_STORE_MAPPED_FILE);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_jwks_store_mapped_format)
+{
+  // The mapped file is rejected when json_loads would reject it
+  const char * invalid[] = {
+    "{\"keys\":[%s]} x",
+    "{\"keys\":[%s]}{}",
+    "{\"keys\":[%s],\v\"a\":1}",
+    "{\"keys\":[%s],\"a\":\"\x01\"}",
+    "{\"keys\":[%s],\"a\":\"\\q\"}",
+    "{\"keys\":[%s],\"a\":\"\\u00g0\"}",
+    "{\"keys\":[%s],\"a\":\"\\u0000\"}",
+    "{\"keys\":[%s],\"a\":\"\\udc00\"}",
+    "{\"keys\":[%s],\"a\":\"\\ud800x\"}",
+    "{\"keys\":[%s],\"a\":\"\xc3\x28\"}",
+    "{\"keys\":[%s],\"a\":\"\xc0\xaf\"}",
+    "{\"keys\":[%s],\"a\":\"\xed\xa0\x80\"}",
+    "{\"keys\":[%s],\"a\":\"\xf4\x90\x80\x80\"}",
+    "{\"keys\":[%s],\"a\":01}",
+    "{\"keys\":[%s],\"a\":1.}",
+    "{\"keys\":[%s],\"a\":-}",
+    "{\"keys\":[%s],\"a\":1e}",
+    "{\"keys\":[%s],\"a\":+1}",
+    "{\"keys\":[%s],\"a\":99999999999999999999}",
+    "{\"keys\":[%s],\"a\":1e999}",
+    "{\"keys\":[%s],\"a\":tru}",
+    "{\"keys\":[%s],\"a\":nulls}",
+    "{\"keys\":[%s],\"a\":True}",
+    "{\"keys\":[%s],\"a\":[1 2]}",
+    "{\"keys\":[%s],\"a\":[1,]}",
+    "{\"keys\":[%s],\"a\":{\"b\":1,}}",
+    "{\"keys\":[%s],\"a\":{1:2}}",
+    "{\"keys\":[%s,{\"kid\":\"2\",\"kty\":\"oct\",\"k\":\"AAAA\",\"a\":[01]}]}",
+    NULL
+  };
+  // Valid JSON the scanner must accept
+  const char * valid[] = {
+    "{\"ke\\u0079s\":[%s],\"a\":[-0.5e+3,0,true,false,null,{},[],\"\\ud83d\\ude00\\u00e9\\n\xc3\xa9\"]}\r\n",
+    "{\"keys\":[{\"kid\":\"old\"}],\"keys\":[%s]}",
+    NULL
+  };
+  jwks_store_t * store;
+  jwk_t * jwk;
+  json_t * j_content;
+  char * content, * nested;
+  FILE * f;
+  size_t i;
+  
+  for (i=0; invalid[i] != NULL; i++) {
+    ck_assert_ptr_ne(NULL, content = msprintf(invalid[i], jwk_pubkey_ecdsa_str));
+    ck_assert_ptr_eq(NULL, j_content = json_loads(content, 0, NULL));
+    ck_assert_ptr_ne(NULL, f = fopen(JWKS_STORE_MAPPED_FILE, "w"));
+    fputs(content, f);
+    fclose(f);
+    ck_assert_int_eq(r_jwks_store_init(&store), RHN_OK);
+    ck_assert_int_eq(r_jwks_store_add_file_mapped(store, JWKS_STORE_MAPPED_FILE), RHN_OK);
+    ck_assert_int_eq(r_jwks_store_refresh(store), RHN_ERROR);
+    ck_assert_int_eq(r_jwks_store_size(store), 0);
+    r_jwks_store_free(store);
+    o_free(content);
+  }
+  for (i=0; valid[i] != NULL; i++) {
+    ck_assert_ptr_ne(NULL, content = msprintf(valid[i], jwk_pubkey_ecdsa_str));
+    ck_assert_ptr_ne(NULL, j_content = json_loads(content, 0, NULL));
+    json_decref(j_content);
+    ck_assert_ptr_ne(NULL, f = fopen(JWKS_STORE_MAPPED_FILE, "w"));
+    fputs(content, f);
+    fclose(f);
+    ck_assert_int_eq(r_jwks_store_init(&store), RHN_OK);
+    ck_assert_int_eq(r_jwks_store_add_file_mapped(store, JWKS_STORE_MAPPED_FILE), RHN_OK);
+    ck_assert_int_eq(r_jwks_store_refresh(store), RHN_OK);
+    ck_assert_int_eq(r_jwks_store_size(store), 1);
+    ck_assert_ptr_ne(NULL, jwk = r_jwks_store_get_by_kid(store, "1"));
+    r_jwk_free(jwk);
+    r_jwks_store_free(store);
+    o_free(content);
+  }
+  
+  // The nesting depth is limited like json_loads
+  for (i=2047; i<=2048; i++) {
+    ck_assert_ptr_ne(NULL, nested = o_malloc(2*i+1));
+    memset(nested, '[', i);
+    memset(nested+i, ']', i);
+    nested[2*i] = '\0';
+    ck_assert_ptr_ne(NULL, content = msprintf("{\"keys\":[%s],\"a\":%s}", jwk_pubkey_ecdsa_str, nested));
+    j_content = json_loads(content, 0, NULL);
+    ck_assert_ptr_ne(NULL, f = fopen(JWKS_STORE_MAPPED_FILE, "w"));
+    fputs(content, f);
+    fclose(f);
+    ck_assert_int_eq(r_jwks_store_init(&store), RHN_OK);
+    ck_assert_int_eq(r_jwks_store_add_file_mapped(store, JWKS_STORE_MAPPED_FILE), RHN_OK);
+    if (i == 2047) {
+      ck_assert_ptr_ne(NULL, j_content);
+      ck_assert_int_eq(r_jwks_store_refresh(store), RHN_OK);
+    } else {
+      ck_assert_ptr_eq(NULL, j_content);
+      ck_assert_int_eq(r_jwks_store_refresh(store), RHN_ERROR);
+    }
+    json_decref(j_content);
+    r_jwks_store_free(store);
+    o_free(content);
+    o_free(nested);
+  }
+  unlink(JWKS_STORE_MAPPED_FILE);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_jwks_binary)
+{
+  jwks_t * jwks, * jwks_imported;
+  jwk_t * jwk;
+  unsigned char * binary;
+  size_t binary_len = 0, offset;
+  uint32_t crc;
+  
+  ck_assert_ptr_ne(NULL, jwks = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_pubkey_ecdsa_str, R_IMPORT_JSON_STR, jwk_privkey_rsa_str, R_IMPORT_JSON_STR, jwk_pubkey_rsa_x5c_str, R_IMPORT_NONE));
+  ck_assert_int_eq(r_jwks_size(jwks), 3);
+  ck_assert_ptr_eq(NULL, r_jwks_export_to_binary(NULL, &binary_len));
+  ck_assert_ptr_ne(NULL, binary = r_jwks_export_to_binary(jwks, &binary_len));
+  ck_assert_int_gt(binary_len, 16);
+  
+  ck_assert_int_eq(r_jwks_init(&jwks_imported), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_binary(jwks_imported, NULL, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_import_from_binary(jwks_imported, (const unsigned char *)jwk_pubkey_ecdsa_str, o_strlen(jwk_pubkey_ecdsa_str)), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_import_from_binary(jwks_imported, binary, binary_len-1), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_import_from_binary(jwks_imported, binary, binary_len), RHN_OK);
+  ck_assert_int_eq(r_jwks_equal(jwks, jwks_imported), 1);
+  ck_assert_int_eq(r_jwks_binary_verify(NULL, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_binary_verify(binary, binary_len-1), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_binary_verify(binary, binary_len), RHN_OK);
+  
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_binary_get_by_kid(binary, binary_len, "2016-06-22"));
+  ck_assert_int_eq(r_jwk_key_type(jwk, NULL, 0), R_KEY_TYPE_RSA|R_KEY_TYPE_PRIVATE);
+  r_jwk_free(jwk);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_binary_get_by_kid(binary, binary_len, "1b94c"));
+  ck_assert_int_eq(r_jwk_key_type(jwk, NULL, 0), R_KEY_TYPE_RSA|R_KEY_TYPE_PUBLIC);
+  r_jwk_free(jwk);
+  ck_assert_ptr_eq(NULL, r_jwks_binary_get_by_kid(binary, binary_len, "error"));
+  ck_assert_ptr_eq(NULL, r_jwks_binary_get_by_kid(binary, 8, "2016-06-22"));
+  
+  // A modified content is rejected
+  binary[binary_len-1] ^= 0xff;
+  ck_assert_int_eq(r_jwks_empty(jwks_imported), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_binary(jwks_imported, binary, binary_len), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_size(jwks_imported), 0);
+  ck_assert_int_eq(r_jwks_binary_verify(binary, binary_len), RHN_ERROR_PARAM);
+  binary[binary_len-1] ^= 0xff;
+  
+  // An invalid record with a valid checksum doesn't append the previous keys
+  offset = (size_t)binary[56] | ((size_t)binary[57] << 8) | ((size_t)binary[58] << 16) | ((size_t)binary[59] << 24);
+  binary[offset] = 0xff;
+  binary[offset+1] = 0xff;
+  crc = (uint32_t)crc32(0L, binary+16, (uInt)(binary_len-16));
+  binary[12] = (unsigned char)(crc & 0xff);
+  binary[13] = (unsigned char)((crc >> 8) & 0xff);
+  binary[14] = (unsigned char)((crc >> 16) & 0xff);
+  binary[15] = (unsigned char)((crc >> 24) & 0xff);
+  ck_assert_int_eq(r_jwks_import_from_binary(jwks_imported, binary, binary_len), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_size(jwks_imported), 0);
+  binary[4] = 2;
+  ck_assert_int_eq(r_jwks_import_from_binary(jwks_imported, binary, binary_len), RHN_ERROR_UNSUPPORTED);
+  ck_assert_int_eq(r_jwks_binary_verify(binary, binary_len), RHN_ERROR_UNSUPPORTED);
+  ck_assert_ptr_eq(NULL, r_jwks_binary_get_by_kid(binary, binary_len, "2016-06-22"));
+  r_free(binary);
+  
+  // Invalid keys can't be exported
+  ck_assert_ptr_ne(NULL, jwk = json_loads(jwk_pubkey_rsa_str_invalid_n, JSON_DECODE_ANY, NULL));
+  ck_assert_int_eq(r_jwks_append_jwk(jwks, jwk), RHN_OK);
+  ck_assert_ptr_eq(NULL, r_jwks_export_to_binary(jwks, &binary_len));
+  
+  r_jwk_free(jwk);
+  r_jwks_free(jwks);
+  r_jwks_free(jwks_imported);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_jwks_shared)
+{
+  jwks_t * jwks;
+  jwks_shared_t * shared, * shared_ref;
+  jwk_t * jwk;
+  
+  ck_assert_ptr_eq(NULL, r_jwks_shared_new(NULL));
+  ck_assert_ptr_eq(NULL, r_jwks_shared_ref(NULL));
+  ck_assert_int_eq(r_jwks_shared_size(NULL), 0);
+  ck_assert_ptr_eq(NULL, r_jwks_shared_get_at(NULL, 0));
+  ck_assert_ptr_eq(NULL, r_jwks_shared_get_by_kid(NULL, "1"));
+  r_jwks_shared_free(NULL);
+  
+  ck_assert_ptr_ne(NULL, jwks = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_pubkey_ecdsa_str, R_IMPORT_JSON_STR, jwk_pubkey_rsa_str, R_IMPORT_JSON_STR, jwk_pubkey_rsa_x5c_str, R_IMPORT_NONE));
+  ck_assert_ptr_ne(NULL, shared = r_jwks_shared_new(jwks));
+  
+  // The shared set is a copy, modifying the source set doesn't change it
+  ck_assert_int_eq(r_jwks_empty(jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_shared_size(shared), 3);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_shared_get_at(shared, 2));
+  ck_assert_str_eq(r_jwk_get_property_str(jwk, "kid"), "1b94c");
+  r_jwk_free(jwk);
+  ck_assert_ptr_eq(NULL, r_jwks_shared_get_at(shared, 3));
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_shared_get_by_kid(shared, "1"));
+  ck_assert_int_eq(r_jwk_key_type(jwk, NULL, 0), R_KEY_TYPE_EC|R_KEY_TYPE_PUBLIC);
+  r_jwk_free(jwk);
+  ck_assert_ptr_eq(NULL, r_jwks_shared_get_by_kid(shared, "error"));
+  ck_assert_ptr_eq(NULL, r_jwks_shared_get_by_kid(shared, NULL));
+  
+  // A reference stays valid after the creator released its own
+  ck_assert_ptr_eq(shared, shared_ref = r_jwks_shared_ref(shared));
+  r_jwks_shared_free(shared);
+  ck_assert_int_eq(r_jwks_shared_size(shared_ref), 3);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_shared_get_by_kid(shared_ref, "1b94c"));
+  r_jwk_free(jwk);
+  r_jwks_shared_free(shared_ref);
+  
+  r_jwks_free(jwks);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_jwks_get_by_kid)
 {
   char * jwks_str = msprintf("{\"keys\":[%s,%s,%s,%s]}", jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str, jwk_pubkey_rsa_x5u_str, jwk_pubkey_rsa_x5c_str);
@@ -952,7 +1768,17 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_jwks_export_pubkey);
   tcase_add_test(tc_core, test_rhonabwy_jwks_export_pem);
   tcase_add_test(tc_core, test_rhonabwy_jwks_import);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_import_parallel);
   tcase_add_test(tc_core, test_rhonabwy_jwks_import_uri);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_import_uri_http_options);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_import_uri_single_flight);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_store);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_store_uri);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_store_validation);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_store_mapped);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_store_mapped_format);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_binary);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_shared);
   tcase_add_test(tc_core, test_rhonabwy_jwks_get_by_kid);
   tcase_add_test(tc_core, test_rhonabwy_jwks_equal);
   tcase_add_test(tc_core, test_rhonabwy_jwks_empty);
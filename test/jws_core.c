@@ -823,6 +823,110 @@ START_TEST(test_rhonabwy_token_serialize_unsecure)
 }
 END_TEST
   
+START_TEST(test_rhonabwy_token_serialize_to)
+{
+  jws_t * jws, * jws_verify;
+  jwk_t * jwk_privkey, * jwk_pubkey;
+  char * token, output[4096];
+  size_t output_len, length;
+  unsigned int i;
+  struct {
+    jwa_alg alg;
+    const char * privkey;
+    const char * pubkey;
+    int zip;
+  } cases[] = {
+    {R_JWA_ALG_HS256, jwk_key_symmetric_str, jwk_key_symmetric_str, 0},
+    {R_JWA_ALG_HS512, jwk_key_symmetric_str, jwk_key_symmetric_str, 1},
+    {R_JWA_ALG_RS256, jwk_privkey_rsa_str, jwk_pubkey_rsa_str, 0},
+    {R_JWA_ALG_PS384, jwk_privkey_rsa_str, jwk_pubkey_rsa_str, 1},
+    {R_JWA_ALG_ES256, jwk_privkey_ecdsa_str, jwk_pubkey_ecdsa_str, 0},
+  };
+
+  for (i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+    ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+    ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+    ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, cases[i].privkey), RHN_OK);
+    ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, cases[i].pubkey), RHN_OK);
+    ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+    ck_assert_int_eq(r_jws_set_alg(jws, cases[i].alg), RHN_OK);
+    if (cases[i].zip) {
+      ck_assert_int_eq(r_jws_set_header_str_value(jws, "zip", "DEF"), RHN_OK);
+    }
+    ck_assert_int_eq(r_jws_set_payload(jws, (const unsigned char *)HUGE_PAYLOAD, o_strlen(HUGE_PAYLOAD)), RHN_OK);
+
+    ck_assert_ptr_ne((token = r_jws_serialize(jws, jwk_privkey, 0)), NULL);
+    ck_assert_int_eq(length = r_jws_serialized_length(jws, jwk_privkey, 0), o_strlen(token));
+    ck_assert_int_lt(length, sizeof(output));
+    o_free(token);
+
+    output_len = length-1;
+    ck_assert_int_eq(r_jws_serialize_to(jws, jwk_privkey, 0, output, &output_len), RHN_ERROR_PARAM);
+    ck_assert_int_eq(output_len, length);
+    output_len = length;
+    ck_assert_int_eq(r_jws_serialize_to(jws, jwk_privkey, 0, output, &output_len), RHN_OK);
+    ck_assert_int_eq(output_len, length);
+
+    ck_assert_int_eq(r_jws_init(&jws_verify), RHN_OK);
+    ck_assert_int_eq(r_jws_parsen(jws_verify, output, output_len, 0), RHN_OK);
+    ck_assert_int_eq(r_jws_verify_signature(jws_verify, jwk_pubkey, 0), RHN_OK);
+    ck_assert_int_eq(0, o_strncmp(HUGE_PAYLOAD, (const char *)r_jws_get_payload(jws_verify, NULL), o_strlen(HUGE_PAYLOAD)));
+
+    r_jws_free(jws_verify);
+    r_jws_free(jws);
+    r_jwk_free(jwk_privkey);
+    r_jwk_free(jwk_pubkey);
+  }
+
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jws_set_alg(jws, R_JWA_ALG_NONE), RHN_OK);
+  ck_assert_int_eq(r_jws_serialized_length(jws, NULL, 0), 0);
+  output_len = sizeof(output);
+  ck_assert_int_eq(r_jws_serialize_to(jws, NULL, 0, output, &output_len), RHN_ERROR_PARAM);
+  r_jws_free(jws);
+
+  // The length doesn't change the jws, serialize_to sets the same header values as r_jws_serialize but doesn't keep the encoded values
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_set_property_str(jwk_privkey, "alg", "RS256"), RHN_OK);
+  ck_assert_int_eq(r_jwk_set_property_str(jwk_privkey, "kid", "serialize_to"), RHN_OK);
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_gt(length = r_jws_serialized_length(jws, jwk_privkey, 0), 0);
+  ck_assert_int_eq(r_jws_get_alg(jws), R_JWA_ALG_UNKNOWN);
+  ck_assert_ptr_eq(NULL, r_jws_get_header_str_value(jws, "kid"));
+  output_len = length;
+  ck_assert_int_eq(r_jws_serialize_to(jws, jwk_privkey, 0, output, &output_len), RHN_OK);
+  ck_assert_int_eq(output_len, length);
+  ck_assert_int_eq(r_jws_get_alg(jws), R_JWA_ALG_RS256);
+  ck_assert_str_eq("serialize_to", r_jws_get_header_str_value(jws, "kid"));
+  ck_assert_ptr_eq(NULL, jws->header_b64url);
+  ck_assert_ptr_eq(NULL, jws->payload_b64url);
+  ck_assert_ptr_eq(NULL, jws->signature_b64url);
+  ck_assert_ptr_ne((token = r_jws_serialize(jws, jwk_privkey, 0)), NULL);
+  ck_assert_int_eq(o_strlen(token), length);
+  ck_assert_int_eq(0, o_strncmp(output, token, length));
+  o_free(token);
+  r_jws_free(jws);
+
+  // The key is taken from the jws private keys by kid
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jws_set_alg(jws, R_JWA_ALG_RS256), RHN_OK);
+  ck_assert_int_eq(r_jws_set_header_str_value(jws, "kid", "serialize_to"), RHN_OK);
+  ck_assert_int_eq(r_jws_add_keys(jws, jwk_privkey, NULL), RHN_OK);
+  output_len = sizeof(output);
+  ck_assert_int_eq(r_jws_serialize_to(jws, NULL, 0, output, &output_len), RHN_OK);
+  ck_assert_int_eq(output_len, length);
+  ck_assert_ptr_ne((token = r_jws_serialize(jws, NULL, 0)), NULL);
+  ck_assert_int_eq(0, o_strncmp(output, token, length));
+  o_free(token);
+  r_jws_free(jws);
+  r_jwk_free(jwk_privkey);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_copy)
 {
   jws_t * jws, * jws_copy;
@@ -1035,6 +1139,128 @@ START_TEST(test_rhonabwy_jwk_in_header_invalid)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_remote_resume)
+{
+  jws_t * jws, * jws_sign, * jws_other;
+  jwk_t * jwk_priv, * jwk_pub;
+  char * token, * jwks_str;
+  int type = 0;
+  
+  ck_assert_int_eq(r_jwk_init(&jwk_priv), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_priv, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jws_init(&jws_sign), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws_sign, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jws_set_alg(jws_sign, R_JWA_ALG_RS256), RHN_OK);
+  ck_assert_int_eq(r_jws_set_header_str_value(jws_sign, "jku", "https://www.example.com/jwks"), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jws_serialize(jws_sign, jwk_priv, 0));
+  ck_assert_ptr_ne(NULL, jwks_str = msprintf("{\"keys\":[%s]}", jwk_pubkey_rsa_str));
+  
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, token, R_FLAG_DEFER_REMOTE), RHN_OK);
+  ck_assert_int_eq(r_jws_remote_pending_size(jws), 1);
+  ck_assert_str_eq(r_jws_remote_pending_get_at(jws, 0, &type), "https://www.example.com/jwks");
+  ck_assert_int_eq(type, R_REMOTE_JKU);
+  ck_assert_ptr_eq(r_jws_remote_pending_get_at(jws, 1, &type), NULL);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_NEED_KEY);
+  
+  ck_assert_int_eq(r_jws_remote_resume(jws, "https://www.example.com/error", jwks_str, o_strlen(jwks_str)), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jws_remote_resume(jws, "https://www.example.com/jwks", jwks_str, o_strlen(jwks_str)), RHN_OK);
+  ck_assert_int_eq(r_jws_remote_pending_size(jws), 0);
+  ck_assert_int_eq(r_jwks_size(jws->jwks_pubkey), 1);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_OK);
+  
+  ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, token, R_FLAG_DEFER_REMOTE), RHN_OK);
+  ck_assert_int_eq(r_jws_remote_resume(jws, "https://www.example.com/jwks", NULL, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_remote_pending_size(jws), 0);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_ERROR_INVALID);
+  
+  // A key already available verifies the signature while urls are pending
+  ck_assert_int_eq(r_jwk_init(&jwk_pub), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pub, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, token, R_FLAG_DEFER_REMOTE), RHN_OK);
+  ck_assert_int_eq(r_jws_add_keys(jws, NULL, jwk_pub), RHN_OK);
+  ck_assert_int_eq(r_jws_remote_pending_size(jws), 1);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_OK);
+  
+  // A key that doesn't verify the signature leaves the pending urls to try
+  ck_assert_int_eq(r_jws_init(&jws_other), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws_other, token, R_FLAG_DEFER_REMOTE), RHN_OK);
+  r_jwk_free(jwk_pub);
+  ck_assert_int_eq(r_jwk_init(&jwk_pub), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pub, jwk_pubkey_ecdsa_str), RHN_OK);
+  ck_assert_int_eq(r_jws_add_keys(jws_other, NULL, jwk_pub), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws_other, NULL, 0), RHN_NEED_KEY);
+  r_jws_free(jws_other);
+  r_jwk_free(jwk_pub);
+  
+  o_free(token);
+  o_free(jwks_str);
+  r_jws_free(jws);
+  r_jws_free(jws_sign);
+  r_jwk_free(jwk_priv);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_reset)
+{
+  jws_t * jws, * jws_sign;
+  jwk_t * jwk_pub, * jwk_priv;
+  json_t * j_header;
+  char * token;
+  size_t payload_len = 0;
+  
+  ck_assert_int_eq(r_jwk_init(&jwk_pub), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_priv), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pub, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_priv, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jws_init(&jws_sign), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws_sign, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jws_set_alg(jws_sign, R_JWA_ALG_RS256), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jws_serialize(jws_sign, jwk_priv, 0));
+  
+  ck_assert_int_eq(r_jws_reset(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_add_keys(jws, NULL, jwk_pub), RHN_OK);
+  j_header = jws->j_header;
+  ck_assert_int_eq(r_jws_parse(jws, TOKEN_WITH_JWK_IN_HEADER, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jws->jwks_pubkey), 2);
+  ck_assert_ptr_eq(j_header, jws->j_header);
+  
+  ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+  ck_assert_ptr_eq(j_header, jws->j_header);
+  ck_assert_int_eq(json_object_size(jws->j_header), 0);
+  ck_assert_int_eq(r_jwks_size(jws->jwks_pubkey), 1);
+  ck_assert_int_eq(r_jws_get_alg(jws), R_JWA_ALG_UNKNOWN);
+  ck_assert_ptr_eq(NULL, r_jws_get_header_str_value(jws, "alg"));
+  ck_assert_ptr_eq(NULL, r_jws_get_payload(jws, &payload_len));
+  ck_assert_int_eq(payload_len, 0);
+  
+  // A key added between two parsed tokens isn't removed with the header keys
+  ck_assert_int_eq(r_jws_parse(jws, TOKEN_WITH_JWK_IN_HEADER, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_add_keys(jws, NULL, jwk_priv), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, TOKEN_WITH_JWK_IN_HEADER, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jws->jwks_pubkey), 4);
+  ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jws->jwks_pubkey), 2);
+  ck_assert_int_eq(r_jwks_remove_at(jws->jwks_pubkey, 1), RHN_OK);
+  
+  ck_assert_int_eq(r_jws_parse(jws, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jws->jwks_pubkey), 1);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_OK);
+  
+  o_free(token);
+  r_jws_free(jws);
+  r_jws_free(jws_sign);
+  r_jwk_free(jwk_pub);
+  r_jwk_free(jwk_priv);
+}
+END_TEST
+
 #ifdef R_WITH_CURL
 static char * get_file_content(const char * file_path) {
   char * buffer = NULL;
@@ -1076,6 +1302,66 @@ int callback_jku_ecdsa_crt (const struct _u_request * request, struct _u_respons
   return U_CALLBACK_CONTINUE;
 }
 
+START_TEST(test_rhonabwy_shared_jwks)
+{
+  jws_t * jws_sign, * jws_verify, * jws_copy;
+  jwks_t * jwks_privkey, * jwks_pubkey;
+  jwks_shared_t * shared_privkey, * shared_pubkey;
+  jwk_t * jwk;
+  char * token, * token_json;
+  
+  // The shared key sets themselves are tested in jwks_core, only their use by a jws_t is tested here
+  ck_assert_ptr_ne(NULL, jwks_privkey = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_privkey_ecdsa_str, R_IMPORT_JSON_STR, jwk_privkey_rsa_str, R_IMPORT_NONE));
+  ck_assert_ptr_ne(NULL, jwks_pubkey = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_pubkey_ecdsa_str, R_IMPORT_JSON_STR, jwk_pubkey_rsa_str, R_IMPORT_NONE));
+  ck_assert_ptr_ne(NULL, shared_privkey = r_jwks_shared_new(jwks_privkey));
+  ck_assert_ptr_ne(NULL, shared_pubkey = r_jwks_shared_new(jwks_pubkey));
+  ck_assert_int_eq(r_jws_set_shared_jwks(NULL, shared_privkey, shared_pubkey), RHN_ERROR_PARAM);
+  
+  // The signing key is selected by the kid header in the shared set
+  ck_assert_int_eq(r_jws_init(&jws_sign), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws_sign, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jws_set_alg(jws_sign, R_JWA_ALG_RS256), RHN_OK);
+  ck_assert_int_eq(r_jws_set_shared_jwks(jws_sign, shared_privkey, NULL), RHN_OK);
+  ck_assert_ptr_eq(NULL, r_jws_serialize(jws_sign, NULL, 0));
+  ck_assert_int_eq(r_jws_set_header_str_value(jws_sign, "kid", "2011-04-29"), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jws_serialize(jws_sign, NULL, 0));
+  
+  // A copy holds its own reference to the shared set
+  ck_assert_int_eq(r_jws_init(&jws_verify), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws_verify, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws_verify, NULL, 0), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jws_set_shared_jwks(jws_verify, NULL, shared_pubkey), RHN_OK);
+  ck_assert_ptr_ne(NULL, jws_copy = r_jws_copy(jws_verify));
+  r_jws_free(jws_verify);
+  ck_assert_int_eq(r_jws_verify_signature(jws_copy, NULL, 0), RHN_OK);
+  r_jws_free(jws_copy);
+  
+  // Without kid, every key of the shared set is tried
+  ck_assert_ptr_ne(NULL, jwk = r_jwk_quick_import(R_IMPORT_JSON_STR, jwk_privkey_rsa_str));
+  ck_assert_int_eq(r_jwk_delete_property_str(jwk, "kid"), RHN_OK);
+  ck_assert_int_eq(r_jwks_empty(jwks_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwks_append_jwk(jwks_privkey, jwk), RHN_OK);
+  r_jwk_free(jwk);
+  ck_assert_int_eq(r_jws_set_shared_jwks(jws_sign, NULL, NULL), RHN_OK);
+  ck_assert_int_eq(r_jws_set_header_str_value(jws_sign, "kid", NULL), RHN_OK);
+  ck_assert_ptr_ne(NULL, token_json = r_jws_serialize_json_str(jws_sign, jwks_privkey, 0, R_JSON_MODE_GENERAL));
+  ck_assert_ptr_eq(NULL, o_strstr(token_json, "\"kid\""));
+  ck_assert_int_eq(r_jws_init(&jws_verify), RHN_OK);
+  ck_assert_int_eq(r_jws_parse_json_str(jws_verify, token_json, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_set_shared_jwks(jws_verify, NULL, shared_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws_verify, NULL, 0), RHN_OK);
+  r_jws_free(jws_verify);
+  
+  o_free(token);
+  o_free(token_json);
+  r_jws_free(jws_sign);
+  r_jwks_shared_free(shared_privkey);
+  r_jwks_shared_free(shared_pubkey);
+  r_jwks_free(jwks_privkey);
+  r_jwks_free(jwks_pubkey);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_advanced_parse)
 {
   jwk_t * jwk_pub;
@@ -1378,6 +1664,7 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_token_unsecure);
   tcase_add_test(tc_core, test_rhonabwy_token_parse_unsecure);
   tcase_add_test(tc_core, test_rhonabwy_token_serialize_unsecure);
+  tcase_add_test(tc_core, test_rhonabwy_token_serialize_to);
   tcase_add_test(tc_core, test_rhonabwy_copy);
   tcase_add_test(tc_core, test_rhonabwy_set_properties_error);
   tcase_add_test(tc_core, test_rhonabwy_set_properties);
@@ -1385,6 +1672,9 @@ static Suite *rhonabwy_suite(void)
 #if GNUTLS_VERSION_NUMBER >= 0x030600
   tcase_add_test(tc_core, test_rhonabwy_jwk_in_header);
   tcase_add_test(tc_core, test_rhonabwy_jwk_in_header_invalid);
+  tcase_add_test(tc_core, test_rhonabwy_reset);
+  tcase_add_test(tc_core, test_rhonabwy_remote_resume);
+  tcase_add_test(tc_core, test_rhonabwy_shared_jwks);
 #ifdef R_WITH_CURL
   tcase_add_test(tc_core, test_rhonabwy_advanced_parse);
   tcase_add_test(tc_core, test_rhonabwy_quick_parse);
@@ -1,6 +1,7 @@
 /* Public domain, no copyright. Use at your own risk. */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <gnutls/abstract.h>
 #include <gnutls/x509.h>
 
@@ -1373,6 +1374,429 @@ int callback_jku_ecdsa_crt (const struct _u_request * request, struct _u_respons
   return U_CALLBACK_CONTINUE;
 }
 
+START_TEST(test_rhonabwy_shared_jwks)
+{
+  jwt_t * jwt, * jwt_parsed, * jwt_copy;
+  jwks_t * jwks;
+  jwks_shared_t * sign_privkey, * sign_pubkey, * enc_privkey, * enc_pubkey;
+  char * token;
+  
+  // The shared key sets themselves are tested in jwks_core, only their use by a jwt_t is tested here
+  ck_assert_ptr_ne(NULL, jwks = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_privkey_ecdsa_str, R_IMPORT_NONE));
+  ck_assert_ptr_ne(NULL, sign_privkey = r_jwks_shared_new(jwks));
+  r_jwks_free(jwks);
+  ck_assert_ptr_ne(NULL, jwks = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_pubkey_ecdsa_str, R_IMPORT_NONE));
+  ck_assert_ptr_ne(NULL, sign_pubkey = r_jwks_shared_new(jwks));
+  r_jwks_free(jwks);
+  ck_assert_ptr_ne(NULL, jwks = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_privkey_rsa_str, R_IMPORT_NONE));
+  ck_assert_ptr_ne(NULL, enc_privkey = r_jwks_shared_new(jwks));
+  r_jwks_free(jwks);
+  ck_assert_ptr_ne(NULL, jwks = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_pubkey_rsa_str, R_IMPORT_NONE));
+  ck_assert_ptr_ne(NULL, enc_pubkey = r_jwks_shared_new(jwks));
+  r_jwks_free(jwks);
+  
+  ck_assert_int_eq(r_jwt_set_sign_shared_jwks(NULL, sign_privkey, sign_pubkey), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_set_enc_shared_jwks(NULL, enc_privkey, enc_pubkey), RHN_ERROR_PARAM);
+  
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "str", CLAIM_STR), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_ES256), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_enc_alg(jwt, R_JWA_ALG_RSA_OAEP_256), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_enc(jwt, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_shared_jwks(jwt, sign_privkey, NULL), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_enc_shared_jwks(jwt, NULL, enc_pubkey), RHN_OK);
+  
+  // The shared sets are kept by reference, a copy holds its own reference
+  ck_assert_ptr_ne(NULL, jwt_copy = r_jwt_copy(jwt));
+  r_jwt_free(jwt);
+  r_jwks_shared_free(sign_privkey);
+  r_jwks_shared_free(enc_pubkey);
+  ck_assert_ptr_ne(NULL, token = r_jwt_serialize_nested(jwt_copy, R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT, NULL, 0, NULL, 0));
+  r_jwt_free(jwt_copy);
+  
+  ck_assert_int_eq(r_jwt_init(&jwt_parsed), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt_parsed, token, 0), RHN_OK);
+  ck_assert_int_ne(r_jwt_decrypt_verify_signature_nested(jwt_parsed, NULL, 0, NULL, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_shared_jwks(jwt_parsed, NULL, sign_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_enc_shared_jwks(jwt_parsed, enc_privkey, NULL), RHN_OK);
+  r_jwks_shared_free(sign_pubkey);
+  r_jwks_shared_free(enc_privkey);
+  ck_assert_int_eq(r_jwt_decrypt_verify_signature_nested(jwt_parsed, NULL, 0, NULL, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt_parsed, "str"), CLAIM_STR);
+  r_jwt_free(jwt_parsed);
+  
+  o_free(token);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_verify_compact)
+{
+  jwt_t * jwt;
+  jwks_t * jwks;
+  jwks_shared_t * shared_ecdsa, * shared_rsa;
+  json_t * j_claims = NULL, * j_value;
+  char * token, * large_value;
+  
+  ck_assert_ptr_ne(NULL, jwks = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_pubkey_ecdsa_str, R_IMPORT_NONE));
+  ck_assert_ptr_ne(NULL, shared_ecdsa = r_jwks_shared_new(jwks));
+  r_jwks_free(jwks);
+  ck_assert_ptr_ne(NULL, jwks = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_pubkey_rsa_str, R_IMPORT_NONE));
+  ck_assert_ptr_ne(NULL, shared_rsa = r_jwks_shared_new(jwks));
+  r_jwks_free(jwks);
+  
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claims(jwt, R_JWT_CLAIM_ISS, JWT_CLAIM_ISS, R_JWT_CLAIM_EXP, time(NULL)+JWT_CLAIM_EXP, R_JWT_CLAIM_STR, "str", CLAIM_STR, R_JWT_CLAIM_NOP), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_ES256), RHN_OK);
+  ck_assert_int_eq(r_jwt_add_sign_keys_json_str(jwt, jwk_privkey_ecdsa_str, NULL), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jwt_serialize_signed(jwt, NULL, 0));
+  
+  ck_assert_int_eq(r_jwt_verify_compact(NULL, 0, shared_ecdsa, NULL, R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_verify_compact(token, o_strlen(token), NULL, NULL, R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_verify_compact(token, o_strlen(token), shared_ecdsa, NULL, R_JWT_CLAIM_NOP), RHN_OK);
+  ck_assert_int_eq(r_jwt_verify_compact(token, o_strlen(token), shared_rsa, &j_claims, R_JWT_CLAIM_NOP), RHN_ERROR_INVALID);
+  ck_assert_ptr_eq(NULL, j_claims);
+  ck_assert_int_eq(r_jwt_verify_compact(token, o_strlen(token)-2, shared_ecdsa, NULL, R_JWT_CLAIM_NOP), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jwt_verify_compact(token, o_strlen(token), shared_ecdsa, &j_claims, R_JWT_CLAIM_ISS, "error", R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  ck_assert_ptr_eq(NULL, j_claims);
+  ck_assert_int_eq(r_jwt_verify_compact(token, o_strlen(token), shared_ecdsa, &j_claims, R_JWT_CLAIM_ISS, JWT_CLAIM_ISS, R_JWT_CLAIM_EXP, R_JWT_CLAIM_NOW, R_JWT_CLAIM_STR, "str", CLAIM_STR, R_JWT_CLAIM_NOP), RHN_OK);
+  ck_assert_ptr_ne(NULL, j_claims);
+  ck_assert_str_eq(json_string_value(json_object_get(j_claims, "str")), CLAIM_STR);
+  json_decref(j_claims);
+  
+  // The R_JWT_CLAIM_JSN values are released on every path
+  ck_assert_ptr_ne(NULL, j_value = json_string(CLAIM_STR));
+  ck_assert_int_eq(r_jwt_verify_compact(token, o_strlen(token), shared_rsa, NULL, R_JWT_CLAIM_JSN, "str", json_incref(j_value), R_JWT_CLAIM_NOP), RHN_ERROR_INVALID);
+  ck_assert_int_eq(j_value->refcount, 1);
+  ck_assert_int_eq(r_jwt_verify_compact(token, o_strlen(token), shared_ecdsa, NULL, R_JWT_CLAIM_ISS, "error", R_JWT_CLAIM_INT, "int", 42, R_JWT_CLAIM_JSN, "str", json_incref(j_value), R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  ck_assert_int_eq(j_value->refcount, 1);
+  ck_assert_int_eq(r_jwt_verify_compact(token, o_strlen(token), shared_ecdsa, NULL, R_JWT_CLAIM_JSN, "str", json_incref(j_value), R_JWT_CLAIM_NOP), RHN_OK);
+  ck_assert_int_eq(j_value->refcount, 1);
+  ck_assert_int_eq(r_jwt_validate_claims(NULL, R_JWT_CLAIM_JSN, "str", json_incref(j_value), R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  ck_assert_int_eq(j_value->refcount, 1);
+  json_decref(j_value);
+  o_free(token);
+  
+  // A token larger than the stack buffer
+  large_value = o_malloc(8193);
+  memset(large_value, 'a', 8192);
+  large_value[8192] = '\0';
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "large", large_value), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jwt_serialize_signed(jwt, NULL, 0));
+  ck_assert_int_eq(r_jwt_verify_compact(token, o_strlen(token), shared_ecdsa, &j_claims, R_JWT_CLAIM_STR, "large", large_value, R_JWT_CLAIM_NOP), RHN_OK);
+  json_decref(j_claims);
+  o_free(token);
+  o_free(large_value);
+  
+  ck_assert_int_eq(r_jwt_verify_compact(TOKEN_UNSECURE, o_strlen(TOKEN_UNSECURE), shared_ecdsa, NULL, R_JWT_CLAIM_NOP), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jwt_verify_compact(TOKEN_ENC, o_strlen(TOKEN_ENC), shared_rsa, NULL, R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_verify_compact(TOKEN_INVALID_HEADER_B64, o_strlen(TOKEN_INVALID_HEADER_B64), shared_rsa, NULL, R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  
+  r_jwt_free(jwt);
+  r_jwks_shared_free(shared_ecdsa);
+  r_jwks_shared_free(shared_rsa);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_peek)
+{
+  jwt_t * jwt;
+  char * token, buffer[256], small_buffer[8], * exp_str;
+  const char * alg, * kid, * typ, * x5u, * iss, * exp, * str, * obj, * nil, * verified;
+  struct _o_datum dat = {0, NULL};
+  const char zip_header[] = "{\"alg\":\"HS256\",\"zip\":\"DEF\"}";
+  const char escaped_header[] = "{ \"x5c\" : [\"a\", {\"b\": [1, 2.5e3]}], \"\\u006bid\" : \"\\u00e9\\ud83d\\ude00\\n\", \"alg\":\"HS256\" }";
+  const char duplicate_header[] = "{\"kid\":\"first\",\"alg\":\"HS256\",\"kid\":\"last\"}", duplicate_claims[] = "{\"iss\":\"first\",\"iss\":\"last\"}";
+  struct _o_datum dat_claims = {0, NULL};
+  rhn_int_t exp_value = time(NULL)+JWT_CLAIM_EXP;
+  
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_header_str_value(jwt, "typ", JWT_CLAIM_TYP), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_header_str_value(jwt, "kid", "1"), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claims(jwt, R_JWT_CLAIM_ISS, JWT_CLAIM_ISS, R_JWT_CLAIM_EXP, exp_value, R_JWT_CLAIM_STR, "str", "q\"uot\\e \xc3\xa9 \xf0\x9f\x98\x80", R_JWT_CLAIM_JSN, "obj", json_pack("{s[is]}", "a", 1, "}"), R_JWT_CLAIM_JSN, "nil", json_null(), R_JWT_CLAIM_JSN, "verified", JWT_CLAIM_VERIFIED, R_JWT_CLAIM_NOP), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_ES256), RHN_OK);
+  ck_assert_int_eq(r_jwt_add_sign_keys_json_str(jwt, jwk_privkey_ecdsa_str, NULL), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jwt_serialize_signed(jwt, NULL, 0));
+  
+  ck_assert_int_eq(r_jwt_peek_header(token, o_strlen(token), buffer, sizeof(buffer), "alg", &alg, "kid", &kid, "typ", &typ, "x5u", &x5u, NULL), RHN_OK);
+  ck_assert_str_eq(alg, "ES256");
+  ck_assert_str_eq(kid, "1");
+  ck_assert_str_eq(typ, JWT_CLAIM_TYP);
+  ck_assert_ptr_eq(x5u, NULL);
+  ck_assert_int_eq(r_jwt_peek_header(token, o_strlen(token), small_buffer, sizeof(small_buffer), "alg", &alg, "typ", &typ, NULL), RHN_ERROR_PARAM);
+  
+  ck_assert_int_eq(r_jwt_peek_claims(token, o_strlen(token), buffer, sizeof(buffer), "iss", &iss, "exp", &exp, "str", &str, "obj", &obj, "nil", &nil, "verified", &verified, NULL), RHN_OK);
+  ck_assert_str_eq(iss, JWT_CLAIM_ISS);
+  exp_str = msprintf("%lld", (long long)exp_value);
+  ck_assert_str_eq(exp, exp_str);
+  o_free(exp_str);
+  ck_assert_str_eq(str, "q\"uot\\e \xc3\xa9 \xf0\x9f\x98\x80");
+  ck_assert_ptr_eq(obj, NULL);
+  ck_assert_ptr_eq(nil, NULL);
+  ck_assert_str_eq(verified, "true");
+  ck_assert_int_eq(r_jwt_peek_claims(token, o_strlen(token), small_buffer, sizeof(small_buffer), "iss", &iss, NULL), RHN_ERROR_PARAM);
+  o_free(token);
+  
+  // Encrypted tokens only have a readable header
+  ck_assert_int_eq(r_jwt_peek_header(TOKEN_ENC, o_strlen(TOKEN_ENC), buffer, sizeof(buffer), "alg", &alg, "enc", &str, NULL), RHN_OK);
+  ck_assert_str_eq(alg, "RSA1_5");
+  ck_assert_str_eq(str, "A128CBC-HS256");
+  ck_assert_int_eq(r_jwt_peek_claims(TOKEN_ENC, o_strlen(TOKEN_ENC), buffer, sizeof(buffer), "iss", &iss, NULL), RHN_ERROR_UNSUPPORTED);
+  ck_assert_ptr_eq(iss, NULL);
+  
+  // Compressed payloads aren't read
+  ck_assert_int_eq(o_base64url_encode_alloc((const unsigned char *)zip_header, o_strlen(zip_header), &dat), 1);
+  token = msprintf("%.*s.e30.c2ln", (int)dat.size, dat.data);
+  ck_assert_int_eq(r_jwt_peek_claims(token, o_strlen(token), buffer, sizeof(buffer), "iss", &iss, NULL), RHN_ERROR_UNSUPPORTED);
+  o_free(token);
+  o_free(dat.data);
+  
+  // Escaped names and values
+  ck_assert_int_eq(o_base64url_encode_alloc((const unsigned char *)escaped_header, o_strlen(escaped_header), &dat), 1);
+  token = msprintf("%.*s.e30.c2ln", (int)dat.size, dat.data);
+  ck_assert_int_eq(r_jwt_peek_header(token, o_strlen(token), buffer, sizeof(buffer), "alg", &alg, "kid", &kid, NULL), RHN_OK);
+  ck_assert_str_eq(alg, "HS256");
+  ck_assert_str_eq(kid, "\xc3\xa9\xf0\x9f\x98\x80\n");
+  o_free(token);
+  o_free(dat.data);
+  
+  // Duplicate members return the last value, as jansson keeps it when the token is parsed
+  ck_assert_int_eq(o_base64url_encode_alloc((const unsigned char *)duplicate_header, o_strlen(duplicate_header), &dat), 1);
+  ck_assert_int_eq(o_base64url_encode_alloc((const unsigned char *)duplicate_claims, o_strlen(duplicate_claims), &dat_claims), 1);
+  token = msprintf("%.*s.%.*s.c2ln", (int)dat.size, dat.data, (int)dat_claims.size, dat_claims.data);
+  ck_assert_int_eq(r_jwt_peek_header(token, o_strlen(token), buffer, sizeof(buffer), "kid", &kid, "alg", &alg, NULL), RHN_OK);
+  ck_assert_str_eq(kid, "last");
+  ck_assert_str_eq(alg, "HS256");
+  ck_assert_int_eq(r_jwt_peek_claims(token, o_strlen(token), buffer, sizeof(buffer), "iss", &iss, NULL), RHN_OK);
+  ck_assert_str_eq(iss, "last");
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_header_str_value(jwt, "kid"), kid);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "iss"), iss);
+  o_free(token);
+  o_free(dat.data);
+  o_free(dat_claims.data);
+  
+  ck_assert_int_eq(r_jwt_peek_header(NULL, 0, buffer, sizeof(buffer), "alg", &alg, NULL), RHN_ERROR_PARAM);
+  ck_assert_ptr_eq(alg, NULL);
+  ck_assert_int_eq(r_jwt_peek_header(TOKEN_INVALID_HEADER_B64, o_strlen(TOKEN_INVALID_HEADER_B64), buffer, sizeof(buffer), "alg", &alg, NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_peek_header(TOKEN_INVALID_HEADER, o_strlen(TOKEN_INVALID_HEADER), buffer, sizeof(buffer), "alg", &alg, "kid", &kid, NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_peek_claims(TOKEN_INVALID_CLAIMS_B64, o_strlen(TOKEN_INVALID_CLAIMS_B64), buffer, sizeof(buffer), "iss", &iss, NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_peek_claims(TOKEN_INVALID_DOTS, o_strlen(TOKEN_INVALID_DOTS), buffer, sizeof(buffer), "iss", &iss, NULL), RHN_ERROR_PARAM);
+  
+  r_jwt_free(jwt);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_lazy_claims)
+{
+  jwt_t * jwt, * jwt_copy;
+  json_t * j_claims, * j_aud;
+  char * token, * claims_str;
+  struct _o_datum dat = {0, NULL};
+  const char claims[] = "{\"iss\":\"first\",\"exp\":\"soon\",\"iss\":\"" JWT_CLAIM_ISS "\",\"nbf\":12,\"aud\":[\"a\",\"b\"],\"sub\":null,\"iat\":1.5,\"data\":{\"iss\":\"nested\"}}";
+  const char invalid_claims[] = "{\"iss\":\"" JWT_CLAIM_ISS "\",";
+  const char long_number_claims[] = "{\"iss\":\"" JWT_CLAIM_ISS "\",\"data\":0.12345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890}";
+  const char * rejected_claims[] = {
+    "{\"iss\":\"a\\u0000b\",\"exp\":1}",
+    "{\"iss\":\"a\",\"exp\":99999999999999999999}",
+    "{\"iss\":\"a\",\"exp\":-99999999999999999999}",
+    "{\"iss\":\"a\",\"exp\":1,\"data\":1e999}",
+    "{\"iss\":\"a\",\"exp\":1,\"data\":01}",
+    "{\"iss\":\"a\",\"exp\":1,\"data\":tru}",
+    "{\"iss\":\"a\",\"exp\":1,\"data\":[1 2]}",
+    "{\"iss\":\"a\",\"exp\":1,\"data\":[1,]}",
+    "{\"iss\":\"a\",\"exp\":1,\"data\":{\"a\" 1}}",
+    "{\"iss\":\"a\",\"exp\":1,\"data\":{\"a\":1,}}",
+    "{\"iss\":\"a\",\"exp\":1,\"data\":{1:1}}",
+    "{\"iss\":\"a\",\"exp\":1,\"data\":\"\xc0\xaf\"}",
+    "{\"iss\":\"a\",\"exp\":1,\"data\":\"\xed\xa0\x80\"}"
+  };
+  size_t i;
+  
+  ck_assert_int_eq(o_base64url_encode_alloc((const unsigned char *)claims, o_strlen(claims), &dat), 1);
+  token = msprintf("eyJhbGciOiJub25lIn0.%.*s.", (int)dat.size, dat.data);
+  o_free(dat.data);
+  
+  // Registered claims are read without loading the claims
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_advanced_parse(jwt, token, R_PARSE_UNSIGNED|R_PARSE_LAZY_CLAIMS, 0), RHN_OK);
+  ck_assert_ptr_eq(jwt->j_claims, NULL);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "iss"), JWT_CLAIM_ISS);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "exp"), "soon");
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "exp"), 0);
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "nbf"), 12);
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "iat"), 0);
+  ck_assert_ptr_eq(r_jwt_get_claim_str_value(jwt, "nbf"), NULL);
+  ck_assert_ptr_eq(r_jwt_get_claim_str_value(jwt, "aud"), NULL);
+  ck_assert_ptr_eq(r_jwt_get_claim_str_value(jwt, "sub"), NULL);
+  ck_assert_ptr_eq(r_jwt_get_claim_str_value(jwt, "jti"), NULL);
+  ck_assert_int_eq(r_jwt_validate_claims(jwt, R_JWT_CLAIM_ISS, JWT_CLAIM_ISS, R_JWT_CLAIM_NBF, R_JWT_CLAIM_NOW, R_JWT_CLAIM_INT, "nbf", 12, R_JWT_CLAIM_NOP), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims(jwt, R_JWT_CLAIM_EXP, R_JWT_CLAIM_PRESENT, R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_validate_claims(jwt, R_JWT_CLAIM_SUB, NULL, R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  ck_assert_ptr_eq(jwt->j_claims, NULL);
+  
+  // Other claims load the claims
+  ck_assert_int_eq(r_jwt_validate_claims(jwt, R_JWT_CLAIM_JSN, "aud", json_pack("[ss]", "a", "b"), R_JWT_CLAIM_NOP), RHN_OK);
+  ck_assert_ptr_ne(jwt->j_claims, NULL);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "iss"), JWT_CLAIM_ISS);
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "nbf"), 12);
+  r_jwt_free(jwt);
+  
+  ck_assert_ptr_ne(NULL, jwt = r_jwt_quick_parse(token, R_PARSE_UNSIGNED|R_PARSE_LAZY_CLAIMS, 0));
+  ck_assert_ptr_ne(NULL, j_aud = r_jwt_get_claim_json_t_value(jwt, "aud"));
+  ck_assert_int_eq(json_array_size(j_aud), 2);
+  json_decref(j_aud);
+  r_jwt_free(jwt);
+  
+  ck_assert_ptr_ne(NULL, jwt = r_jwt_quick_parse(token, R_PARSE_UNSIGNED|R_PARSE_LAZY_CLAIMS, 0));
+  ck_assert_ptr_ne(NULL, j_claims = r_jwt_get_full_claims_json_t(jwt));
+  ck_assert_str_eq(json_string_value(json_object_get(j_claims, "iss")), JWT_CLAIM_ISS);
+  ck_assert_str_eq(json_string_value(json_object_get(json_object_get(j_claims, "data"), "iss")), "nested");
+  json_decref(j_claims);
+  r_jwt_free(jwt);
+  
+  // Copy, set and serialize a lazy token
+  ck_assert_ptr_ne(NULL, jwt = r_jwt_quick_parse(token, R_PARSE_UNSIGNED|R_PARSE_LAZY_CLAIMS, 0));
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "iss"), JWT_CLAIM_ISS);
+  ck_assert_ptr_ne(NULL, jwt_copy = r_jwt_copy(jwt));
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt_copy, "iss"), JWT_CLAIM_ISS);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt_copy, "exp"), "soon");
+  r_jwt_free(jwt_copy);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "sub", JWT_CLAIM_SUB), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "sub"), JWT_CLAIM_SUB);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_HS256), RHN_OK);
+  ck_assert_int_eq(r_jwt_add_sign_key_symmetric(jwt, symmetric_key, sizeof(symmetric_key)), RHN_OK);
+  o_free(token);
+  ck_assert_ptr_ne(NULL, token = r_jwt_serialize_signed(jwt, NULL, 0));
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "sub"), JWT_CLAIM_SUB);
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "nbf"), 12);
+  ck_assert_int_eq(r_jwt_advanced_parse(jwt, token, R_PARSE_LAZY_CLAIMS, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt, NULL, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "sub"), JWT_CLAIM_SUB);
+  ck_assert_ptr_ne(NULL, claims_str = r_jwt_get_full_claims_str(jwt));
+  o_free(claims_str);
+  ck_assert_int_eq(r_jwt_reset(jwt), RHN_OK);
+  ck_assert_ptr_eq(r_jwt_get_claim_str_value(jwt, "sub"), NULL);
+  o_free(token);
+  
+  // Invalid claims are detected when they're read
+  ck_assert_int_eq(o_base64url_encode_alloc((const unsigned char *)invalid_claims, o_strlen(invalid_claims), &dat), 1);
+  token = msprintf("eyJhbGciOiJub25lIn0.%.*s.", (int)dat.size, dat.data);
+  o_free(dat.data);
+  ck_assert_int_eq(r_jwt_advanced_parse(jwt, token, R_PARSE_UNSIGNED, 0), RHN_ERROR);
+  ck_assert_int_eq(r_jwt_advanced_parse(jwt, token, R_PARSE_UNSIGNED|R_PARSE_LAZY_CLAIMS, 0), RHN_OK);
+  ck_assert_ptr_eq(r_jwt_get_claim_str_value(jwt, "iss"), NULL);
+  ck_assert_ptr_eq(r_jwt_get_full_claims_json_t(jwt), NULL);
+  ck_assert_int_eq(r_jwt_validate_claims(jwt, R_JWT_CLAIM_ISS, JWT_CLAIM_ISS, R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_advanced_parse(jwt, token, R_PARSE_UNSIGNED|R_PARSE_LAZY_CLAIMS, 0), RHN_OK);
+  ck_assert_ptr_ne(NULL, j_aud = json_string("a"));
+  ck_assert_int_eq(r_jwt_validate_claims(jwt, R_JWT_CLAIM_JSN, "aud", json_incref(j_aud), R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  ck_assert_int_eq(j_aud->refcount, 1);
+  json_decref(j_aud);
+  o_free(token);
+  
+  // The payloads rejected by jansson are rejected by the scanner
+  for (i=0; i<sizeof(rejected_claims)/sizeof(rejected_claims[0]); i++) {
+    ck_assert_int_eq(o_base64url_encode_alloc((const unsigned char *)rejected_claims[i], o_strlen(rejected_claims[i]), &dat), 1);
+    token = msprintf("eyJhbGciOiJub25lIn0.%.*s.", (int)dat.size, dat.data);
+    o_free(dat.data);
+    ck_assert_int_eq(r_jwt_advanced_parse(jwt, token, R_PARSE_UNSIGNED, 0), RHN_ERROR);
+    ck_assert_int_eq(r_jwt_advanced_parse(jwt, token, R_PARSE_UNSIGNED|R_PARSE_LAZY_CLAIMS, 0), RHN_OK);
+    ck_assert_ptr_eq(r_jwt_get_claim_str_value(jwt, "iss"), NULL);
+    ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "exp"), 0);
+    o_free(token);
+  }
+  
+  // A valid payload the scanner can't validate is loaded by jansson
+  ck_assert_int_eq(o_base64url_encode_alloc((const unsigned char *)long_number_claims, o_strlen(long_number_claims), &dat), 1);
+  token = msprintf("eyJhbGciOiJub25lIn0.%.*s.", (int)dat.size, dat.data);
+  o_free(dat.data);
+  ck_assert_int_eq(r_jwt_advanced_parse(jwt, token, R_PARSE_UNSIGNED|R_PARSE_LAZY_CLAIMS, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "iss"), JWT_CLAIM_ISS);
+  ck_assert_ptr_ne(jwt->j_claims, NULL);
+  o_free(token);
+  r_jwt_free(jwt);
+}
+END_TEST
+
+struct claims_struct {
+  char      iss[32];
+  char      sub[16];
+  rhn_int_t exp;
+  rhn_int_t age;
+  int       verified;
+  char      scope[8];
+  rhn_int_t missing;
+};
+
+START_TEST(test_rhonabwy_claims_struct)
+{
+  jwt_t * jwt;
+  jwt_claims_schema_t * schema;
+  struct claims_struct claims;
+  char * token;
+  uint64_t present;
+  uint32_t parse_flags[2] = {R_PARSE_NONE, R_PARSE_LAZY_CLAIMS};
+  size_t i;
+  rhn_claim_desc desc[] = {
+    {"iss", R_CLAIM_TYPE_STR, offsetof(struct claims_struct, iss), sizeof(((struct claims_struct *)0)->iss)},
+    {"sub", R_CLAIM_TYPE_STR, offsetof(struct claims_struct, sub), sizeof(((struct claims_struct *)0)->sub)},
+    {"exp", R_CLAIM_TYPE_INT, offsetof(struct claims_struct, exp), 0},
+    {"age", R_CLAIM_TYPE_INT, offsetof(struct claims_struct, age), 0},
+    {"verified", R_CLAIM_TYPE_BOOL, offsetof(struct claims_struct, verified), 0},
+    {"scope", R_CLAIM_TYPE_STR, offsetof(struct claims_struct, scope), sizeof(((struct claims_struct *)0)->scope)},
+    {"missing", R_CLAIM_TYPE_INT, offsetof(struct claims_struct, missing), 0}
+  };
+  rhn_claim_desc desc_invalid[] = {
+    {"iss", R_CLAIM_TYPE_STR, offsetof(struct claims_struct, iss), 0},
+    {"iss", R_CLAIM_TYPE_INT, offsetof(struct claims_struct, exp), 0}
+  };
+  
+  ck_assert_ptr_eq(r_jwt_claims_schema_new(NULL, 1), NULL);
+  ck_assert_ptr_eq(r_jwt_claims_schema_new(desc, 0), NULL);
+  ck_assert_ptr_eq(r_jwt_claims_schema_new(desc_invalid, 1), NULL);
+  desc_invalid[0].max_len = 8;
+  ck_assert_ptr_eq(r_jwt_claims_schema_new(desc_invalid, 2), NULL);
+  ck_assert_ptr_ne(schema = r_jwt_claims_schema_new(desc, sizeof(desc)/sizeof(rhn_claim_desc)), NULL);
+  
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claims(jwt, R_JWT_CLAIM_ISS, JWT_CLAIM_ISS, R_JWT_CLAIM_SUB, JWT_CLAIM_SUB, R_JWT_CLAIM_EXP, 1234, R_JWT_CLAIM_STR, "age", "42", R_JWT_CLAIM_JSN, "verified", JWT_CLAIM_VERIFIED, R_JWT_CLAIM_STR, "scope", JWT_CLAIM_SCOPE, R_JWT_CLAIM_NOP), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_HS256), RHN_OK);
+  ck_assert_int_eq(r_jwt_add_sign_key_symmetric(jwt, symmetric_key, sizeof(symmetric_key)), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jwt_serialize_signed(jwt, NULL, 0));
+  
+  // Same result with the claims loaded or read from the payload
+  for (i=0; i<2; i++) {
+    memset(&claims, 0xff, sizeof(struct claims_struct));
+    ck_assert_int_eq(r_jwt_advanced_parse(jwt, token, parse_flags[i], 0), RHN_OK);
+    ck_assert_int_eq(r_jwt_get_claims_struct(jwt, schema, &claims, &present), RHN_OK);
+    ck_assert_str_eq(claims.iss, JWT_CLAIM_ISS);
+    ck_assert_str_eq(claims.sub, JWT_CLAIM_SUB);
+    ck_assert_int_eq(claims.exp, 1234);
+    ck_assert_int_eq(claims.age, 0);
+    ck_assert_int_eq(claims.verified, 1);
+    ck_assert_str_eq(claims.scope, JWT_CLAIM_SCOPE);
+    ck_assert_int_eq(claims.missing, 0);
+    ck_assert_int_eq(present, 0x37);
+  }
+  ck_assert_ptr_eq(jwt->j_claims, NULL);
+  
+  // A string value longer than its member is an error
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "scope", "scope_too_long"), RHN_OK);
+  ck_assert_int_eq(r_jwt_get_claims_struct(jwt, schema, &claims, &present), RHN_ERROR_PARAM);
+  ck_assert_str_eq(claims.scope, "");
+  ck_assert_int_eq(present, 0x17);
+  
+  ck_assert_int_eq(r_jwt_get_claims_struct(NULL, schema, &claims, &present), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_get_claims_struct(jwt, NULL, &claims, &present), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_get_claims_struct(jwt, schema, NULL, NULL), RHN_ERROR_PARAM);
+  
+  o_free(token);
+  r_jwt_free(jwt);
+  r_jwt_claims_schema_free(schema);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_advanced_parse)
 {
   jwk_t * jwk_pub, * jwk_priv, * jwk_pubkey_1;
@@ -1750,6 +2174,104 @@ START_TEST(test_rhonabwy_token_type)
 }
 END_TEST
 
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+START_TEST(test_rhonabwy_remote_resume)
+{
+  jwt_t * jwt, * jwt_parsed;
+  jwk_t * jwk_privkey_rsa;
+  char * str_jwt, * jwks_str;
+  int type = 0;
+  
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey_rsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey_rsa, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", JWT_CLAIM_ISS), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_RS256), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_header_str_value(jwt, "jku", "https://www.example.com/jwks"), RHN_OK);
+  ck_assert_ptr_ne(NULL, str_jwt = r_jwt_serialize_signed(jwt, jwk_privkey_rsa, 0));
+  ck_assert_ptr_ne(NULL, jwks_str = msprintf("{\"keys\":[%s]}", jwk_pubkey_rsa_str));
+  
+  ck_assert_int_eq(r_jwt_init(&jwt_parsed), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt_parsed, str_jwt, R_FLAG_DEFER_REMOTE), RHN_OK);
+  ck_assert_int_eq(r_jwt_remote_pending_size(jwt_parsed), 1);
+  ck_assert_str_eq(r_jwt_remote_pending_get_at(jwt_parsed, 0, &type), "https://www.example.com/jwks");
+  ck_assert_int_eq(type, R_REMOTE_JKU);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt_parsed, NULL, 0), RHN_NEED_KEY);
+  ck_assert_int_eq(r_jwt_remote_resume(jwt_parsed, "https://www.example.com/error", jwks_str, o_strlen(jwks_str)), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_remote_resume(jwt_parsed, "https://www.example.com/jwks", jwks_str, o_strlen(jwks_str)), RHN_OK);
+  ck_assert_int_eq(r_jwt_remote_pending_size(jwt_parsed), 0);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt_parsed, NULL, 0), RHN_OK);
+  ck_assert_str_eq(JWT_CLAIM_ISS, r_jwt_get_claim_str_value(jwt_parsed, "iss"));
+  
+  o_free(str_jwt);
+  o_free(jwks_str);
+  r_jwt_free(jwt);
+  r_jwt_free(jwt_parsed);
+  r_jwk_free(jwk_privkey_rsa);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_reset)
+{
+  jwt_t * jwt, * jwt_parsed;
+  jwk_t * jwk_privkey_ecdsa, * jwk_privkey_rsa, * jwk_pubkey_rsa;
+  json_t * j_jwk;
+  char * str_jwt_header, * str_jwt_ecdsa, * str_jwt_rsa;
+  
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey_ecdsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey_rsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey_rsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey_ecdsa, jwk_privkey_ecdsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey_rsa, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey_rsa, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", JWT_CLAIM_ISS), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_ES256), RHN_OK);
+  ck_assert_ptr_ne(NULL, str_jwt_ecdsa = r_jwt_serialize_signed(jwt, jwk_privkey_ecdsa, 0));
+  ck_assert_ptr_ne(NULL, j_jwk = json_loads(jwk_pubkey_ecdsa_str, JSON_DECODE_ANY, NULL));
+  ck_assert_int_eq(r_jwt_set_header_json_t_value(jwt, "jwk", j_jwk), RHN_OK);
+  ck_assert_ptr_ne(NULL, str_jwt_header = r_jwt_serialize_signed(jwt, jwk_privkey_ecdsa, 0));
+  ck_assert_int_eq(r_jwt_set_header_json_t_value(jwt, "jwk", NULL), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_RS256), RHN_OK);
+  ck_assert_ptr_ne(NULL, str_jwt_rsa = r_jwt_serialize_signed(jwt, jwk_privkey_rsa, 0));
+  
+  ck_assert_int_eq(r_jwt_reset(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_init(&jwt_parsed), RHN_OK);
+  ck_assert_int_eq(r_jwt_add_sign_keys(jwt_parsed, NULL, jwk_pubkey_rsa), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt_parsed, str_jwt_header, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwt_parsed->jwks_pubkey_sign), 2);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt_parsed, NULL, 0), RHN_OK);
+  ck_assert_str_eq(JWT_CLAIM_ISS, r_jwt_get_claim_str_value(jwt_parsed, "iss"));
+  
+  ck_assert_int_eq(r_jwt_reset(jwt_parsed), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwt_parsed->jwks_pubkey_sign), 1);
+  ck_assert_int_eq(r_jwt_get_type(jwt_parsed), R_JWT_TYPE_NONE);
+  ck_assert_int_eq(r_jwt_get_sign_alg(jwt_parsed), R_JWA_ALG_UNKNOWN);
+  ck_assert_ptr_eq(NULL, r_jwt_get_header_str_value(jwt_parsed, "alg"));
+  ck_assert_ptr_eq(NULL, r_jwt_get_claim_str_value(jwt_parsed, "iss"));
+  
+  // The key extracted from the previous token header must not verify this one
+  ck_assert_int_eq(r_jwt_parse(jwt_parsed, str_jwt_ecdsa, 0), RHN_OK);
+  ck_assert_int_ne(r_jwt_verify_signature(jwt_parsed, NULL, 0), RHN_OK);
+  
+  ck_assert_int_eq(r_jwt_reset(jwt_parsed), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt_parsed, str_jwt_rsa, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt_parsed, NULL, 0), RHN_OK);
+  ck_assert_str_eq(JWT_CLAIM_ISS, r_jwt_get_claim_str_value(jwt_parsed, "iss"));
+  
+  r_jwt_free(jwt);
+  r_jwt_free(jwt_parsed);
+  r_jwk_free(jwk_privkey_ecdsa);
+  r_jwk_free(jwk_privkey_rsa);
+  r_jwk_free(jwk_pubkey_rsa);
+  json_decref(j_jwk);
+  o_free(str_jwt_header);
+  o_free(str_jwt_ecdsa);
+  o_free(str_jwt_rsa);
+}
+END_TEST
+#endif
+
 static Suite *rhonabwy_suite(void)
 {
   Suite *s;
@@ -1784,6 +2306,15 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_copy);
   tcase_add_test(tc_core, test_rhonabwy_set_enc_cypher_key_iv);
   tcase_add_test(tc_core, test_rhonabwy_token_type);
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+  tcase_add_test(tc_core, test_rhonabwy_reset);
+  tcase_add_test(tc_core, test_rhonabwy_remote_resume);
+  tcase_add_test(tc_core, test_rhonabwy_shared_jwks);
+  tcase_add_test(tc_core, test_rhonabwy_verify_compact);
+  tcase_add_test(tc_core, test_rhonabwy_peek);
+  tcase_add_test(tc_core, test_rhonabwy_lazy_claims);
+  tcase_add_test(tc_core, test_rhonabwy_claims_struct);
+#endif
 #if GNUTLS_VERSION_NUMBER >= 0x030600 && defined(R_WITH_CURL)
   tcase_add_test(tc_core, test_rhonabwy_advanced_parse);
   tcase_add_test(tc_core, test_rhonabwy_quick_parse);
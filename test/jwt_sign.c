@@ -155,6 +155,53 @@ START_TEST(test_rhonabwy_sign_with_key_in_serialize)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_sign_serialize_to)
+{
+  jwt_t * jwt;
+  jwk_t * jwk_privkey, * jwk_pubkey;
+  json_t * j_claims = json_pack("{sssiso}", "str", "grut", "int", 42, "obj", json_true());
+  char * token, output[1024];
+  size_t output_len, length;
+  
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_full_claims_json_t(jwt, j_claims), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, jwk_privkey_sign_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_sign_str), RHN_OK);
+  
+  // The length doesn't change the jwt header
+  r_jwt_serialized_signed_length(jwt, jwk_privkey, 0);
+  ck_assert_ptr_eq(NULL, r_jwt_get_header_str_value(jwt, "typ"));
+  output_len = sizeof(output);
+  ck_assert_int_eq(r_jwt_serialize_signed_to(jwt, jwk_privkey, 0, output, &output_len), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_RS256), RHN_OK);
+  
+  ck_assert_ptr_ne(token = r_jwt_serialize_signed(jwt, jwk_privkey, 0), NULL);
+  ck_assert_int_eq(length = r_jwt_serialized_signed_length(jwt, jwk_privkey, 0), o_strlen(token));
+  o_free(token);
+  
+  output_len = length-1;
+  ck_assert_int_eq(r_jwt_serialize_signed_to(jwt, jwk_privkey, 0, output, &output_len), RHN_ERROR_PARAM);
+  ck_assert_int_eq(output_len, length);
+  output_len = length;
+  ck_assert_int_eq(r_jwt_serialize_signed_to(jwt, jwk_privkey, 0, output, &output_len), RHN_OK);
+  ck_assert_int_eq(output_len, length);
+  r_jwt_free(jwt);
+  
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  output[output_len] = '\0';
+  ck_assert_int_eq(r_jwt_parse(jwt, output, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt, jwk_pubkey, 0), RHN_OK);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "str"), "grut");
+  
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+  json_decref(j_claims);
+  r_jwt_free(jwt);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_sign_without_set_sign_alg)
 {
   jwt_t * jwt;
@@ -401,6 +448,7 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_sign_error);
   tcase_add_test(tc_core, test_rhonabwy_sign_with_add_keys);
   tcase_add_test(tc_core, test_rhonabwy_sign_with_key_in_serialize);
+  tcase_add_test(tc_core, test_rhonabwy_sign_serialize_to);
   tcase_add_test(tc_core, test_rhonabwy_sign_without_set_sign_alg);
   tcase_add_test(tc_core, test_rhonabwy_verify_error_key);
   tcase_add_test(tc_core, test_rhonabwy_verify_error_key_with_add_keys);
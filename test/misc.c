@@ -1,6 +1,8 @@
 /* Public domain, no copyright. Use at your own risk. */
 
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <check.h>
 #include <yder.h>
@@ -213,6 +215,17 @@ START_TEST(test_rhonabwy_alg_conversion)
   ck_assert_int_eq(r_str_to_jwa_alg("PBES2-HS512+A256KW"), R_JWA_ALG_PBES2_H512);
   ck_assert_str_eq(r_jwa_alg_to_str(R_JWA_ALG_PBES2_H512), "PBES2-HS512+A256KW");
   ck_assert_int_eq(r_str_to_jwa_alg("error"), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_alg("HS257"), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_alg("hs256"), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_alg("XS256"), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_alg("EdDSB"), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_alg("ES256L"), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_alg("A512KW"), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_alg("PBES2-HS256+A256KW"), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_alg("ECDH-ES+A128GCM"), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_alg("dir "), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_alg(""), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_alg(NULL), R_JWA_ALG_UNKNOWN);
   ck_assert_ptr_eq(r_jwa_alg_to_str(R_JWA_ALG_UNKNOWN), NULL);
 }
 END_TEST
@@ -232,10 +245,371 @@ START_TEST(test_rhonabwy_enc_conversion)
   ck_assert_int_eq(r_str_to_jwa_enc("A256GCM"), R_JWA_ENC_A256GCM);
   ck_assert_str_eq(r_jwa_enc_to_str(R_JWA_ENC_A256GCM), "A256GCM");
   ck_assert_int_eq(r_str_to_jwa_enc("error"), R_JWA_ENC_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_enc("A128CBC-HS384"), R_JWA_ENC_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_enc("A512GCM"), R_JWA_ENC_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_enc("A128CCM"), R_JWA_ENC_UNKNOWN);
+  ck_assert_int_eq(r_str_to_jwa_enc(NULL), R_JWA_ENC_UNKNOWN);
   ck_assert_ptr_eq(r_jwa_enc_to_str(R_JWA_ENC_UNKNOWN), NULL);
 }
 END_TEST
 
+START_TEST(test_rhonabwy_arena)
+{
+  rhn_arena_t * arena;
+  jwt_t * jwt;
+  jwk_t * jwk;
+  char * token = NULL, * str;
+  const unsigned char key[] = "my-very-secret";
+  size_t i, used = 0;
+
+  ck_assert_ptr_ne(NULL, arena = r_arena_new(1024));
+  ck_assert_int_eq(r_arena_begin(arena), RHN_ERROR_UNSUPPORTED);
+  ck_assert_int_eq(r_global_enable_arena(), RHN_OK);
+  ck_assert_int_eq(r_arena_begin(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_arena_used(arena), 0);
+
+  // The key is allocated outside of the arena and freed in the arena scope
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_symmetric_key(jwk, key, sizeof(key)), RHN_OK);
+  ck_assert_ptr_ne(NULL, str = o_strdup("outside"));
+
+  for (i=0; i<3; i++) {
+    ck_assert_int_eq(r_arena_begin(arena), RHN_OK);
+    ck_assert_int_eq(r_arena_begin(arena), RHN_ERROR_PARAM);
+    ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+    ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_HS256), RHN_OK);
+    ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", "https://rhonabwy.tld"), RHN_OK);
+    ck_assert_ptr_ne(NULL, token = r_jwt_serialize_signed(jwt, jwk, 0));
+    ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+    ck_assert_int_eq(r_jwt_verify_signature(jwt, jwk, 0), RHN_OK);
+    ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "iss"), "https://rhonabwy.tld");
+    r_jwt_free(jwt);
+    r_free(token);
+    ck_assert_int_gt(r_arena_used(arena), 1024);
+    if (i) {
+      // The same operation uses the same amount of memory after a reset
+      ck_assert_int_eq(r_arena_used(arena), used);
+    }
+    used = r_arena_used(arena);
+    if (i == 2) {
+      o_free(str);
+      r_jwk_free(jwk);
+    }
+    r_arena_end();
+    r_arena_reset(arena);
+    ck_assert_int_eq(r_arena_used(arena), 0);
+  }
+
+  r_arena_free(arena);
+}
+END_TEST
+
+static void * test_arena_free_thread(void * args) {
+  r_jwt_free((jwt_t *)args);
+  return NULL;
+}
+
+START_TEST(test_rhonabwy_arena_outlive_scope)
+{
+  rhn_arena_t * arena, * arena_other;
+  jwt_t * jwt, * jwt_thread;
+  jwk_t * jwk, * jwk_kid;
+  jwks_t * jwks;
+  jwks_shared_t * shared;
+  pthread_t thread;
+  unsigned char * scribble;
+  char * token;
+  const unsigned char key[] = "my-very-secret";
+
+  ck_assert_int_eq(r_global_enable_arena(), RHN_OK);
+  ck_assert_ptr_ne(NULL, arena = r_arena_new(1024));
+  ck_assert_ptr_ne(NULL, arena_other = r_arena_new(1024));
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_symmetric_key(jwk, key, sizeof(key)), RHN_OK);
+  ck_assert_int_eq(r_jwk_set_property_str(jwk, "kid", "1"), RHN_OK);
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_HS256), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", "https://rhonabwy.tld"), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jwt_serialize_signed(jwt, jwk, 0));
+  r_jwt_free(jwt);
+
+  // The tokens are created outside of the arena scope and parsed in it
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_init(&jwt_thread), RHN_OK);
+  ck_assert_int_eq(r_arena_begin(arena), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt_thread, token, 0), RHN_OK);
+  // The long-lived objects created in the scope aren't allocated in the arena
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_append_jwk(jwks, jwk), RHN_OK);
+  ck_assert_ptr_ne(NULL, shared = r_jwks_shared_new(jwks));
+  r_jwks_free(jwks);
+  ck_assert_int_eq(r_jwe_pbes2_cache_start(4), RHN_OK);
+  ck_assert_int_eq(r_jwe_ecdh_pool_start(2), RHN_OK);
+  r_arena_end();
+
+  // The arena memory is used, reset and reallocated after the scope
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "iss"), "https://rhonabwy.tld");
+  ck_assert_int_eq(r_jwt_reset(jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt_thread, "sub", "a subject long enough to grow the claims object"), RHN_OK);
+
+  // Freed in the scope of another arena and in another thread
+  ck_assert_int_eq(r_arena_begin(arena_other), RHN_OK);
+  r_jwt_free(jwt);
+  r_arena_end();
+  ck_assert_int_eq(pthread_create(&thread, NULL, test_arena_free_thread, jwt_thread), 0);
+  ck_assert_int_eq(pthread_join(thread, NULL), 0);
+
+  // The arena memory is overwritten by the next operation
+  r_arena_reset(arena);
+  ck_assert_int_eq(r_arena_begin(arena), RHN_OK);
+  ck_assert_ptr_ne(NULL, scribble = o_malloc(4096));
+  memset(scribble, 0xa5, 4096);
+  r_arena_end();
+  ck_assert_int_eq(r_jwks_shared_size(shared), 1);
+  ck_assert_ptr_ne(NULL, jwk_kid = r_jwks_shared_get_by_kid(shared, "1"));
+  r_jwk_free(jwk_kid);
+  ck_assert_int_eq(r_jwe_pbes2_cache_count(), 0);
+  r_jwe_pbes2_cache_stop();
+  r_jwe_ecdh_pool_stop();
+
+  r_jwks_shared_free(shared);
+  r_jwk_free(jwk);
+  r_free(token);
+  r_arena_free(arena);
+  r_arena_free(arena_other);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_thread_ctx)
+{
+  jwe_t * jwe;
+  jws_t * jws;
+  jwk_t * jwk;
+  char * token = NULL, * large;
+  const unsigned char key[] = "0123456789abcdef0123456789abcdef", payload[] = "The quick brown fox jumps over the lazy dog";
+  size_t i, size = 0, large_len = 2*R_THREAD_CTX_SCRATCH_MAX;
+
+  r_thread_ctx_release();
+  ck_assert_int_eq(r_thread_ctx_size(), 0);
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_symmetric_key(jwk, key, sizeof(key)-1), RHN_OK);
+
+  // The scratch buffers and the compression streams are reused by the next operations
+  for (i=0; i<3; i++) {
+    ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_DIR), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_header_str_value(jwe, "zip", "DEF"), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_payload(jwe, payload, sizeof(payload)), RHN_OK);
+    ck_assert_ptr_ne(NULL, token = r_jwe_serialize(jwe, jwk, 0));
+    r_jwe_free(jwe);
+    ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_parse(jwe, token, 0), RHN_OK);
+    ck_assert_int_eq(r_jwe_decrypt(jwe, jwk, 0), RHN_OK);
+    ck_assert_int_eq(0, memcmp(r_jwe_get_payload(jwe, NULL), payload, sizeof(payload)));
+    r_jwe_free(jwe);
+    r_free(token);
+
+    ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+    ck_assert_int_eq(r_jws_set_alg(jws, R_JWA_ALG_HS256), RHN_OK);
+    ck_assert_int_eq(r_jws_set_payload(jws, payload, sizeof(payload)), RHN_OK);
+    ck_assert_ptr_ne(NULL, token = r_jws_serialize(jws, jwk, 0));
+    ck_assert_int_eq(r_jws_parse(jws, token, 0), RHN_OK);
+    ck_assert_int_eq(r_jws_verify_signature(jws, jwk, 0), RHN_OK);
+    r_jws_free(jws);
+    r_free(token);
+
+    ck_assert_int_gt(r_thread_ctx_size(), 0);
+    if (i) {
+      ck_assert_int_eq(r_thread_ctx_size(), size);
+    }
+    size = r_thread_ctx_size();
+  }
+
+  // A scratch buffer larger than R_THREAD_CTX_SCRATCH_MAX isn't kept
+  ck_assert_ptr_ne(NULL, large = o_malloc(large_len));
+  memset(large, 'a', large_len);
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_set_alg(jws, R_JWA_ALG_HS256), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws, (const unsigned char *)large, large_len), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jws_serialize(jws, jwk, 0));
+  ck_assert_int_eq(r_jws_parse(jws, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk, 0), RHN_OK);
+  ck_assert_int_le(r_thread_ctx_size(), size);
+  r_jws_free(jws);
+  r_free(token);
+  o_free(large);
+
+  r_thread_ctx_release();
+  ck_assert_int_eq(r_thread_ctx_size(), 0);
+  r_jwk_free(jwk);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_alloc_stats)
+{
+  rhn_alloc_stats stats;
+  char * str, * str2;
+
+  ck_assert_int_eq(r_alloc_stats_begin(), RHN_ERROR_UNSUPPORTED);
+  ck_assert_int_eq(r_global_enable_alloc_stats(), RHN_OK);
+  ck_assert_int_eq(r_alloc_stats_end(&stats), RHN_ERROR_PARAM);
+  ck_assert_ptr_ne(NULL, str2 = o_strdup("outside"));
+
+  ck_assert_int_eq(r_alloc_stats_begin(), RHN_OK);
+  ck_assert_int_eq(r_alloc_stats_begin(), RHN_ERROR_PARAM);
+  ck_assert_ptr_ne(NULL, str = o_malloc(100));
+  ck_assert_ptr_ne(NULL, str = o_realloc(str, 200));
+  o_free(str);
+  ck_assert_ptr_ne(NULL, str = o_malloc(50));
+  // Freeing memory allocated outside of the scope doesn't change in_use
+  o_free(str2);
+  ck_assert_int_eq(r_alloc_stats_end(&stats), RHN_OK);
+  ck_assert_int_eq(stats.allocs, 2);
+  ck_assert_int_eq(stats.reallocs, 1);
+  ck_assert_int_eq(stats.frees, 2);
+  ck_assert_int_eq(stats.bytes, 350);
+  ck_assert_int_eq(stats.peak, 200);
+  ck_assert_int_eq(stats.in_use, 50);
+  o_free(str);
+  ck_assert_int_eq(r_alloc_stats_end(NULL), RHN_ERROR_PARAM);
+}
+END_TEST
+
+/**
+ * Allocation budgets of the main operations, measured after a first run
+ * so the per-thread buffers are already allocated
+ * A budget exceeded means an operation allocates more than before
+ */
+#define BUDGET_RS256_PARSE_VERIFY_ALLOCS 130
+#define BUDGET_RS256_VERIFY_COMPACT_ALLOCS 56
+#define BUDGET_HS256_SERIALIZE_ALLOCS 100
+#define BUDGET_A128GCM_DECRYPT_ALLOCS 130
+
+START_TEST(test_rhonabwy_alloc_budget)
+{
+  rhn_alloc_stats stats;
+  jwk_t * jwk_privkey, * jwk_pubkey, * jwk_key;
+  jwks_t * jwks;
+  jwks_shared_t * shared;
+  jwt_t * jwt;
+  jwe_t * jwe;
+  char * token = NULL, * token_hs = NULL, * token_enc = NULL;
+  const unsigned char key[] = "0123456789abcdef", payload[] = "The quick brown fox jumps over the lazy dog";
+  size_t i;
+
+  ck_assert_int_eq(r_global_enable_alloc_stats(), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_key), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwk_generate_key_pair(jwk_privkey, jwk_pubkey, R_KEY_TYPE_RSA, 2048, "1"), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_symmetric_key(jwk_key, key, sizeof(key)-1), RHN_OK);
+  ck_assert_int_eq(r_jwks_append_jwk(jwks, jwk_pubkey), RHN_OK);
+  ck_assert_ptr_ne(NULL, shared = r_jwks_shared_new(jwks));
+
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_RS256), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", "https://rhonabwy.tld"), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "sub", "dev"), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claim_int_value(jwt, "exp", time(NULL)+3600), RHN_OK);
+  ck_assert_ptr_ne(NULL, token = r_jwt_serialize_signed(jwt, jwk_privkey, 0));
+  r_jwt_free(jwt);
+
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_DIR), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128GCM), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_payload(jwe, payload, sizeof(payload)), RHN_OK);
+  ck_assert_ptr_ne(NULL, token_enc = r_jwe_serialize(jwe, jwk_key, 0));
+  r_jwe_free(jwe);
+
+  for (i=0; i<2; i++) {
+    ck_assert_int_eq(r_alloc_stats_begin(), RHN_OK);
+    ck_assert_ptr_ne(NULL, jwt = r_jwt_quick_parse(token, R_PARSE_NONE, 0));
+    ck_assert_int_eq(r_jwt_verify_signature(jwt, jwk_pubkey, 0), RHN_OK);
+    r_jwt_free(jwt);
+    ck_assert_int_eq(r_alloc_stats_end(&stats), RHN_OK);
+  }
+  ck_assert_int_eq(stats.in_use, 0);
+  ck_assert_int_le(stats.allocs+stats.reallocs, BUDGET_RS256_PARSE_VERIFY_ALLOCS);
+
+  for (i=0; i<2; i++) {
+    ck_assert_int_eq(r_alloc_stats_begin(), RHN_OK);
+    ck_assert_int_eq(r_jwt_verify_compact(token, o_strlen(token), shared, NULL, R_JWT_CLAIM_ISS, "https://rhonabwy.tld", R_JWT_CLAIM_EXP, R_JWT_CLAIM_NOW, R_JWT_CLAIM_NOP), RHN_OK);
+    ck_assert_int_eq(r_alloc_stats_end(&stats), RHN_OK);
+  }
+  ck_assert_int_eq(stats.in_use, 0);
+  ck_assert_int_le(stats.allocs+stats.reallocs, BUDGET_RS256_VERIFY_COMPACT_ALLOCS);
+
+  for (i=0; i<2; i++) {
+    ck_assert_int_eq(r_alloc_stats_begin(), RHN_OK);
+    ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+    ck_assert_int_eq(r_jwt_set_sign_alg(jwt, R_JWA_ALG_HS256), RHN_OK);
+    ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", "https://rhonabwy.tld"), RHN_OK);
+    ck_assert_ptr_ne(NULL, token_hs = r_jwt_serialize_signed(jwt, jwk_key, 0));
+    r_jwt_free(jwt);
+    r_free(token_hs);
+    ck_assert_int_eq(r_alloc_stats_end(&stats), RHN_OK);
+  }
+  ck_assert_int_eq(stats.in_use, 0);
+  ck_assert_int_le(stats.allocs+stats.reallocs, BUDGET_HS256_SERIALIZE_ALLOCS);
+
+  for (i=0; i<2; i++) {
+    ck_assert_int_eq(r_alloc_stats_begin(), RHN_OK);
+    ck_assert_ptr_ne(NULL, jwe = r_jwe_quick_parse(token_enc, R_PARSE_NONE, 0));
+    ck_assert_int_eq(r_jwe_decrypt(jwe, jwk_key, 0), RHN_OK);
+    r_jwe_free(jwe);
+    ck_assert_int_eq(r_alloc_stats_end(&stats), RHN_OK);
+  }
+  ck_assert_int_eq(stats.in_use, 0);
+  ck_assert_int_le(stats.allocs+stats.reallocs, BUDGET_A128GCM_DECRYPT_ALLOCS);
+
+  r_free(token);
+  r_free(token_enc);
+  r_jwks_shared_free(shared);
+  r_jwks_free(jwks);
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+  r_jwk_free(jwk_key);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_secure_memory)
+{
+  jwe_t * jwe, * jwe_large;
+  unsigned char large_key[2048];
+  size_t mapped = 0, locked = 0, in_use = 0, in_use_start = 0, mapped_large = 0, locked_large = 0;
+
+  r_secure_memory_info(NULL, NULL, &in_use_start);
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A256GCM), RHN_OK);
+  ck_assert_int_eq(r_jwe_generate_cypher_key(jwe), RHN_OK);
+  r_secure_memory_info(&mapped, &locked, &in_use);
+  ck_assert_int_gt(mapped, 0);
+  ck_assert_int_le(locked, mapped);
+  ck_assert_int_eq(in_use, in_use_start+32);
+
+  // A key too large for the slabs gets its own locked mapping
+  memset(large_key, 'a', sizeof(large_key));
+  ck_assert_int_eq(r_jwe_init(&jwe_large), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_cypher_key(jwe_large, large_key, sizeof(large_key)), RHN_OK);
+  r_secure_memory_info(&mapped_large, &locked_large, &in_use);
+  ck_assert_int_eq(in_use, in_use_start+32);
+  ck_assert_int_ge(mapped_large, mapped+sizeof(large_key));
+  ck_assert_int_le(locked_large, mapped_large);
+  ck_assert_int_eq(0, memcmp(r_jwe_get_cypher_key(jwe_large, NULL), large_key, sizeof(large_key)));
+  r_jwe_free(jwe_large);
+  r_secure_memory_info(&mapped_large, NULL, NULL);
+  ck_assert_int_eq(mapped_large, mapped);
+
+  r_jwe_free(jwe);
+  r_secure_memory_info(NULL, NULL, &in_use);
+  ck_assert_int_eq(in_use, in_use_start);
+}
+END_TEST
+
 static Suite *rhonabwy_suite(void)
 {
   Suite *s;
@@ -247,6 +621,12 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_info_str);
   tcase_add_test(tc_core, test_rhonabwy_alg_conversion);
   tcase_add_test(tc_core, test_rhonabwy_enc_conversion);
+  tcase_add_test(tc_core, test_rhonabwy_arena);
+  tcase_add_test(tc_core, test_rhonabwy_arena_outlive_scope);
+  tcase_add_test(tc_core, test_rhonabwy_thread_ctx);
+  tcase_add_test(tc_core, test_rhonabwy_alloc_stats);
+  tcase_add_test(tc_core, test_rhonabwy_alloc_budget);
+  tcase_add_test(tc_core, test_rhonabwy_secure_memory);
   tcase_set_timeout(tc_core, 30);
   suite_add_tcase(s, tc_core);
 
@@ -17,6 +17,8 @@
  *   * decrypt content
  *   * verify claims
  * - Serialize JWE, JWS or JWT based on the key and the content
+ * - Benchmark sign, verify, encrypt and decrypt operations
+ * - Verify or decrypt a list of tokens in batch
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU GENERAL PUBLIC LICENSE
@@ -37,8 +39,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 #include <gnutls/abstract.h>
@@ -57,10 +65,81 @@
 #define R_ACTION_JWKS_OUT        1
 #define R_ACTION_PARSE_TOKEN     2
 #define R_ACTION_SERIALIZE_TOKEN 3
+#define R_ACTION_BENCH           4
+#define R_ACTION_BATCH           5
 
 #define RNBYC_FORMAT_JWK 0
 #define RNBYC_FORMAT_PEM 1
 #define RNBYC_FORMAT_DER 2
+#define RNBYC_FORMAT_BIN 3
+
+#define RNBYC_BENCH_SIGN    0
+#define RNBYC_BENCH_VERIFY  1
+#define RNBYC_BENCH_ENCRYPT 2
+#define RNBYC_BENCH_DECRYPT 3
+
+#define RNBYC_BENCH_DEFAULT_DURATION     5
+#define RNBYC_BENCH_DEFAULT_THREADS      1
+#define RNBYC_BENCH_DEFAULT_PAYLOAD_SIZE 1024
+#define RNBYC_BENCH_RSA_SIZE             2048
+#define RNBYC_BENCH_SAMPLES_BLOCK        4096
+
+#define RNBYC_BATCH_JOBS_PER_THREAD 64
+
+struct _bench_thread {
+  pthread_t             thread;
+  int                   operation;
+  jwa_alg               alg;
+  jwa_enc               enc;
+  jwk_t               * jwk;
+  const unsigned char * payload;
+  size_t                payload_len;
+  const char          * token;
+  double                duration;
+  double              * samples;
+  size_t                nb_samples;
+  size_t                errors;
+};
+
+struct _batch_job {
+  char        * line;
+  size_t        line_size;
+  size_t        line_number;
+  const char  * token;
+  size_t        token_len;
+  char        * result;
+  int           valid;
+  int           done;
+};
+
+struct _batch_input {
+  const char * map;
+  size_t       map_len;
+  size_t       offset;
+  size_t       line_number;
+};
+
+struct _batch {
+  pthread_mutex_t     lock;
+  pthread_cond_t      job_cond;
+  pthread_cond_t      done_cond;
+  struct _batch_job * jobs;
+  size_t              window;
+  size_t              head;
+  size_t              next;
+  int                 end;
+  int                 x5u_flags;
+  int                 self_signed;
+  jwks_t            * jwks_pubkey;
+  jwks_t            * jwks_privkey;
+};
+
+struct _batch_worker {
+  pthread_t        thread;
+  struct _batch  * batch;
+  jwks_t         * jwks_pubkey;
+  jwks_t         * jwks_privkey;
+};
 
 static void print_help(FILE * output) {
   fprintf(output, "\nrnbyc - JWK/JWKS parser and generator, JWT parser and serializer, supports signed, encrypted and nested JWTs\n");
@@ -89,7 +168,7 @@ static void print_help(FILE * output) {
   fprintf(output, "-i --stdin\n");
   fprintf(output, "\tReads key to parse from stdin\n");
   fprintf(output, "-f --in-file\n");
-  fprintf(output, "\tReads key to parse from a file\n");
+  fprintf(output, "\tReads key to parse from a file, a JWKS file in binary format is detected\n");
   fprintf(output, "-k --key-id\n");
   fprintf(output, "\tSpecifies the key-id to add to the current key\n");
   fprintf(output, "-a --alg\n");
@@ -106,7 +185,7 @@ static void print_help(FILE * output) {
   fprintf(output, "-n --indent\n");
   fprintf(output, "\tJWKS output spaces indentation: 0 is compact mode, default is 2 spaces indent\n");
   fprintf(output, "-F --format\n");
-  fprintf(output, "\tOutput format, values available are JWK (default), PEM or DER\n");
+  fprintf(output, "\tOutput format, values available are JWK (default), PEM, DER or BIN (binary JWKS)\n");
   fprintf(output, "-x --split\n");
   fprintf(output, "\tSplit JWKS output in public and private keys\n");
   fprintf(output, "-t --parse-token\n");
@@ -128,6 +207,18 @@ static void print_help(FILE * output) {
   fprintf(output, "\tas 'jwk', 'x5c' or 'x5u' parameter\n");
   fprintf(output, "-W --password\n");
   fprintf(output, "\tSpecifies the password for key management encryption/decryption using PBES2 alg or signature generation/verification using HS alg\n");
+  fprintf(output, "-b --bench\n");
+  fprintf(output, "\tAction: benchmark sign and verify operations using the alg value, and/or encrypt and decrypt operations using the enc-alg and enc values\n");
+  fprintf(output, "\tKeys are generated if no private key, public key or password is specified\n");
+  fprintf(output, "-B --batch <path>\n");
+  fprintf(output, "\tAction: verify or decrypt the tokens listed in the file, one token per line, use '-' to read the tokens from stdin\n");
+  fprintf(output, "\tThe result of each token is printed as a JSON object on one line, in the same order as the input\n");
+  fprintf(output, "-T --threads\n");
+  fprintf(output, "\tNumber of threads running the benchmark, default %d, or the batch, default is the number of CPUs\n", RNBYC_BENCH_DEFAULT_THREADS);
+  fprintf(output, "-D --duration\n");
+  fprintf(output, "\tDuration of each benchmark operation in seconds, default %d\n", RNBYC_BENCH_DEFAULT_DURATION);
+  fprintf(output, "-L --payload-size\n");
+  fprintf(output, "\tPayload size in bytes of the benchmarked tokens, default %d\n", RNBYC_BENCH_DEFAULT_PAYLOAD_SIZE);
   fprintf(output, "-u --x5u-flags\n");
   fprintf(output, "\tSet x5u flags to retrieve online certificate, values available are:\n");
   fprintf(output, "\t\tcert: ignore server certificate errors (self-signed, expired, etc.)\n");
@@ -161,7 +252,27 @@ static int write_file_content(const char * file_path, const char * content, size
   return ret;
 }
 
-static char * get_file_content(const char * file_path) {
+static int write_file_binary(const char * file_path, const char * content, size_t content_len) {
+  FILE * f;
+  int ret;
+
+  f = fopen (file_path, "wb");
+  if (f) {
+    if (fwrite(content, 1, content_len, f) == content_len) {
+      ret = 0;
+    } else {
+      ret = ENOENT;
+    }
+    fclose (f);
+  } else {
+    fprintf(stderr, "error opening file %s\n", file_path);
+    ret = EACCES;
+  }
+
+  return ret;
+}
+
+static char * get_file_content_len(const char * file_path, size_t * content_len) {
   char * buffer = NULL;
   size_t length, res;
   FILE * f;
@@ -179,6 +290,9 @@ static char * get_file_content(const char * file_path) {
       }
       // Add null character at the end of buffer, just in case
       buffer[length] = '\0';
+      if (content_len != NULL) {
+        *content_len = res;
+      }
     }
     fclose (f);
   } else {
@@ -188,6 +302,10 @@ static char * get_file_content(const char * file_path) {
   return buffer;
 }
 
+static char * get_file_content(const char * file_path) {
+  return get_file_content_len(file_path, NULL);
+}
+
 static char * get_stdin_content() {
   int size = 100;
   char * out = NULL, buffer[size];
@@ -435,6 +553,30 @@ static int jwks_parse_str(jwks_t * jwks_priv, jwks_t * jwks_pub, const char * in
   return ret;
 }
 
+static int jwks_parse_binary(jwks_t * jwks_priv, jwks_t * jwks_pub, const char * in, size_t in_len, int x5u_flags) {
+  jwks_t * jwks = NULL;
+  jwk_t * jwk = NULL;
+  int ret;
+  size_t i;
+
+  if (r_jwks_init(&jwks) == RHN_OK && r_jwks_import_from_binary(jwks, (const unsigned char *)in, in_len) == RHN_OK) {
+    for (i=0; i<r_jwks_size(jwks); i++) {
+      jwk = r_jwks_get_at(jwks, i);
+      if (r_jwk_key_type(jwk, NULL, x5u_flags) & R_KEY_TYPE_PUBLIC && jwks_pub != NULL) {
+        r_jwks_append_jwk(jwks_pub, jwk);
+      } else {
+        r_jwks_append_jwk(jwks_priv, jwk);
+      }
+      r_jwk_free(jwk);
+    }
+    ret = 0;
+  } else {
+    ret = EINVAL;
+  }
+  r_jwks_free(jwks);
+  return ret;
+}
+
 static int jwk_stdin(jwks_t * jwks_priv, jwks_t * jwks_pub, json_t * j_element, int x5u_flags) {
   char * in = get_stdin_content();
   int ret;
@@ -449,11 +591,16 @@ static int jwk_stdin(jwks_t * jwks_priv, jwks_t * jwks_pub, json_t * j_element,
 }
 
 static int jwk_file(jwks_t * jwks_priv, jwks_t * jwks_pub, json_t * j_element, int x5u_flags) {
-  char * in = get_file_content(json_string_value(json_object_get(j_element, "path")));
+  size_t in_len = 0;
+  char * in = get_file_content_len(json_string_value(json_object_get(j_element, "path")), &in_len);
   int ret;
 
   if (in != NULL) {
-    ret = jwks_parse_str(jwks_priv, jwks_pub, in, json_string_value(json_object_get(j_element, "kid")), x5u_flags);
+    if (in_len >= 4 && 0 == memcmp(in, "RHNK", 4)) {
+      ret = jwks_parse_binary(jwks_priv, jwks_pub, in, in_len, x5u_flags);
+    } else {
+      ret = jwks_parse_str(jwks_priv, jwks_pub, in, json_string_value(json_object_get(j_element, "kid")), x5u_flags);
+    }
   } else {
     ret = EIO;
   }
@@ -493,6 +640,10 @@ static void get_jwks_out(json_t * j_arguments, int split_keys, int x5u_flags, in
       j_jwks = r_jwks_export_to_json_t(jwks_privkey);
       str_jwks = json_dumps(j_jwks, JSON_INDENT(indent)|JSON_SORT_KEYS);
       str_jwks_len = o_strlen(str_jwks);
+    } else if (format == RNBYC_FORMAT_BIN) {
+      if ((str_jwks = (char *)r_jwks_export_to_binary(jwks_privkey, &str_jwks_len)) == NULL) {
+        fprintf(stderr, "Error exporting jwks binary\n");
+      }
     } else {
       str_jwks = NULL;
       for (index=0; index<r_jwks_size(jwks_privkey); index++) {
@@ -519,9 +670,11 @@ static void get_jwks_out(json_t * j_arguments, int split_keys, int x5u_flags, in
     }
     if (str_jwks != NULL) {
       if (out_file != NULL) {
-        if (write_file_content(out_file, str_jwks, str_jwks_len)) {
+        if ((format==RNBYC_FORMAT_BIN?write_file_binary:write_file_content)(out_file, str_jwks, str_jwks_len)) {
           fprintf(stderr, "Error writing to file %s\n", out_file);
         }
+      } else if (format == RNBYC_FORMAT_BIN) {
+        fwrite(str_jwks, 1, str_jwks_len, stdout);
       } else {
         if (r_jwks_size(jwks_pubkey)) {
           printf("Private keys:\n");
@@ -540,6 +693,10 @@ static void get_jwks_out(json_t * j_arguments, int split_keys, int x5u_flags, in
       j_jwks = r_jwks_export_to_json_t(jwks_pubkey);
       str_jwks = json_dumps(j_jwks, JSON_INDENT(indent)|JSON_SORT_KEYS);
       str_jwks_len = o_strlen(str_jwks);
+    } else if (format == RNBYC_FORMAT_BIN) {
+      if ((str_jwks = (char *)r_jwks_export_to_binary(jwks_pubkey, &str_jwks_len)) == NULL) {
+        fprintf(stderr, "Error exporting jwks public binary\n");
+      }
     } else {
       for (index=0; index<r_jwks_size(jwks_pubkey); index++) {
         cur_jwk = r_jwks_get_at(jwks_pubkey, index);
@@ -565,9 +722,11 @@ static void get_jwks_out(json_t * j_arguments, int split_keys, int x5u_flags, in
     }
     if (str_jwks != NULL) {
       if (out_file_public != NULL) {
-        if (write_file_content(out_file_public, str_jwks, str_jwks_len)) {
+        if ((format==RNBYC_FORMAT_BIN?write_file_binary:write_file_content)(out_file_public, str_jwks, str_jwks_len)) {
           fprintf(stderr, "Error writing to file %s\n", out_file_public);
         }
+      } else if (format == RNBYC_FORMAT_BIN) {
+        fwrite(str_jwks, 1, str_jwks_len, stdout);
       } else {
         printf("\nPublic keys:\n%.*s\n", (int)str_jwks_len, str_jwks);
       }
@@ -852,6 +1011,817 @@ static int serialize_token(const char * claims, int x5u_flags, const char * str_
   return ret;
 }
 
+static double bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+static int bench_compare_double(const void * a, const void * b) {
+  double da = *(const double *)a, db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+static double bench_percentile(const double * sorted, size_t nb, double percentile) {
+  size_t index = (size_t)(percentile * (double)(nb-1) + 0.5);
+
+  return sorted[index<nb?index:nb-1];
+}
+
+/**
+ * Returns a copy of the first key of the JWKS having the given alg, or the first key of the JWKS
+ */
+static jwk_t * bench_load_key(const char * str_jwks, jwa_alg alg, int x5u_flags) {
+  jwks_t * jwks = NULL;
+  jwk_t * jwk = NULL, * jwk_cur;
+  char * content = NULL;
+  size_t i;
+
+  if (r_jwks_init(&jwks) == RHN_OK) {
+    if (str_jwks[0] == '{') {
+      if (r_jwks_import_from_json_str(jwks, str_jwks) != RHN_OK) {
+        fprintf(stderr, "Invalid jwks\n");
+      }
+    } else {
+      content = get_file_content(str_jwks);
+      if (r_jwks_import_from_json_str(jwks, content) != RHN_OK) {
+        fprintf(stderr, "Invalid jwks path or content\n");
+      }
+      o_free(content);
+    }
+    for (i=0; i<r_jwks_size(jwks) && jwk == NULL; i++) {
+      jwk_cur = r_jwks_get_at(jwks, i);
+      if (r_str_to_jwa_alg(r_jwk_get_property_str(jwk_cur, "alg")) == alg) {
+        jwk = jwk_cur;
+      } else {
+        r_jwk_free(jwk_cur);
+      }
+    }
+    if (jwk == NULL && r_jwks_size(jwks)) {
+      jwk = r_jwks_get_at(jwks, 0);
+    }
+    if (jwk != NULL && !r_jwk_key_type(jwk, NULL, x5u_flags)) {
+      fprintf(stderr, "Invalid key\n");
+      r_jwk_free(jwk);
+      jwk = NULL;
+    }
+  }
+  r_jwks_free(jwks);
+  return jwk;
+}
+
+static jwk_t * bench_password_key(const char * password) {
+  jwk_t * jwk = NULL;
+
+  if (r_jwk_init(&jwk) == RHN_OK && r_jwk_import_from_password(jwk, password) != RHN_OK) {
+    fprintf(stderr, "Error parsing password\n");
+    r_jwk_free(jwk);
+    jwk = NULL;
+  }
+  return jwk;
+}
+
+static int bench_generate_keys(jwa_alg alg, jwa_enc enc, jwk_t ** jwk_privkey, jwk_t ** jwk_pubkey) {
+  unsigned char key[64];
+  size_t key_len = 0;
+  int type = 0, ret = 0;
+  unsigned int bits = 0;
+
+  switch (alg) {
+    case R_JWA_ALG_HS256:
+    case R_JWA_ALG_A256KW:
+    case R_JWA_ALG_A256GCMKW:
+      key_len = 32;
+      break;
+    case R_JWA_ALG_HS384:
+      key_len = 48;
+      break;
+    case R_JWA_ALG_HS512:
+      key_len = 64;
+      break;
+    case R_JWA_ALG_A128KW:
+    case R_JWA_ALG_A128GCMKW:
+      key_len = 16;
+      break;
+    case R_JWA_ALG_A192KW:
+    case R_JWA_ALG_A192GCMKW:
+      key_len = 24;
+      break;
+    case R_JWA_ALG_DIR:
+      if (enc == R_JWA_ENC_A128GCM) {
+        key_len = 16;
+      } else if (enc == R_JWA_ENC_A192GCM) {
+        key_len = 24;
+      } else if (enc == R_JWA_ENC_A256GCM || enc == R_JWA_ENC_A128CBC) {
+        key_len = 32;
+      } else if (enc == R_JWA_ENC_A192CBC) {
+        key_len = 48;
+      } else if (enc == R_JWA_ENC_A256CBC) {
+        key_len = 64;
+      }
+      break;
+    case R_JWA_ALG_RS256:
+    case R_JWA_ALG_RS384:
+    case R_JWA_ALG_RS512:
+    case R_JWA_ALG_PS256:
+    case R_JWA_ALG_PS384:
+    case R_JWA_ALG_PS512:
+    case R_JWA_ALG_RSA1_5:
+    case R_JWA_ALG_RSA_OAEP:
+    case R_JWA_ALG_RSA_OAEP_256:
+      type = R_KEY_TYPE_RSA;
+      bits = RNBYC_BENCH_RSA_SIZE;
+      break;
+    case R_JWA_ALG_ES256:
+    case R_JWA_ALG_ECDH_ES:
+    case R_JWA_ALG_ECDH_ES_A128KW:
+    case R_JWA_ALG_ECDH_ES_A192KW:
+    case R_JWA_ALG_ECDH_ES_A256KW:
+      type = R_KEY_TYPE_EC;
+      bits = 256;
+      break;
+    case R_JWA_ALG_ES384:
+      type = R_KEY_TYPE_EC;
+      bits = 384;
+      break;
+    case R_JWA_ALG_ES512:
+      type = R_KEY_TYPE_EC;
+      bits = 521;
+      break;
+    case R_JWA_ALG_EDDSA:
+      type = R_KEY_TYPE_EDDSA;
+      bits = 256;
+      break;
+    default:
+      break;
+  }
+  if (r_jwk_init(jwk_privkey) == RHN_OK && r_jwk_init(jwk_pubkey) == RHN_OK) {
+    if (key_len) {
+      gnutls_rnd(GNUTLS_RND_KEY, key, key_len);
+      if (r_jwk_import_from_symmetric_key(*jwk_privkey, key, key_len) != RHN_OK || r_jwk_import_from_symmetric_key(*jwk_pubkey, key, key_len) != RHN_OK) {
+        ret = EINVAL;
+      }
+    } else if (type) {
+      if (r_jwk_generate_key_pair(*jwk_privkey, *jwk_pubkey, type, bits, NULL) != RHN_OK) {
+        ret = EINVAL;
+      }
+    } else {
+      ret = EINVAL;
+    }
+  } else {
+    ret = ENOMEM;
+  }
+  if (ret) {
+    fprintf(stderr, "Unable to generate a key for alg %s\n", r_jwa_alg_to_str(alg));
+    r_jwk_free(*jwk_privkey);
+    r_jwk_free(*jwk_pubkey);
+    *jwk_privkey = NULL;
+    *jwk_pubkey = NULL;
+  }
+  return ret;
+}
+
+/**
+ * Sets the private and public keys used by the benchmark
+ * The private key is used to sign or decrypt, the public key to verify or encrypt
+ */
+static int bench_get_keys(jwa_alg alg, jwa_enc enc, int x5u_flags, const char * str_jwks_privkey, const char * str_jwks_pubkey, const char * password, jwk_t ** jwk_privkey, jwk_t ** jwk_pubkey) {
+  int ret = 0;
+
+  *jwk_privkey = NULL;
+  *jwk_pubkey = NULL;
+  if (o_strlen(str_jwks_privkey) || o_strlen(str_jwks_pubkey)) {
+    if (o_strlen(str_jwks_privkey)) {
+      *jwk_privkey = bench_load_key(str_jwks_privkey, alg, x5u_flags);
+    }
+    if (o_strlen(str_jwks_pubkey)) {
+      *jwk_pubkey = bench_load_key(str_jwks_pubkey, alg, x5u_flags);
+    } else if (*jwk_privkey != NULL) {
+      if (r_jwk_key_type(*jwk_privkey, NULL, x5u_flags) & R_KEY_TYPE_SYMMETRIC) {
+        *jwk_pubkey = r_jwk_copy(*jwk_privkey);
+      } else if (r_jwk_init(jwk_pubkey) != RHN_OK || r_jwk_extract_pubkey(*jwk_privkey, *jwk_pubkey, x5u_flags) != RHN_OK) {
+        r_jwk_free(*jwk_pubkey);
+        *jwk_pubkey = NULL;
+      }
+    }
+    if (*jwk_privkey == NULL && *jwk_pubkey != NULL && r_jwk_key_type(*jwk_pubkey, NULL, x5u_flags) & R_KEY_TYPE_SYMMETRIC) {
+      *jwk_privkey = r_jwk_copy(*jwk_pubkey);
+    }
+  } else if (o_strlen(password)) {
+    *jwk_privkey = bench_password_key(password);
+    *jwk_pubkey = bench_password_key(password);
+  } else {
+    ret = bench_generate_keys(alg, enc, jwk_privkey, jwk_pubkey);
+  }
+  if (!ret && (*jwk_privkey == NULL || *jwk_pubkey == NULL)) {
+    fprintf(stderr, "Missing key for alg %s, private and public keys are required\n", r_jwa_alg_to_str(alg));
+    ret = EINVAL;
+  }
+  return ret;
+}
+
+static char * bench_serialize(int operation, jwa_alg alg, jwa_enc enc, jwk_t * jwk, const unsigned char * payload, size_t payload_len) {
+  jws_t * jws = NULL;
+  jwe_t * jwe = NULL;
+  char * token = NULL;
+
+  if (operation == RNBYC_BENCH_SIGN) {
+    if (r_jws_init(&jws) == RHN_OK) {
+      if (r_jws_set_alg(jws, alg) == RHN_OK && r_jws_set_payload(jws, payload, payload_len) == RHN_OK) {
+        token = r_jws_serialize(jws, jwk, 0);
+      }
+      r_jws_free(jws);
+    }
+  } else {
+    if (r_jwe_init(&jwe) == RHN_OK) {
+      if (r_jwe_set_alg(jwe, alg) == RHN_OK && r_jwe_set_enc(jwe, enc) == RHN_OK && r_jwe_set_payload(jwe, payload, payload_len) == RHN_OK) {
+        token = r_jwe_serialize(jwe, jwk, 0);
+      }
+      r_jwe_free(jwe);
+    }
+  }
+  return token;
+}
+
+static int bench_operation(struct _bench_thread * bench) {
+  jws_t * jws = NULL;
+  jwe_t * jwe = NULL;
+  char * token;
+  int ret = RHN_ERROR;
+
+  switch (bench->operation) {
+    case RNBYC_BENCH_SIGN:
+    case RNBYC_BENCH_ENCRYPT:
+      if ((token = bench_serialize(bench->operation, bench->alg, bench->enc, bench->jwk, bench->payload, bench->payload_len)) != NULL) {
+        ret = RHN_OK;
+      }
+      o_free(token);
+      break;
+    case RNBYC_BENCH_VERIFY:
+      if (r_jws_init(&jws) == RHN_OK) {
+        if (r_jws_parse(jws, bench->token, 0) == RHN_OK) {
+          ret = r_jws_verify_signature(jws, bench->jwk, 0);
+        }
+        r_jws_free(jws);
+      }
+      break;
+    case RNBYC_BENCH_DECRYPT:
+      if (r_jwe_init(&jwe) == RHN_OK) {
+        if (r_jwe_parse(jwe, bench->token, 0) == RHN_OK) {
+          ret = r_jwe_decrypt(jwe, bench->jwk, 0);
+        }
+        r_jwe_free(jwe);
+      }
+      break;
+  }
+  return ret;
+}
+
+static void * bench_thread_run(void * arg) {
+  struct _bench_thread * bench = (struct _bench_thread *)arg;
+  size_t samples_size = RNBYC_BENCH_SAMPLES_BLOCK;
+  double start, end, stop, * samples;
+
+  if ((bench->samples = o_malloc(samples_size*sizeof(double))) != NULL) {
+    stop = bench_now() + bench->duration;
+    do {
+      start = bench_now();
+      if (bench_operation(bench) == RHN_OK) {
+        end = bench_now();
+        if (bench->nb_samples == samples_size) {
+          samples_size += RNBYC_BENCH_SAMPLES_BLOCK;
+          if ((samples = o_realloc(bench->samples, samples_size*sizeof(double))) == NULL) {
+            fprintf(stderr, "Error reallocating resources for samples\n");
+            bench->nb_samples = 0;
+            break;
+          }
+          bench->samples = samples;
+        }
+        bench->samples[bench->nb_samples++] = end - start;
+      } else {
+        end = bench_now();
+        bench->errors++;
+      }
+    } while (end < stop);
+  } else {
+    fprintf(stderr, "Error allocating resources for samples\n");
+  }
+  return NULL;
+}
+
+static json_t * bench_run(int operation, jwa_alg alg, jwa_enc enc, jwk_t * jwk, const char * token, const unsigned char * payload, size_t payload_len, unsigned int threads, double duration) {
+  struct _bench_thread * bench = NULL;
+  json_t * j_result = NULL;
+  double * samples = NULL, start, elapsed;
+  size_t nb_samples = 0, errors = 0;
+  unsigned int i, started = 0;
+  const char * operation_str[] = {"sign", "verify", "encrypt", "decrypt"};
+
+  if ((bench = o_malloc(threads*sizeof(struct _bench_thread))) != NULL) {
+    memset(bench, 0, threads*sizeof(struct _bench_thread));
+    start = bench_now();
+    for (i=0; i<threads; i++) {
+      bench[i].operation = operation;
+      bench[i].alg = alg;
+      bench[i].enc = enc;
+      // Each thread works with its own copy of the key
+      bench[i].jwk = r_jwk_copy(jwk);
+      bench[i].payload = payload;
+      bench[i].payload_len = payload_len;
+      bench[i].token = token;
+      bench[i].duration = duration;
+      if (pthread_create(&bench[i].thread, NULL, bench_thread_run, &bench[i])) {
+        fprintf(stderr, "Error creating thread %u\n", i);
+        r_jwk_free(bench[i].jwk);
+        break;
+      }
+      started++;
+    }
+    for (i=0; i<started; i++) {
+      pthread_join(bench[i].thread, NULL);
+      nb_samples += bench[i].nb_samples;
+      errors += bench[i].errors;
+    }
+    elapsed = bench_now() - start;
+    if (nb_samples && (samples = o_malloc(nb_samples*sizeof(double))) != NULL) {
+      nb_samples = 0;
+      for (i=0; i<started; i++) {
+        memcpy(samples+nb_samples, bench[i].samples, bench[i].nb_samples*sizeof(double));
+        nb_samples += bench[i].nb_samples;
+      }
+      qsort(samples, nb_samples, sizeof(double), bench_compare_double);
+      j_result = json_pack("{sssssisIsfsIsIsfs{sfsfsfsfsfsf}}",
+                           "operation", operation_str[operation],
+                           "alg", r_jwa_alg_to_str(alg),
+                           "threads", started,
+                           "payload_size", (json_int_t)payload_len,
+                           "duration", elapsed,
+                           "operations", (json_int_t)nb_samples,
+                           "errors", (json_int_t)errors,
+                           "ops_per_sec", (double)nb_samples/elapsed,
+                           "latency_us",
+                             "min", samples[0]*1e6,
+                             "p50", bench_percentile(samples, nb_samples, 0.50)*1e6,
+                             "p90", bench_percentile(samples, nb_samples, 0.90)*1e6,
+                             "p99", bench_percentile(samples, nb_samples, 0.99)*1e6,
+                             "p999", bench_percentile(samples, nb_samples, 0.999)*1e6,
+                             "max", samples[nb_samples-1]*1e6);
+      if (operation == RNBYC_BENCH_ENCRYPT || operation == RNBYC_BENCH_DECRYPT) {
+        json_object_set_new(j_result, "enc", json_string(r_jwa_enc_to_str(enc)));
+      }
+    } else {
+      fprintf(stderr, "Benchmark %s failed, %zu errors\n", operation_str[operation], errors);
+    }
+    for (i=0; i<started; i++) {
+      o_free(bench[i].samples);
+      r_jwk_free(bench[i].jwk);
+    }
+    o_free(samples);
+    o_free(bench);
+  }
+  return j_result;
+}
+
+static int bench_token(int indent, int x5u_flags, const char * str_jwks_pubkey, const char * str_jwks_privkey, const char * password, const char * alg, const char * enc, const char * enc_alg, unsigned int threads, double duration, size_t payload_len) {
+  jwk_t * jwk_privkey = NULL, * jwk_pubkey = NULL;
+  unsigned char * payload = NULL;
+  jwa_alg sign_alg = R_JWA_ALG_UNKNOWN, key_alg = R_JWA_ALG_UNKNOWN;
+  jwa_enc enc_value = R_JWA_ENC_A128CBC;
+  json_t * j_results = json_array(), * j_result;
+  char * token = NULL, * str_results;
+  size_t i;
+  int ret = 0;
+
+  if (alg != NULL && (sign_alg = r_str_to_jwa_alg(alg)) == R_JWA_ALG_UNKNOWN) {
+    fprintf(stderr, "Invalid alg value\n");
+    ret = EINVAL;
+  }
+  if (enc_alg != NULL && (key_alg = r_str_to_jwa_alg(enc_alg)) == R_JWA_ALG_UNKNOWN) {
+    fprintf(stderr, "Invalid enc_alg value\n");
+    ret = EINVAL;
+  }
+  if (enc != NULL && (enc_value = r_str_to_jwa_enc(enc)) == R_JWA_ENC_UNKNOWN) {
+    fprintf(stderr, "Invalid enc value\n");
+    ret = EINVAL;
+  }
+  if (sign_alg == R_JWA_ALG_UNKNOWN && key_alg == R_JWA_ALG_UNKNOWN) {
+    fprintf(stderr, "Please specify an alg or an enc-alg value to benchmark\n");
+    ret = EINVAL;
+  }
+  if (!threads || duration <= 0 || !payload_len) {
+    fprintf(stderr, "Invalid threads, duration or payload size value\n");
+    ret = EINVAL;
+  }
+  if (!ret) {
+    if ((payload = o_malloc(payload_len)) != NULL) {
+      for (i=0; i<payload_len; i++) {
+        payload[i] = (unsigned char)('a'+(i%26));
+      }
+    } else {
+      fprintf(stderr, "Error allocating resources for payload\n");
+      ret = ENOMEM;
+    }
+  }
+  if (!ret && sign_alg != R_JWA_ALG_UNKNOWN) {
+    if (!(ret = bench_get_keys(sign_alg, R_JWA_ENC_UNKNOWN, x5u_flags, str_jwks_privkey, str_jwks_pubkey, password, &jwk_privkey, &jwk_pubkey))) {
+      if ((token = bench_serialize(RNBYC_BENCH_SIGN, sign_alg, R_JWA_ENC_UNKNOWN, jwk_privkey, payload, payload_len)) != NULL) {
+        if ((j_result = bench_run(RNBYC_BENCH_SIGN, sign_alg, R_JWA_ENC_UNKNOWN, jwk_privkey, NULL, payload, payload_len, threads, duration)) != NULL) {
+          json_array_append_new(j_results, j_result);
+        }
+        if ((j_result = bench_run(RNBYC_BENCH_VERIFY, sign_alg, R_JWA_ENC_UNKNOWN, jwk_pubkey, token, payload, payload_len, threads, duration)) != NULL) {
+          json_array_append_new(j_results, j_result);
+        }
+      } else {
+        fprintf(stderr, "Error signing token with alg %s\n", r_jwa_alg_to_str(sign_alg));
+        ret = EINVAL;
+      }
+      o_free(token);
+      token = NULL;
+    }
+    r_jwk_free(jwk_privkey);
+    r_jwk_free(jwk_pubkey);
+  }
+  if (!ret && key_alg != R_JWA_ALG_UNKNOWN) {
+    if (!(ret = bench_get_keys(key_alg, enc_value, x5u_flags, str_jwks_privkey, str_jwks_pubkey, password, &jwk_privkey, &jwk_pubkey))) {
+      if ((token = bench_serialize(RNBYC_BENCH_ENCRYPT, key_alg, enc_value, jwk_pubkey, payload, payload_len)) != NULL) {
+        if ((j_result = bench_run(RNBYC_BENCH_ENCRYPT, key_alg, enc_value, jwk_pubkey, NULL, payload, payload_len, threads, duration)) != NULL) {
+          json_array_append_new(j_results, j_result);
+        }
+        if ((j_result = bench_run(RNBYC_BENCH_DECRYPT, key_alg, enc_value, jwk_privkey, token, payload, payload_len, threads, duration)) != NULL) {
+          json_array_append_new(j_results, j_result);
+        }
+      } else {
+        fprintf(stderr, "Error encrypting token with alg %s and enc %s\n", r_jwa_alg_to_str(key_alg), r_jwa_enc_to_str(enc_value));
+        ret = EINVAL;
+      }
+      o_free(token);
+    }
+    r_jwk_free(jwk_privkey);
+    r_jwk_free(jwk_pubkey);
+  }
+  if (json_array_size(j_results)) {
+    str_results = json_dumps(j_results, JSON_INDENT(indent));
+    printf("%s\n", str_results);
+    o_free(str_results);
+  } else if (!ret) {
+    ret = EINVAL;
+  }
+  o_free(payload);
+  json_decref(j_results);
+  return ret;
+}
+
+static jwks_t * batch_load_jwks(const char * str_jwks, const char * password) {
+  jwks_t * jwks = NULL;
+  jwk_t * jwk_password;
+  char * content;
+
+  if (r_jwks_init(&jwks) == RHN_OK) {
+    if (o_strlen(str_jwks) && str_jwks[0] == '{') {
+      if (r_jwks_import_from_json_str(jwks, str_jwks) != RHN_OK) {
+        fprintf(stderr, "Invalid jwks\n");
+      }
+    } else if (o_strlen(str_jwks)) {
+      content = get_file_content(str_jwks);
+      if (r_jwks_import_from_json_str(jwks, content) != RHN_OK) {
+        fprintf(stderr, "Invalid jwks path or content\n");
+      }
+      o_free(content);
+    } else if (o_strlen(password)) {
+      r_jwk_init(&jwk_password);
+      if (r_jwk_import_from_password(jwk_password, password) != RHN_OK) {
+        fprintf(stderr, "Error parsing password\n");
+      } else if (r_jwks_append_jwk(jwks, jwk_password) != RHN_OK) {
+        fprintf(stderr, "Error importing password\n");
+      }
+      r_jwk_free(jwk_password);
+    }
+  }
+  return jwks;
+}
+
+/**
+ * Reads the next line of the input and sets the job token without its surrounding whitespaces
+ * Returns 0 when the end of the input is reached
+ */
+static int batch_read_line(struct _batch_input * input, struct _batch_job * job) {
+  const char * line, * end;
+  ssize_t len;
+  size_t line_len;
+
+  if (input->map != NULL) {
+    if (input->offset >= input->map_len) {
+      return 0;
+    }
+    line = input->map + input->offset;
+    if ((end = memchr(line, '\n', input->map_len - input->offset)) != NULL) {
+      line_len = (size_t)(end - line);
+      input->offset += line_len + 1;
+    } else {
+      line_len = input->map_len - input->offset;
+      input->offset = input->map_len;
+    }
+  } else {
+    if ((len = getline(&job->line, &job->line_size, stdin)) < 0) {
+      return 0;
+    }
+    line = job->line;
+    line_len = (size_t)len;
+  }
+  while (line_len && isspace((unsigned char)line[0])) {
+    line++;
+    line_len--;
+  }
+  while (line_len && isspace((unsigned char)line[line_len-1])) {
+    line_len--;
+  }
+  job->token = line;
+  job->token_len = line_len;
+  job->line_number = ++input->line_number;
+  return 1;
+}
+
+static int batch_apply_key(jwt_t * jwt, int type, int decrypt, jwk_t * jwk, int x5u_flags) {
+  int ret;
+
+  if (decrypt) {
+    if (type == R_JWT_TYPE_ENCRYPT) {
+      ret = r_jwt_decrypt(jwt, jwk, x5u_flags);
+    } else {
+      ret = r_jwt_decrypt_nested(jwt, jwk, x5u_flags);
+    }
+  } else {
+    if (type == R_JWT_TYPE_SIGN) {
+      ret = r_jwt_verify_signature(jwt, jwk, x5u_flags);
+    } else {
+      ret = r_jwt_verify_signature_nested(jwt, jwk, x5u_flags);
+    }
+  }
+  return ret;
+}
+
+/**
+ * Decrypts or verifies the token using the key identified by kid
+ * or each key of the jwks until one matches if the token has no kid
+ */
+static int batch_apply_keys(jwt_t * jwt, int type, int decrypt, jwks_t * jwks, const char * kid, int x5u_flags) {
+  jwk_t * jwk;
+  size_t i;
+  int ret = RHN_ERROR_INVALID;
+
+  if (kid != NULL) {
+    if ((jwk = r_jwks_get_by_kid(jwks, kid)) != NULL) {
+      ret = batch_apply_key(jwt, type, decrypt, jwk, x5u_flags);
+      r_jwk_free(jwk);
+    }
+  } else {
+    for (i=0; i<r_jwks_size(jwks) && ret != RHN_OK; i++) {
+      jwk = r_jwks_get_at(jwks, i);
+      ret = batch_apply_key(jwt, type, decrypt, jwk, x5u_flags);
+      r_jwk_free(jwk);
+    }
+  }
+  return ret;
+}
+
+static void batch_process_job(struct _batch_worker * worker, struct _batch_job * job) {
+  jwt_t * jwt = NULL;
+  json_t * j_result = json_pack("{sIss}", "line", (json_int_t)job->line_number, "status", "invalid");
+  const char * error = NULL, * kid = NULL;
+  int type, res, unverified = 0;
+
+  if (r_jwt_init(&jwt) == RHN_OK) {
+    res = r_jwt_advanced_parsen(jwt, job->token, job->token_len, worker->batch->self_signed?R_PARSE_HEADER_ALL:R_PARSE_NONE, worker->batch->x5u_flags);
+    if (res == RHN_OK) {
+      type = r_jwt_get_type(jwt);
+      if (type == R_JWT_TYPE_SIGN) {
+        json_object_set_new(j_result, "type", json_string("sign"));
+      } else if (type == R_JWT_TYPE_ENCRYPT) {
+        json_object_set_new(j_result, "type", json_string("encrypt"));
+      } else {
+        json_object_set_new(j_result, "type", json_string("nested"));
+      }
+      if (type == R_JWT_TYPE_ENCRYPT || type == R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN || type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT) {
+        if (!r_jwks_size(worker->jwks_privkey)) {
+          error = "No decryption key";
+        } else if (batch_apply_keys(jwt, type, 1, worker->jwks_privkey, r_jwt_get_enc_kid(jwt), worker->batch->x5u_flags) != RHN_OK) {
+          error = "Unable to decrypt token";
+        }
+        kid = r_jwt_get_enc_kid(jwt);
+      }
+      if (error == NULL && type != R_JWT_TYPE_ENCRYPT) {
+        kid = r_jwt_get_sig_kid(jwt);
+        if (r_jwks_size(worker->jwks_pubkey)) {
+          if (batch_apply_keys(jwt, type, 0, worker->jwks_pubkey, kid, worker->batch->x5u_flags) != RHN_OK) {
+            error = "Invalid signature";
+          }
+        } else if (worker->batch->self_signed && type == R_JWT_TYPE_SIGN) {
+          if (r_jwt_verify_signature(jwt, NULL, worker->batch->x5u_flags) != RHN_OK) {
+            error = "Invalid signature";
+          }
+        } else {
+          unverified = 1;
+        }
+      }
+      if (kid != NULL) {
+        json_object_set_new(j_result, "kid", json_string(kid));
+      }
+      if (error == NULL) {
+        json_object_set_new(j_result, "status", json_string(unverified?"unverified":"valid"));
+        json_object_set_new(j_result, "claims", r_jwt_get_full_claims_json_t(jwt));
+        job->valid = 1;
+      }
+    } else if (res == RHN_ERROR_PARAM) {
+      error = "Invalid token";
+    } else {
+      error = "Error parsing token";
+    }
+  } else {
+    error = "Error allocating resources";
+  }
+  if (error != NULL) {
+    json_object_set_new(j_result, "error", json_string(error));
+  }
+  job->result = json_dumps(j_result, JSON_COMPACT);
+  json_decref(j_result);
+  r_jwt_free(jwt);
+}
+
+static void * batch_worker_run(void * arg) {
+  struct _batch_worker * worker = (struct _batch_worker *)arg;
+  struct _batch * batch = worker->batch;
+  struct _batch_job * job;
+
+  while (1) {
+    pthread_mutex_lock(&batch->lock);
+    while (!batch->end && batch->next == batch->head) {
+      pthread_cond_wait(&batch->job_cond, &batch->lock);
+    }
+    if (batch->next == batch->head) {
+      pthread_mutex_unlock(&batch->lock);
+      break;
+    }
+    job = &batch->jobs[batch->next % batch->window];
+    batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+
+    batch_process_job(worker, job);
+
+    pthread_mutex_lock(&batch->lock);
+    job->done = 1;
+    pthread_cond_signal(&batch->done_cond);
+    pthread_mutex_unlock(&batch->lock);
+  }
+  return NULL;
+}
+
+/**
+ * Verifies or decrypts each token of the input, one token per line, using a pool of threads
+ * The results are printed as one JSON object per line in the input order
+ */
+static int batch_tokens(const char * in_file, int x5u_flags, const char * str_jwks_pubkey, const char * str_jwks_privkey, const char * password, int self_signed, unsigned int threads) {
+  struct _batch batch;
+  struct _batch_input input;
+  struct _batch_worker * workers = NULL;
+  struct _batch_job * job;
+  struct stat st;
+  size_t tail = 0, invalid = 0, i;
+  unsigned int started = 0;
+  int fd = -1, eof = 0, ret = 0;
+
+  memset(&batch, 0, sizeof(struct _batch));
+  memset(&input, 0, sizeof(struct _batch_input));
+  if (!threads) {
+    threads = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (!threads) {
+      threads = 1;
+    }
+  }
+  if (o_strlen(in_file) && 0 != o_strcmp(in_file, "-")) {
+    if ((fd = open(in_file, O_RDONLY)) < 0 || fstat(fd, &st)) {
+      fprintf(stderr, "error opening file %s\n", in_file);
+      ret = EACCES;
+    } else if (st.st_size) {
+      if ((input.map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "error mapping file %s\n", in_file);
+        input.map = NULL;
+        ret = EACCES;
+      } else {
+        input.map_len = (size_t)st.st_size;
+        madvise((void *)input.map, input.map_len, MADV_SEQUENTIAL);
+      }
+    } else {
+      // Empty file, nothing to read
+      eof = 1;
+    }
+  }
+  if (!ret) {
+    batch.x5u_flags = x5u_flags;
+    batch.self_signed = self_signed;
+    batch.window = threads * RNBYC_BATCH_JOBS_PER_THREAD;
+    batch.jwks_pubkey = batch_load_jwks(str_jwks_pubkey, password);
+    batch.jwks_privkey = batch_load_jwks(str_jwks_privkey, password);
+    if (batch.jwks_pubkey == NULL || batch.jwks_privkey == NULL ||
+       (batch.jobs = o_malloc(batch.window*sizeof(struct _batch_job))) == NULL ||
+       (workers = o_malloc(threads*sizeof(struct _batch_worker))) == NULL) {
+      fprintf(stderr, "Error allocating resources for batch\n");
+      ret = ENOMEM;
+    }
+  }
+  if (!ret) {
+    memset(batch.jobs, 0, batch.window*sizeof(struct _batch_job));
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.job_cond, NULL);
+    pthread_cond_init(&batch.done_cond, NULL);
+    for (started=0; started<threads; started++) {
+      // Each worker uses its own copy of the keys
+      workers[started].batch = &batch;
+      workers[started].jwks_pubkey = r_jwks_copy(batch.jwks_pubkey);
+      workers[started].jwks_privkey = r_jwks_copy(batch.jwks_privkey);
+      if (pthread_create(&workers[started].thread, NULL, batch_worker_run, &workers[started])) {
+        fprintf(stderr, "Error creating thread %u\n", started);
+        r_jwks_free(workers[started].jwks_pubkey);
+        r_jwks_free(workers[started].jwks_privkey);
+        break;
+      }
+    }
+    if (!started) {
+      ret = ENOMEM;
+      eof = 1;
+    }
+    while (!eof || tail < batch.head) {
+      // Fill the free jobs with the next tokens
+      while (!eof && batch.head - tail < batch.window) {
+        job = &batch.jobs[batch.head % batch.window];
+        if (batch_read_line(&input, job)) {
+          if (job->token_len) {
+            job->done = 0;
+            job->valid = 0;
+            pthread_mutex_lock(&batch.lock);
+            batch.head++;
+            pthread_cond_signal(&batch.job_cond);
+            pthread_mutex_unlock(&batch.lock);
+          }
+        } else {
+          eof = 1;
+        }
+      }
+      if (tail < batch.head) {
+        // Print the oldest job once it's done to keep the input order
+        job = &batch.jobs[tail % batch.window];
+        pthread_mutex_lock(&batch.lock);
+        while (!job->done) {
+          pthread_cond_wait(&batch.done_cond, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+        if (job->result != NULL) {
+          fputs(job->result, stdout);
+          fputc('\n', stdout);
+        }
+        if (!job->valid) {
+          invalid++;
+        }
+        o_free(job->result);
+        job->result = NULL;
+        tail++;
+      }
+    }
+    pthread_mutex_lock(&batch.lock);
+    batch.end = 1;
+    pthread_cond_broadcast(&batch.job_cond);
+    pthread_mutex_unlock(&batch.lock);
+    for (i=0; i<started; i++) {
+      pthread_join(workers[i].thread, NULL);
+      r_jwks_free(workers[i].jwks_pubkey);
+      r_jwks_free(workers[i].jwks_privkey);
+    }
+    fflush(stdout);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.job_cond);
+    pthread_cond_destroy(&batch.done_cond);
+    if (!ret && invalid) {
+      ret = EINVAL;
+    }
+  }
+  if (batch.jobs != NULL) {
+    for (i=0; i<batch.window; i++) {
+      o_free(batch.jobs[i].line);
+    }
+  }
+  if (input.map != NULL) {
+    munmap((void *)input.map, input.map_len);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  o_free(batch.jobs);
+  o_free(workers);
+  r_jwks_free(batch.jwks_pubkey);
+  r_jwks_free(batch.jwks_privkey);
+  return ret;
+}
+
 int main (int argc, char ** argv) {
   int next_option,
       action = R_ACTION_NONE,
@@ -864,10 +1834,14 @@ int main (int argc, char ** argv) {
       x5u_flags = 0,
       debug_mode = 0,
       format = RNBYC_FORMAT_JWK;
-  const char * short_options = "j::g:i::f:k:a:e:l:o:p:n:F:x::t:s:H::C:K:P:S::W:u:v::h::d::";
+  unsigned int threads = 0;
+  double bench_duration = RNBYC_BENCH_DEFAULT_DURATION;
+  size_t bench_payload_size = RNBYC_BENCH_DEFAULT_PAYLOAD_SIZE;
+  const char * short_options = "j::g:i::f:k:a:e:l:o:p:n:F:x::t:s:H::C:K:P:S::W:b::B:T:D:L:u:v::h::d::";
   char * out_file = NULL,
        * out_file_public = NULL,
        * parsed_token = NULL,
+       * batch_file = NULL,
        * str_token_public_key = NULL,
        * str_token_private_key = NULL,
        * password = NULL,
@@ -897,6 +1871,11 @@ int main (int argc, char ** argv) {
     {"self-signed", required_argument, NULL, 'S'},
     {"private-key", required_argument, NULL, 'K'},
     {"password", required_argument, NULL, 'W'},
+    {"bench", no_argument, NULL, 'b'},
+    {"batch", required_argument, NULL, 'B'},
+    {"threads", required_argument, NULL, 'T'},
+    {"duration", required_argument, NULL, 'D'},
+    {"payload-size", required_argument, NULL, 'L'},
     {"x5u-flags", required_argument, NULL, 'u'},
     {"version", no_argument, NULL, 'v'},
     {"help", no_argument, NULL, 'h'},
@@ -992,6 +1971,8 @@ int main (int argc, char ** argv) {
             format = RNBYC_FORMAT_PEM;
           } else if (0 == o_strncasecmp(optarg, "DER", o_strlen("DER"))) {
             format = RNBYC_FORMAT_DER;
+          } else if (0 == o_strncasecmp(optarg, "BIN", o_strlen("BIN"))) {
+            format = RNBYC_FORMAT_BIN;
           } else {
             fprintf(stderr, "--format: Invalid format\n");
             ret = EINVAL;
@@ -1053,6 +2034,23 @@ int main (int argc, char ** argv) {
       case 'W':
         password = o_strdup(optarg);
         break;
+      case 'b':
+        action = R_ACTION_BENCH;
+        break;
+      case 'B':
+        action = R_ACTION_BATCH;
+        o_free(batch_file);
+        batch_file = o_strdup(optarg);
+        break;
+      case 'T':
+        threads = (unsigned int)strtoul(optarg, NULL, 10);
+        break;
+      case 'D':
+        bench_duration = strtod(optarg, NULL);
+        break;
+      case 'L':
+        bench_payload_size = (size_t)strtoul(optarg, NULL, 10);
+        break;
       case 'u':
         if (o_strcasestr(optarg, "cert") != NULL) {
           x5u_flags |= R_FLAG_IGNORE_SERVER_CERTIFICATE;
@@ -1091,6 +2089,10 @@ int main (int argc, char ** argv) {
       ret = parse_token(parsed_token, indent, x5u_flags, str_token_public_key, str_token_private_key, password, show_header, show_claims, self_signed);
     } else if (action == R_ACTION_SERIALIZE_TOKEN) {
       ret = serialize_token(claims, x5u_flags, str_token_public_key, str_token_private_key, password, alg, enc, enc_alg);
+    } else if (action == R_ACTION_BENCH) {
+      ret = bench_token(indent, x5u_flags, str_token_public_key, str_token_private_key, password, alg, enc, enc_alg, threads?threads:RNBYC_BENCH_DEFAULT_THREADS, bench_duration, bench_payload_size);
+    } else if (action == R_ACTION_BATCH) {
+      ret = batch_tokens(batch_file, x5u_flags, str_token_public_key, str_token_private_key, password, self_signed, threads);
     } else {
       ret = EINVAL;
       fprintf(stderr, "Please epecify an action\n");
@@ -1105,6 +2107,7 @@ int main (int argc, char ** argv) {
   o_free(enc);
   o_free(enc_alg);
   o_free(parsed_token);
+  o_free(batch_file);
   o_free(claims);
   o_free(str_token_private_key);
   o_free(str_token_public_key);